@@ -20,13 +20,27 @@ of target files.
 """
 
 import argparse
+import concurrent.futures
+import hashlib
 import os
+import struct
 import subprocess
 import sys
 from fsverity_digests_pb2 import FSVerityDigests
 
 HASH_ALGORITHM = 'sha256'
 
+# Parameters of the fs-verity Merkle tree, matching the defaults of
+# `fsverity digest`: version 1 descriptor, SHA-256, 4096-byte blocks, no salt.
+FSVERITY_VERSION = 1
+FSVERITY_HASH_ALG_SHA256 = 1
+BLOCK_SIZE = 4096
+LOG_BLOCK_SIZE = 12
+DIGEST_SIZE = 32
+
+# Files are read this many blocks at a time.
+READ_BLOCKS = 256
+
 def _digest(fsverity_path, input_file):
   cmd = [fsverity_path, 'digest', input_file]
   cmd.extend(['--compact'])
@@ -34,6 +48,63 @@ def _digest(fsverity_path, input_file):
   out = subprocess.check_output(cmd, universal_newlines=True).strip()
   return bytes(bytearray.fromhex(out))
 
+def _hash_blocks(data):
+  """Returns the concatenated hashes of the zero-padded blocks of data."""
+  hashes = bytearray()
+  for offset in range(0, len(data), BLOCK_SIZE):
+    block = data[offset:offset + BLOCK_SIZE]
+    if len(block) < BLOCK_SIZE:
+      block = bytes(block) + bytes(BLOCK_SIZE - len(block))
+    hashes += hashlib.sha256(block).digest()
+  return hashes
+
+def _root_hash(input_file):
+  """Computes the root hash of the fs-verity Merkle tree of a file, and its
+  size."""
+  level = bytearray()
+  size = 0
+  with open(input_file, 'rb') as f:
+    while True:
+      data = f.read(BLOCK_SIZE * READ_BLOCKS)
+      if not data:
+        break
+      size += len(data)
+      level += _hash_blocks(data)
+  if size == 0:
+    return bytes(DIGEST_SIZE), size
+  # Hash each level of the tree until it fits into a single block.
+  while len(level) > DIGEST_SIZE:
+    level = _hash_blocks(level)
+  return bytes(level), size
+
+def _fsverity_digest(input_file):
+  """Computes the same digest as `fsverity digest --compact`, in-process."""
+  root_hash, size = _root_hash(input_file)
+  descriptor = struct.pack(
+      '<BBBBIQ64s32s144x', FSVERITY_VERSION, FSVERITY_HASH_ALG_SHA256,
+      LOG_BLOCK_SIZE, 0, 0, size, root_hash, b'')
+  return hashlib.sha256(descriptor).digest()
+
+def generate_manifest(inputs, base_dir, jobs=None, fsverity_path=None):
+  """Returns the serialized FSVerityDigests of inputs. The digests are
+  computed in-process on up to jobs processes, or with the fsverity program if
+  fsverity_path is given. The output does not depend on either."""
+  inputs = sorted(inputs)
+  if fsverity_path:
+    results = [_digest(fsverity_path, f) for f in inputs]
+  else:
+    with concurrent.futures.ProcessPoolExecutor(max_workers=jobs) as executor:
+      results = list(executor.map(_fsverity_digest, inputs, chunksize=16))
+
+  digests = FSVerityDigests()
+  for f, result in zip(inputs, results):
+    # f is a full path for now; make it relative so it starts with {mount_point}/
+    digest = digests.digests[os.path.relpath(f, base_dir)]
+    digest.digest = result
+    digest.hash_alg = HASH_ALGORITHM
+
+  return digests.SerializeToString()
+
 if __name__ == '__main__':
   p = argparse.ArgumentParser(fromfile_prefix_chars='@')
   p.add_argument(
@@ -42,8 +113,17 @@ if __name__ == '__main__':
       required=True)
   p.add_argument(
       '--fsverity-path',
-      help='path to the fsverity program',
-      required=True)
+      help='path to the fsverity program. Digests are computed in-process '
+           'unless --use-fsverity-program is given')
+  p.add_argument(
+      '--use-fsverity-program',
+      action='store_true',
+      help='compute digests with the fsverity program, one file at a time')
+  p.add_argument(
+      '--jobs',
+      type=int,
+      help='number of processes computing digests, the number of CPUs by '
+           'default')
   p.add_argument(
       '--base-dir',
       help='directory to use as a relative root for the inputs',
@@ -54,14 +134,12 @@ if __name__ == '__main__':
       help='input file for the build manifest')
   args = p.parse_args()
 
-  digests = FSVerityDigests()
-  for f in sorted(args.inputs):
-    # f is a full path for now; make it relative so it starts with {mount_point}/
-    digest = digests.digests[os.path.relpath(f, args.base_dir)]
-    digest.digest = _digest(args.fsverity_path, f)
-    digest.hash_alg = HASH_ALGORITHM
+  if args.use_fsverity_program and not args.fsverity_path:
+    p.error('--use-fsverity-program requires --fsverity-path')
 
-  manifest = digests.SerializeToString()
+  manifest = generate_manifest(
+      args.inputs, args.base_dir, args.jobs,
+      args.fsverity_path if args.use_fsverity_program else None)
 
   with open(args.output, "wb") as f:
     f.write(manifest)
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024 Google Inc. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+`fsverity_manifest_generator_benchmark` times manifest generation over a
+synthetic tree of files. If the fsverity program is given, it also times the
+one-subprocess-per-file path and checks that both manifests are identical.
+"""
+
+import argparse
+import os
+import random
+import tempfile
+import time
+from fsverity_manifest_generator import generate_manifest
+
+def _create_tree(base_dir, count, seed):
+  """Creates count files with sizes similar to those of APKs, jars and odex
+  files on a system image: mostly small, some of several MiB."""
+  rng = random.Random(seed)
+  inputs = []
+  for i in range(count):
+    directory = os.path.join(base_dir, 'system', 'app%d' % (i % 64))
+    os.makedirs(directory, exist_ok=True)
+    if rng.random() < 0.9:
+      size = rng.randrange(0, 256 * 1024)
+    else:
+      size = rng.randrange(256 * 1024, 8 * 1024 * 1024)
+    path = os.path.join(directory, 'file%d.apk' % i)
+    with open(path, 'wb') as f:
+      f.write(rng.randbytes(size))
+    inputs.append(path)
+  return inputs
+
+def _time(name, inputs, base_dir, **kwargs):
+  start = time.monotonic()
+  manifest = generate_manifest(inputs, base_dir, **kwargs)
+  elapsed = time.monotonic() - start
+  print('%s: %d files in %.2fs, %.0f files/s' %
+        (name, len(inputs), elapsed, len(inputs) / elapsed))
+  return manifest
+
+if __name__ == '__main__':
+  p = argparse.ArgumentParser()
+  p.add_argument(
+      '--files',
+      type=int,
+      default=5000,
+      help='number of files in the synthetic tree')
+  p.add_argument(
+      '--seed',
+      type=int,
+      default=0,
+      help='seed for the sizes and contents of the files')
+  p.add_argument(
+      '--jobs',
+      type=int,
+      help='number of processes computing digests, the number of CPUs by '
+           'default')
+  p.add_argument(
+      '--fsverity-path',
+      help='path to the fsverity program to compare with')
+  args = p.parse_args()
+
+  with tempfile.TemporaryDirectory() as base_dir:
+    inputs = _create_tree(base_dir, args.files, args.seed)
+    total = sum(os.path.getsize(f) for f in inputs)
+    print('Synthetic tree: %d files, %.1f MiB' % (len(inputs), total / 2**20))
+
+    _time('in-process, 1 job', inputs, base_dir, jobs=1)
+    manifest = _time('in-process, %s jobs' % (args.jobs or os.cpu_count()),
+                     inputs, base_dir, jobs=args.jobs)
+    if args.fsverity_path:
+      expected = _time('fsverity program', inputs, base_dir,
+                       fsverity_path=args.fsverity_path)
+      if manifest != expected:
+        raise SystemExit('Manifests differ')
+      print('Manifests are identical')
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024 Google Inc. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Tests the in-process fs-verity digests of `fsverity_manifest_generator`."""
+
+import os
+import shutil
+import tempfile
+import unittest
+from fsverity_digests_pb2 import FSVerityDigests
+from fsverity_manifest_generator import (
+    BLOCK_SIZE, _digest, _fsverity_digest, generate_manifest)
+
+# Digests of `fsverity digest --compact --hash-alg sha256`, with 4096-byte
+# blocks and no salt.
+EMPTY_DIGEST = (
+    '3d248ca542a24fc62d1c43b916eae5016878e2533c88238480b26128a1f1af95')
+# bytes(range(256)) * 16, a single full data block: the root hash is the hash
+# of that block.
+ONE_BLOCK_DIGEST = (
+    '15a0095100272ab90a2209e97f8a2c54dff6f84d2b29524f95d92fe23b6ef25b')
+# 129 full blocks and a partial one of i % 251: two levels of hash blocks,
+# both partially filled.
+MULTI_LEVEL_DIGEST = (
+    'adaedab4a05c570541847330fd12c24af418724cacd4ed1e91be376847740eb7')
+
+def _pattern(size):
+  return bytes(i % 251 for i in range(size))
+
+class FsverityDigestTest(unittest.TestCase):
+
+  def setUp(self):
+    self.dir = tempfile.mkdtemp()
+    self.addCleanup(shutil.rmtree, self.dir)
+
+  def _file(self, name, data):
+    path = os.path.join(self.dir, name)
+    with open(path, 'wb') as f:
+      f.write(data)
+    return path
+
+  def test_empty_file(self):
+    path = self._file('empty', b'')
+    self.assertEqual(_fsverity_digest(path).hex(), EMPTY_DIGEST)
+
+  def test_one_block_file(self):
+    path = self._file('one_block', bytes(range(256)) * 16)
+    self.assertEqual(os.path.getsize(path), BLOCK_SIZE)
+    self.assertEqual(_fsverity_digest(path).hex(), ONE_BLOCK_DIGEST)
+
+  def test_multi_level_tree(self):
+    # More data blocks than the 128 hashes that fit into one hash block.
+    path = self._file('multi_level', _pattern(129 * BLOCK_SIZE + 100))
+    self.assertEqual(_fsverity_digest(path).hex(), MULTI_LEVEL_DIGEST)
+
+  def test_manifest_digests(self):
+    inputs = [
+        self._file('empty', b''),
+        self._file('multi_level', _pattern(129 * BLOCK_SIZE + 100)),
+    ]
+    digests = FSVerityDigests()
+    digests.ParseFromString(generate_manifest(inputs, self.dir, jobs=2))
+    self.assertEqual(digests.digests['empty'].digest.hex(), EMPTY_DIGEST)
+    self.assertEqual(digests.digests['multi_level'].digest.hex(),
+                     MULTI_LEVEL_DIGEST)
+    self.assertEqual(digests.digests['empty'].hash_alg, 'sha256')
+
+  @unittest.skipUnless(shutil.which('fsverity'), 'needs the fsverity program')
+  def test_matches_fsverity_program(self):
+    fsverity_path = shutil.which('fsverity')
+    for size in [0, 1, BLOCK_SIZE, BLOCK_SIZE + 1, 129 * BLOCK_SIZE + 100]:
+      path = self._file('file%d' % size, _pattern(size))
+      self.assertEqual(_fsverity_digest(path), _digest(fsverity_path, path),
+                       'size %d' % size)
+
+if __name__ == '__main__':
+  unittest.main(verbosity=2)
@@ -571,7 +571,7 @@ Status Credential::getEntries(const vector<uint8_t>& requestMessage,
 
     // Ensure useCount is updated on disk.
     if (updateUseCountOnDisk) {
-        if (!data->saveToDisk()) {
+        if (!data->saveAuthKeyUpdatesToDisk()) {
             return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                     "Error saving data");
         }
@@ -748,7 +748,7 @@ Status Credential::getAuthKeysNeedingCertification(vector<AuthKeyParcel>* _aidl_
         authKeyParcel.x509cert = key;
         authKeyParcels.push_back(authKeyParcel);
     }
-    if (!data->saveToDisk()) {
+    if (!data->saveAuthKeyUpdatesToDisk()) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                 "Error saving data");
     }
@@ -17,6 +17,10 @@
 #define LOG_TAG "credstore"
 
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include <fcntl.h>
 #include <stdlib.h>
@@ -29,6 +33,7 @@
 
 #include <cppbor.h>
 #include <cppbor_parse.h>
+#include <openssl/rand.h>
 
 #include <android/hardware/identity/support/IdentityCredentialSupport.h>
 
@@ -51,8 +56,11 @@ string CredentialData::calculateCredentialFileName(const string& dataPath, uid_t
 CredentialData::CredentialData(const string& dataPath, uid_t ownerUid, const string& name)
     : dataPath_(dataPath), ownerUid_(ownerUid), name_(name), secureUserId_(0) {
     fileName_ = calculateCredentialFileName(dataPath_, ownerUid_, name_);
+    journalFileName_ = fileName_ + ".journal";
 }
 
+CredentialData::~CredentialData() {}
+
 void CredentialData::setSecureUserId(int64_t secureUserId) {
     secureUserId_ = secureUserId;
 }
@@ -75,7 +83,263 @@ void CredentialData::addEntryData(const string& namespaceName, const string& ent
     idToEncryptedChunks_[namespaceName + ":" + entryName] = data;
 }
 
-bool CredentialData::saveToDisk() const {
+// Writes the encoded pieces of a credential file in order. With |background| set they are
+// written by a separate thread, so the caller can go on producing the next piece meanwhile.
+// At most |kMaxQueuedBytes| are queued before write() blocks.
+class CredentialData::FileWriter {
+  public:
+    static constexpr size_t kMaxQueuedBytes = 256 * 1024;
+
+    explicit FileWriter(const string& fileName) : file_(fileName) {}
+
+    ~FileWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.clear();
+        }
+        stop();
+    }
+
+    bool open(bool background) {
+        if (!file_.open()) {
+            return false;
+        }
+        if (background) {
+            thread_ = std::thread([this] { run(); });
+        }
+        return true;
+    }
+
+    bool write(vector<uint8_t> data) {
+        if (!thread_.joinable()) {
+            return file_.write(data.data(), data.size());
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return failed_ || queuedBytes_ < kMaxQueuedBytes; });
+        if (failed_) {
+            return false;
+        }
+        queuedBytes_ += data.size();
+        queue_.push_back(std::move(data));
+        cv_.notify_all();
+        return true;
+    }
+
+    // Waits for everything queued to be written and then replaces the credential file.
+    bool commit() {
+        stop();
+        return !failed_ && file_.commit();
+    }
+
+  private:
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return done_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            vector<uint8_t> data = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            bool success = file_.write(data.data(), data.size());
+            lock.lock();
+            queuedBytes_ -= data.size();
+            failed_ = !success;
+            cv_.notify_all();
+            if (failed_) {
+                return;
+            }
+        }
+    }
+
+    AtomicFileWriter file_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<vector<uint8_t>> queue_;
+    size_t queuedBytes_ = 0;
+    bool done_ = false;
+    bool failed_ = false;
+};
+
+namespace {
+
+// The credential file is a CBOR map with this many fields. "entryData" comes first so that
+// entries can be written as they are produced, the other fields are only known at the end.
+constexpr size_t kNumCredentialFields = 10;
+
+void appendHeader(vector<uint8_t>* encoded, cppbor::MajorType type, uint64_t addlInfo) {
+    size_t offset = encoded->size();
+    encoded->resize(offset + cppbor::headerSize(addlInfo));
+    cppbor::encodeHeader(type, addlInfo, encoded->data() + offset,
+                         encoded->data() + encoded->size());
+}
+
+void appendItem(vector<uint8_t>* encoded, const cppbor::Item& item) {
+    item.encode(std::back_inserter(*encoded));
+}
+
+// Encodes the start of one key-value pair of the "entryData" map, up to the header of the array
+// of encrypted chunks. Each chunk follows as a bstr.
+vector<uint8_t> encodeEntryHeader(const string& nsAndName, uint64_t size,
+                                  const vector<int32_t>& accessControlProfileIds,
+                                  size_t chunkCount) {
+    cppbor::Array idsArray;
+    for (int32_t id : accessControlProfileIds) {
+        idsArray.add(id);
+    }
+
+    vector<uint8_t> encoded;
+    appendItem(&encoded, cppbor::Tstr(nsAndName));
+    appendHeader(&encoded, cppbor::ARRAY, 3);
+    appendItem(&encoded, cppbor::Uint(size));
+    appendItem(&encoded, idsArray);
+    appendHeader(&encoded, cppbor::ARRAY, chunkCount);
+    return encoded;
+}
+
+// Encodes one key-value pair of the "entryData" map. The encrypted chunks are copied straight
+// into the encoding instead of into intermediate cppbor items.
+vector<uint8_t> encodeEntryData(const string& nsAndName, const EntryData& entryData) {
+    vector<uint8_t> encoded =
+        encodeEntryHeader(nsAndName, entryData.size, entryData.accessControlProfileIds,
+                          entryData.encryptedChunks.size());
+    size_t chunksSize = 0;
+    for (const vector<uint8_t>& encryptedChunk : entryData.encryptedChunks) {
+        chunksSize += encryptedChunk.size();
+    }
+    encoded.reserve(encoded.size() + chunksSize + entryData.encryptedChunks.size() * 9);
+    for (const vector<uint8_t>& encryptedChunk : entryData.encryptedChunks) {
+        appendHeader(&encoded, cppbor::BSTR, encryptedChunk.size());
+        encoded.insert(encoded.end(), encryptedChunk.begin(), encryptedChunk.end());
+    }
+    return encoded;
+}
+
+}  // namespace
+
+bool CredentialData::saveToDisk() {
+    if (!beginSave_(idToEncryptedChunks_.size(), false /* background */)) {
+        return false;
+    }
+    for (auto const& [nsAndName, entryData] : idToEncryptedChunks_) {
+        entriesToSave_--;
+        if (!fileWriter_->write(encodeEntryData(nsAndName, entryData))) {
+            fileWriter_.reset();
+            return false;
+        }
+    }
+    return finishSaveToDisk();
+}
+
+bool CredentialData::beginSaveToDisk(size_t entryCount) {
+    return beginSave_(entryCount, true /* background */);
+}
+
+bool CredentialData::beginSave_(size_t entryCount, bool background) {
+    fileWriter_ = std::make_unique<FileWriter>(fileName_);
+    if (!fileWriter_->open(background)) {
+        fileWriter_.reset();
+        return false;
+    }
+    entriesToSave_ = entryCount;
+    chunksToSave_ = 0;
+    savedEntryIds_.clear();
+
+    vector<uint8_t> encoded;
+    appendHeader(&encoded, cppbor::MAP, kNumCredentialFields);
+    appendItem(&encoded, cppbor::Tstr("entryData"));
+    appendHeader(&encoded, cppbor::MAP, entryCount);
+    if (!fileWriter_->write(std::move(encoded))) {
+        fileWriter_.reset();
+        return false;
+    }
+    return true;
+}
+
+bool CredentialData::beginEntryDataToDisk(const string& namespaceName, const string& entryName,
+                                          uint64_t size,
+                                          const vector<int32_t>& accessControlProfileIds,
+                                          size_t chunkCount) {
+    if (!fileWriter_ || entriesToSave_ == 0 || chunksToSave_ != 0) {
+        LOG(ERROR) << "Unexpected entry data for " << namespaceName << ":" << entryName;
+        return false;
+    }
+    // Entries are written as they come, so a second one with the same name cannot replace the
+    // first like in addEntryData() and would end up as a duplicate key in the "entryData" map.
+    string nsAndName = namespaceName + ":" + entryName;
+    if (!savedEntryIds_.insert(nsAndName).second) {
+        LOG(ERROR) << "Duplicate entry data for " << nsAndName;
+        fileWriter_.reset();
+        return false;
+    }
+    entriesToSave_--;
+    chunksToSave_ = chunkCount;
+    if (!fileWriter_->write(
+            encodeEntryHeader(nsAndName, size, accessControlProfileIds, chunkCount))) {
+        fileWriter_.reset();
+        return false;
+    }
+    return true;
+}
+
+bool CredentialData::saveEntryChunkToDisk(vector<uint8_t> encryptedChunk) {
+    if (!fileWriter_ || chunksToSave_ == 0) {
+        LOG(ERROR) << "Unexpected encrypted chunk";
+        return false;
+    }
+    chunksToSave_--;
+    // The chunk itself is queued as is rather than copied behind its header.
+    vector<uint8_t> header;
+    appendHeader(&header, cppbor::BSTR, encryptedChunk.size());
+    if (!fileWriter_->write(std::move(header)) || !fileWriter_->write(std::move(encryptedChunk))) {
+        fileWriter_.reset();
+        return false;
+    }
+    return true;
+}
+
+bool CredentialData::saveEntryDataToDisk(const string& namespaceName, const string& entryName,
+                                         const EntryData& data) {
+    if (!beginEntryDataToDisk(namespaceName, entryName, data.size, data.accessControlProfileIds,
+                              data.encryptedChunks.size())) {
+        return false;
+    }
+    for (const vector<uint8_t>& encryptedChunk : data.encryptedChunks) {
+        if (!saveEntryChunkToDisk(encryptedChunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CredentialData::finishSaveToDisk() {
+    std::unique_ptr<FileWriter> fileWriter = std::move(fileWriter_);
+    if (!fileWriter || entriesToSave_ != 0 || chunksToSave_ != 0) {
+        LOG(ERROR) << "Credential file is missing " << entriesToSave_ << " entries and "
+                   << chunksToSave_ << " chunks";
+        return false;
+    }
+
+    int64_t newJournalId;
+    if (RAND_bytes(reinterpret_cast<uint8_t*>(&newJournalId), sizeof(newJournalId)) != 1) {
+        LOG(ERROR) << "Error generating journal id";
+        return false;
+    }
+
     cppbor::Map map;
 
     map.add("secureUserId", secureUserId_);
@@ -98,23 +362,6 @@ bool CredentialData::saveToDisk() const {
     }
     map.add("secureAccessControlProfiles", std::move(sacpArray));
 
-    cppbor::Map encryptedBlobsMap;
-    for (auto const& [nsAndName, entryData] : idToEncryptedChunks_) {
-        cppbor::Array encryptedChunkArray;
-        for (const vector<uint8_t>& encryptedChunk : entryData.encryptedChunks) {
-            encryptedChunkArray.add(encryptedChunk);
-        }
-        cppbor::Array entryDataArray;
-        entryDataArray.add(entryData.size);
-        cppbor::Array idsArray;
-        for (int32_t id : entryData.accessControlProfileIds) {
-            idsArray.add(id);
-        }
-        entryDataArray.add(std::move(idsArray));
-        entryDataArray.add(std::move(encryptedChunkArray));
-        encryptedBlobsMap.add(nsAndName, std::move(entryDataArray));
-    }
-    map.add("entryData", std::move(encryptedBlobsMap));
     map.add("authKeyCount", keyCount_);
     map.add("maxUsesPerAuthKey", maxUsesPerKey_);
     map.add("minValidTimeMillis", minValidTimeMillis_);
@@ -134,10 +381,128 @@ bool CredentialData::saveToDisk() const {
         authKeyDatasArray.add(std::move(array));
     }
     map.add("authKeyData", std::move(authKeyDatasArray));
+    map.add("journalId", newJournalId);
 
-    vector<uint8_t> credentialData = map.encode();
+    // "entryData" was written by beginSave_().
+    if (map.size() + 1 != kNumCredentialFields) {
+        LOG(ERROR) << "Credential file has " << map.size() + 1 << " fields, expected "
+                   << kNumCredentialFields;
+        return false;
+    }
+    vector<uint8_t> encoded;
+    for (const auto& [key, value] : map) {
+        appendItem(&encoded, *key);
+        appendItem(&encoded, *value);
+    }
+    if (!fileWriter->write(std::move(encoded)) || !fileWriter->commit()) {
+        return false;
+    }
 
-    return fileSetContents(fileName_, credentialData);
+    // All journal records are part of the credential file now. Those that are left behind if
+    // the journal cannot be removed are ignored because their journal id no longer matches.
+    journalId_ = newJournalId;
+    journalSize_ = 0;
+    journalRecordCount_ = 0;
+    dirtyAuthKeys_.clear();
+    if (unlink(journalFileName_.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Error deleting " << journalFileName_;
+    }
+    return true;
+}
+
+// Each journal record is a CBOR array holding the journal id of the credential file, the
+// index of the auth key, and the auth key fields that change between full saves.
+//
+//   [ journalId, index, useCount, pendingCertificate, pendingKeyBlob ]
+//
+bool CredentialData::saveAuthKeyUpdatesToDisk() {
+    if (dirtyAuthKeys_.empty()) {
+        return true;
+    }
+    if (journalRecordCount_ + dirtyAuthKeys_.size() > kMaxJournalRecords) {
+        return saveToDisk();
+    }
+
+    vector<uint8_t> records;
+    for (size_t index : dirtyAuthKeys_) {
+        const AuthKeyData& data = authKeyDatas_[index];
+        cppbor::Array record;
+        record.add(journalId_);
+        record.add(index);
+        record.add(data.useCount);
+        record.add(data.pendingCertificate);
+        record.add(data.pendingKeyBlob);
+        vector<uint8_t> encodedRecord = record.encode();
+        records.insert(records.end(), encodedRecord.begin(), encodedRecord.end());
+    }
+
+    // Writing at |journalSize_| discards a record that may have been torn by a crash.
+    if (!fileWriteContentsAt(journalFileName_, journalSize_, records)) {
+        return false;
+    }
+    journalSize_ += records.size();
+    journalRecordCount_ += dirtyAuthKeys_.size();
+    dirtyAuthKeys_.clear();
+    return true;
+}
+
+bool CredentialData::loadJournal_() {
+    struct stat statbuf;
+    if (stat(journalFileName_.c_str(), &statbuf) != 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        PLOG(ERROR) << "Error getting information about " << journalFileName_;
+        return false;
+    }
+
+    optional<vector<uint8_t>> journal = fileGetContents(journalFileName_);
+    if (!journal) {
+        LOG(ERROR) << "Error loading journal";
+        return false;
+    }
+
+    const uint8_t* begin = journal.value().data();
+    const uint8_t* end = begin + journal.value().size();
+    const uint8_t* pos = begin;
+    while (pos < end) {
+        auto [item, newPos, message] = cppbor::parse(pos, end);
+        const cppbor::Array* record = (item != nullptr) ? item->asArray() : nullptr;
+        if (record == nullptr || record->size() < 5) {
+            // The last append was interrupted. Everything before it is intact.
+            LOG(WARNING) << "Ignoring torn record at offset " << (pos - begin) << " of "
+                         << journalFileName_;
+            break;
+        }
+        const cppbor::Int* itemJournalId = (*record)[0]->asInt();
+        const cppbor::Int* itemIndex = (*record)[1]->asInt();
+        const cppbor::Int* itemUseCount = (*record)[2]->asInt();
+        const cppbor::Bstr* itemPendingCertificate = (*record)[3]->asBstr();
+        const cppbor::Bstr* itemPendingKeyBlob = (*record)[4]->asBstr();
+        if (itemJournalId == nullptr || itemIndex == nullptr || itemUseCount == nullptr ||
+            itemPendingCertificate == nullptr || itemPendingKeyBlob == nullptr) {
+            LOG(ERROR) << "One or more items in journal record is of wrong type";
+            return false;
+        }
+        if (itemJournalId->value() != journalId_) {
+            // Left over from before the last saveToDisk(), so none of it applies.
+            break;
+        }
+        if (itemIndex->value() < 0 || size_t(itemIndex->value()) >= authKeyDatas_.size()) {
+            LOG(ERROR) << "Journal record refers to auth key " << itemIndex->value()
+                       << " but there are only " << authKeyDatas_.size();
+            return false;
+        }
+        AuthKeyData& data = authKeyDatas_[itemIndex->value()];
+        data.useCount = itemUseCount->value();
+        data.pendingCertificate = itemPendingCertificate->value();
+        data.pendingKeyBlob = itemPendingKeyBlob->value();
+
+        pos = newPos;
+        journalSize_ = pos - begin;
+        journalRecordCount_ += 1;
+    }
+    return true;
 }
 
 optional<SecureAccessControlProfile> parseSacp(const cppbor::Item& item) {
@@ -255,6 +620,10 @@ bool CredentialData::loadFromDisk() {
     keyCount_ = 0;
     maxUsesPerKey_ = 1;
     minValidTimeMillis_ = 0;
+    journalId_ = 0;
+    journalSize_ = 0;
+    journalRecordCount_ = 0;
+    dirtyAuthKeys_.clear();
 
     optional<vector<uint8_t>> data = fileGetContents(fileName_);
     if (!data) {
@@ -408,6 +777,14 @@ bool CredentialData::loadFromDisk() {
                 return false;
             }
             minValidTimeMillis_ = number->value();
+
+        } else if (key == "journalId") {
+            const cppbor::Int* number = valueItem->asInt();
+            if (number == nullptr) {
+                LOG(ERROR) << "Value for journalId is not a number";
+                return false;
+            }
+            journalId_ = number->value();
         }
     }
 
@@ -427,6 +804,11 @@ bool CredentialData::loadFromDisk() {
         return false;
     }
 
+    if (!loadJournal_()) {
+        LOG(ERROR) << "Error loading auth key journal";
+        return false;
+    }
+
     return true;
 }
 
@@ -470,6 +852,9 @@ bool CredentialData::deleteCredential() {
         PLOG(ERROR) << "Error deleting " << fileName_;
         return false;
     }
+    if (unlink(journalFileName_.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Error deleting " << journalFileName_;
+    }
     return true;
 }
 
@@ -505,6 +890,7 @@ void CredentialData::setAvailableAuthenticationKeys(int keyCount, int maxUsesPer
     //
     // Therefore, in either case it's as simple as just resizing the vector.
     authKeyDatas_.resize(keyCount_);
+    dirtyAuthKeys_.erase(dirtyAuthKeys_.lower_bound(authKeyDatas_.size()), dirtyAuthKeys_.end());
 }
 
 const vector<AuthKeyData>& CredentialData::getAuthKeyDatas() const {
@@ -574,6 +960,7 @@ const AuthKeyData* CredentialData::selectAuthKey(bool allowUsingExhaustedKeys,
 
     if (incrementUsageCount) {
         candidate->useCount += 1;
+        dirtyAuthKeys_.insert(candidate - authKeyDatas_.data());
     }
     return candidate;
 }
@@ -590,7 +977,8 @@ CredentialData::getAuthKeysNeedingCertification(const sp<IIdentityCredential>& h
         return {};
     }
 
-    for (AuthKeyData& data : authKeyDatas_) {
+    for (size_t n = 0; n < authKeyDatas_.size(); n++) {
+        AuthKeyData& data = authKeyDatas_[n];
         bool keyExceedUseCount = (data.useCount >= maxUsesPerKey_);
         int64_t expirationDateAdjusted = data.expirationDateMillisSinceEpoch - minValidTimeMillis_;
         bool keyBeyondAdjustedExpirationDate = (nowMilliseconds > expirationDateAdjusted);
@@ -607,6 +995,7 @@ CredentialData::getAuthKeysNeedingCertification(const sp<IIdentityCredential>& h
             }
             data.pendingCertificate = signingKeyCertificate.encodedCertificate;
             data.pendingKeyBlob = signingKeyBlob;
+            dirtyAuthKeys_.insert(n);
             certificationPending = true;
         }
 
@@ -21,6 +21,8 @@
 #include <unistd.h>
 
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -64,6 +66,7 @@ struct AuthKeyData {
 class CredentialData : public RefBase {
   public:
     CredentialData(const string& dataPath, uid_t ownerUid, const string& name);
+    ~CredentialData();
 
     static string calculateCredentialFileName(const string& dataPath, uid_t ownerUid,
                                               const string& name);
@@ -82,8 +85,33 @@ class CredentialData : public RefBase {
 
     void addEntryData(const string& namespaceName, const string& entryName, const EntryData& data);
 
-    bool saveToDisk() const;
-
+    // Writes the whole credential to disk and discards the auth key journal.
+    bool saveToDisk();
+
+    // Streaming alternative to addEntryData() followed by saveToDisk(), so that entry data does
+    // not have to be held in memory all at once. Entry data is written by a background thread
+    // while the caller produces the next chunk, and is not kept. Exactly |entryCount| entries
+    // with distinct names must be saved before finishSaveToDisk() writes the remaining fields
+    // and replaces the credential file. An entry is saved by beginEntryDataToDisk() followed by
+    // its |chunkCount| encrypted chunks passed to saveEntryChunkToDisk(), or in one go by
+    // saveEntryDataToDisk(). A duplicate name fails and abandons the save. Abandoning a save
+    // leaves the existing credential file untouched.
+    bool beginSaveToDisk(size_t entryCount);
+    bool beginEntryDataToDisk(const string& namespaceName, const string& entryName,
+                              uint64_t size, const vector<int32_t>& accessControlProfileIds,
+                              size_t chunkCount);
+    bool saveEntryChunkToDisk(vector<uint8_t> encryptedChunk);
+    bool saveEntryDataToDisk(const string& namespaceName, const string& entryName,
+                             const EntryData& data);
+    bool finishSaveToDisk();
+
+    // Persists the changes made to auth keys by selectAuthKey() and
+    // getAuthKeysNeedingCertification() since the last load or save by appending them to
+    // the auth key journal instead of rewriting the whole credential. Once the journal has
+    // grown large enough it is compacted by calling saveToDisk().
+    bool saveAuthKeyUpdatesToDisk();
+
+    // Loads the credential from disk and applies the auth key journal, if any.
     bool loadFromDisk();
 
     bool deleteCredential();
@@ -115,6 +143,9 @@ class CredentialData : public RefBase {
     const AuthKeyData* selectAuthKey(bool allowUsingExhaustedKeys, bool allowUsingExpiredKeys,
                                      bool incrementUsageCount);
 
+    // Assigns a new pending key pair to every auth key that needs to be replaced and returns
+    // the pending certificates. Key pairs are generated by the HAL one at a time, since it does
+    // not promise that an IIdentityCredential can be used from several threads at once.
     optional<vector<vector<uint8_t>>>
     getAuthKeysNeedingCertification(const sp<IIdentityCredential>& halBinder);
 
@@ -122,9 +153,19 @@ class CredentialData : public RefBase {
                                        int64_t expirationDateMillisSinceEpoch,
                                        const vector<uint8_t>& staticAuthData);
 
+    // The auth key journal is compacted into the credential file instead of growing beyond
+    // this many records.
+    static constexpr size_t kMaxJournalRecords = 64;
+
   private:
+    class FileWriter;
+
+    bool beginSave_(size_t entryCount, bool background);
+
     AuthKeyData* findAuthKey_(bool allowUsingExhaustedKeys, bool allowUsingExpiredKeys);
 
+    bool loadJournal_();
+
     // Set by constructor.
     //
     string dataPath_;
@@ -133,6 +174,24 @@ class CredentialData : public RefBase {
 
     // Calculated at construction time, from |dataPath_|, |ownerUid_|, |name_|.
     string fileName_;
+    string journalFileName_;
+
+    // State of the auth key journal. Records are only applied if they carry the same
+    // |journalId_| as the credential file. Every saveToDisk() draws a new random id, so
+    // records that were already compacted into the credential file, or that are left over
+    // from a deleted credential of the same name, are ignored.
+    //
+    int64_t journalId_ = 0;
+    size_t journalSize_ = 0;  // Size of the valid prefix of the journal file.
+    size_t journalRecordCount_ = 0;
+    std::set<size_t> dirtyAuthKeys_;  // Indices into |authKeyDatas_|.
+
+    // State of a save in progress, between beginSave_() and finishSaveToDisk().
+    //
+    std::unique_ptr<FileWriter> fileWriter_;
+    size_t entriesToSave_ = 0;
+    size_t chunksToSave_ = 0;  // Of the entry begun last.
+    std::set<string> savedEntryIds_;
 
     // Data serialized in CBOR from here:
     //
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CredentialData.h"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <limits>
+#include <set>
+#include <string>
+#include <vector>
+
+using ::android::sp;
+using ::android::base::ReadFileToString;
+using ::android::base::TemporaryDir;
+using ::android::base::WriteStringToFile;
+using ::android::binder::Status;
+using ::android::hardware::identity::Certificate;
+using ::android::hardware::identity::IIdentityCredentialDefault;
+
+using namespace ::android::security::identity;
+
+namespace {
+
+constexpr uid_t kOwnerUid = 10042;
+constexpr char kCredentialName[] = "mdl";
+constexpr int kKeyCount = 3;
+constexpr int kMaxUsesPerKey = 1000;
+
+// Hands out a distinct certificate for every signing key pair it is asked to generate. Fails
+// every call if |fail| is set.
+class FakeIdentityCredential : public IIdentityCredentialDefault {
+  public:
+    explicit FakeIdentityCredential(bool fail = false) : fail_(fail) {}
+
+    Status generateSigningKeyPair(vector<uint8_t>* signingKeyBlob,
+                                  Certificate* signingKeyCertificate) override {
+        if (fail_) {
+            return Status::fromExceptionCode(Status::EX_ILLEGAL_STATE);
+        }
+        uint8_t n = generated_++;
+        *signingKeyBlob = {'b', n};
+        signingKeyCertificate->encodedCertificate = {'c', n};
+        return Status::ok();
+    }
+
+    int generated() const { return generated_; }
+
+  private:
+    bool fail_;
+    int generated_ = 0;
+};
+
+class CredentialDataTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        fileName_ = CredentialData::calculateCredentialFileName(dir_.path, kOwnerUid,
+                                                                kCredentialName);
+        journalFileName_ = fileName_ + ".journal";
+
+        // Provision a credential whose auth keys are all certified.
+        sp<CredentialData> data = newData();
+        data->setCredentialData({0x01, 0x02});
+        data->setAttestationCertificate({0x03, 0x04});
+        data->setAvailableAuthenticationKeys(kKeyCount, kMaxUsesPerKey, 0);
+        ASSERT_TRUE(data->saveToDisk());
+        auto keysNeedingCert = data->getAuthKeysNeedingCertification(new FakeIdentityCredential);
+        ASSERT_TRUE(keysNeedingCert);
+        ASSERT_EQ(keysNeedingCert->size(), size_t(kKeyCount));
+        for (const vector<uint8_t>& key : keysNeedingCert.value()) {
+            ASSERT_TRUE(data->storeStaticAuthenticationData(
+                key, std::numeric_limits<int64_t>::max(), {0x05}));
+        }
+        ASSERT_TRUE(data->saveToDisk());
+    }
+
+    sp<CredentialData> newData() {
+        return new CredentialData(dir_.path, kOwnerUid, kCredentialName);
+    }
+
+    sp<CredentialData> load() {
+        sp<CredentialData> data = newData();
+        EXPECT_TRUE(data->loadFromDisk());
+        return data;
+    }
+
+    // Selects an auth key, like a presentation does, and persists its new use count.
+    void present() {
+        sp<CredentialData> data = load();
+        ASSERT_NE(data->selectAuthKey(false, false, true), nullptr);
+        ASSERT_TRUE(data->saveAuthKeyUpdatesToDisk());
+    }
+
+    static vector<int> useCounts(const sp<CredentialData>& data) {
+        vector<int> counts;
+        for (const AuthKeyData& authKey : data->getAuthKeyDatas()) {
+            counts.push_back(authKey.useCount);
+        }
+        return counts;
+    }
+
+    static string readFile(const string& path) {
+        string contents;
+        EXPECT_TRUE(ReadFileToString(path, &contents));
+        return contents;
+    }
+
+    static EntryData makeEntryData(uint8_t fill, size_t numChunks) {
+        EntryData entryData;
+        entryData.accessControlProfileIds = {fill, fill + 1};
+        for (size_t n = 0; n < numChunks; n++) {
+            entryData.encryptedChunks.push_back(vector<uint8_t>(kChunkSize, fill));
+            entryData.size += kChunkSize;
+        }
+        return entryData;
+    }
+
+    static void expectEntryData(const sp<CredentialData>& data, const string& name,
+                                const EntryData& expected) {
+        optional<EntryData> entryData = data->getEntryData(kNamespace, name);
+        ASSERT_TRUE(entryData) << name;
+        EXPECT_EQ(entryData->size, expected.size) << name;
+        EXPECT_EQ(entryData->accessControlProfileIds, expected.accessControlProfileIds) << name;
+        EXPECT_EQ(entryData->encryptedChunks, expected.encryptedChunks) << name;
+    }
+
+    size_t numFiles() const {
+        return std::distance(std::filesystem::directory_iterator(dir_.path),
+                             std::filesystem::directory_iterator());
+    }
+
+    static constexpr size_t kChunkSize = 4096;
+    static constexpr char kNamespace[] = "org.iso.18013.5.1";
+
+    TemporaryDir dir_;
+    string fileName_;
+    string journalFileName_;
+};
+
+TEST_F(CredentialDataTest, UseCountUpdatesDoNotRewriteCredential) {
+    string credential = readFile(fileName_);
+    for (int n = 0; n < kKeyCount * 2; n++) {
+        present();
+    }
+    EXPECT_EQ(readFile(fileName_), credential);
+    EXPECT_EQ(useCounts(load()), vector<int>(kKeyCount, 2));
+}
+
+TEST_F(CredentialDataTest, PendingCertificatesAreJournaled) {
+    sp<CredentialData> data = load();
+    data->setAvailableAuthenticationKeys(kKeyCount, 1, 0);
+    ASSERT_TRUE(data->saveToDisk());
+    present();
+
+    string credential = readFile(fileName_);
+    data = load();
+    auto keysNeedingCert = data->getAuthKeysNeedingCertification(new FakeIdentityCredential);
+    ASSERT_TRUE(keysNeedingCert);
+    ASSERT_EQ(keysNeedingCert->size(), 1u);
+    ASSERT_TRUE(data->saveAuthKeyUpdatesToDisk());
+    EXPECT_EQ(readFile(fileName_), credential);
+
+    data = load();
+    ASSERT_TRUE(data->storeStaticAuthenticationData(keysNeedingCert->front(),
+                                                    std::numeric_limits<int64_t>::max(), {}));
+}
+
+// Simulates a crash at every byte of a journal append by truncating the journal there.
+TEST_F(CredentialDataTest, TornJournalAppend) {
+    present();
+    string before = readFile(journalFileName_);
+    vector<int> countsBefore = useCounts(load());
+    present();
+    string after = readFile(journalFileName_);
+    vector<int> countsAfter = useCounts(load());
+    ASSERT_GT(after.size(), before.size());
+
+    for (size_t size = before.size(); size < after.size(); size++) {
+        ASSERT_TRUE(WriteStringToFile(after.substr(0, size), journalFileName_));
+        EXPECT_EQ(useCounts(load()), countsBefore) << "size " << size;
+
+        // The torn record is overwritten by the next append.
+        present();
+        EXPECT_EQ(useCounts(load()), countsAfter) << "size " << size;
+    }
+}
+
+// Simulates a crash after a compaction replaced the credential file but before the journal
+// was deleted.
+TEST_F(CredentialDataTest, StaleJournalIsIgnored) {
+    present();
+    string staleJournal = readFile(journalFileName_);
+
+    sp<CredentialData> data = load();
+    ASSERT_NE(data->selectAuthKey(false, false, true), nullptr);
+    ASSERT_TRUE(data->saveToDisk());
+    vector<int> counts = useCounts(data);
+
+    ASSERT_TRUE(WriteStringToFile(staleJournal, journalFileName_));
+    EXPECT_EQ(useCounts(load()), counts);
+
+    // Leftovers of a deleted credential with the same name do not apply either.
+    present();
+    staleJournal = readFile(journalFileName_);
+    ASSERT_TRUE(load()->deleteCredential());
+    SetUp();
+    ASSERT_TRUE(WriteStringToFile(staleJournal, journalFileName_));
+    EXPECT_EQ(useCounts(load()), vector<int>(kKeyCount, 0));
+}
+
+TEST_F(CredentialDataTest, JournalIsCompacted) {
+    for (size_t n = 0; n < CredentialData::kMaxJournalRecords; n++) {
+        present();
+    }
+    string credential = readFile(fileName_);
+    present();
+    EXPECT_NE(readFile(fileName_), credential);
+    EXPECT_NE(access(journalFileName_.c_str(), F_OK), 0);
+
+    size_t total = 0;
+    for (int count : useCounts(load())) {
+        total += count;
+    }
+    EXPECT_EQ(total, CredentialData::kMaxJournalRecords + 1);
+}
+
+TEST_F(CredentialDataTest, KeyPairsAreGeneratedForNewKeysOnly) {
+    constexpr int kManyKeys = 16;
+
+    sp<CredentialData> data = load();
+    data->setAvailableAuthenticationKeys(kManyKeys, 1, 0);
+    sp<FakeIdentityCredential> hal = new FakeIdentityCredential;
+    // The keys provisioned in SetUp() are still valid, only the new ones need key pairs.
+    constexpr int kNewKeys = kManyKeys - kKeyCount;
+
+    auto keysNeedingCert = data->getAuthKeysNeedingCertification(hal);
+    ASSERT_TRUE(keysNeedingCert);
+    ASSERT_EQ(keysNeedingCert->size(), size_t(kNewKeys));
+    EXPECT_EQ(std::set<vector<uint8_t>>(keysNeedingCert->begin(), keysNeedingCert->end()).size(),
+              size_t(kNewKeys));
+    EXPECT_EQ(hal->generated(), kNewKeys);
+
+    // Keys whose certification is pending keep their key pair.
+    EXPECT_EQ(data->getAuthKeysNeedingCertification(hal), keysNeedingCert);
+    EXPECT_EQ(hal->generated(), kNewKeys);
+
+    // A failing HAL call fails the whole request.
+    data->setAvailableAuthenticationKeys(kManyKeys + 1, 1, 0);
+    EXPECT_FALSE(data->getAuthKeysNeedingCertification(
+        new FakeIdentityCredential(true /* fail */)));
+}
+
+TEST_F(CredentialDataTest, StreamingSaveMatchesSaveToDisk) {
+    // "portrait" is large enough for the background writer to fall behind.
+    vector<std::pair<string, EntryData>> entries = {
+        {"family_name", makeEntryData(1, 1)},
+        {"portrait", makeEntryData(2, 200)},
+        {"empty", makeEntryData(3, 0)},
+        {"birth_date", makeEntryData(4, 1)},
+    };
+
+    sp<CredentialData> data = load();
+    vector<int> counts = useCounts(data);
+    ASSERT_TRUE(data->beginSaveToDisk(entries.size()));
+    for (const auto& [name, entryData] : entries) {
+        ASSERT_TRUE(data->saveEntryDataToDisk(kNamespace, name, entryData));
+    }
+    ASSERT_TRUE(data->finishSaveToDisk());
+
+    data = load();
+    for (const auto& [name, entryData] : entries) {
+        expectEntryData(data, name, entryData);
+    }
+    EXPECT_EQ(useCounts(data), counts);
+
+    // Writing the loaded entries back in one go results in the same credential.
+    ASSERT_TRUE(data->saveToDisk());
+    data = load();
+    for (const auto& [name, entryData] : entries) {
+        expectEntryData(data, name, entryData);
+    }
+    EXPECT_EQ(useCounts(data), counts);
+}
+
+TEST_F(CredentialDataTest, AbandonedStreamingSaveKeepsCredential) {
+    string credential = readFile(fileName_);
+    size_t files = numFiles();
+
+    sp<CredentialData> data = load();
+    ASSERT_TRUE(data->beginSaveToDisk(2));
+    ASSERT_TRUE(data->saveEntryDataToDisk(kNamespace, "family_name", makeEntryData(1, 1)));
+    EXPECT_FALSE(data->finishSaveToDisk());
+    EXPECT_EQ(readFile(fileName_), credential);
+    EXPECT_EQ(numFiles(), files);
+
+    data = load();
+    ASSERT_TRUE(data->beginSaveToDisk(2));
+    ASSERT_TRUE(data->saveEntryDataToDisk(kNamespace, "portrait", makeEntryData(2, 200)));
+    data.clear();
+    EXPECT_EQ(readFile(fileName_), credential);
+    EXPECT_EQ(numFiles(), files);
+}
+
+TEST_F(CredentialDataTest, StreamingSaveRejectsDuplicateEntries) {
+    string credential = readFile(fileName_);
+    size_t files = numFiles();
+
+    sp<CredentialData> data = load();
+    ASSERT_TRUE(data->beginSaveToDisk(2));
+    ASSERT_TRUE(data->saveEntryDataToDisk(kNamespace, "family_name", makeEntryData(1, 1)));
+    EXPECT_FALSE(data->saveEntryDataToDisk(kNamespace, "family_name", makeEntryData(2, 1)));
+    EXPECT_FALSE(data->finishSaveToDisk());
+    EXPECT_EQ(readFile(fileName_), credential);
+    EXPECT_EQ(numFiles(), files);
+}
+
+}  // namespace
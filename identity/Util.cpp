@@ -80,49 +80,103 @@ optional<vector<uint8_t>> fileGetContents(const string& path) {
     return data;
 }
 
-bool fileSetContents(const string& path, const vector<uint8_t>& data) {
+AtomicFileWriter::AtomicFileWriter(const string& path) : path_(path) {}
+
+AtomicFileWriter::~AtomicFileWriter() {
+    if (fd_ != -1) {
+        close(fd_);
+        unlink(tempName_.c_str());
+    }
+}
+
+bool AtomicFileWriter::open() {
     char tempName[4096];
-    int fd;
 
-    string tempNameStr = path + ".XXXXXX";
+    string tempNameStr = path_ + ".XXXXXX";
     if (tempNameStr.size() >= sizeof tempName - 1) {
         LOG(ERROR) << "Path name too long";
         return false;
     }
     strncpy(tempName, tempNameStr.c_str(), sizeof tempName);
 
-    fd = mkstemp(tempName);
+    fd_ = mkstemp(tempName);
+    if (fd_ == -1) {
+        PLOG(ERROR) << "Error creating temp file for '" << path_ << "'";
+        return false;
+    }
+    tempName_ = tempName;
+    return true;
+}
+
+bool AtomicFileWriter::write(const uint8_t* data, size_t size) {
+    const uint8_t* p = data;
+    size_t remaining = size;
+    while (remaining > 0) {
+        ssize_t numWritten = TEMP_FAILURE_RETRY(::write(fd_, p, remaining));
+        if (numWritten <= 0) {
+            PLOG(ERROR) << "Failed writing into temp file for '" << path_ << "'";
+            return false;
+        }
+        p += numWritten;
+        remaining -= numWritten;
+    }
+    return true;
+}
+
+bool AtomicFileWriter::commit() {
+    if (TEMP_FAILURE_RETRY(fsync(fd_))) {
+        PLOG(ERROR) << "Failed fsyncing temp file for '" << path_ << "'";
+        return false;
+    }
+
+    if (rename(tempName_.c_str(), path_.c_str()) != 0) {
+        PLOG(ERROR) << "Error renaming temp file for '" << path_ << "'";
+        return false;
+    }
+    close(fd_);
+    fd_ = -1;
+    return true;
+}
+
+bool fileSetContents(const string& path, const vector<uint8_t>& data) {
+    AtomicFileWriter writer(path);
+    return writer.open() && writer.write(data.data(), data.size()) && writer.commit();
+}
+
+bool fileWriteContentsAt(const string& path, size_t offset, const vector<uint8_t>& data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
     if (fd == -1) {
-        PLOG(ERROR) << "Error creating temp file for '" << path << "'";
+        PLOG(ERROR) << "Error opening '" << path << "'";
+        return false;
+    }
+
+    if (TEMP_FAILURE_RETRY(ftruncate(fd, offset)) != 0) {
+        PLOG(ERROR) << "Error truncating '" << path << "'";
+        close(fd);
         return false;
     }
 
     const uint8_t* p = data.data();
     size_t remaining = data.size();
     while (remaining > 0) {
-        ssize_t numWritten = TEMP_FAILURE_RETRY(write(fd, p, remaining));
+        ssize_t numWritten = TEMP_FAILURE_RETRY(pwrite(fd, p, remaining, offset));
         if (numWritten <= 0) {
-            PLOG(ERROR) << "Failed writing into temp file for '" << path << "'";
+            PLOG(ERROR) << "Failed writing into '" << path << "'";
             close(fd);
             return false;
         }
         p += numWritten;
+        offset += numWritten;
         remaining -= numWritten;
     }
 
     if (TEMP_FAILURE_RETRY(fsync(fd))) {
-        PLOG(ERROR) << "Failed fsyncing temp file for '" << path << "'";
+        PLOG(ERROR) << "Failed fsyncing '" << path << "'";
         close(fd);
         return false;
     }
     close(fd);
 
-    if (rename(tempName, path.c_str()) != 0) {
-        PLOG(ERROR) << "Error renaming temp file for '" << path << "'";
-        close(fd);
-        return false;
-    }
-
     return true;
 }
 
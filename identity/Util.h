@@ -39,12 +39,41 @@ Status halStatusToGenericError(const Status& halStatus);
 // Converts a HAL status to a credstore service-specific error of a given value
 Status halStatusToError(const Status& halStatus, int credStoreError);
 
+// Writes a file at |path| in pieces, for files too large to build in memory first. The file
+// only replaces an existing one at |path| once commit() succeeds; until then the data goes to
+// a temporary file, which is removed if the writer is destroyed.
+class AtomicFileWriter {
+  public:
+    explicit AtomicFileWriter(const string& path);
+    ~AtomicFileWriter();
+
+    AtomicFileWriter(const AtomicFileWriter&) = delete;
+    AtomicFileWriter& operator=(const AtomicFileWriter&) = delete;
+
+    bool open();
+    bool write(const uint8_t* data, size_t size);
+    bool commit();
+
+  private:
+    string path_;
+    string tempName_;
+    int fd_ = -1;
+};
+
 // Helper function to atomically write |data| into file at |path|.
 //
 // Returns true on success, false on error.
 //
 bool fileSetContents(const string& path, const vector<uint8_t>& data);
 
+// Helper function to durably write |data| into file at |path| at offset |offset|. The file is
+// created if it does not exist and truncated to |offset| first, which discards any data from
+// an earlier write that was interrupted.
+//
+// Returns true on success, false on error.
+//
+bool fileWriteContentsAt(const string& path, size_t offset, const vector<uint8_t>& data);
+
 // Helper function which reads contents offile at |path| into |data|.
 //
 // Returns nothing on error, the content on success.
@@ -16,6 +16,9 @@
 
 #define LOG_TAG "credstore"
 
+#include <algorithm>
+#include <set>
+
 #include <android-base/logging.h>
 #include <android/hardware/identity/support/IdentityCredentialSupport.h>
 #include <android/security/identity/ICredentialStore.h>
@@ -36,8 +39,6 @@ using ::std::pair;
 
 using ::android::hardware::identity::SecureAccessControlProfile;
 
-using ::android::hardware::identity::support::chunkVector;
-
 WritableCredential::WritableCredential(const string& dataPath, const string& credentialName,
                                        const string& docType, bool isUpdate,
                                        HardwareInformation hwInfo,
@@ -112,10 +113,9 @@ ssize_t WritableCredential::calcExpectedProofOfProvisioningSize(
     const vector<AccessControlProfileParcel>& accessControlProfiles,
     const vector<EntryNamespaceParcel>& entryNamespaces) {
 
-    // Right now, we calculate the size by simply just calculating the
-    // CBOR. There's a little bit of overhead associated with this (as compared
-    // to just adding up sizes) but it's a lot simpler and robust. In the future
-    // if this turns out to be a problem, we can optimize it.
+    // We calculate the size of each part of the CBOR and add them up. Only one entry value is
+    // parsed at a time, since encoding all of them at once would need several times the size
+    // of the credential in memory.
     //
 
     cppbor::Array acpArray;
@@ -132,9 +132,10 @@ ssize_t WritableCredential::calcExpectedProofOfProvisioningSize(
         acpArray.add(std::move(map));
     }
 
-    cppbor::Map dataMap;
+    size_t dataMapSize = cppbor::headerSize(entryNamespaces.size());
     for (const EntryNamespaceParcel& ensParcel : entryNamespaces) {
-        cppbor::Array entriesArray;
+        dataMapSize += cppbor::Tstr(ensParcel.namespaceName).encodedSize();
+        dataMapSize += cppbor::headerSize(ensParcel.entries.size());
         for (const EntryParcel& eParcel : ensParcel.entries) {
             // TODO: ideally do do this without parsing the data (but still validate data is valid
             // CBOR).
@@ -150,18 +151,13 @@ ssize_t WritableCredential::calcExpectedProofOfProvisioningSize(
                 acpIdsArray.add(id);
             }
             entryMap.add("accessControlProfiles", std::move(acpIdsArray));
-            entriesArray.add(std::move(entryMap));
+            dataMapSize += entryMap.encodedSize();
         }
-        dataMap.add(ensParcel.namespaceName, std::move(entriesArray));
     }
 
-    cppbor::Array array;
-    array.add("ProofOfProvisioning");
-    array.add(docType_);
-    array.add(std::move(acpArray));
-    array.add(std::move(dataMap));
-    array.add(false);  // testCredential
-    return array.encode().size();
+    return cppbor::headerSize(5) + cppbor::Tstr("ProofOfProvisioning").encodedSize() +
+           cppbor::Tstr(docType_).encodedSize() + acpArray.encodedSize() + dataMapSize +
+           cppbor::Bool(false).encodedSize();  // testCredential
 }
 
 Status
@@ -187,8 +183,18 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
     data.setAttestationCertificate(attestationCertificate_);
 
     vector<int32_t> entryCounts;
+    size_t totalEntryCount = 0;
+    std::set<string> entryIds;
     for (const EntryNamespaceParcel& ensParcel : entryNamespaces) {
         entryCounts.push_back(ensParcel.entries.size());
+        totalEntryCount += ensParcel.entries.size();
+        for (const EntryParcel& eParcel : ensParcel.entries) {
+            if (!entryIds.insert(ensParcel.namespaceName + ":" + eParcel.name).second) {
+                LOG(ERROR) << "Duplicate entry " << ensParcel.namespaceName << ":" << eParcel.name;
+                return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
+                                                        "Duplicate entry name");
+            }
+        }
     }
 
     ssize_t expectedPoPSize =
@@ -223,10 +229,15 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
         data.addSecureAccessControlProfile(profile);
     }
 
+    // Encrypted entries are written to the new credential file as they come back from the HAL,
+    // rather than all at the end, so only a bounded amount of them is held in memory.
+    if (!data.beginSaveToDisk(totalEntryCount)) {
+        return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
+                                                "Error saving credential data to disk");
+    }
+
     for (const EntryNamespaceParcel& ensParcel : entryNamespaces) {
         for (const EntryParcel& eParcel : ensParcel.entries) {
-            vector<vector<uint8_t>> chunks = chunkVector(eParcel.value, hwInfo_.dataChunkSize);
-
             vector<int32_t> ids;
             std::copy(eParcel.accessControlProfileIds.begin(),
                       eParcel.accessControlProfileIds.end(), std::back_inserter(ids));
@@ -237,20 +248,35 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
                 return halStatusToGenericError(status);
             }
 
-            vector<vector<uint8_t>> encryptedChunks;
-            for (const auto& chunk : chunks) {
+            // Each encrypted chunk is handed to the writer as soon as the HAL returns it, so
+            // neither the entry's encrypted chunks nor their encoding are held as a whole.
+            // Like chunkVector(), but only one chunk is copied out of the value at a time. An
+            // empty value is still passed to the HAL as one empty chunk.
+            size_t chunkSize = hwInfo_.dataChunkSize;
+            size_t chunkCount =
+                std::max<size_t>(1, (eParcel.value.size() + chunkSize - 1) / chunkSize);
+            if (!data.beginEntryDataToDisk(ensParcel.namespaceName, eParcel.name,
+                                           eParcel.value.size(), ids, chunkCount)) {
+                return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
+                                                        "Error saving credential data to disk");
+            }
+            size_t offset = 0;
+            do {
+                size_t size = std::min(eParcel.value.size() - offset, chunkSize);
+                vector<uint8_t> chunk(eParcel.value.begin() + offset,
+                                      eParcel.value.begin() + offset + size);
+                offset += size;
+
                 vector<uint8_t> encryptedChunk;
                 status = halBinder_->addEntryValue(chunk, &encryptedChunk);
                 if (!status.isOk()) {
                     return halStatusToGenericError(status);
                 }
-                encryptedChunks.push_back(encryptedChunk);
-            }
-            EntryData eData;
-            eData.size = eParcel.value.size();
-            eData.accessControlProfileIds = std::move(ids);
-            eData.encryptedChunks = std::move(encryptedChunks);
-            data.addEntryData(ensParcel.namespaceName, eParcel.name, eData);
+                if (!data.saveEntryChunkToDisk(std::move(encryptedChunk))) {
+                    return Status::fromServiceSpecificError(
+                        ICredentialStore::ERROR_GENERIC, "Error saving credential data to disk");
+                }
+            } while (offset < eParcel.value.size());
         }
     }
 
@@ -264,7 +290,7 @@ WritableCredential::personalize(const vector<AccessControlProfileParcel>& access
 
     data.setAvailableAuthenticationKeys(keyCount_, maxUsesPerKey_, minValidTimeMillis_);
 
-    if (!data.saveToDisk()) {
+    if (!data.finishSaveToDisk()) {
         return Status::fromServiceSpecificError(ICredentialStore::ERROR_GENERIC,
                                                 "Error saving credential data to disk");
     }
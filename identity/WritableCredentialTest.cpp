@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WritableCredential.h"
+
+#include <android-base/file.h>
+#include <cppbor.h>
+#include <gtest/gtest.h>
+#include <malloc.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CredentialData.h"
+
+using ::android::sp;
+using ::android::base::TemporaryDir;
+using ::android::binder::Status;
+using ::android::hardware::identity::Certificate;
+using ::android::hardware::identity::HardwareInformation;
+using ::android::hardware::identity::IWritableIdentityCredentialDefault;
+using ::android::hardware::identity::SecureAccessControlProfile;
+using ::std::chrono::microseconds;
+using ::std::chrono::milliseconds;
+using ::std::chrono::steady_clock;
+
+using namespace ::android::security::identity;
+
+namespace {
+
+constexpr char kCredentialName[] = "mdl";
+constexpr char kNamespace[] = "org.iso.18013.5.1";
+constexpr size_t kDataChunkSize = 4096;
+constexpr size_t kTagSize = 16;
+
+// Returns the number of bytes currently allocated on the heap.
+size_t heapInUse() {
+    return mallinfo().uordblks;
+}
+
+// Encrypts by appending a tag, taking |latency| per chunk like a secure-hardware
+// implementation would. Every chunk samples how far the heap has grown beyond the size it had
+// when personalization started.
+class FakeWritableIdentityCredential : public IWritableIdentityCredentialDefault {
+  public:
+    explicit FakeWritableIdentityCredential(microseconds latency) : latency_(latency) {}
+
+    size_t peakHeapGrowth() const { return peakHeapGrowth_; }
+
+    Status setExpectedProofOfProvisioningSize(int32_t) override { return Status::ok(); }
+
+    Status startPersonalization(int32_t, const vector<int32_t>&) override {
+        heapBaseline_ = heapInUse();
+        return Status::ok();
+    }
+
+    Status addAccessControlProfile(int32_t id, const Certificate& readerCertificate,
+                                   bool userAuthenticationRequired, int64_t timeoutMillis,
+                                   int64_t secureUserId,
+                                   SecureAccessControlProfile* profile) override {
+        profile->id = id;
+        profile->readerCertificate = readerCertificate;
+        profile->userAuthenticationRequired = userAuthenticationRequired;
+        profile->timeoutMillis = timeoutMillis;
+        profile->secureUserId = secureUserId;
+        return Status::ok();
+    }
+
+    Status beginAddEntry(const vector<int32_t>&, const string&, const string&, int32_t) override {
+        return Status::ok();
+    }
+
+    Status addEntryValue(const vector<uint8_t>& content,
+                         vector<uint8_t>* encryptedContent) override {
+        size_t inUse = heapInUse();
+        if (inUse > heapBaseline_) {
+            peakHeapGrowth_ = std::max(peakHeapGrowth_, inUse - heapBaseline_);
+        }
+        std::this_thread::sleep_for(latency_);
+        *encryptedContent = content;
+        encryptedContent->resize(content.size() + kTagSize, 't');
+        return Status::ok();
+    }
+
+    Status finishAddingEntries(vector<uint8_t>* credentialData,
+                               vector<uint8_t>* proofOfProvisioningSignature) override {
+        *credentialData = {0x01};
+        *proofOfProvisioningSignature = {0x02};
+        return Status::ok();
+    }
+
+  private:
+    microseconds latency_;
+    size_t heapBaseline_ = 0;
+    size_t peakHeapGrowth_ = 0;
+};
+
+// Personalizes a credential of several megabytes and reports how long it takes and how much
+// the heap grows beyond the memory already taken by the request itself.
+TEST(WritableCredentialTest, PersonalizeBenchmark) {
+    constexpr size_t kNumEntries = 8;
+    constexpr size_t kEntrySize = 1024 * 1024;
+    constexpr microseconds kLatencyPerChunk(100);
+
+    TemporaryDir dir;
+    HardwareInformation hwInfo;
+    hwInfo.dataChunkSize = kDataChunkSize;
+    sp<FakeWritableIdentityCredential> hal = new FakeWritableIdentityCredential(kLatencyPerChunk);
+    sp<WritableCredential> writableCredential =
+        new WritableCredential(dir.path, kCredentialName, "org.iso.18013.5.1.mDL",
+                               true /* isUpdate */, hwInfo, hal);
+
+    AccessControlProfileParcel profile;
+    profile.id = 0;
+    EntryNamespaceParcel ensParcel;
+    ensParcel.namespaceName = kNamespace;
+    for (size_t n = 0; n < kNumEntries; n++) {
+        EntryParcel eParcel;
+        eParcel.name = "entry" + std::to_string(n);
+        eParcel.value = cppbor::Bstr(vector<uint8_t>(kEntrySize, n)).encode();
+        eParcel.accessControlProfileIds = {0};
+        ensParcel.entries.push_back(std::move(eParcel));
+    }
+
+    auto start = steady_clock::now();
+    vector<uint8_t> proofOfProvisioningSignature;
+    ASSERT_TRUE(
+        writableCredential->personalize({profile}, {ensParcel}, 0, &proofOfProvisioningSignature)
+            .isOk());
+    auto elapsed = std::chrono::duration_cast<milliseconds>(steady_clock::now() - start);
+    std::cout << "Personalized " << kNumEntries * kEntrySize / 1024 << " KiB in "
+              << elapsed.count() << " ms, peak heap grew by " << hal->peakHeapGrowth() / 1024
+              << " KiB" << std::endl;
+    // Encrypted chunks go to the background writer as they come, so memory stays well below
+    // a single entry, which is what holding an entry's chunks or their encoding would take.
+    EXPECT_LT(hal->peakHeapGrowth(), kEntrySize / 2);
+
+    sp<CredentialData> data = new CredentialData(dir.path, getuid(), kCredentialName);
+    ASSERT_TRUE(data->loadFromDisk());
+    for (const EntryParcel& eParcel : ensParcel.entries) {
+        optional<EntryData> entryData = data->getEntryData(kNamespace, eParcel.name);
+        ASSERT_TRUE(entryData) << eParcel.name;
+        EXPECT_EQ(entryData->size, eParcel.value.size());
+        ASSERT_EQ(entryData->encryptedChunks.size(),
+                  (eParcel.value.size() + kDataChunkSize - 1) / kDataChunkSize);
+        vector<uint8_t> firstChunk(eParcel.value.begin(), eParcel.value.begin() + kDataChunkSize);
+        firstChunk.resize(kDataChunkSize + kTagSize, 't');
+        EXPECT_EQ(entryData->encryptedChunks.front(), firstChunk);
+    }
+}
+
+}  // namespace
@@ -15,6 +15,7 @@
  */
 
 #include "keystore2_engine.h"
+#include "keystore2_engine_internal.h"
 
 #include <aidl/android/system/keystore2/IKeystoreService.h>
 #include <android-base/logging.h>
@@ -23,6 +24,13 @@
 
 #include <private/android_filesystem_config.h>
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <openssl/bio.h>
 #include <openssl/bn.h>
 #include <openssl/ec.h>
@@ -31,6 +39,7 @@
 #include <openssl/engine.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
+#include <openssl/ssl.h>
 #include <openssl/x509.h>
 
 #define AT __func__ << ":" << __LINE__ << " "
@@ -356,6 +365,270 @@ bssl::UniquePtr<EVP_PKEY> extractPubKey(const std::vector<uint8_t>& cert_bytes)
     return pub_key;
 }
 
+
+/* key_backend_of returns the Keystore backend of |pkey|, or nullptr if |pkey|
+ * was not created by EVP_PKEY_from_keystore2. */
+const std::shared_ptr<Keystore2KeyBackend>* key_backend_of(const EVP_PKEY* pkey) {
+    switch (EVP_PKEY_id(pkey)) {
+    case EVP_PKEY_RSA:
+        return reinterpret_cast<std::shared_ptr<Keystore2KeyBackend>*>(RSA_get_ex_data(
+            EVP_PKEY_get0_RSA(pkey), Keystore2Engine::get().rsa_ex_index()));
+    case EVP_PKEY_EC:
+        return reinterpret_cast<std::shared_ptr<Keystore2KeyBackend>*>(EC_KEY_get_ex_data(
+            EVP_PKEY_get0_EC_KEY(pkey), Keystore2Engine::get().ec_key_ex_index()));
+    default:
+        return nullptr;
+    }
+}
+
+/* AsyncSignJob is a TLS handshake signature that is computed by a worker of
+ * AsyncSigner while the handshake of |ssl_| returns
+ * SSL_ERROR_WANT_PRIVATE_KEY_OPERATION. */
+struct AsyncSignJob {
+    enum class State { kPending, kDone, kFailed };
+
+    bssl::UniquePtr<EVP_PKEY> pkey_;
+    std::shared_ptr<Keystore2KeyBackend> key_backend_;
+    uint16_t signature_algorithm_;
+    std::vector<uint8_t> input_;
+
+    /* lock_ guards the members below. */
+    std::mutex lock_;
+    State state_ = State::kPending;
+    std::vector<uint8_t> signature_;
+    /* ssl_ is reset to nullptr when the connection is freed before the job
+     * completes. */
+    SSL* ssl_;
+    keystore2_async_sign_done_cb done_;
+    void* done_arg_;
+};
+
+/* compute_signature signs |input| with |pkey| as TLS |signature_algorithm|
+ * requires. It blocks on Keystore through the engine methods above. */
+bool compute_signature(EVP_PKEY* pkey, uint16_t signature_algorithm,
+                       const std::vector<uint8_t>& input, std::vector<uint8_t>* signature) {
+    bssl::ScopedEVP_MD_CTX ctx;
+    EVP_PKEY_CTX* pctx;
+    const EVP_MD* digest = SSL_get_signature_algorithm_digest(signature_algorithm);
+    if (!EVP_DigestSignInit(ctx.get(), &pctx, digest, nullptr /* engine */, pkey)) {
+        return false;
+    }
+    if (SSL_is_signature_algorithm_rsa_pss(signature_algorithm) &&
+        (!EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) ||
+         !EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, -1 /* digest length */))) {
+        return false;
+    }
+    size_t len = EVP_PKEY_size(pkey);
+    signature->resize(len);
+    if (!EVP_DigestSign(ctx.get(), signature->data(), &len, input.data(), input.size())) {
+        return false;
+    }
+    signature->resize(len);
+    return true;
+}
+
+/* AsyncSigner runs AsyncSignJobs on a pool of worker threads, with at most
+ * |max_in_flight_per_key_| jobs of the same key at a time. Jobs beyond that
+ * limit wait in the queue, so a busy key cannot occupy all workers. */
+class AsyncSigner {
+  public:
+    static AsyncSigner& get() {
+        // Never destroyed, because the detached workers may still use it at exit.
+        static AsyncSigner* signer = new AsyncSigner();
+        return *signer;
+    }
+
+    bool configure(size_t worker_threads, size_t max_in_flight_per_key) {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (workers_started_ > 0 || worker_threads == 0 || max_in_flight_per_key == 0) {
+            return false;
+        }
+        worker_threads_ = worker_threads;
+        max_in_flight_per_key_ = max_in_flight_per_key;
+        return true;
+    }
+
+    void submit(std::shared_ptr<AsyncSignJob> job) {
+        std::lock_guard<std::mutex> lock(lock_);
+        for (; workers_started_ < worker_threads_; ++workers_started_) {
+            std::thread(&AsyncSigner::worker_loop, this).detach();
+        }
+        queue_.push_back(std::move(job));
+        cv_.notify_one();
+    }
+
+  private:
+    AsyncSigner() = default;
+
+    /* next_runnable returns the oldest queued job whose key is below its
+     * limit. Must be called with lock_ held. */
+    std::deque<std::shared_ptr<AsyncSignJob>>::iterator next_runnable() {
+        for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+            auto in_flight = in_flight_.find((*it)->key_backend_.get());
+            if (in_flight == in_flight_.end() || in_flight->second < max_in_flight_per_key_) {
+                return it;
+            }
+        }
+        return queue_.end();
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(lock_);
+        for (;;) {
+            auto it = queue_.end();
+            cv_.wait(lock, [&] { return (it = next_runnable()) != queue_.end(); });
+            auto job = std::move(*it);
+            queue_.erase(it);
+            auto key = job->key_backend_.get();
+            ++in_flight_[key];
+            lock.unlock();
+
+            run(*job);
+
+            lock.lock();
+            if (--in_flight_[key] == 0) {
+                in_flight_.erase(key);
+            }
+            // A job of the same key may have become runnable.
+            cv_.notify_all();
+        }
+    }
+
+    static void run(AsyncSignJob& job) {
+        {
+            std::lock_guard<std::mutex> lock(job.lock_);
+            if (job.ssl_ == nullptr) {
+                // The connection is gone, so nobody will collect the signature.
+                return;
+            }
+        }
+        std::vector<uint8_t> signature;
+        bool success =
+            compute_signature(job.pkey_.get(), job.signature_algorithm_, job.input_, &signature);
+        if (!success) {
+            LOG(ERROR) << AT << "Asynchronous signature failed.";
+        }
+
+        std::lock_guard<std::mutex> lock(job.lock_);
+        job.state_ = success ? AsyncSignJob::State::kDone : AsyncSignJob::State::kFailed;
+        job.signature_ = std::move(signature);
+        if (job.ssl_ != nullptr && job.done_ != nullptr) {
+            job.done_(job.ssl_, job.done_arg_);
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    size_t worker_threads_ = 4;
+    size_t max_in_flight_per_key_ = 2;
+    size_t workers_started_ = 0;
+    std::deque<std::shared_ptr<AsyncSignJob>> queue_;
+    std::map<const Keystore2KeyBackend*, size_t> in_flight_;
+};
+
+/* AsyncKeyState is attached to an SSL that uses a Keystore key through
+ * async_private_key_method. */
+struct AsyncKeyState {
+    bssl::UniquePtr<EVP_PKEY> pkey_;
+    std::shared_ptr<Keystore2KeyBackend> key_backend_;
+    keystore2_async_sign_done_cb done_;
+    void* done_arg_;
+    /* job_ is the pending or not yet collected signature of the handshake. */
+    std::shared_ptr<AsyncSignJob> job_;
+};
+
+/* async_key_state_free is called when the SSL is freed. A pending job must not
+ * call back into it afterwards. */
+extern "C" void async_key_state_free(void* /* parent */, void* ptr, CRYPTO_EX_DATA* /* ad */,
+                                     int /* index */, long /* argl */, void* /* argp */) {
+    auto state = reinterpret_cast<AsyncKeyState*>(ptr);
+    if (state == nullptr) {
+        return;
+    }
+    if (state->job_) {
+        std::lock_guard<std::mutex> lock(state->job_->lock_);
+        state->job_->ssl_ = nullptr;
+    }
+    delete state;
+}
+
+int async_key_state_index() {
+    static int index = SSL_get_ex_new_index(0 /* argl */, nullptr /* argp */,
+                                            nullptr /* new_func */, nullptr /* dup_func */,
+                                            async_key_state_free);
+    return index;
+}
+
+extern "C" ssl_private_key_result_t async_sign(SSL* ssl, uint8_t* /* out */, size_t* /* out_len */,
+                                               size_t /* max_out */, uint16_t signature_algorithm,
+                                               const uint8_t* in, size_t in_len) {
+    auto state = reinterpret_cast<AsyncKeyState*>(SSL_get_ex_data(ssl, async_key_state_index()));
+    if (state == nullptr) {
+        LOG(ERROR) << AT << "No Keystore key attached to the connection.";
+        return ssl_private_key_failure;
+    }
+    if (SSL_get_signature_algorithm_key_type(signature_algorithm) !=
+        EVP_PKEY_id(state->pkey_.get())) {
+        LOG(ERROR) << AT << "Signature algorithm " << signature_algorithm
+                   << " does not match the key type.";
+        return ssl_private_key_failure;
+    }
+
+    auto job = std::make_shared<AsyncSignJob>();
+    EVP_PKEY_up_ref(state->pkey_.get());
+    job->pkey_.reset(state->pkey_.get());
+    job->key_backend_ = state->key_backend_;
+    job->signature_algorithm_ = signature_algorithm;
+    job->input_.assign(in, in + in_len);
+    job->ssl_ = ssl;
+    job->done_ = state->done_;
+    job->done_arg_ = state->done_arg_;
+    state->job_ = job;
+    AsyncSigner::get().submit(std::move(job));
+    return ssl_private_key_retry;
+}
+
+extern "C" ssl_private_key_result_t async_decrypt(SSL* /* ssl */, uint8_t* /* out */,
+                                                  size_t* /* out_len */, size_t /* max_out */,
+                                                  const uint8_t* /* in */, size_t /* in_len */) {
+    LOG(ERROR) << AT << "RSA key exchange is not supported with Keystore keys.";
+    return ssl_private_key_failure;
+}
+
+extern "C" ssl_private_key_result_t async_complete(SSL* ssl, uint8_t* out, size_t* out_len,
+                                                   size_t max_out) {
+    auto state = reinterpret_cast<AsyncKeyState*>(SSL_get_ex_data(ssl, async_key_state_index()));
+    if (state == nullptr || !state->job_) {
+        LOG(ERROR) << AT << "No signature pending.";
+        return ssl_private_key_failure;
+    }
+    auto job = state->job_;
+    std::lock_guard<std::mutex> lock(job->lock_);
+    switch (job->state_) {
+    case AsyncSignJob::State::kPending:
+        return ssl_private_key_retry;
+    case AsyncSignJob::State::kFailed:
+        state->job_.reset();
+        return ssl_private_key_failure;
+    case AsyncSignJob::State::kDone:
+        break;
+    }
+    state->job_.reset();
+    if (job->signature_.size() > max_out) {
+        LOG(ERROR) << AT << "Signature is too large";
+        return ssl_private_key_failure;
+    }
+    memcpy(out, job->signature_.data(), job->signature_.size());
+    *out_len = job->signature_.size();
+    return ssl_private_key_success;
+}
+
+const SSL_PRIVATE_KEY_METHOD async_private_key_method = {
+    .sign = async_sign,
+    .decrypt = async_decrypt,
+    .complete = async_complete,
+};
+
 }  // namespace
 
 /* EVP_PKEY_from_keystore returns an |EVP_PKEY| that contains either an RSA or
@@ -418,25 +691,51 @@ extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id) {
         return nullptr;
     }
 
+    return wrap_keystore2_key(response.metadata.key, response.iSecurityLevel, pkey.get())
+        .release();
+}
+
+bssl::UniquePtr<EVP_PKEY> wrap_keystore2_key(
+    const ks2::KeyDescriptor& descriptor,
+    std::shared_ptr<ks2::IKeystoreSecurityLevel> i_keystore_security_level,
+    const EVP_PKEY* public_key) {
     auto key_backend = std::make_shared<Keystore2KeyBackend>(
-        Keystore2KeyBackend{response.metadata.key, response.iSecurityLevel});
+        Keystore2KeyBackend{descriptor, std::move(i_keystore_security_level)});
 
-    bssl::UniquePtr<EVP_PKEY> result;
-    switch (EVP_PKEY_id(pkey.get())) {
-    case EVP_PKEY_RSA: {
-        RSA* public_rsa = EVP_PKEY_get0_RSA(pkey.get());
-        result = wrap_rsa(key_backend, public_rsa);
-        break;
-    }
-    case EVP_PKEY_EC: {
-        EC_KEY* public_ecdsa = EVP_PKEY_get0_EC_KEY(pkey.get());
-        result = wrap_ecdsa(key_backend, public_ecdsa);
-        break;
-    }
+    switch (EVP_PKEY_id(public_key)) {
+    case EVP_PKEY_RSA:
+        return wrap_rsa(key_backend, EVP_PKEY_get0_RSA(public_key));
+    case EVP_PKEY_EC:
+        return wrap_ecdsa(key_backend, EVP_PKEY_get0_EC_KEY(public_key));
     default:
-        LOG(ERROR) << AT << "Unsupported key type " << EVP_PKEY_id(pkey.get());
+        LOG(ERROR) << AT << "Unsupported key type " << EVP_PKEY_id(public_key);
         return nullptr;
     }
+}
+
+extern "C" int SSL_use_keystore2_private_key_async(SSL* ssl, EVP_PKEY* pkey,
+                                                   keystore2_async_sign_done_cb done,
+                                                   void* arg) {
+    auto key_backend = key_backend_of(pkey);
+    if (key_backend == nullptr) {
+        LOG(ERROR) << AT << "Not a Keystore key.";
+        return 0;
+    }
+
+    EVP_PKEY_up_ref(pkey);
+    auto state = new AsyncKeyState{bssl::UniquePtr<EVP_PKEY>(pkey), *key_backend, done, arg, {}};
+    auto old_state =
+        reinterpret_cast<AsyncKeyState*>(SSL_get_ex_data(ssl, async_key_state_index()));
+    if (!SSL_set_ex_data(ssl, async_key_state_index(), state)) {
+        delete state;
+        return 0;
+    }
+    async_key_state_free(nullptr, old_state, nullptr, 0, 0, nullptr);
+    SSL_set_private_key_method(ssl, &async_private_key_method);
+    return 1;
+}
 
-    return result.release();
+extern "C" int keystore2_configure_async_signing(size_t worker_threads,
+                                                 size_t max_in_flight_per_key) {
+    return AsyncSigner::get().configure(worker_threads, max_in_flight_per_key) ? 1 : 0;
 }
@@ -17,5 +17,32 @@
 #pragma once
 
 #include <openssl/evp.h>
+#include <openssl/ssl.h>
 
 extern "C" EVP_PKEY* EVP_PKEY_from_keystore2(const char* key_id);
+
+/* keystore2_async_sign_done_cb is called on a worker thread when the
+ * asynchronous signature of |ssl| is ready, so that the caller's event loop can
+ * resume the handshake. It must not call into |ssl| itself, and the
+ * connection must not be freed while it runs. */
+typedef void (*keystore2_async_sign_done_cb)(SSL* ssl, void* arg);
+
+/* SSL_use_keystore2_private_key_async makes |ssl| sign its handshakes with
+ * |pkey|, which must have been returned by EVP_PKEY_from_keystore2, without
+ * blocking the calling thread. Signatures are computed on a pool of worker
+ * threads while SSL_do_handshake fails with
+ * SSL_ERROR_WANT_PRIVATE_KEY_OPERATION, and |done| is called with |arg| once
+ * the handshake can be retried. The certificate must be set separately. It
+ * returns one on success and zero otherwise. */
+extern "C" int SSL_use_keystore2_private_key_async(SSL* ssl, EVP_PKEY* pkey,
+                                                   keystore2_async_sign_done_cb done, void* arg)
+    __attribute__((visibility("default")));
+
+/* keystore2_configure_async_signing sets the number of worker threads that
+ * compute asynchronous signatures, 4 by default, and how many signatures of
+ * the same key may be in flight at once, 2 by default. It must be called
+ * before the first asynchronous signature and returns one on success and zero
+ * otherwise. */
+extern "C" int keystore2_configure_async_signing(size_t worker_threads,
+                                                 size_t max_in_flight_per_key)
+    __attribute__((visibility("default")));
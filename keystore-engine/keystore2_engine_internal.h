@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/system/keystore2/IKeystoreSecurityLevel.h>
+#include <openssl/evp.h>
+
+#include <memory>
+
+/* wrap_keystore2_key returns an |EVP_PKEY| whose public part is taken from
+ * |public_key| and whose private operations are forwarded to the key
+ * |descriptor| of |i_keystore_security_level|. EVP_PKEY_from_keystore2 uses
+ * it after looking the key up; tests use it with a fake security level. */
+bssl::UniquePtr<EVP_PKEY> wrap_keystore2_key(
+    const ::aidl::android::system::keystore2::KeyDescriptor& descriptor,
+    std::shared_ptr<::aidl::android::system::keystore2::IKeystoreSecurityLevel>
+        i_keystore_security_level,
+    const EVP_PKEY* public_key);
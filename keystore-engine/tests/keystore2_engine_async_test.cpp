@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "keystore2_engine.h"
+#include "keystore2_engine_internal.h"
+
+#include <aidl/android/system/keystore2/IKeystoreOperation.h>
+#include <aidl/android/system/keystore2/IKeystoreSecurityLevel.h>
+#include <gtest/gtest.h>
+
+#include <openssl/bio.h>
+#include <openssl/bn.h>
+#include <openssl/ec_key.h>
+#include <openssl/ecdsa.h>
+#include <openssl/nid.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+namespace ks2 = ::aidl::android::system::keystore2;
+namespace KMV1 = ::aidl::android::hardware::security::keymint;
+
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+constexpr size_t kWorkerThreads = 16;
+constexpr size_t kMaxInFlightPerKey = 8;
+
+/* Counts the signatures a fake key computes at the same time. */
+struct Concurrency {
+    std::atomic<size_t> current{0};
+    std::atomic<size_t> max{0};
+};
+
+/* FakeOperation signs like KeyMint does with PaddingMode::NONE and
+ * Digest::NONE, using a software key and a fixed latency instead of a TEE. */
+class FakeOperation : public ks2::IKeystoreOperationDefault {
+  public:
+    FakeOperation(EVP_PKEY* pkey, milliseconds latency, Concurrency* concurrency)
+        : pkey_(pkey), latency_(latency), concurrency_(concurrency) {}
+
+    ::ndk::ScopedAStatus finish(const std::optional<std::vector<uint8_t>>& input,
+                                const std::optional<std::vector<uint8_t>>& /* signature */,
+                                std::optional<std::vector<uint8_t>>* output) override {
+        size_t current = ++concurrency_->current;
+        size_t max = concurrency_->max;
+        while (current > max && !concurrency_->max.compare_exchange_weak(max, current)) {
+        }
+        std::this_thread::sleep_for(latency_);
+        --concurrency_->current;
+
+        std::vector<uint8_t> result(EVP_PKEY_size(pkey_));
+        size_t len = result.size();
+        if (EVP_PKEY_id(pkey_) == EVP_PKEY_RSA) {
+            if (!RSA_sign_raw(EVP_PKEY_get0_RSA(pkey_), &len, result.data(), result.size(),
+                              input->data(), input->size(), RSA_NO_PADDING)) {
+                return ::ndk::ScopedAStatus::fromServiceSpecificError(1);
+            }
+        } else {
+            unsigned int sig_len;
+            if (!ECDSA_sign(0, input->data(), input->size(), result.data(), &sig_len,
+                            EVP_PKEY_get0_EC_KEY(pkey_))) {
+                return ::ndk::ScopedAStatus::fromServiceSpecificError(1);
+            }
+            len = sig_len;
+        }
+        result.resize(len);
+        *output = std::move(result);
+        return ::ndk::ScopedAStatus::ok();
+    }
+
+  private:
+    EVP_PKEY* pkey_;
+    milliseconds latency_;
+    Concurrency* concurrency_;
+};
+
+class FakeSecurityLevel : public ks2::IKeystoreSecurityLevelDefault {
+  public:
+    FakeSecurityLevel(EVP_PKEY* pkey, milliseconds latency) : pkey_(pkey), latency_(latency) {}
+
+    ::ndk::ScopedAStatus createOperation(const ks2::KeyDescriptor& /* key */,
+                                         const std::vector<KMV1::KeyParameter>& /* params */,
+                                         bool /* forced */,
+                                         ks2::CreateOperationResponse* response) override {
+        response->iOperation =
+            ::ndk::SharedRefBase::make<FakeOperation>(pkey_, latency_, &concurrency_);
+        return ::ndk::ScopedAStatus::ok();
+    }
+
+    size_t max_concurrency() const { return concurrency_.max; }
+
+  private:
+    EVP_PKEY* pkey_;
+    milliseconds latency_;
+    Concurrency concurrency_;
+};
+
+bssl::UniquePtr<EVP_PKEY> generate_software_key(int type) {
+    bssl::UniquePtr<EVP_PKEY> pkey(EVP_PKEY_new());
+    if (type == EVP_PKEY_RSA) {
+        bssl::UniquePtr<RSA> rsa(RSA_new());
+        bssl::UniquePtr<BIGNUM> e(BN_new());
+        if (!BN_set_word(e.get(), RSA_F4) ||
+            !RSA_generate_key_ex(rsa.get(), 2048, e.get(), nullptr) ||
+            !EVP_PKEY_assign_RSA(pkey.get(), rsa.release())) {
+            return nullptr;
+        }
+    } else {
+        bssl::UniquePtr<EC_KEY> ec(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+        if (!EC_KEY_generate_key(ec.get()) || !EVP_PKEY_assign_EC_KEY(pkey.get(), ec.release())) {
+            return nullptr;
+        }
+    }
+    return pkey;
+}
+
+bssl::UniquePtr<X509> self_signed_certificate(EVP_PKEY* pkey) {
+    bssl::UniquePtr<X509> cert(X509_new());
+    if (!X509_set_version(cert.get(), X509_VERSION_3) ||
+        !ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1) ||
+        !X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0) ||
+        !X509_gmtime_adj(X509_getm_notAfter(cert.get()), 3600) ||
+        !X509_set_pubkey(cert.get(), pkey) || !X509_sign(cert.get(), pkey, EVP_sha256())) {
+        return nullptr;
+    }
+    return cert;
+}
+
+/* KeystoreServer is a TLS server whose private key lives in a fake Keystore. */
+struct KeystoreServer {
+    explicit KeystoreServer(int type, milliseconds latency)
+        : software_key(generate_software_key(type)),
+          security_level(
+              ::ndk::SharedRefBase::make<FakeSecurityLevel>(software_key.get(), latency)),
+          keystore_key(
+              wrap_keystore2_key(ks2::KeyDescriptor{}, security_level, software_key.get())),
+          ctx(SSL_CTX_new(TLS_method())) {
+        auto cert = self_signed_certificate(software_key.get());
+        EXPECT_TRUE(cert && SSL_CTX_use_certificate(ctx.get(), cert.get()));
+    }
+
+    bssl::UniquePtr<EVP_PKEY> software_key;
+    std::shared_ptr<FakeSecurityLevel> security_level;
+    bssl::UniquePtr<EVP_PKEY> keystore_key;
+    bssl::UniquePtr<SSL_CTX> ctx;
+};
+
+/* Wakes up the event loop when an asynchronous signature is ready. */
+struct EventLoop {
+    std::mutex lock;
+    std::condition_variable cv;
+    size_t ready = 0;
+};
+
+struct Connection {
+    bssl::UniquePtr<SSL> client;
+    bssl::UniquePtr<SSL> server;
+    bool client_done = false;
+    bool server_done = false;
+    bool waiting = false;
+    std::atomic<bool> signature_ready{false};
+    EventLoop* loop;
+};
+
+void on_signature_ready(SSL* /* ssl */, void* arg) {
+    auto connection = reinterpret_cast<Connection*>(arg);
+    connection->signature_ready = true;
+    std::lock_guard<std::mutex> lock(connection->loop->lock);
+    ++connection->loop->ready;
+    connection->loop->cv.notify_one();
+}
+
+bool start_connection(KeystoreServer& server, SSL_CTX* client_ctx, bool async, uint16_t version,
+                      Connection* connection) {
+    connection->client.reset(SSL_new(client_ctx));
+    connection->server.reset(SSL_new(server.ctx.get()));
+    connection->client_done = connection->server_done = connection->waiting = false;
+    connection->signature_ready = false;
+    BIO* client_bio;
+    BIO* server_bio;
+    if (!connection->client || !connection->server ||
+        !BIO_new_bio_pair(&client_bio, 0, &server_bio, 0)) {
+        return false;
+    }
+    SSL_set_bio(connection->client.get(), client_bio, client_bio);
+    SSL_set_bio(connection->server.get(), server_bio, server_bio);
+    SSL_set_connect_state(connection->client.get());
+    SSL_set_accept_state(connection->server.get());
+    if (!SSL_set_min_proto_version(connection->server.get(), version) ||
+        !SSL_set_max_proto_version(connection->server.get(), version)) {
+        return false;
+    }
+    if (async) {
+        return SSL_use_keystore2_private_key_async(
+            connection->server.get(), server.keystore_key.get(), on_signature_ready, connection);
+    }
+    return SSL_use_PrivateKey(connection->server.get(), server.keystore_key.get());
+}
+
+/* Advances the handshake of |connection| without blocking, except on Keystore
+ * in the synchronous case. Returns false if the handshake failed. */
+bool step(Connection* connection) {
+    if (!connection->client_done) {
+        int ret = SSL_do_handshake(connection->client.get());
+        if (ret == 1) {
+            connection->client_done = true;
+        } else if (SSL_get_error(connection->client.get(), ret) != SSL_ERROR_WANT_READ) {
+            return false;
+        }
+    }
+    if (!connection->server_done) {
+        if (connection->waiting && !connection->signature_ready.exchange(false)) {
+            return true;
+        }
+        connection->waiting = false;
+        int ret = SSL_do_handshake(connection->server.get());
+        if (ret == 1) {
+            connection->server_done = true;
+        } else {
+            switch (SSL_get_error(connection->server.get(), ret)) {
+            case SSL_ERROR_WANT_READ:
+                break;
+            case SSL_ERROR_WANT_PRIVATE_KEY_OPERATION:
+                connection->waiting = true;
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Runs |handshakes| handshakes on one thread, |concurrency| at a time, and
+ * returns the number of handshakes per second, or zero on failure. */
+double run_handshakes(KeystoreServer& server, bool async, uint16_t version, size_t concurrency,
+                      size_t handshakes) {
+    bssl::UniquePtr<SSL_CTX> client_ctx(SSL_CTX_new(TLS_method()));
+    EventLoop loop;
+    std::vector<Connection> connections(concurrency);
+    size_t started = 0;
+    size_t finished = 0;
+    auto start = steady_clock::now();
+    for (auto& connection : connections) {
+        connection.loop = &loop;
+        if (started < handshakes) {
+            if (!start_connection(server, client_ctx.get(), async, version, &connection)) {
+                return 0;
+            }
+            ++started;
+        }
+    }
+
+    while (finished < handshakes) {
+        bool progress = false;
+        for (auto& connection : connections) {
+            if (!connection.client) {
+                continue;
+            }
+            bool was_waiting = connection.waiting;
+            if (!step(&connection)) {
+                ADD_FAILURE() << "Handshake failed.";
+                return 0;
+            }
+            progress |= !connection.waiting || !was_waiting;
+            if (connection.client_done && connection.server_done) {
+                ++finished;
+                connection.client.reset();
+                connection.server.reset();
+                if (started < handshakes) {
+                    if (!start_connection(server, client_ctx.get(), async, version,
+                                          &connection)) {
+                        return 0;
+                    }
+                    ++started;
+                }
+            }
+        }
+        if (!progress) {
+            // Every live connection waits for a signature.
+            std::unique_lock<std::mutex> lock(loop.lock);
+            loop.cv.wait(lock, [&] { return loop.ready > 0; });
+            loop.ready = 0;
+        }
+    }
+    std::chrono::duration<double> elapsed = steady_clock::now() - start;
+    return handshakes / elapsed.count();
+}
+
+class Keystore2EngineAsyncTest : public ::testing::Test {
+  protected:
+    static void SetUpTestSuite() {
+        ASSERT_TRUE(keystore2_configure_async_signing(kWorkerThreads, kMaxInFlightPerKey));
+    }
+};
+
+TEST_F(Keystore2EngineAsyncTest, HandshakeWithRsaKey) {
+    KeystoreServer server(EVP_PKEY_RSA, milliseconds(1));
+    // TLS 1.2 negotiates RSA-PKCS1 and TLS 1.3 RSA-PSS.
+    EXPECT_GT(run_handshakes(server, true /* async */, TLS1_2_VERSION, 4, 8), 0);
+    EXPECT_GT(run_handshakes(server, true /* async */, TLS1_3_VERSION, 4, 8), 0);
+}
+
+TEST_F(Keystore2EngineAsyncTest, HandshakeWithEcKey) {
+    KeystoreServer server(EVP_PKEY_EC, milliseconds(1));
+    EXPECT_GT(run_handshakes(server, true /* async */, TLS1_2_VERSION, 4, 8), 0);
+    EXPECT_GT(run_handshakes(server, true /* async */, TLS1_3_VERSION, 4, 8), 0);
+}
+
+TEST_F(Keystore2EngineAsyncTest, ConcurrencyIsBoundedPerKey) {
+    KeystoreServer server(EVP_PKEY_EC, milliseconds(5));
+    EXPECT_GT(run_handshakes(server, true /* async */, TLS1_3_VERSION, 64, 256), 0);
+    EXPECT_LE(server.security_level->max_concurrency(), kMaxInFlightPerKey);
+    EXPECT_GT(server.security_level->max_concurrency(), 1u);
+}
+
+/* Compares handshakes per second of one event loop thread with many
+ * connections, signing synchronously through the engine and asynchronously,
+ * against a fake Keystore that takes 5ms per signature. */
+TEST_F(Keystore2EngineAsyncTest, HandshakeThroughput) {
+    constexpr size_t kConcurrentConnections = 64;
+    constexpr size_t kHandshakes = 512;
+
+    for (int type : {EVP_PKEY_EC, EVP_PKEY_RSA}) {
+        KeystoreServer server(type, milliseconds(5));
+        double sync = run_handshakes(server, false /* async */, TLS1_3_VERSION,
+                                     kConcurrentConnections, kHandshakes);
+        double async = run_handshakes(server, true /* async */, TLS1_3_VERSION,
+                                      kConcurrentConnections, kHandshakes);
+        std::cout << (type == EVP_PKEY_EC ? "EC" : "RSA") << ": " << kConcurrentConnections
+                  << " connections, synchronous " << sync << " handshakes/s, asynchronous "
+                  << async << " handshakes/s" << std::endl;
+        EXPECT_GT(sync, 0);
+        EXPECT_GT(async, sync);
+    }
+}
+
+}  // namespace
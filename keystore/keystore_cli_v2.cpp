@@ -12,17 +12,25 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <thread>
 #include <variant>
 #include <vector>
 
 #include <base/command_line.h>
+#include <base/files/file.h>
 #include <base/files/file_util.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
@@ -103,6 +111,9 @@ void PrintUsageAndExit() {
            "          sign-verify --name=<key_name>\n"
            "          [en|de]crypt --name=<key_name> --in=<file> --out=<file>\n"
            "                       [--seclevel=software|strongbox|tee(default)]\n"
+           "          benchmark [--workload=<subset of generate,sign,encrypt,delete>]\n"
+           "                    [--threads=<count>] [--iterations=<count>]\n"
+           "                    [--data_size=<bytes>] [--seclevel=strongbox|tee(default)]\n"
            "          confirmation --prompt_text=<PromptText> --extra_data=<hex>\n"
            "                       --locale=<locale> [--ui_options=<list_of_ints>]\n"
            "                       --cancel_after=<seconds>\n");
@@ -152,6 +163,14 @@ const char kAuthenticateSuffix[] = "_AUTH";
 constexpr uint32_t kAESKeySize = 256;      // bits
 constexpr uint32_t kHMACKeySize = 256;     // bits
 constexpr uint32_t kHMACOutputSize = 256;  // bits
+constexpr size_t kAESBlockSize = 16;       // bytes
+
+// Files written by `encrypt` start with this magic. A serialized EncryptedData, which is what
+// `encrypt` used to write, cannot start with a zero byte, so `decrypt` tells the two apart by it.
+constexpr uint8_t kStreamMagic[] = {0x00, 'K', 'S', 'E', 'N', 'C', 0x00, 0x01};
+// Input is passed to Keystore in chunks of this size. It leaves room for the padding block an
+// encryption may add and still stays below the most Keystore accepts per call.
+constexpr size_t kStreamChunkSize = 16 * 1024;
 
 bool verifyEncryptionKeyAttributes(const std::vector<ks2::Authorization> authorizations) {
     bool verified = true;
@@ -340,9 +359,84 @@ loadOrCreateAndVerifyAuthenticationKey(const std::string& name,
     return keyEntryResponse;
 }
 
-std::variant<int, std::vector<uint8_t>>
-encryptWithAuthentication(const std::string& name, const std::vector<uint8_t>& data,
-                          keymint::SecurityLevel securityLevel) {
+// Reads up to |size| bytes from the current position of |file| into |data|, which ends up
+// shorter than |size| only at the end of the file.
+int readInput(base::File* file, size_t size, std::vector<uint8_t>* data) {
+    data->resize(size);
+    size_t done = 0;
+    while (done < size) {
+        int n = file->ReadAtCurrentPos(reinterpret_cast<char*>(data->data() + done),
+                                       static_cast<int>(size - done));
+        if (n < 0) {
+            std::cerr << "Failed to read input." << std::endl;
+            return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    data->resize(done);
+    return 0;
+}
+
+int writeOutput(base::File* file, const std::vector<uint8_t>& data) {
+    if (data.empty()) return 0;
+    int size = data.size();
+    if (file->WriteAtCurrentPos(reinterpret_cast<const char*>(data.data()), size) != size) {
+        std::cerr << "Failed to write output." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+    return 0;
+}
+
+// Passes |input| to |operation| and appends whatever it returns to |output|, if given.
+int updateOperation(const std::shared_ptr<ks2::IKeystoreOperation>& operation,
+                    const std::vector<uint8_t>& input, std::vector<uint8_t>* output) {
+    std::optional<std::vector<uint8_t>> optOutput;
+    auto rc = operation->update(input, &optOutput);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to update operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+    if (optOutput && output) {
+        output->insert(output->end(), optOutput->begin(), optOutput->end());
+    }
+    return 0;
+}
+
+// Reads exactly |size| bytes at |offset| of |file| into |data|.
+int readInputAt(base::File* file, int64_t offset, size_t size, std::vector<uint8_t>* data) {
+    if (file->Seek(base::File::FROM_BEGIN, offset) != offset) {
+        std::cerr << "Failed to seek in input." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+    if (int error = readInput(file, size, data)) return error;
+    if (data->size() != size) {
+        std::cerr << "Input is truncated." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+    return 0;
+}
+
+// Calls |consume| with consecutive chunks of at most kStreamChunkSize bytes covering
+// [offset, offset + size) of |file|.
+int forEachChunk(base::File* file, int64_t offset, int64_t size,
+                 const std::function<int(const std::vector<uint8_t>&)>& consume) {
+    std::vector<uint8_t> chunk;
+    while (size > 0) {
+        size_t chunkSize = std::min<int64_t>(size, kStreamChunkSize);
+        if (int error = readInputAt(file, offset, chunkSize, &chunk)) return error;
+        if (int error = consume(chunk)) return error;
+        offset += chunkSize;
+        size -= chunkSize;
+    }
+    return 0;
+}
+
+// Encrypts and authenticates |in| into |out| like the protobuf format that came before, but in
+// chunks of kStreamChunkSize, so that memory use does not depend on the size of the input. The
+// output is kStreamMagic, the IV, the cipher-text and the HMAC of all of the preceding bytes.
+int encryptStreamWithAuthentication(const std::string& name, base::File* in, base::File* out,
+                                    keymint::SecurityLevel securityLevel) {
     // The encryption algorithm is AES-256-CBC with PKCS #7 padding and a random
     // IV. The authentication algorithm is HMAC-SHA256 and is computed over the
     // cipher-text (i.e. Encrypt-then-MAC approach). This was chosen over AES-GCM
@@ -377,14 +471,6 @@ encryptWithAuthentication(const std::string& name, const std::vector<uint8_t>& d
         return unwrapError(rc);
     }
 
-    std::optional<std::vector<uint8_t>> optCiphertext;
-
-    rc = encOperationResponse.iOperation->finish(data, {}, &optCiphertext);
-    if (!rc.isOk()) {
-        std::cerr << "Failed to finish encryption operation: " << rc.getDescription() << std::endl;
-        return unwrapError(rc);
-    }
-
     std::vector<uint8_t> initVector;
     if (auto params = encOperationResponse.parameters) {
         for (auto& p : params->keyParameter) {
@@ -393,21 +479,12 @@ encryptWithAuthentication(const std::string& name, const std::vector<uint8_t>& d
                 break;
             }
         }
-        if (initVector.empty()) {
-            std::cerr << "Encryption operation did not return an IV." << std::endl;
-            return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
-        }
     }
-
-    if (!optCiphertext) {
-        std::cerr << "Encryption succeeded but no ciphertext returned." << std::endl;
+    if (initVector.size() != kAESBlockSize) {
+        std::cerr << "Encryption operation did not return an IV." << std::endl;
         return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
     }
 
-    auto ciphertext = std::move(*optCiphertext);
-    auto toBeSigned = initVector;
-    toBeSigned.insert(toBeSigned.end(), ciphertext.begin(), ciphertext.end());
-
     ks2::CreateOperationResponse signOperationResponse;
     auto sign_params = keymint::AuthorizationSetBuilder()
                            .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::SIGN)
@@ -422,35 +499,50 @@ encryptWithAuthentication(const std::string& name, const std::vector<uint8_t>& d
         return unwrapError(rc);
     }
 
-    std::optional<std::vector<uint8_t>> optMac;
+    std::vector<uint8_t> header(std::begin(kStreamMagic), std::end(kStreamMagic));
+    header.insert(header.end(), initVector.begin(), initVector.end());
+    if (int error = writeOutput(out, header)) return error;
+    if (int error = updateOperation(signOperationResponse.iOperation, header, nullptr)) {
+        return error;
+    }
 
-    rc = signOperationResponse.iOperation->finish(toBeSigned, {}, &optMac);
+    std::vector<uint8_t> plaintext;
+    std::vector<uint8_t> ciphertext;
+    while (true) {
+        if (int error = readInput(in, kStreamChunkSize, &plaintext)) return error;
+        if (plaintext.empty()) break;
+        ciphertext.clear();
+        if (int error = updateOperation(encOperationResponse.iOperation, plaintext, &ciphertext)) {
+            return error;
+        }
+        if (int error = writeOutput(out, ciphertext)) return error;
+        if (int error = updateOperation(signOperationResponse.iOperation, ciphertext, nullptr)) {
+            return error;
+        }
+    }
+
+    std::optional<std::vector<uint8_t>> optCiphertext;
+    rc = encOperationResponse.iOperation->finish(std::nullopt, {}, &optCiphertext);
     if (!rc.isOk()) {
         std::cerr << "Failed to finish encryption operation: " << rc.getDescription() << std::endl;
         return unwrapError(rc);
     }
+    ciphertext = optCiphertext.value_or(std::vector<uint8_t>());
+    if (int error = writeOutput(out, ciphertext)) return error;
 
-    if (!optMac) {
-        std::cerr << "Signing succeeded but no MAC returned." << std::endl;
-        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    std::optional<std::vector<uint8_t>> optMac;
+    rc = signOperationResponse.iOperation->finish(ciphertext, {}, &optMac);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to finish signing operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
     }
 
-    auto mac = std::move(*optMac);
-
-    EncryptedData protobuf;
-    protobuf.set_init_vector(initVector.data(), initVector.size());
-    protobuf.set_authentication_data(mac.data(), mac.size());
-    protobuf.set_encrypted_data(ciphertext.data(), ciphertext.size());
-    std::string resultString;
-    if (!protobuf.SerializeToString(&resultString)) {
-        std::cerr << "Encrypt: Failed to serialize EncryptedData protobuf.";
+    if (!optMac) {
+        std::cerr << "Signing succeeded but no MAC returned." << std::endl;
         return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
     }
 
-    std::vector<uint8_t> result(reinterpret_cast<const uint8_t*>(resultString.data()),
-                                reinterpret_cast<const uint8_t*>(resultString.data()) +
-                                    resultString.size());
-    return result;
+    return writeOutput(out, *optMac);
 }
 
 std::variant<int, std::vector<uint8_t>>
@@ -548,6 +640,108 @@ decryptWithAuthentication(const std::string& name, const std::vector<uint8_t>& d
     return *optPlaintext;
 }
 
+// Decrypts the output of encryptStreamWithAuthentication from |in| into |out|. The input is
+// authenticated and decrypted in a single pass, so |in| changing between passes cannot
+// smuggle unauthenticated cipher-text past the MAC. |out| therefore receives plaintext before
+// the MAC is checked, and must be discarded by the caller unless this returns 0.
+int decryptStreamWithAuthentication(const std::string& name, base::File* in, base::File* out) {
+    constexpr int64_t kHeaderSize = sizeof(kStreamMagic) + kAESBlockSize;
+    constexpr int64_t kMacSize = kHMACOutputSize / 8;
+    int64_t length = in->GetLength();
+    int64_t ciphertextSize = length - kHeaderSize - kMacSize;
+    if (ciphertextSize < static_cast<int64_t>(kAESBlockSize) || ciphertextSize % kAESBlockSize) {
+        std::cerr << "Decrypt: Input is not a stream of whole cipher blocks." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::SYSTEM_ERROR);
+    }
+
+    std::vector<uint8_t> header;
+    if (int error = readInputAt(in, 0, kHeaderSize, &header)) return error;
+    std::vector<uint8_t> initVector(header.begin() + sizeof(kStreamMagic), header.end());
+
+    std::vector<uint8_t> signature;
+    if (int error = readInputAt(in, length - kMacSize, kMacSize, &signature)) return error;
+
+    // Load encryption and authentication keys.
+    std::string encryption_key_name = name + kEncryptSuffix;
+    auto encryption_key_result = loadOrCreateAndVerifyEncryptionKey(
+        encryption_key_name, keymint::SecurityLevel::KEYSTORE /* ignored */, false /* create */);
+    if (auto error = std::get_if<int>(&encryption_key_result)) {
+        return *error;
+    }
+    auto encryption_key = std::get<ks2::KeyEntryResponse>(encryption_key_result);
+
+    std::string authentication_key_name = name + kAuthenticateSuffix;
+    auto authentication_key_result = loadOrCreateAndVerifyAuthenticationKey(
+        authentication_key_name, keymint::SecurityLevel::KEYSTORE /* ignored */,
+        false /* create */);
+    if (auto error = std::get_if<int>(&authentication_key_result)) {
+        return *error;
+    }
+    auto authentication_key = std::get<ks2::KeyEntryResponse>(authentication_key_result);
+
+    // Authenticate header and cipher-text.
+    ks2::CreateOperationResponse signOperationResponse;
+    auto sign_params = keymint::AuthorizationSetBuilder()
+                           .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::VERIFY)
+                           .Digest(keymint::Digest::SHA_2_256)
+                           .Authorization(keymint::TAG_MAC_LENGTH, kHMACOutputSize);
+
+    auto rc = authentication_key.iSecurityLevel->createOperation(
+        authentication_key.metadata.key, sign_params.vector_data(), false /* forced */,
+        &signOperationResponse);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to begin verify operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+
+    // Begin decryption operation
+    ks2::CreateOperationResponse encOperationResponse;
+    auto decrypt_params = keymint::AuthorizationSetBuilder()
+                              .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::DECRYPT)
+                              .Authorization(keymint::TAG_NONCE, initVector.data(),
+                                             initVector.size())
+                              .Padding(keymint::PaddingMode::PKCS7)
+                              .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::CBC);
+
+    rc = encryption_key.iSecurityLevel->createOperation(encryption_key.metadata.key,
+                                                        decrypt_params.vector_data(),
+                                                        false /* forced */, &encOperationResponse);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to begin decryption operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+
+    auto& verifyOperation = signOperationResponse.iOperation;
+    auto& decryptOperation = encOperationResponse.iOperation;
+    if (int error = updateOperation(verifyOperation, header, nullptr)) return error;
+    std::vector<uint8_t> plaintext;
+    auto verifyAndDecryptChunk = [&](const std::vector<uint8_t>& chunk) {
+        if (int error = updateOperation(verifyOperation, chunk, nullptr)) return error;
+        plaintext.clear();
+        if (int error = updateOperation(decryptOperation, chunk, &plaintext)) return error;
+        return writeOutput(out, plaintext);
+    };
+    if (int error = forEachChunk(in, kHeaderSize, ciphertextSize, verifyAndDecryptChunk)) {
+        return error;
+    }
+
+    std::optional<std::vector<uint8_t>> optOut;
+    rc = verifyOperation->finish(std::nullopt, signature, &optOut);
+    if (!rc.isOk()) {
+        std::cerr << "Decrypt: HMAC verification failed: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+
+    std::optional<std::vector<uint8_t>> optPlaintext;
+    rc = decryptOperation->finish(std::nullopt, {}, &optPlaintext);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to finish decryption operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+
+    return writeOutput(out, optPlaintext.value_or(std::vector<uint8_t>()));
+}
+
 bool TestKey(const std::string& name, bool required,
              const std::vector<keymint::KeyParameter>& parameters) {
     auto keystore = CreateKeystoreInstance();
@@ -945,25 +1139,290 @@ int SignAndVerify(const std::string& name) {
 
 int Encrypt(const std::string& key_name, const std::string& input_filename,
             const std::string& output_filename, keymint::SecurityLevel securityLevel) {
-    auto input = ReadFile(input_filename);
-    auto result = encryptWithAuthentication(key_name, input, securityLevel);
-    if (auto error = std::get_if<int>(&result)) {
+    base::File input(base::FilePath(input_filename), base::File::FLAG_OPEN | base::File::FLAG_READ);
+    if (!input.IsValid()) {
+        printf("Failed to read file: %s\n", input_filename.c_str());
+        exit(1);
+    }
+    base::File output(base::FilePath(output_filename),
+                      base::File::FLAG_CREATE_ALWAYS | base::File::FLAG_WRITE);
+    if (!output.IsValid()) {
+        printf("Failed to write file: %s\n", output_filename.c_str());
+        exit(1);
+    }
+    if (int error = encryptStreamWithAuthentication(key_name, &input, &output, securityLevel)) {
         std::cerr << "EncryptWithAuthentication failed." << std::endl;
-        return *error;
+        output.Close();
+        unlink(output_filename.c_str());
+        return error;
     }
-    WriteFile(output_filename, std::get<std::vector<uint8_t>>(result));
     return 0;
 }
 
 int Decrypt(const std::string& key_name, const std::string& input_filename,
             const std::string& output_filename) {
-    auto input = ReadFile(input_filename);
-    auto result = decryptWithAuthentication(key_name, input);
-    if (auto error = std::get_if<int>(&result)) {
+    base::File input(base::FilePath(input_filename), base::File::FLAG_OPEN | base::File::FLAG_READ);
+    std::vector<uint8_t> magic;
+    if (!input.IsValid() || readInput(&input, sizeof(kStreamMagic), &magic)) {
+        printf("Failed to read file: %s\n", input_filename.c_str());
+        exit(1);
+    }
+
+    // Files written before encryption was streamed hold a serialized EncryptedData.
+    if (!std::equal(magic.begin(), magic.end(), std::begin(kStreamMagic), std::end(kStreamMagic))) {
+        input.Close();
+        auto data = ReadFile(input_filename);
+        auto result = decryptWithAuthentication(key_name, data);
+        if (auto error = std::get_if<int>(&result)) {
+            std::cerr << "DecryptWithAuthentication failed." << std::endl;
+            return *error;
+        }
+        WriteFile(output_filename, std::get<std::vector<uint8_t>>(result));
+        return 0;
+    }
+
+    // The plaintext goes to a temporary file next to the output, which only takes the place
+    // of the output once the MAC has been verified.
+    std::string temp_filename = output_filename + ".XXXXXX";
+    base::File output(mkstemp(temp_filename.data()));
+    if (!output.IsValid()) {
+        printf("Failed to write file: %s\n", output_filename.c_str());
+        exit(1);
+    }
+    if (int error = decryptStreamWithAuthentication(key_name, &input, &output)) {
         std::cerr << "DecryptWithAuthentication failed." << std::endl;
-        return *error;
+        output.Close();
+        unlink(temp_filename.c_str());
+        return error;
+    }
+    output.Close();
+    if (rename(temp_filename.c_str(), output_filename.c_str())) {
+        printf("Failed to write file: %s\n", output_filename.c_str());
+        unlink(temp_filename.c_str());
+        exit(1);
+    }
+    return 0;
+}
+
+// Latencies of one benchmark step and the number of bytes it processed.
+struct BenchmarkSamples {
+    std::vector<std::chrono::microseconds> latencies;
+    uint64_t bytes = 0;
+};
+
+using BenchmarkResults = std::map<std::string, BenchmarkSamples>;
+
+const char* const kBenchmarkSteps[] = {"generate", "sign", "encrypt", "delete"};
+
+struct BenchmarkKey {
+    std::string type;
+    keymint::AuthorizationSet keyParams;
+    keymint::AuthorizationSet operationParams;
+    ks2::KeyDescriptor key;
+};
+
+// Runs |step| and, if |samples| is given, records how long it took.
+int timeBenchmarkStep(BenchmarkSamples* samples, const std::function<int()>& step) {
+    auto start = std::chrono::steady_clock::now();
+    int error = step();
+    if (!error && samples) {
+        samples->latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start));
+    }
+    return error;
+}
+
+// Passes |data| through a new operation on |key|, in chunks like Encrypt does.
+int runBenchmarkOperation(const std::shared_ptr<ks2::IKeystoreSecurityLevel>& sec_level,
+                          const BenchmarkKey& key, const std::vector<uint8_t>& data) {
+    ks2::CreateOperationResponse operationResponse;
+    auto rc = sec_level->createOperation(key.key, key.operationParams.vector_data(),
+                                         false /* forced */, &operationResponse);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to create operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+    for (size_t offset = 0; offset < data.size(); offset += kStreamChunkSize) {
+        std::vector<uint8_t> chunk(data.begin() + offset,
+                                   data.begin() + std::min(data.size(), offset + kStreamChunkSize));
+        if (int error = updateOperation(operationResponse.iOperation, chunk, nullptr)) {
+            return error;
+        }
+    }
+    std::optional<std::vector<uint8_t>> output;
+    rc = operationResponse.iOperation->finish(std::nullopt, {}, &output);
+    if (!rc.isOk()) {
+        std::cerr << "Failed to finish operation: " << rc.getDescription() << std::endl;
+        return unwrapError(rc);
+    }
+    return 0;
+}
+
+// One benchmark thread. With "generate" in |steps| every iteration works on fresh keys which
+// are deleted again at its end, otherwise the keys are created once up front.
+int runBenchmarkThread(int thread, const std::set<std::string>& steps, int iterations,
+                       const std::vector<uint8_t>& data, keymint::SecurityLevel securityLevel,
+                       BenchmarkResults* results) {
+    auto keystore = CreateKeystoreInstance();
+    auto sec_level = GetSecurityLevelInterface(keystore, securityLevel);
+
+    std::vector<BenchmarkKey> keys;
+    if (steps.count("sign") || !steps.count("encrypt")) {
+        keys.push_back({
+            .type = "ec",
+            .keyParams = keymint::AuthorizationSetBuilder()
+                             .EcdsaSigningKey(keymint::EcCurve::P_256)
+                             .Digest(keymint::Digest::SHA_2_256)
+                             .Authorization(keymint::TAG_NO_AUTH_REQUIRED),
+            .operationParams =
+                keymint::AuthorizationSetBuilder()
+                    .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::SIGN)
+                    .Digest(keymint::Digest::SHA_2_256),
+        });
+    }
+    if (steps.count("encrypt")) {
+        keys.push_back({
+            .type = "aes",
+            .keyParams = keymint::AuthorizationSetBuilder()
+                             .AesEncryptionKey(kAESKeySize)
+                             .Padding(keymint::PaddingMode::PKCS7)
+                             .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::CBC)
+                             .Authorization(keymint::TAG_NO_AUTH_REQUIRED),
+            .operationParams =
+                keymint::AuthorizationSetBuilder()
+                    .Authorization(keymint::TAG_PURPOSE, keymint::KeyPurpose::ENCRYPT)
+                    .Padding(keymint::PaddingMode::PKCS7)
+                    .Authorization(keymint::TAG_BLOCK_MODE, keymint::BlockMode::CBC),
+        });
+    }
+
+    bool perIteration = steps.count("generate");
+    auto samplesFor = [&](const char* step) -> BenchmarkSamples* {
+        return steps.count(step) ? &(*results)[step] : nullptr;
+    };
+    auto alias = [&](const BenchmarkKey& key, int iteration) {
+        std::string alias = "benchmark_" + std::to_string(thread) + "_" + key.type;
+        return perIteration ? alias + "_" + std::to_string(iteration) : alias;
+    };
+
+    for (int i = 0; i < iterations; i++) {
+        if (perIteration || i == 0) {
+            for (auto& key : keys) {
+                int error = timeBenchmarkStep(samplesFor("generate"), [&] {
+                    ks2::KeyMetadata keyMetadata;
+                    auto rc = sec_level->generateKey(
+                        keyDescriptor(alias(key, i)), {} /* attestationKey */,
+                        key.keyParams.vector_data(), 0 /* flags */, {} /* entropy */,
+                        &keyMetadata);
+                    if (!rc.isOk()) {
+                        std::cerr << "GenerateKey failed: " << rc.getDescription() << std::endl;
+                        return unwrapError(rc);
+                    }
+                    key.key = keyMetadata.key;
+                    return 0;
+                });
+                if (error) return error;
+            }
+        }
+
+        for (const auto& key : keys) {
+            const char* step = key.type == "ec" ? "sign" : "encrypt";
+            if (!steps.count(step)) continue;
+            int error = timeBenchmarkStep(samplesFor(step), [&] {
+                return runBenchmarkOperation(sec_level, key, data);
+            });
+            if (error) return error;
+            (*results)[step].bytes += data.size();
+        }
+
+        if (perIteration || i == iterations - 1) {
+            for (const auto& key : keys) {
+                int error = timeBenchmarkStep(samplesFor("delete"), [&] {
+                    auto rc = keystore->deleteKey(keyDescriptor(alias(key, i)));
+                    if (!rc.isOk()) {
+                        std::cerr << "Failed to delete key: " << rc.getDescription() << std::endl;
+                        return unwrapError(rc);
+                    }
+                    return 0;
+                });
+                if (error) return error;
+            }
+        }
+    }
+    return 0;
+}
+
+std::chrono::microseconds percentile(const std::vector<std::chrono::microseconds>& sorted,
+                                     int p) {
+    size_t rank = (sorted.size() * p + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+int Benchmark(const std::string& workload, int threads, int iterations, int dataSize,
+              keymint::SecurityLevel securityLevel) {
+    std::set<std::string> steps;
+    for (const auto& step : base::SplitString(workload, ",", base::TRIM_WHITESPACE,
+                                              base::SPLIT_WANT_NONEMPTY)) {
+        if (std::find(std::begin(kBenchmarkSteps), std::end(kBenchmarkSteps), step) ==
+            std::end(kBenchmarkSteps)) {
+            std::cerr << "Unknown benchmark step: " << step << std::endl;
+            return static_cast<int>(ks2::ResponseCode::INVALID_ARGUMENT);
+        }
+        steps.insert(step);
+    }
+    if (steps.empty() || threads < 1 || iterations < 1 || dataSize < 0) {
+        PrintUsageAndExit();
+    }
+    if (steps.count("delete") && !steps.count("generate")) {
+        std::cerr << "The delete step needs the generate step." << std::endl;
+        return static_cast<int>(ks2::ResponseCode::INVALID_ARGUMENT);
+    }
+
+    std::vector<uint8_t> data(dataSize);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i;
+
+    std::vector<BenchmarkResults> results(threads);
+    std::vector<int> errors(threads);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            errors[t] = runBenchmarkThread(t, steps, iterations, data, securityLevel, &results[t]);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    for (int t = 0; t < threads; t++) {
+        if (errors[t]) {
+            std::cerr << "Benchmark thread " << t << " failed." << std::endl;
+            return errors[t];
+        }
+    }
+
+    printf("%d threads x %d iterations, %d bytes per operation, %.2f s\n", threads, iterations,
+           dataSize, elapsed.count());
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s\n", "step", "count", "ops/s", "p50 ms",
+           "p90 ms", "p99 ms", "max ms", "MB/s");
+    for (const char* step : kBenchmarkSteps) {
+        if (!steps.count(step)) continue;
+        BenchmarkSamples merged;
+        for (const auto& result : results) {
+            auto samples = result.find(step);
+            if (samples == result.end()) continue;
+            merged.latencies.insert(merged.latencies.end(), samples->second.latencies.begin(),
+                                    samples->second.latencies.end());
+            merged.bytes += samples->second.bytes;
+        }
+        auto& latencies = merged.latencies;
+        if (latencies.empty()) continue;
+        std::sort(latencies.begin(), latencies.end());
+        auto ms = [](std::chrono::microseconds latency) { return latency.count() / 1000.0; };
+        printf("%-10s %8zu %10.1f %10.2f %10.2f %10.2f %10.2f %10.2f\n", step, latencies.size(),
+               latencies.size() / elapsed.count(), ms(percentile(latencies, 50)),
+               ms(percentile(latencies, 90)), ms(percentile(latencies, 99)),
+               ms(latencies.back()), merged.bytes / 1e6 / elapsed.count());
     }
-    WriteFile(output_filename, std::get<std::vector<uint8_t>>(result));
     return 0;
 }
 
@@ -981,6 +1440,16 @@ keymint::SecurityLevel securityLevelOption2SecurlityLevel(const CommandLine& cmd
     return keymint::SecurityLevel::TRUSTED_ENVIRONMENT;
 }
 
+int intOption(const CommandLine& cmd, const char* name, int defaultValue) {
+    if (!cmd.HasSwitch(name)) return defaultValue;
+    int value;
+    if (!base::StringToInt(cmd.GetSwitchValueASCII(name), &value)) {
+        std::cerr << "Invalid value for --" << name << std::endl;
+        PrintUsageAndExit();
+    }
+    return value;
+}
+
 class ConfirmationListener
     : public apc::BnConfirmationCallback,
       public std::promise<std::tuple<apc::ResponseCode, std::optional<std::vector<uint8_t>>>> {
@@ -1132,6 +1601,14 @@ int main(int argc, char** argv) {
         return Decrypt(command_line->GetSwitchValueASCII("name"),
                        command_line->GetSwitchValueASCII("in"),
                        command_line->GetSwitchValueASCII("out"));
+    } else if (args[0] == "benchmark") {
+        return Benchmark(command_line->HasSwitch("workload")
+                             ? command_line->GetSwitchValueASCII("workload")
+                             : "generate,sign,encrypt,delete",
+                         intOption(*command_line, "threads", 4),
+                         intOption(*command_line, "iterations", 10),
+                         intOption(*command_line, "data_size", 1024),
+                         securityLevelOption2SecurlityLevel(*command_line));
     } else if (args[0] == "confirmation") {
         return Confirmation(command_line->GetSwitchValueNative("prompt_text"),
                             command_line->GetSwitchValueASCII("extra_data"),
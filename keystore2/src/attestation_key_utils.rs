@@ -15,21 +15,23 @@
 //! Implements get_attestation_key_info which loads remote provisioned or user
 //! generated attestation keys.
 
-use crate::database::{BlobMetaData, KeyEntryLoadBits, KeyType};
+use crate::database::{BlobMetaData, BlobMetaEntry, KeyEntryLoadBits, KeyType, SubComponentType};
 use crate::database::{KeyIdGuard, KeystoreDB};
 use crate::error::{Error, ErrorCode};
 use crate::ks_err;
 use crate::permission::KeyPerm;
 use crate::remote_provisioning::RemProvState;
-use crate::utils::check_key_permission;
+use crate::utils::{check_key_permission, upgrade_keyblob_if_required_with};
 use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
-    AttestationKey::AttestationKey, Certificate::Certificate, KeyParameter::KeyParameter, Tag::Tag,
+    AttestationKey::AttestationKey, Certificate::Certificate, IKeyMintDevice::IKeyMintDevice,
+    KeyParameter::KeyParameter, Tag::Tag,
 };
 use android_system_keystore2::aidl::android::system::keystore2::{
     Domain::Domain, KeyDescriptor::KeyDescriptor, ResponseCode::ResponseCode,
 };
 use anyhow::{Context, Result};
 use keystore2_crypto::parse_subject_from_certificate;
+use std::cell::RefCell;
 
 /// KeyMint takes two different kinds of attestation keys. Remote provisioned keys
 /// and those that have been generated by the user. Unfortunately, they need to be
@@ -39,10 +41,10 @@ pub enum AttestationKeyInfo {
         attestation_key: AttestationKey,
         attestation_certs: Certificate,
     },
+    /// The key is not locked, see `use_user_generated_attestation_key`.
     UserGenerated {
-        key_id_guard: KeyIdGuard,
+        key_id: i64,
         blob: Vec<u8>,
-        blob_metadata: BlobMetaData,
         issuer_subject: Vec<u8>,
     },
 }
@@ -83,21 +85,97 @@ fn get_user_generated_attestation_key(
     caller_uid: u32,
     db: &mut KeystoreDB,
 ) -> Result<AttestationKeyInfo> {
-    let (key_id_guard, blob, cert, blob_metadata) =
-        load_attest_key_blob_and_cert(key, caller_uid, db)
-            .context(ks_err!("Failed to load blob and cert"))?;
+    let (key_id_guard, blob, cert) = load_attest_key_blob_and_cert(key, caller_uid, db)
+        .context(ks_err!("Failed to load blob and cert"))?;
 
     let issuer_subject: Vec<u8> = parse_subject_from_certificate(&cert)
         .context(ks_err!("Failed to parse subject from certificate"))?;
 
-    Ok(AttestationKeyInfo::UserGenerated { key_id_guard, blob, issuer_subject, blob_metadata })
+    Ok(AttestationKeyInfo::UserGenerated { key_id: key_id_guard.id(), blob, issuer_subject })
+}
+
+/// Calls `km_op`, typically a key generation, with the blob of a user generated attestation key
+/// loaded by `get_attest_key_info`. The attestation key is only read by `km_op`, so it is not
+/// locked, and concurrent generations with the same attestation key run in parallel. Only if
+/// KeyMint requires the blob to be upgraded is the attestation key locked. Then it is reloaded,
+/// because another caller may have upgraded it in the meantime, and `km_op` is called again with
+/// the current blob, upgrading and storing it if required.
+#[allow(clippy::too_many_arguments)]
+pub fn use_user_generated_attestation_key<T, F>(
+    km_dev: &dyn IKeyMintDevice,
+    km_dev_version: i32,
+    key_id: i64,
+    blob: &[u8],
+    upgrade_params: &[KeyParameter],
+    caller_uid: u32,
+    db: &RefCell<KeystoreDB>,
+    km_op: F,
+) -> Result<(T, Option<Vec<u8>>)>
+where
+    F: Fn(&[u8]) -> Result<T, Error>,
+{
+    match km_op(blob) {
+        Err(Error::Km(ErrorCode::KEY_REQUIRES_UPGRADE))
+        | Err(Error::Km(ErrorCode::INVALID_KEY_BLOB)) => {}
+        result => return result.map(|v| (v, None)).context(ks_err!()),
+    }
+
+    let (key_id_guard, blob, blob_metadata) =
+        lock_user_generated_attestation_key(key_id, caller_uid, &mut db.borrow_mut())
+            .context(ks_err!("Failed to lock attestation key for upgrade."))?;
+    upgrade_keyblob_if_required_with(
+        km_dev,
+        km_dev_version,
+        &blob,
+        upgrade_params,
+        km_op,
+        |upgraded_blob| {
+            let mut new_blob_metadata = BlobMetaData::new();
+            if let Some(uuid) = blob_metadata.km_uuid() {
+                new_blob_metadata.add(BlobMetaEntry::KmUuid(*uuid));
+            }
+            db.borrow_mut()
+                .set_blob(
+                    &key_id_guard,
+                    SubComponentType::KEY_BLOB,
+                    Some(upgraded_blob),
+                    Some(&new_blob_metadata),
+                )
+                .context(ks_err!("Failed to store upgraded attestation key blob."))
+        },
+    )
+    .context(ks_err!("upgrade_keyblob_if_required_with(key_id={key_id})"))
+}
+
+/// Locks the user generated attestation key with the given key id and loads its current blob.
+/// The caller's permission to use the key was checked when it was first loaded by
+/// `get_attest_key_info`, so it is not checked again.
+fn lock_user_generated_attestation_key(
+    key_id: i64,
+    caller_uid: u32,
+    db: &mut KeystoreDB,
+) -> Result<(KeyIdGuard, Vec<u8>, BlobMetaData)> {
+    let (key_id_guard, mut key_entry) = db
+        .load_key_entry(
+            &KeyDescriptor { domain: Domain::KEY_ID, nspace: key_id, ..Default::default() },
+            KeyType::Client,
+            KeyEntryLoadBits::KM,
+            caller_uid,
+            |_, _| Ok(()),
+        )
+        .context(ks_err!("Failed to load key."))?;
+    let (blob, blob_metadata) = key_entry
+        .take_key_blob_info()
+        .ok_or(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+        .context(ks_err!("Successfully loaded key entry, but KM blob was missing"))?;
+    Ok((key_id_guard, blob, blob_metadata))
 }
 
 fn load_attest_key_blob_and_cert(
     key: &KeyDescriptor,
     caller_uid: u32,
     db: &mut KeystoreDB,
-) -> Result<(KeyIdGuard, Vec<u8>, Vec<u8>, BlobMetaData)> {
+) -> Result<(KeyIdGuard, Vec<u8>, Vec<u8>)> {
     match key.domain {
         Domain::BLOB => Err(Error::Km(ErrorCode::INVALID_ARGUMENT))
             .context(ks_err!("Domain::BLOB attestation keys not supported")),
@@ -112,7 +190,7 @@ fn load_attest_key_blob_and_cert(
                 )
                 .context(ks_err!("Failed to load key."))?;
 
-            let (blob, blob_metadata) = key_entry
+            let (blob, _) = key_entry
                 .take_key_blob_info()
                 .ok_or(Error::Rc(ResponseCode::INVALID_ARGUMENT))
                 .context(ks_err!("Successfully loaded key entry, but KM blob was missing"))?;
@@ -120,7 +198,128 @@ fn load_attest_key_blob_and_cert(
                 .take_cert()
                 .ok_or(Error::Rc(ResponseCode::INVALID_ARGUMENT))
                 .context(ks_err!("Successfully loaded key entry, but cert was missing"))?;
-            Ok((key_id_guard, blob, cert, blob_metadata))
+            Ok((key_id_guard, blob, cert))
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::database::{BlobInfo, CertificateInfo, KeyMetaData, KEYSTORE_UUID};
+    use crate::error::map_km_error;
+    use crate::raw_device::KeyMintDevice;
+    use crate::test_keymint::{Rendezvous, SoftKeyMint};
+    use keystore2_test_utils::TempDir;
+    use std::sync::atomic::Ordering;
+    use std::thread;
+
+    const CALLER_UID: u32 = 10001;
+    const OLD_BLOB: &[u8] = b"attestation key blob";
+    const UPGRADED_BLOB: &[u8] = b"upgraded attestation key blob";
+
+    /// Stores an attestation key with `OLD_BLOB` and returns its key id.
+    fn store_attestation_key(db: &mut KeystoreDB) -> i64 {
+        let mut blob_metadata = BlobMetaData::new();
+        blob_metadata.add(BlobMetaEntry::KmUuid(KEYSTORE_UUID));
+        db.store_new_key(
+            &KeyDescriptor {
+                domain: Domain::APP,
+                nspace: CALLER_UID as i64,
+                alias: Some("attest_key".to_string()),
+                blob: None,
+            },
+            KeyType::Client,
+            &[],
+            &BlobInfo::new(OLD_BLOB, &blob_metadata),
+            &CertificateInfo::new(Some(b"attestation key cert".to_vec()), None),
+            &KeyMetaData::new(),
+            &KEYSTORE_UUID,
+        )
+        .unwrap()
+        .id()
+    }
+
+    /// Generates keys with the attestation key on `threads` threads at the same time, each with
+    /// its own database connection.
+    fn generate_concurrently(keymint: &SoftKeyMint, db_dir: &TempDir, threads: usize) {
+        let key_id = store_attestation_key(&mut KeystoreDB::new(db_dir.path(), None).unwrap());
+        thread::scope(|s| {
+            for _ in 0..threads {
+                s.spawn(|| {
+                    let db = RefCell::new(KeystoreDB::new(db_dir.path(), None).unwrap());
+                    use_user_generated_attestation_key(
+                        keymint,
+                        KeyMintDevice::KEY_MINT_V1,
+                        key_id,
+                        OLD_BLOB,
+                        &[],
+                        CALLER_UID,
+                        &db,
+                        |blob| {
+                            map_km_error(keymint.generateKey(
+                                &[],
+                                Some(&AttestationKey {
+                                    keyBlob: blob.to_vec(),
+                                    attestKeyParams: vec![],
+                                    issuerSubjectName: vec![],
+                                }),
+                            ))
+                        },
+                    )
+                    .unwrap();
+                });
+            }
+        });
+    }
+
+    #[test]
+    fn concurrent_generation_with_shared_attestation_key() {
+        const THREADS: usize = 8;
+
+        let db_dir = TempDir::new("attestation_key_utils_concurrent_generation").unwrap();
+        let rendezvous = Rendezvous::new(THREADS);
+        let keymint =
+            SoftKeyMint { generate_rendezvous: Some(rendezvous.clone()), ..Default::default() };
+        generate_concurrently(&keymint, &db_dir, THREADS);
+        // All generations were in flight at once, none was serialized behind another.
+        assert_eq!(rendezvous.calls(), (THREADS, THREADS));
+        assert_eq!(keymint.upgrades.load(Ordering::SeqCst), 0);
+    }
+
+    #[test]
+    fn concurrent_generation_upgrades_attestation_key_once() {
+        const THREADS: usize = 8;
+
+        let db_dir = TempDir::new("attestation_key_utils_concurrent_upgrade").unwrap();
+        // Generations that need the upgraded blob run under the key id lock, one at a time.
+        let rendezvous = Rendezvous::new(1);
+        let keymint = SoftKeyMint {
+            generate_rendezvous: Some(rendezvous.clone()),
+            key_upgrade: Some((OLD_BLOB.to_vec(), UPGRADED_BLOB.to_vec())),
+            ..Default::default()
+        };
+        generate_concurrently(&keymint, &db_dir, THREADS);
+        assert_eq!(keymint.upgrades.load(Ordering::SeqCst), 1);
+        assert_eq!(rendezvous.calls().0, THREADS);
+
+        let mut db = KeystoreDB::new(db_dir.path(), None).unwrap();
+        let (_, key_entry) = db
+            .load_key_entry(
+                &KeyDescriptor {
+                    domain: Domain::APP,
+                    nspace: CALLER_UID as i64,
+                    alias: Some("attest_key".to_string()),
+                    blob: None,
+                },
+                KeyType::Client,
+                KeyEntryLoadBits::KM,
+                CALLER_UID,
+                |_, _| Ok(()),
+            )
+            .unwrap();
+        let (blob, blob_metadata) = key_entry.key_blob_info().as_ref().unwrap();
+        assert_eq!(blob, UPGRADED_BLOB);
+        assert_eq!(blob_metadata.km_uuid(), Some(&KEYSTORE_UUID));
+    }
+}
@@ -19,6 +19,7 @@ use crate::error::Error as KeystoreError;
 use crate::globals::{DB, ENFORCEMENTS, LEGACY_IMPORTER, SUPER_KEY};
 use crate::ks_err;
 use crate::permission::KeystorePerm;
+use crate::super_key::SuperKeyManager;
 use crate::utils::{check_keystore_permission, watchdog as wd};
 use aconfig_android_hardware_biometrics_rust;
 use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
@@ -134,15 +135,26 @@ impl AuthorizationManager {
             .context(ks_err!("caller missing Unlock permissions"))?;
         ENFORCEMENTS.set_device_locked(user_id, false);
 
-        let mut skm = SUPER_KEY.write().unwrap();
         if let Some(password) = password {
             DB.with(|db| {
-                skm.unlock_user(&mut db.borrow_mut(), &LEGACY_IMPORTER, user_id as u32, &password)
+                SuperKeyManager::unlock_user(
+                    &SUPER_KEY,
+                    &mut db.borrow_mut(),
+                    &LEGACY_IMPORTER,
+                    user_id as u32,
+                    &password,
+                )
             })
             .context(ks_err!("Unlock with password."))
         } else {
-            DB.with(|db| skm.try_unlock_user_with_biometric(&mut db.borrow_mut(), user_id as u32))
-                .context(ks_err!("try_unlock_user_with_biometric failed user_id={user_id}"))
+            DB.with(|db| {
+                SuperKeyManager::try_unlock_user_with_biometric(
+                    &SUPER_KEY,
+                    &mut db.borrow_mut(),
+                    user_id as u32,
+                )
+            })
+            .context(ks_err!("try_unlock_user_with_biometric failed user_id={user_id}"))
         }
     }
 
@@ -161,9 +173,9 @@ impl AuthorizationManager {
         check_keystore_permission(KeystorePerm::Lock)
             .context(ks_err!("caller missing Lock permission"))?;
         ENFORCEMENTS.set_device_locked(user_id, true);
-        let mut skm = SUPER_KEY.write().unwrap();
         DB.with(|db| {
-            skm.lock_unlocked_device_required_keys(
+            SuperKeyManager::lock_unlocked_device_required_keys(
+                &SUPER_KEY,
                 &mut db.borrow_mut(),
                 user_id as u32,
                 unlocking_sids,
@@ -177,7 +189,7 @@ impl AuthorizationManager {
         log::info!("on_weak_unlock_methods_expired(user_id={})", user_id);
         check_keystore_permission(KeystorePerm::Lock)
             .context(ks_err!("caller missing Lock permission"))?;
-        SUPER_KEY.write().unwrap().wipe_plaintext_unlocked_device_required_keys(user_id as u32);
+        SuperKeyManager::wipe_plaintext_unlocked_device_required_keys(&SUPER_KEY, user_id as u32);
         Ok(())
     }
 
@@ -185,7 +197,7 @@ impl AuthorizationManager {
         log::info!("on_non_lskf_unlock_methods_expired(user_id={})", user_id);
         check_keystore_permission(KeystorePerm::Lock)
             .context(ks_err!("caller missing Lock permission"))?;
-        SUPER_KEY.write().unwrap().wipe_all_unlocked_device_required_keys(user_id as u32);
+        SuperKeyManager::wipe_all_unlocked_device_required_keys(&SUPER_KEY, user_id as u32);
         Ok(())
     }
 
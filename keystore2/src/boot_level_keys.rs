@@ -179,16 +179,26 @@ pub fn get_level_zero_key(db: &mut KeystoreDB) -> Result<ZVec> {
     Ok(level_zero_key)
 }
 
+/// The keys for a single boot level.
+struct BootLevelKeys {
+    /// The HKDF key for this boot level, from which the key of the next level is derived.
+    hkdf_key: ZVec,
+    /// The AES-256-GCM key for this boot level. It is derived from `hkdf_key` on first use and
+    /// kept, so that loading further keys bound to this level does not repeat the derivation.
+    aes_key: Option<ZVec>,
+}
+
 /// Holds the key for the current boot level, and a cache of future keys generated as required.
 /// When the boot level advances, keys prior to the current boot level are securely dropped.
+/// This includes the AES keys derived for those levels.
 pub struct BootLevelKeyCache {
     /// Least boot level currently accessible, if any is.
     current: usize,
-    /// Invariant: cache entry *i*, if it exists, holds the HKDF key for boot level
+    /// Invariant: cache entry *i*, if it exists, holds the keys for boot level
     /// *i* + `current`. If the cache is non-empty it can be grown forwards, but it cannot be
     /// grown backwards, so keys below `current` are inaccessible.
     /// `cache.clear()` makes all keys inaccessible.
-    cache: VecDeque<ZVec>,
+    cache: VecDeque<BootLevelKeys>,
 }
 
 impl BootLevelKeyCache {
@@ -198,8 +208,8 @@ impl BootLevelKeyCache {
 
     /// Initialize the cache with the level zero key.
     pub fn new(level_zero_key: ZVec) -> Self {
-        let mut cache: VecDeque<ZVec> = VecDeque::new();
-        cache.push_back(level_zero_key);
+        let mut cache: VecDeque<BootLevelKeys> = VecDeque::new();
+        cache.push_back(BootLevelKeys { hkdf_key: level_zero_key, aes_key: None });
         Self { current: 0, cache }
     }
 
@@ -211,9 +221,9 @@ impl BootLevelKeyCache {
         boot_level >= self.current && !self.cache.is_empty()
     }
 
-    /// Get the HKDF key for boot level `boot_level`. The key for level *i*+1
+    /// Get the keys for boot level `boot_level`. The HKDF key for level *i*+1
     /// is calculated from the level *i* key using `hkdf_expand`.
-    fn get_hkdf_key(&mut self, boot_level: usize) -> Result<Option<&ZVec>> {
+    fn get_level_keys(&mut self, boot_level: usize) -> Result<Option<&mut BootLevelKeys>> {
         if !self.level_accessible(boot_level) {
             return Ok(None);
         }
@@ -225,14 +235,14 @@ impl BootLevelKeyCache {
         for _level in first_not_cached..=boot_level {
             // We check at the start that cache is non-empty and future iterations only push,
             // so this must unwrap.
-            let highest_key = self.cache.back().unwrap();
+            let highest_key = &self.cache.back().unwrap().hkdf_key;
             let next_key = hkdf_expand(Self::HKDF_KEY_SIZE, highest_key, Self::HKDF_ADVANCE)
                 .context(ks_err!("Advancing key one step"))?;
-            self.cache.push_back(next_key);
+            self.cache.push_back(BootLevelKeys { hkdf_key: next_key, aes_key: None });
         }
 
         // If we reach this point, we should have a key at index boot_level - current.
-        Ok(Some(self.cache.get(boot_level - self.current).unwrap()))
+        Ok(Some(self.cache.get_mut(boot_level - self.current).unwrap()))
     }
 
     /// Drop keys prior to the given boot level, while retaining the ability to generate keys for
@@ -250,10 +260,11 @@ impl BootLevelKeyCache {
 
         // We `get` the new boot level for the side effect of advancing the cache to a point
         // where the new boot level is present.
-        self.get_hkdf_key(new_boot_level).context(ks_err!("Advancing cache"))?;
+        self.get_level_keys(new_boot_level).context(ks_err!("Advancing cache"))?;
 
         // Then we split the queue at the index of the new boot level and discard the front,
-        // keeping only the keys with the current boot level or higher.
+        // keeping only the keys with the current boot level or higher. Dropping the front
+        // zeroes both the HKDF and the AES keys of the discarded levels.
         self.cache = self.cache.split_off(new_boot_level - self.current);
 
         // The new cache has the new boot level at index 0, so we set `current` to
@@ -269,23 +280,20 @@ impl BootLevelKeyCache {
         self.cache.clear();
     }
 
-    fn expand_key(
-        &mut self,
-        boot_level: usize,
-        out_len: usize,
-        info: &[u8],
-    ) -> Result<Option<ZVec>> {
-        self.get_hkdf_key(boot_level)
-            .context(ks_err!("Looking up HKDF key"))?
-            .map(|k| hkdf_expand(out_len, k, info))
-            .transpose()
-            .context(ks_err!("Calling hkdf_expand"))
-    }
-
     /// Return the AES-256-GCM key for the current boot level.
     pub fn aes_key(&mut self, boot_level: usize) -> Result<Option<ZVec>> {
-        self.expand_key(boot_level, AES_256_KEY_LENGTH, BootLevelKeyCache::HKDF_AES)
-            .context(ks_err!("expand_key failed"))
+        let Some(keys) = self.get_level_keys(boot_level).context(ks_err!("Looking up HKDF key"))?
+        else {
+            return Ok(None);
+        };
+        if keys.aes_key.is_none() {
+            keys.aes_key = Some(
+                hkdf_expand(AES_256_KEY_LENGTH, &keys.hkdf_key, BootLevelKeyCache::HKDF_AES)
+                    .context(ks_err!("Calling hkdf_expand"))?,
+            );
+        }
+        // The cached key was set above, so this must unwrap.
+        keys.aes_key.as_ref().unwrap().try_clone().context(ks_err!("Cloning AES key")).map(Some)
     }
 }
 
@@ -335,4 +343,54 @@ mod test {
         assert_eq!(None, blkc.aes_key(10)?);
         Ok(())
     }
+
+    #[test]
+    fn test_aes_key_is_cached_per_level() -> Result<()> {
+        let initial_key = b"initial key";
+        let mut blkc = BootLevelKeyCache::new(ZVec::try_from(initial_key as &[u8])?);
+        let v10 = blkc.aes_key(10)?.unwrap();
+        assert!(blkc.cache[10].aes_key.is_some());
+        assert!(blkc.cache[5].aes_key.is_none());
+
+        // The cached key must match a fresh derivation.
+        let mut fresh = BootLevelKeyCache::new(ZVec::try_from(initial_key as &[u8])?);
+        assert_eq!(Some(&v10), fresh.aes_key(10)?.as_ref());
+
+        // Advancing past a level drops its cached AES key together with its HKDF key.
+        blkc.advance_boot_level(11)?;
+        assert_eq!(blkc.cache.len(), 1);
+        assert!(blkc.cache[0].aes_key.is_none());
+        assert_eq!(None, blkc.aes_key(10)?);
+        Ok(())
+    }
+
+    #[test]
+    fn test_aes_key_benchmark() -> Result<()> {
+        const LOADS: u32 = 10_000;
+        const BOOT_LEVEL: usize = 30;
+        let initial_key = b"initial key";
+
+        // Per-load cost without a cached AES key: one HKDF derivation per load.
+        let mut blkc = BootLevelKeyCache::new(ZVec::try_from(initial_key as &[u8])?);
+        blkc.get_level_keys(BOOT_LEVEL)?;
+        let start = std::time::Instant::now();
+        for _ in 0..LOADS {
+            blkc.cache[BOOT_LEVEL].aes_key = None;
+            blkc.aes_key(BOOT_LEVEL)?.unwrap();
+        }
+        let uncached = start.elapsed() / LOADS;
+
+        // Per-load cost with the cached AES key.
+        let start = std::time::Instant::now();
+        for _ in 0..LOADS {
+            blkc.aes_key(BOOT_LEVEL)?.unwrap();
+        }
+        let cached = start.elapsed() / LOADS;
+
+        // The cache lock is held for exactly the duration of `aes_key`, so these are also the
+        // times spent holding it per load.
+        println!("\nuncached_aes_key_in_ns,cached_aes_key_in_ns");
+        println!("{}, {}", uncached.as_nanos(), cached.as_nanos());
+        Ok(())
+    }
 }
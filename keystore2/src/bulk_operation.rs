@@ -0,0 +1,210 @@
+// Copyright 2024, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! This module implements the IKeystoreBulkOperation AIDL interface, which feeds input from a
+//! file descriptor to an ongoing key operation. See `operation.rs` for how the input is passed
+//! on to KeyMint.
+//!
+//! The file descriptors come from the client, so they are checked before they are used: a pipe
+//! or socket that never delivers data, or a file served by a stalled FUSE daemon, would pin a
+//! Keystore binder thread. Only regular files on other file systems are accepted, and shared
+//! memory files, e.g., memfds, must be sealed against shrinking. The length of a single call is
+//! capped as well, so that it ties up a binder thread for a bounded amount of work.
+
+use crate::error::{into_logged_binder, Error, ResponseCode};
+use crate::ks_err;
+use crate::operation::KeystoreOperation;
+use android_security_bulkoperation::aidl::android::security::bulkoperation::IKeystoreBulkOperation::{
+    BnKeystoreBulkOperation, IKeystoreBulkOperation,
+};
+use android_security_bulkoperation::binder::{
+    BinderFeatures, Interface, ParcelFileDescriptor, Result as BinderResult, Strong,
+    ThreadState,
+};
+use android_system_keystore2::aidl::android::system::keystore2::IKeystoreOperation::IKeystoreOperation;
+use anyhow::{Context, Result};
+use std::fs::File;
+use std::io::{Seek, SeekFrom};
+use std::os::fd::AsRawFd;
+
+/// The most bytes a single bulk call reads from its input.
+const MAX_BULK_LENGTH: usize = 64 << 20;
+
+/// `statfs::f_type` of FUSE file systems.
+const FUSE_SUPER_MAGIC: libc::c_long = 0x65735546;
+
+/// This struct is defined to implement IKeystoreBulkOperation AIDL interface.
+pub struct BulkOperation;
+
+impl BulkOperation {
+    /// Create a new instance of the Keystore bulk operation service.
+    pub fn new_native_binder() -> Result<Strong<dyn IKeystoreBulkOperation>> {
+        Ok(BnKeystoreBulkOperation::new_binder(Self, BinderFeatures::default()))
+    }
+
+    /// Resolves `operation` and checks that it belongs to the caller. Holding an operation
+    /// binder is all it takes to use it through `IKeystoreOperation`, but the binder may have
+    /// been leaked to another app, and an app has no reason to use another app's operation.
+    fn get_operation(operation: &Strong<dyn IKeystoreOperation>) -> Result<KeystoreOperation> {
+        let operation = KeystoreOperation::from_binder(&operation.as_binder())
+            .ok_or(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+            .context(ks_err!("Not a Keystore operation."))?;
+        if let Some(owner) = operation.owner() {
+            if owner != ThreadState::get_calling_uid() {
+                return Err(Error::Rc(ResponseCode::PERMISSION_DENIED))
+                    .context(ks_err!("Operation is owned by {owner}."));
+            }
+        }
+        Ok(operation)
+    }
+
+    fn get_length(length: i64) -> Result<usize> {
+        match usize::try_from(length) {
+            Ok(length) if length <= MAX_BULK_LENGTH => Ok(length),
+            _ => Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Invalid length {length}.")),
+        }
+    }
+
+    /// Checks that reading from or writing to `file` cannot block indefinitely, i.e., that it is
+    /// a regular file that is not on a FUSE file system.
+    fn check_file(file: &File) -> Result<()> {
+        let metadata = file
+            .metadata()
+            .map_err(|_| Error::Rc(ResponseCode::INVALID_ARGUMENT))
+            .context(ks_err!("Failed to stat file."))?;
+        if !metadata.is_file() {
+            return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Not a regular file."));
+        }
+        // SAFETY: `statfs` is plain old data, for which all zeroes is a valid value.
+        let mut statfs: libc::statfs = unsafe { std::mem::zeroed() };
+        // SAFETY: The file descriptor is valid for the lifetime of `file`, and the pointer is
+        // valid because it comes from a reference. fstatfs doesn't retain it beyond the call.
+        if unsafe { libc::fstatfs(file.as_raw_fd(), &mut statfs) } != 0 {
+            return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Failed to statfs file."));
+        }
+        if statfs.f_type as libc::c_long == FUSE_SUPER_MAGIC {
+            return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Files on FUSE file systems are not supported."));
+        }
+        Ok(())
+    }
+
+    /// Checks `input` like `check_file`, and that `length` bytes can be read from it at its
+    /// current offset, which is returned. Shared memory files must be sealed against shrinking,
+    /// because their size could change while they are read otherwise.
+    fn check_input(mut input: &File, length: usize) -> Result<u64> {
+        Self::check_file(input).context(ks_err!("Invalid input."))?;
+        // SAFETY: The file descriptor is valid for the lifetime of `input`. F_GET_SEALS takes
+        // no argument and fails with EINVAL for files that do not support sealing.
+        let seals = unsafe { libc::fcntl(input.as_raw_fd(), libc::F_GET_SEALS) };
+        if seals >= 0 && seals & libc::F_SEAL_SHRINK == 0 {
+            return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Shared memory input must be sealed against shrinking."));
+        }
+        let size = input
+            .metadata()
+            .map_err(|_| Error::Rc(ResponseCode::INVALID_ARGUMENT))
+            .context(ks_err!("Failed to stat input."))?
+            .len();
+        let offset = input
+            .stream_position()
+            .map_err(|_| Error::Rc(ResponseCode::INVALID_ARGUMENT))
+            .context(ks_err!("Failed to get the input offset."))?;
+        if size.saturating_sub(offset) < length as u64 {
+            return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Input has fewer than {length} bytes left."));
+        }
+        Ok(offset)
+    }
+
+    /// Moves the offset of `input` past the `length` bytes read at `offset`, as if they had
+    /// been read with `read`.
+    fn advance_input(mut input: &File, offset: u64, length: usize) -> Result<()> {
+        input
+            .seek(SeekFrom::Start(offset + length as u64))
+            .map_err(|_| Error::Rc(ResponseCode::INVALID_ARGUMENT))
+            .context(ks_err!("Failed to set the input offset."))?;
+        Ok(())
+    }
+
+    fn update_bulk(
+        operation: &Strong<dyn IKeystoreOperation>,
+        input: &ParcelFileDescriptor,
+        length: i64,
+        output: Option<&ParcelFileDescriptor>,
+    ) -> Result<i64> {
+        let operation = Self::get_operation(operation).context(ks_err!())?;
+        let length = Self::get_length(length).context(ks_err!())?;
+        let input: &File = input.as_ref();
+        let offset = Self::check_input(input, length).context(ks_err!())?;
+        let output: Option<&File> = output.map(|output| output.as_ref());
+        if let Some(output) = output {
+            Self::check_file(output).context(ks_err!("Invalid output."))?;
+        }
+        let written = operation.update_bulk(input, offset, length, output).context(ks_err!())?;
+        Self::advance_input(input, offset, length).context(ks_err!())?;
+        Ok(written as i64)
+    }
+
+    fn finish_bulk(
+        operation: &Strong<dyn IKeystoreOperation>,
+        input: &ParcelFileDescriptor,
+        length: i64,
+        signature: Option<&[u8]>,
+        output: Option<&ParcelFileDescriptor>,
+    ) -> Result<Option<Vec<u8>>> {
+        let operation = Self::get_operation(operation).context(ks_err!())?;
+        let length = Self::get_length(length).context(ks_err!())?;
+        let input: &File = input.as_ref();
+        let offset = Self::check_input(input, length).context(ks_err!())?;
+        let output: Option<&File> = output.map(|output| output.as_ref());
+        if let Some(output) = output {
+            Self::check_file(output).context(ks_err!("Invalid output."))?;
+        }
+        let result =
+            operation.finish_bulk(input, offset, length, signature, output).context(ks_err!())?;
+        Self::advance_input(input, offset, length).context(ks_err!())?;
+        Ok(result)
+    }
+}
+
+impl Interface for BulkOperation {}
+
+// There are no watch points around these calls because they legitimately take long for large
+// inputs. Each KeyMint call they make is watched by `Operation`.
+impl IKeystoreBulkOperation for BulkOperation {
+    fn update(
+        &self,
+        operation: &Strong<dyn IKeystoreOperation>,
+        input: &ParcelFileDescriptor,
+        length: i64,
+        output: Option<&ParcelFileDescriptor>,
+    ) -> BinderResult<i64> {
+        Self::update_bulk(operation, input, length, output).map_err(into_logged_binder)
+    }
+
+    fn finish(
+        &self,
+        operation: &Strong<dyn IKeystoreOperation>,
+        input: &ParcelFileDescriptor,
+        length: i64,
+        signature: Option<&[u8]>,
+        output: Option<&ParcelFileDescriptor>,
+    ) -> BinderResult<Option<Vec<u8>>> {
+        Self::finish_bulk(operation, input, length, signature, output).map_err(into_logged_binder)
+    }
+}
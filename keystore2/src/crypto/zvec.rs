@@ -14,22 +14,64 @@
 
 //! Implements ZVec, a vector that is mlocked during its lifetime and zeroed
 //! when dropped.
+//!
+//! Small ZVecs are carved out of a pool of memory that is locked once, when the
+//! first ZVec is created, so that creating and dropping them does not cost an
+//! `mlock` and `munlock` system call each. ZVecs that do not fit into the pool,
+//! because it is exhausted or they are larger than its largest slots, are
+//! locked individually as before.
 
 use nix::sys::mman::{mlock, munlock};
+use std::alloc::{alloc_zeroed, dealloc, Layout};
 use std::convert::TryFrom;
 use std::fmt;
 use std::ops::{Deref, DerefMut};
 use std::ptr::write_volatile;
 use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{LazyLock, Mutex};
 
 /// A semi fixed size u8 vector that is zeroed when dropped.  It can shrink in
 /// size but cannot grow larger than the original size (and if it shrinks it
 /// still owns the entire buffer).  Also the data is pinned in memory with
 /// mlock.
-#[derive(Default, Eq, PartialEq)]
+#[derive(Default)]
 pub struct ZVec {
-    elems: Box<[u8]>,
+    elems: Elems,
     len: usize,
+    /// The size the ZVec was created with. Pool slots may be larger, but the ZVec must not
+    /// grow into the rest of its slot, so that it behaves the same whether it was pooled.
+    capacity: usize,
+}
+
+/// The buffer of a ZVec.
+enum Elems {
+    /// A heap allocation that is mlocked by itself.
+    Locked(Box<[u8]>),
+    /// A slot of the pool.
+    Pooled(PoolSlot),
+}
+
+impl Default for Elems {
+    fn default() -> Self {
+        Self::Locked(Box::default())
+    }
+}
+
+impl Elems {
+    fn as_slice(&self) -> &[u8] {
+        match self {
+            Self::Locked(b) => b,
+            Self::Pooled(slot) => slot.as_slice(),
+        }
+    }
+
+    fn as_mut_slice(&mut self) -> &mut [u8] {
+        match self {
+            Self::Locked(b) => b,
+            Self::Pooled(slot) => slot.as_mut_slice(),
+        }
+    }
 }
 
 /// ZVec specific error codes.
@@ -43,20 +85,30 @@ pub enum Error {
 impl ZVec {
     /// Create a ZVec with the given size.
     pub fn new(size: usize) -> Result<Self, Error> {
+        match POOL.as_ref().and_then(|pool| pool.alloc(size)) {
+            Some(slot) => Ok(Self { elems: Elems::Pooled(slot), len: size, capacity: size }),
+            None => Self::new_locked(size),
+        }
+    }
+
+    /// Create a ZVec with the given size that is locked by itself rather than taken from the
+    /// pool.
+    fn new_locked(size: usize) -> Result<Self, Error> {
         let v: Vec<u8> = vec![0; size];
         let b = v.into_boxed_slice();
         if size > 0 {
+            FALLBACK_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
             // SAFETY: The address range is part of our address space.
             unsafe { mlock(NonNull::from(&b).cast(), b.len()) }?;
         }
-        Ok(Self { elems: b, len: size })
+        Ok(Self { elems: Elems::Locked(b), len: size, capacity: size })
     }
 
     /// Reduce the length to the given value.  Does nothing if that length is
-    /// greater than the length of the vector.  Note that it still owns the
-    /// original allocation even if the length is reduced.
+    /// greater than the size the vector was created with.  Note that it still
+    /// owns the original allocation even if the length is reduced.
     pub fn reduce_len(&mut self, len: usize) {
-        if len <= self.elems.len() {
+        if len <= self.capacity {
             self.len = len;
         }
     }
@@ -72,39 +124,54 @@ impl ZVec {
 
 impl Drop for ZVec {
     fn drop(&mut self) {
-        for i in 0..self.elems.len() {
+        for b in self.elems.as_mut_slice() {
             // SAFETY: The pointer is valid and properly aligned because it came from a reference.
-            unsafe { write_volatile(&mut self.elems[i], 0) };
-        }
-        if !self.elems.is_empty() {
-            if let Err(e) =
-                // SAFETY: The address range is part of our address space, and was previously locked
-                // by `mlock` in `ZVec::new` or the `TryFrom<Vec<u8>>` implementation.
-                unsafe { munlock(NonNull::from(&self.elems).cast(), self.elems.len()) }
-            {
-                log::error!("In ZVec::drop: `munlock` failed: {:?}.", e);
+            unsafe { write_volatile(b, 0) };
+        }
+        match &self.elems {
+            Elems::Locked(b) if !b.is_empty() => {
+                if let Err(e) =
+                    // SAFETY: The address range is part of our address space, and was previously
+                    // locked by `mlock` in `ZVec::new_locked` or the `TryFrom<Vec<u8>>`
+                    // implementation.
+                    unsafe { munlock(NonNull::from(b).cast(), b.len()) }
+                {
+                    log::error!("In ZVec::drop: `munlock` failed: {:?}.", e);
+                }
             }
+            Elems::Locked(_) => {}
+            // The slot can only have come from the pool, so it exists.
+            Elems::Pooled(slot) => POOL.as_ref().unwrap().release(slot),
         }
     }
 }
 
+/// Two ZVecs are equal if their contents are, whether they came from the pool or not.
+impl PartialEq for ZVec {
+    fn eq(&self, other: &Self) -> bool {
+        self[..] == other[..]
+    }
+}
+
+impl Eq for ZVec {}
+
 impl Deref for ZVec {
     type Target = [u8];
 
     fn deref(&self) -> &Self::Target {
-        &self.elems[0..self.len]
+        &self.elems.as_slice()[0..self.len]
     }
 }
 
 impl DerefMut for ZVec {
     fn deref_mut(&mut self) -> &mut Self::Target {
-        &mut self.elems[0..self.len]
+        &mut self.elems.as_mut_slice()[0..self.len]
     }
 }
 
 impl fmt::Debug for ZVec {
     fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
-        if self.elems.is_empty() {
+        if self.elems.as_slice().is_empty() {
             write!(f, "Zvec empty")
         } else {
             write!(f, "Zvec size: {} [ Sensitive information redacted ]", self.len)
@@ -129,15 +196,299 @@ impl TryFrom<Vec<u8>> for ZVec {
 
     fn try_from(mut v: Vec<u8>) -> Result<Self, Self::Error> {
         let len = v.len();
-        // into_boxed_slice calls shrink_to_fit, which may move the pointer.
-        // But sometimes the contents of the Vec are already sensitive and
-        // mustn't be copied. So ensure the shrink_to_fit call is a NOP.
+        // The contents of the Vec may already be sensitive. So make sure that none of its
+        // buffer, including the spare capacity, is freed without being zeroed, and that
+        // into_boxed_slice does not move it, which it may do when it calls shrink_to_fit.
         v.resize(v.capacity(), 0);
+        if let Some(slot) = POOL.as_ref().and_then(|pool| pool.alloc(len)) {
+            let mut z = Self { elems: Elems::Pooled(slot), len, capacity: len };
+            z.copy_from_slice(&v[..len]);
+            for b in v.iter_mut() {
+                // SAFETY: The pointer is valid and properly aligned because it came from a
+                // reference.
+                unsafe { write_volatile(b, 0) };
+            }
+            return Ok(z);
+        }
         let b = v.into_boxed_slice();
         if !b.is_empty() {
+            FALLBACK_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
             // SAFETY: The address range is part of our address space.
             unsafe { mlock(NonNull::from(&b).cast(), b.len()) }?;
         }
-        Ok(Self { elems: b, len })
+        Ok(Self { elems: Elems::Locked(b), len, capacity: len })
+    }
+}
+
+/// The sizes of the slots in the pool, and how many slots there are of each size. Most ZVecs
+/// hold keys of 16 to 66 bytes, passwords, or decrypted key blobs of a few hundred bytes. The
+/// pool takes 60KiB of locked memory.
+const POOL_SLOT_CLASSES: [(usize, usize); 6] =
+    [(32, 128), (64, 128), (128, 64), (512, 16), (2048, 8), (4096, 4)];
+
+/// The pool is aligned to pages, which are the unit of locking.
+const POOL_ALIGNMENT: usize = 4096;
+
+static POOL: LazyLock<Option<Pool>> = LazyLock::new(Pool::new);
+
+/// Number of ZVecs that were locked individually rather than taken from the pool.
+static FALLBACK_ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+/// Usage statistics of the pool that backs small ZVecs.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct PoolStats {
+    /// Bytes of locked memory reserved for the pool. This is 0 if the pool could not be locked,
+    /// e.g., because of `RLIMIT_MEMLOCK`, in which case all ZVecs are locked individually.
+    pub capacity: usize,
+    /// Bytes of the pool held by ZVecs, counting whole slots.
+    pub in_use: usize,
+    /// The largest value of `in_use` so far.
+    pub peak_in_use: usize,
+    /// Number of ZVecs taken from the pool.
+    pub pool_allocations: u64,
+    /// Number of ZVecs that were locked individually, because the pool was exhausted or they
+    /// were larger than its largest slots.
+    pub fallback_allocations: u64,
+}
+
+/// Returns the usage statistics of the pool that backs small ZVecs. Keystore reports them in its
+/// dumpsys output.
+pub fn pool_stats() -> PoolStats {
+    let mut stats = match POOL.as_ref() {
+        Some(pool) => pool.state.lock().unwrap().stats,
+        None => PoolStats::default(),
+    };
+    stats.fallback_allocations = FALLBACK_ALLOCATIONS.load(Ordering::Relaxed);
+    stats
+}
+
+/// A slot of the pool, owned by one ZVec.
+struct PoolSlot {
+    ptr: NonNull<u8>,
+    class: usize,
+    index: usize,
+}
+
+// SAFETY: A slot is a region of the pool that is exclusively owned by the slot until it is
+// released, so it may be used from any thread like a Box<[u8]>.
+unsafe impl Send for PoolSlot {}
+// SAFETY: See above. Shared references only give out shared access to the region.
+unsafe impl Sync for PoolSlot {}
+
+impl PoolSlot {
+    fn as_slice(&self) -> &[u8] {
+        // SAFETY: The slot is a valid region of the pool of this size, exclusively owned by self.
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), POOL_SLOT_CLASSES[self.class].0) }
+    }
+
+    fn as_mut_slice(&mut self) -> &mut [u8] {
+        // SAFETY: The slot is a valid region of the pool of this size, exclusively owned by self.
+        unsafe {
+            std::slice::from_raw_parts_mut(self.ptr.as_ptr(), POOL_SLOT_CLASSES[self.class].0)
+        }
+    }
+}
+
+struct PoolState {
+    /// Indices of the free slots of each class.
+    free: Vec<Vec<usize>>,
+    stats: PoolStats,
+}
+
+/// A region of locked memory, divided into slots of the sizes in `POOL_SLOT_CLASSES`. It lives
+/// until the process exits. Free slots are always zeroed.
+struct Pool {
+    base: NonNull<u8>,
+    /// Offset of the first slot of each class from `base`.
+    class_offsets: Vec<usize>,
+    state: Mutex<PoolState>,
+}
+
+// SAFETY: The pool's memory is only accessed through slots, and the free lists that hand out the
+// slots are protected by a mutex.
+unsafe impl Send for Pool {}
+// SAFETY: See above.
+unsafe impl Sync for Pool {}
+
+impl Pool {
+    fn new() -> Option<Self> {
+        let mut class_offsets = Vec::with_capacity(POOL_SLOT_CLASSES.len());
+        let mut size = 0;
+        for (slot_size, count) in POOL_SLOT_CLASSES {
+            class_offsets.push(size);
+            size += slot_size * count;
+        }
+        let layout = Layout::from_size_align(size, POOL_ALIGNMENT).ok()?.pad_to_align();
+        // SAFETY: The layout has a non-zero size.
+        let base = NonNull::new(unsafe { alloc_zeroed(layout) })?;
+        // SAFETY: The address range was just allocated.
+        if let Err(e) = unsafe { mlock(base.cast(), layout.size()) } {
+            log::warn!("ZVec pool of {} bytes disabled: `mlock` failed: {:?}.", layout.size(), e);
+            // SAFETY: The memory was allocated above with the same layout and is not used.
+            unsafe { dealloc(base.as_ptr(), layout) };
+            return None;
+        }
+        let free = POOL_SLOT_CLASSES.iter().map(|(_, count)| (0..*count).rev().collect()).collect();
+        let stats = PoolStats { capacity: layout.size(), ..Default::default() };
+        Some(Self { base, class_offsets, state: Mutex::new(PoolState { free, stats }) })
+    }
+
+    /// Takes the smallest free slot that holds `size` bytes, if any.
+    fn alloc(&self, size: usize) -> Option<PoolSlot> {
+        if size == 0 {
+            return None;
+        }
+        let mut state = self.state.lock().unwrap();
+        let (class, index) = POOL_SLOT_CLASSES
+            .iter()
+            .enumerate()
+            .filter(|(_, (slot_size, _))| *slot_size >= size)
+            .find_map(|(class, _)| state.free[class].pop().map(|index| (class, index)))?;
+        let slot_size = POOL_SLOT_CLASSES[class].0;
+        state.stats.in_use += slot_size;
+        state.stats.peak_in_use = state.stats.peak_in_use.max(state.stats.in_use);
+        state.stats.pool_allocations += 1;
+        // SAFETY: The offset is within the pool's allocation.
+        let ptr = unsafe { self.base.add(self.class_offsets[class] + index * slot_size) };
+        Some(PoolSlot { ptr, class, index })
+    }
+
+    /// Returns a slot that has been zeroed to the pool.
+    fn release(&self, slot: &PoolSlot) {
+        let mut state = self.state.lock().unwrap();
+        state.free[slot.class].push(slot.index);
+        state.stats.in_use -= POOL_SLOT_CLASSES[slot.class].0;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::process::Command;
+    use std::time::Instant;
+
+    #[test]
+    fn pooled_zvec_is_zeroed() {
+        for size in [1, 32, 33, 100, 4096] {
+            let mut z = ZVec::new(size).unwrap();
+            assert!(matches!(z.elems, Elems::Pooled(_)) || pool_stats().capacity == 0);
+            assert_eq!(z.len(), size);
+            assert!(z.iter().all(|b| *b == 0));
+            z.fill(0xff);
+            drop(z);
+            // The same slot is handed out again unless another thread took it.
+            assert!(ZVec::new(size).unwrap().iter().all(|b| *b == 0));
+        }
+    }
+
+    #[test]
+    fn pooled_and_locked_zvecs_compare_equal() {
+        let data: Vec<u8> = (0..48).collect();
+        let pooled = ZVec::try_from(data.clone()).unwrap();
+        let mut locked = ZVec::new_locked(data.len()).unwrap();
+        locked.copy_from_slice(&data);
+        assert_eq!(pooled, locked);
+        assert_eq!(pooled.try_clone().unwrap(), locked);
+    }
+
+    #[test]
+    fn reduce_len_does_not_grow_into_slot() {
+        // 20 bytes come from a larger slot, but the ZVec must not grow beyond them.
+        for mut z in [ZVec::new(20).unwrap(), ZVec::try_from(vec![1; 20]).unwrap()] {
+            z.reduce_len(32);
+            assert_eq!(z.len(), 20);
+            z.reduce_len(10);
+            assert_eq!(z.len(), 10);
+            z.reduce_len(20);
+            assert_eq!(z.len(), 20);
+        }
+    }
+
+    #[test]
+    fn large_zvec_falls_back() {
+        let fallback_allocations = pool_stats().fallback_allocations;
+        let z = ZVec::new(8192).unwrap();
+        assert!(matches!(z.elems, Elems::Locked(_)));
+        assert!(pool_stats().fallback_allocations > fallback_allocations);
+    }
+
+    #[test]
+    fn exhausted_pool_falls_back() {
+        // Hold more ZVecs than there are slots in the pool.
+        let count: usize = POOL_SLOT_CLASSES.iter().map(|(_, count)| count).sum();
+        let zvecs: Vec<_> = (0..count + 1).map(|_| ZVec::new(16).unwrap()).collect();
+        assert!(zvecs.iter().any(|z| matches!(z.elems, Elems::Locked(_))));
+        let stats = pool_stats();
+        assert!(stats.peak_in_use <= stats.capacity);
+    }
+
+    /// Compares the cost of creating and dropping a small ZVec from the pool with locking it
+    /// individually.
+    #[test]
+    fn allocation_benchmark() {
+        const ITERATIONS: u32 = 100_000;
+        const SIZE: usize = 32;
+
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            ZVec::new(SIZE).unwrap();
+        }
+        let pooled = start.elapsed() / ITERATIONS;
+
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            ZVec::new_locked(SIZE).unwrap();
+        }
+        let locked = start.elapsed() / ITERATIONS;
+
+        println!("ZVec::new({SIZE}) and drop: pooled {pooled:?}, individually locked {locked:?}");
+        println!("{:?}", pool_stats());
+    }
+
+    const MEMLOCK_LIMIT_CHILD: &str = "ZVEC_TEST_MEMLOCK_LIMIT_CHILD";
+
+    /// Creates ZVecs with `RLIMIT_MEMLOCK` lowered to nothing. This runs in a child process,
+    /// because the limit applies to the whole process.
+    #[test]
+    fn memlock_limit() {
+        if std::env::var_os(MEMLOCK_LIMIT_CHILD).is_some() {
+            return memlock_limit_child();
+        }
+        let output = Command::new(std::env::current_exe().unwrap())
+            .args(["--exact", "zvec::tests::memlock_limit", "--nocapture", "--test-threads=1"])
+            .env(MEMLOCK_LIMIT_CHILD, "1")
+            .output()
+            .unwrap();
+        print!("{}", String::from_utf8_lossy(&output.stdout));
+        assert!(output.status.success(), "{}", String::from_utf8_lossy(&output.stderr));
+    }
+
+    fn memlock_limit_child() {
+        // Lock the pool before lowering the limit, as the first ZVec of a process does.
+        drop(ZVec::new(1).unwrap());
+        let capacity = pool_stats().capacity;
+
+        let mut limit = nix::libc::rlimit { rlim_cur: 0, rlim_max: 0 };
+        // SAFETY: `limit` is a valid rlimit struct.
+        assert_eq!(unsafe { nix::libc::getrlimit(nix::libc::RLIMIT_MEMLOCK, &mut limit) }, 0);
+        limit.rlim_cur = 0;
+        // SAFETY: `limit` is a valid rlimit struct.
+        assert_eq!(unsafe { nix::libc::setrlimit(nix::libc::RLIMIT_MEMLOCK, &limit) }, 0);
+
+        // Slots of the pool are already locked, so these do not count against the limit.
+        let pooled: Vec<_> = (0..POOL_SLOT_CLASSES[0].1).map(|_| ZVec::new(32)).collect();
+        let pooled_ok = pooled.iter().filter(|z| z.is_ok()).count();
+        // These do, unless the process may lock memory regardless of the limit.
+        let locked: Vec<_> = (0..16).map(|_| ZVec::new(8192)).collect();
+        let locked_ok = locked.iter().filter(|z| z.is_ok()).count();
+        println!(
+            "With RLIMIT_MEMLOCK 0: {pooled_ok}/{} pooled and {locked_ok}/{} individually \
+             locked ZVecs created, pool capacity {capacity}",
+            pooled.len(),
+            locked.len()
+        );
+        if capacity > 0 {
+            assert_eq!(pooled_ok, pooled.len());
+        }
     }
 }
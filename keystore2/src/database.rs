@@ -90,7 +90,7 @@ use rusqlite::{
 use std::{
     collections::{HashMap, HashSet},
     path::Path,
-    sync::{Arc, Condvar, Mutex},
+    sync::{Arc, Condvar, Mutex, Weak},
     time::{Duration, SystemTime},
 };
 
@@ -125,7 +125,8 @@ impl TransactionBehavior {
     }
 }
 
-/// If the database returns a busy error code, retry after this interval.
+/// If the database returns a busy error code and there is no writer in this process to wait
+/// for, retry after this interval.
 const DB_BUSY_RETRY_INTERVAL: Duration = Duration::from_micros(500);
 
 impl_metadata!(
@@ -588,6 +589,89 @@ impl Drop for KeyIdGuard {
     }
 }
 
+/// The commit queues of the databases opened by this process, by persistent database path.
+static COMMIT_QUEUES: LazyLock<Mutex<HashMap<String, Weak<CommitQueue>>>> =
+    LazyLock::new(Default::default);
+
+/// Serializes the IMMEDIATE transactions of this process on one database in first come, first
+/// served order. SQLite permits only one writer at a time. Without this queue, concurrent
+/// writers on the thread local connections would fail with SQLITE_BUSY and poll until they
+/// happen to win the race, so that their latency was dominated by the retry interval and
+/// unbounded in the worst case. Readers use DEFERRED transactions and do not enter the queue.
+/// They work on a snapshot of the database and are not blocked by the writer in WAL mode.
+///
+/// Lock order: a turn in the commit queue is taken after `KEY_ID_LOCK` guards. A writer that
+/// holds its turn must not block on `KEY_ID_LOCK`, because the holder of that key id lock may
+/// itself be waiting in the queue. It may only use `KeyIdLockDb::try_get` and otherwise has to
+/// finish its transaction and wait for the key id lock outside of the queue.
+struct CommitQueue {
+    state: Mutex<CommitQueueState>,
+    cond_var: Condvar,
+}
+
+#[derive(Default)]
+struct CommitQueueState {
+    next_ticket: u64,
+    now_serving: u64,
+}
+
+/// Represents the turn of the holder in the commit queue. The next writer in line proceeds
+/// when the guard is dropped.
+struct CommitQueueGuard<'a>(&'a CommitQueue);
+
+impl CommitQueue {
+    fn new() -> Self {
+        Self { state: Mutex::new(Default::default()), cond_var: Condvar::new() }
+    }
+
+    /// Returns the commit queue shared by all connections of this process to the database at
+    /// `persistent_path`. Writers to unrelated databases do not wait for each other.
+    fn for_database(persistent_path: &str) -> Arc<Self> {
+        let mut queues = COMMIT_QUEUES.lock().unwrap();
+        if let Some(queue) = queues.get(persistent_path).and_then(Weak::upgrade) {
+            return queue;
+        }
+        queues.retain(|_, queue| queue.strong_count() > 0);
+        let queue = Arc::new(Self::new());
+        queues.insert(persistent_path.to_owned(), Arc::downgrade(&queue));
+        queue
+    }
+
+    /// Blocks until all writers that entered the queue before the caller are done.
+    fn enter(&self) -> CommitQueueGuard<'_> {
+        let mut state = self.state.lock().unwrap();
+        let ticket = state.next_ticket;
+        state.next_ticket += 1;
+        while state.now_serving != ticket {
+            state = self.cond_var.wait(state).unwrap();
+        }
+        CommitQueueGuard(self)
+    }
+
+    /// Blocks until the writer that is currently being served is done. Returns false without
+    /// blocking if there is no writer in the queue.
+    fn wait_for_writer(&self) -> bool {
+        let mut state = self.state.lock().unwrap();
+        if state.now_serving == state.next_ticket {
+            return false;
+        }
+        let serving = state.now_serving;
+        while state.now_serving == serving {
+            state = self.cond_var.wait(state).unwrap();
+        }
+        true
+    }
+}
+
+impl Drop for CommitQueueGuard<'_> {
+    fn drop(&mut self) {
+        let mut state = self.0.state.lock().unwrap();
+        state.now_serving += 1;
+        drop(state);
+        self.0.cond_var.notify_all();
+    }
+}
+
 /// This type represents a certificate and certificate chain entry for a key.
 #[derive(Debug, Default)]
 pub struct CertificateInfo {
@@ -772,6 +856,7 @@ pub struct KeystoreDB {
     conn: Connection,
     gc: Option<Arc<Gc>>,
     perboot: Arc<perboot::PerbootDB>,
+    commit_queue: Arc<CommitQueue>,
 }
 
 /// Database representation of the monotonic time retrieved from the system call clock_gettime with
@@ -868,14 +953,52 @@ pub struct SupersededBlob {
     pub metadata: BlobMetaData,
 }
 
+/// An exact snapshot of the storage statistics of the database, as taken by
+/// `KeystoreDB::sample_storage_stats`. It serves as the baseline for
+/// `KeystoreDB::estimate_storage_stats`.
+#[derive(Clone, Debug)]
+pub struct StorageStatsSnapshot {
+    /// Number of bytes of the database that were in use when the snapshot was taken, if the
+    /// size of the database could be read.
+    used_size: Option<i64>,
+    /// Statistics of all storage types that could be sampled.
+    stats: Vec<StorageStats>,
+}
+
+impl StorageStatsSnapshot {
+    /// Returns the exact storage statistics recorded in this snapshot.
+    pub fn stats(&self) -> &[StorageStats] {
+        &self.stats
+    }
+}
+
 impl KeystoreDB {
     const UNASSIGNED_KEY_ID: i64 = -1i64;
-    const CURRENT_DB_VERSION: u32 = 1;
-    const UPGRADERS: &'static [fn(&Transaction) -> Result<u32>] = &[Self::from_0_to_1];
+    const CURRENT_DB_VERSION: u32 = 3;
+    const UPGRADERS: &'static [fn(&Transaction) -> Result<u32>] =
+        &[Self::from_0_to_1, Self::from_1_to_2, Self::from_2_to_3];
 
     /// Name of the file that holds the cross-boot persistent database.
     pub const PERSISTENT_DB_FILENAME: &'static str = "persistent.sqlite";
 
+    /// All storage types for which `get_storage_stat` reports statistics.
+    pub const STORAGE_STAT_TYPES: &'static [MetricsStorage] = &[
+        MetricsStorage::DATABASE,
+        MetricsStorage::KEY_ENTRY,
+        MetricsStorage::KEY_ENTRY_ID_INDEX,
+        MetricsStorage::KEY_ENTRY_DOMAIN_NAMESPACE_INDEX,
+        MetricsStorage::BLOB_ENTRY,
+        MetricsStorage::BLOB_ENTRY_KEY_ENTRY_ID_INDEX,
+        MetricsStorage::KEY_PARAMETER,
+        MetricsStorage::KEY_PARAMETER_KEY_ENTRY_ID_INDEX,
+        MetricsStorage::KEY_METADATA,
+        MetricsStorage::KEY_METADATA_KEY_ENTRY_ID_INDEX,
+        MetricsStorage::GRANT,
+        MetricsStorage::AUTH_TOKEN,
+        MetricsStorage::BLOB_METADATA,
+        MetricsStorage::BLOB_METADATA_BLOB_ENTRY_ID_INDEX,
+    ];
+
     /// This will create a new database connection connecting the two
     /// files persistent.sqlite and perboot.sqlite in the given directory.
     /// It also attempts to initialize all of the tables.
@@ -885,9 +1008,10 @@ impl KeystoreDB {
         let _wp = wd::watch("KeystoreDB::new");
 
         let persistent_path = Self::make_persistent_path(db_root)?;
-        let conn = Self::make_connection(&persistent_path)?;
+        let commit_queue = CommitQueue::for_database(&persistent_path);
+        let conn = Self::make_connection(&persistent_path, &commit_queue)?;
 
-        let mut db = Self { conn, gc, perboot: perboot::PERBOOT_DB.clone() };
+        let mut db = Self { conn, gc, perboot: perboot::PERBOOT_DB.clone(), commit_queue };
         db.with_transaction(Immediate("TX_new"), |tx| {
             versioning::upgrade_database(tx, Self::CURRENT_DB_VERSION, Self::UPGRADERS)
                 .context(ks_err!("KeystoreDB::new: trying to upgrade database."))?;
@@ -916,6 +1040,38 @@ impl KeystoreDB {
         Ok(1)
     }
 
+    // This upgrade function adds the partial index over USER_SECURE_ID key parameters, which
+    // also backfills it with the secure user ID bindings of all existing keys.
+    fn from_1_to_2(tx: &Transaction) -> Result<u32> {
+        Self::create_keyparameter_user_secure_id_index(tx)
+            .context(ks_err!("Failed to create index keyparameter_user_secure_id_index."))?;
+        Ok(2)
+    }
+
+    // This upgrade function adds the index over the key entry ids and grantees of the grant
+    // table.
+    fn from_2_to_3(tx: &Transaction) -> Result<u32> {
+        Self::create_grant_keyentryid_index(tx)
+            .context(ks_err!("Failed to create index grant_keyentryid_index."))?;
+        Ok(3)
+    }
+
+    // Creates a partial index that maps secure user IDs to the keys bound to them. Only rows
+    // with the USER_SECURE_ID tag are indexed, so the index stays small and is maintained
+    // implicitly whenever key parameters are inserted or deleted.
+    fn create_keyparameter_user_secure_id_index(tx: &Transaction) -> Result<()> {
+        tx.execute(
+            &format!(
+                "CREATE INDEX IF NOT EXISTS persistent.keyparameter_user_secure_id_index
+                ON keyparameter(data, keyentryid) WHERE tag = {};",
+                Tag::USER_SECURE_ID.0
+            ),
+            [],
+        )
+        .context("Failed to create index keyparameter_user_secure_id_index.")?;
+        Ok(())
+    }
+
     fn init_tables(tx: &Transaction) -> Result<()> {
         tx.execute(
             "CREATE TABLE IF NOT EXISTS persistent.keyentry (
@@ -996,6 +1152,8 @@ impl KeystoreDB {
         )
         .context("Failed to create index keyparameter_keyentryid_index.")?;
 
+        Self::create_keyparameter_user_secure_id_index(tx)?;
+
         tx.execute(
             "CREATE TABLE IF NOT EXISTS persistent.keymetadata (
                      keyentryid INTEGER,
@@ -1023,6 +1181,21 @@ impl KeystoreDB {
         )
         .context("Failed to initialize \"grant\" table.")?;
 
+        Self::create_grant_keyentryid_index(tx)?;
+
+        Ok(())
+    }
+
+    // Creates an index for the grant table. Grants are deleted by key entry id whenever a key
+    // is unbound and looked up by key entry id and grantee when granting or when accessing a key
+    // by KEY_ID. Lookups by grant id are already served by the UNIQUE constraint on `id`.
+    fn create_grant_keyentryid_index(tx: &Transaction) -> Result<()> {
+        tx.execute(
+            "CREATE INDEX IF NOT EXISTS persistent.grant_keyentryid_index
+            ON grant(keyentryid, grantee);",
+            [],
+        )
+        .context("Failed to create index grant_keyentryid_index.")?;
         Ok(())
     }
 
@@ -1046,7 +1219,7 @@ impl KeystoreDB {
         Ok(persistent_path_str)
     }
 
-    fn make_connection(persistent_file: &str) -> Result<Connection> {
+    fn make_connection(persistent_file: &str, commit_queue: &CommitQueue) -> Result<Connection> {
         let conn =
             Connection::open_in_memory().context("Failed to initialize SQLite connection.")?;
 
@@ -1056,7 +1229,7 @@ impl KeystoreDB {
                 .context("Failed to attach database persistent.")
             {
                 if Self::is_locked_error(&e) {
-                    std::thread::sleep(DB_BUSY_RETRY_INTERVAL);
+                    Self::wait_while_busy(commit_queue, false);
                     continue;
                 } else {
                     return Err(e);
@@ -1170,6 +1343,75 @@ impl KeystoreDB {
         }
     }
 
+    /// Takes an exact snapshot of the storage statistics of all storage types in
+    /// `STORAGE_STAT_TYPES`. This walks every page of the database and should only be called
+    /// on demand or from a low priority background task. Storage types whose statistics
+    /// cannot be read are logged and left out, so they do not affect the others.
+    pub fn sample_storage_stats(&mut self) -> StorageStatsSnapshot {
+        let _wp = wd::watch("KeystoreDB::sample_storage_stats");
+
+        let stats: Vec<StorageStats> = Self::STORAGE_STAT_TYPES
+            .iter()
+            .filter_map(|storage_type| match self.get_storage_stat(*storage_type) {
+                Ok(stat) => Some(stat),
+                Err(e) => {
+                    log::error!("Error getting storage stat {storage_type:?}: {e:?}");
+                    None
+                }
+            })
+            .collect();
+        let used_size = stats
+            .iter()
+            .find(|s| s.storage_type == MetricsStorage::DATABASE)
+            .map(|s| s.size as i64 - s.unused_size as i64);
+        StorageStatsSnapshot { used_size, stats }
+    }
+
+    /// Estimates the storage statistics of all storage types in `snapshot` without scanning
+    /// the database. The size of the database as a whole is read from the database header,
+    /// which is cheap. The size of each table and index is extrapolated from `snapshot`
+    /// under the assumption that it grew or shrank proportionally to the used size of the
+    /// database since the snapshot was taken. If either used size is unknown, the sampled
+    /// values are reported as they are. Each storage type gets its own result, so that one
+    /// failure does not hide the others.
+    pub fn estimate_storage_stats(
+        &mut self,
+        snapshot: &StorageStatsSnapshot,
+    ) -> Vec<Result<StorageStats>> {
+        let _wp = wd::watch("KeystoreDB::estimate_storage_stats");
+
+        let total = self.get_total_size().context(ks_err!());
+        let scale_factor = match (&total, snapshot.used_size) {
+            (Ok(total), Some(sampled)) if sampled > 0 => {
+                Some((total.size as i64 - total.unused_size as i64, sampled))
+            }
+            _ => None,
+        };
+        let scale = |v: i32| -> i32 {
+            match scale_factor {
+                Some((used_size, sampled)) => {
+                    (v as i64 * used_size / sampled).clamp(0, i32::MAX as i64) as i32
+                }
+                None => v,
+            }
+        };
+
+        let mut total = Some(total);
+        snapshot
+            .stats
+            .iter()
+            .map(|s| match s.storage_type {
+                MetricsStorage::DATABASE => total.take().context(ks_err!("Duplicate entry."))?,
+                MetricsStorage::AUTH_TOKEN => self.get_storage_stat(MetricsStorage::AUTH_TOKEN),
+                storage_type => Ok(StorageStats {
+                    storage_type,
+                    size: scale(s.size),
+                    unused_size: scale(s.unused_size),
+                }),
+            })
+            .collect()
+    }
+
     /// This function is intended to be used by the garbage collector.
     /// It deletes the blobs given by `blob_ids_to_delete`. It then tries to find up to `max_blobs`
     /// superseded key blobs that might need special handling by the garbage collector.
@@ -1370,38 +1612,83 @@ impl KeystoreDB {
     ) -> Result<Option<(KeyIdGuard, KeyEntry)>> {
         let _wp = wd::watch("KeystoreDB::load_super_key");
 
-        self.with_transaction(Immediate("TX_load_super_key"), |tx| {
-            let key_descriptor = KeyDescriptor {
-                domain: Domain::APP,
-                nspace: user_id as i64,
-                alias: Some(key_type.alias.into()),
-                blob: None,
-            };
-            let id = Self::load_key_entry_id(tx, &key_descriptor, KeyType::Super);
-            match id {
-                Ok(id) => {
-                    let key_entry = Self::load_key_components(tx, KeyEntryLoadBits::KM, id)
-                        .context(ks_err!("Failed to load key entry."))?;
-                    Ok(Some((KEY_ID_LOCK.get(id), key_entry)))
+        enum SuperKeyLookup {
+            NotFound,
+            /// The key id lock of the super key with this id is held by someone else.
+            Locked(i64),
+            /// The key id guard is None if the caller already held the key id lock.
+            Loaded(Option<KeyIdGuard>, KeyEntry),
+        }
+
+        // The transaction must not block on the key id lock, see `CommitQueue`. If the lock is
+        // taken, it is waited for after the transaction and the transaction is repeated.
+        let mut locked: Option<KeyIdGuard> = None;
+        loop {
+            let locked_id = locked.as_ref().map(KeyIdGuard::id);
+            let lookup = self
+                .with_transaction(Immediate("TX_load_super_key"), |tx| {
+                    let key_descriptor = KeyDescriptor {
+                        domain: Domain::APP,
+                        nspace: user_id as i64,
+                        alias: Some(key_type.alias.into()),
+                        blob: None,
+                    };
+                    let id = Self::load_key_entry_id(tx, &key_descriptor, KeyType::Super);
+                    match id {
+                        Ok(id) => {
+                            let key_id_guard = if locked_id == Some(id) {
+                                None
+                            } else {
+                                match KEY_ID_LOCK.try_get(id) {
+                                    Some(key_id_guard) => Some(key_id_guard),
+                                    None => return Ok(SuperKeyLookup::Locked(id)).no_gc(),
+                                }
+                            };
+                            let key_entry = Self::load_key_components(tx, KeyEntryLoadBits::KM, id)
+                                .context(ks_err!("Failed to load key entry."))?;
+                            Ok(SuperKeyLookup::Loaded(key_id_guard, key_entry))
+                        }
+                        Err(error) => match error.root_cause().downcast_ref::<KsError>() {
+                            Some(KsError::Rc(ResponseCode::KEY_NOT_FOUND)) => {
+                                Ok(SuperKeyLookup::NotFound)
+                            }
+                            _ => Err(error).context(ks_err!()),
+                        },
+                    }
+                    .no_gc()
+                })
+                .context(ks_err!())?;
+            match lookup {
+                SuperKeyLookup::NotFound => return Ok(None),
+                SuperKeyLookup::Loaded(Some(key_id_guard), key_entry) => {
+                    return Ok(Some((key_id_guard, key_entry)))
+                }
+                SuperKeyLookup::Loaded(None, key_entry) => {
+                    return Ok(locked.map(|key_id_guard| (key_id_guard, key_entry)))
+                }
+                SuperKeyLookup::Locked(id) => {
+                    // Release the lock of a super key that has been replaced in the meantime
+                    // before blocking on the lock of its replacement.
+                    drop(locked.take());
+                    locked = Some(KEY_ID_LOCK.get(id));
                 }
-                Err(error) => match error.root_cause().downcast_ref::<KsError>() {
-                    Some(KsError::Rc(ResponseCode::KEY_NOT_FOUND)) => Ok(None),
-                    _ => Err(error).context(ks_err!()),
-                },
             }
-            .no_gc()
-        })
-        .context(ks_err!())
+        }
     }
 
     /// Creates a transaction with the given behavior and executes f with the new transaction.
     /// The transaction is committed only if f returns Ok and retried if DatabaseBusy
     /// or DatabaseLocked is encountered.
+    /// IMMEDIATE transactions wait for their turn in the `CommitQueue` first, so that they
+    /// do not contend with the other writers of this process. See `CommitQueue` for the
+    /// restrictions this puts on f.
     fn with_transaction<T, F>(&mut self, behavior: TransactionBehavior, f: F) -> Result<T>
     where
         F: Fn(&Transaction) -> Result<(bool, T)>,
     {
         let name = behavior.name();
+        let commit_queue = self.commit_queue.clone();
+        let _queue_guard = name.map(|_| commit_queue.enter());
         loop {
             let result = self
                 .conn
@@ -1419,7 +1706,7 @@ impl KeystoreDB {
                 Ok(result) => break Ok(result),
                 Err(e) => {
                     if Self::is_locked_error(&e) {
-                        std::thread::sleep(DB_BUSY_RETRY_INTERVAL);
+                        Self::wait_while_busy(&commit_queue, _queue_guard.is_some());
                         continue;
                     } else {
                         return Err(e).context(ks_err!());
@@ -1437,6 +1724,17 @@ impl KeystoreDB {
         })
     }
 
+    /// Waits before an operation that failed with DatabaseBusy or DatabaseLocked is retried.
+    /// Within this process only the writer at the head of the `commit_queue` can hold the
+    /// database lock, so a reader waits for that writer to finish. A writer that is itself at
+    /// the head of the queue, or a reader when there is no writer, can only be blocked by a
+    /// transient lock such as a WAL checkpoint and falls back to the retry interval.
+    fn wait_while_busy(commit_queue: &CommitQueue, is_queued_writer: bool) {
+        if is_queued_writer || !commit_queue.wait_for_writer() {
+            std::thread::sleep(DB_BUSY_RETRY_INTERVAL);
+        }
+    }
+
     fn is_locked_error(e: &anyhow::Error) -> bool {
         matches!(
             e.root_cause().downcast_ref::<rusqlite::ffi::Error>(),
@@ -1459,6 +1757,8 @@ impl KeystoreDB {
                     .context(ks_err!("Domain {:?} must be either App or SELinux.", domain));
             }
         }
+        // The id was just picked at random and inserted, so no one else holds its key id lock
+        // and this does not block while holding the turn in the `CommitQueue`.
         Ok(KEY_ID_LOCK.get(
             Self::insert_with_retry(|id| {
                 tx.execute(
@@ -1723,6 +2023,87 @@ impl KeystoreDB {
         .context(ks_err!())
     }
 
+    /// Moves all live client keys of the namespace given by `source` to the namespace given by
+    /// `destination`, keeping their aliases, in a single transaction. The aliases of the
+    /// descriptors are ignored. Namespaces of `Domain::APP` descriptors are replaced with
+    /// `caller_uid`. `check_permission` is called once with the resolved source and destination
+    /// descriptors before any key is touched. If any alias of the source namespace is already
+    /// occupied in the destination namespace, no key is moved and this function fails with
+    /// `ResponseCode::INVALID_ARGUMENT`. Returns the number of keys that were moved.
+    pub fn migrate_namespace(
+        &mut self,
+        source: &KeyDescriptor,
+        destination: &KeyDescriptor,
+        caller_uid: u32,
+        check_permission: impl Fn(&KeyDescriptor, &KeyDescriptor) -> Result<()>,
+    ) -> Result<usize> {
+        let _wp = wd::watch("KeystoreDB::migrate_namespace");
+
+        let resolve = |key: &KeyDescriptor| match key.domain {
+            Domain::APP => {
+                Ok(KeyDescriptor { nspace: caller_uid as i64, alias: None, ..(*key).clone() })
+            }
+            Domain::SELINUX => Ok(KeyDescriptor { alias: None, ..(*key).clone() }),
+            domain => Err(KsError::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(format!("Domain {:?} must be either APP or SELINUX.", domain)),
+        };
+        let source = resolve(source).context(ks_err!("Invalid source."))?;
+        let destination = resolve(destination).context(ks_err!("Invalid destination."))?;
+
+        // Security critical: Must return immediately on failure. Do not remove the '?';
+        check_permission(&source, &destination).context(ks_err!("Trying to check permission."))?;
+
+        if source.domain == destination.domain && source.nspace == destination.nspace {
+            return Err(KsError::Rc(ResponseCode::INVALID_ARGUMENT))
+                .context(ks_err!("Source and destination are the same namespace."));
+        }
+
+        self.with_transaction(Immediate("TX_migrate_namespace"), |tx| {
+            // If any alias of the source namespace is taken in the destination, the migration
+            // request fails. Both lookups are served by keyentry_domain_namespace_index.
+            let conflicts: usize = tx
+                .query_row(
+                    "SELECT COUNT(*) FROM persistent.keyentry AS src
+                     WHERE src.domain = ? AND src.namespace = ? AND src.alias IS NOT NULL
+                     AND src.state = ? AND src.key_type = ?
+                     AND EXISTS (SELECT 1 FROM persistent.keyentry AS dst
+                                 WHERE dst.domain = ? AND dst.namespace = ?
+                                 AND dst.alias = src.alias);",
+                    params![
+                        source.domain.0,
+                        source.nspace,
+                        KeyLifeCycle::Live,
+                        KeyType::Client,
+                        destination.domain.0,
+                        destination.nspace
+                    ],
+                    |row| row.get(0),
+                )
+                .context("Failed to query destination.")?;
+            if conflicts != 0 {
+                return Err(KsError::Rc(ResponseCode::INVALID_ARGUMENT))
+                    .context(format!("{} aliases already exist in the destination.", conflicts));
+            }
+
+            tx.execute(
+                "UPDATE persistent.keyentry SET domain = ?, namespace = ?
+                 WHERE domain = ? AND namespace = ? AND alias IS NOT NULL
+                 AND state = ? AND key_type = ?;",
+                params![
+                    destination.domain.0,
+                    destination.nspace,
+                    source.domain.0,
+                    source.nspace,
+                    KeyLifeCycle::Live,
+                    KeyType::Client
+                ],
+            )
+            .context("Failed to update key entries.")
+            .no_gc()
+        })
+        .context(ks_err!())
+    }
+
     /// Store a new key in a single transaction.
     /// The function creates a new key entry, populates the blob, key parameter, and metadata
     /// fields, and rebinds the given alias to the new key.
@@ -2160,7 +2541,7 @@ impl KeystoreDB {
                 Ok(result) => break Ok(result),
                 Err(e) => {
                     if Self::is_locked_error(&e) {
-                        std::thread::sleep(DB_BUSY_RETRY_INTERVAL);
+                        Self::wait_while_busy(&self.commit_queue, false);
                         continue;
                     } else {
                         return Err(e).context(ks_err!());
@@ -2807,61 +3188,43 @@ impl KeystoreDB {
     ) -> Result<Vec<i64>> {
         let _wp = wd::watch("KeystoreDB::get_app_uids_affected_by_sid");
 
-        let ids = self.with_transaction(Immediate("TX_get_app_uids_affected_by_sid"), |tx| {
+        // The tag is spelled out as a literal so that the query planner can match the query
+        // against the partial index keyparameter_user_secure_id_index.
+        self.with_transaction(TransactionBehavior::Deferred, |tx| {
             let mut stmt = tx
                 .prepare(&format!(
-                    "SELECT id, namespace from persistent.keyentry
-                     WHERE key_type = ?
-                     AND domain = ?
-                     AND cast ( (namespace/{AID_USER_OFFSET}) as int) = ?
-                     AND state = ?;",
+                    "SELECT DISTINCT keyentry.namespace FROM persistent.keyparameter
+                     INNER JOIN persistent.keyentry ON keyentry.id = keyparameter.keyentryid
+                     WHERE keyparameter.tag = {}
+                     AND keyparameter.data = ?
+                     AND keyentry.key_type = ?
+                     AND keyentry.domain = ?
+                     AND cast ( (keyentry.namespace/{AID_USER_OFFSET}) as int) = ?
+                     AND keyentry.state = ?;",
+                    Tag::USER_SECURE_ID.0
                 ))
                 .context(concat!(
                     "In get_app_uids_affected_by_sid, ",
-                    "failed to prepare the query to find the keys created by apps."
+                    "failed to prepare the query to find the apps with keys bound to the sid."
                 ))?;
 
             let mut rows = stmt
-                .query(params![KeyType::Client, Domain::APP.0 as u32, user_id, KeyLifeCycle::Live,])
-                .context(ks_err!("Failed to query the keys created by apps."))?;
+                .query(params![
+                    secure_user_id,
+                    KeyType::Client,
+                    Domain::APP.0 as u32,
+                    user_id,
+                    KeyLifeCycle::Live,
+                ])
+                .context(ks_err!("Failed to query the apps with keys bound to the sid."))?;
 
-            let mut key_ids_and_app_uids: HashMap<i64, i64> = Default::default();
+            let mut app_uids_affected_by_sid: Vec<i64> = Vec::new();
             db_utils::with_rows_extract_all(&mut rows, |row| {
-                key_ids_and_app_uids.insert(
-                    row.get(0).context("Failed to read key id of a key created by an app.")?,
-                    row.get(1).context("Failed to read the app uid")?,
-                );
+                app_uids_affected_by_sid.push(row.get(0).context("Failed to read the app uid")?);
                 Ok(())
             })?;
-            Ok(key_ids_and_app_uids).no_gc()
-        })?;
-        let mut app_uids_affected_by_sid: HashSet<i64> = Default::default();
-        for (key_id, app_uid) in ids {
-            // Read the key parameters for each key in its own transaction. It is OK to ignore
-            // an error to get the properties of a particular key since it might have been deleted
-            // under our feet after the previous transaction concluded. If the key was deleted
-            // then it is no longer applicable if it was auth-bound or not.
-            if let Ok(is_key_bound_to_sid) =
-                self.with_transaction(Immediate("TX_get_app_uids_affects_by_sid 2"), |tx| {
-                    let params = Self::load_key_parameters(key_id, tx)
-                        .context("Failed to load key parameters.")?;
-                    // Check if the key is bound to this secure user ID.
-                    let is_key_bound_to_sid = params.iter().any(|kp| {
-                        matches!(
-                            kp.key_parameter_value(),
-                            KeyParameterValue::UserSecureID(sid) if *sid == secure_user_id
-                        )
-                    });
-                    Ok(is_key_bound_to_sid).no_gc()
-                })
-            {
-                if is_key_bound_to_sid {
-                    app_uids_affected_by_sid.insert(app_uid);
-                }
-            }
-        }
-
-        let app_uids_vec: Vec<i64> = app_uids_affected_by_sid.into_iter().collect();
-        Ok(app_uids_vec)
+            Ok(app_uids_affected_by_sid).no_gc()
+        })
+        .context(ks_err!())
     }
 }
@@ -46,9 +46,12 @@ pub fn new_test_db() -> Result<KeystoreDB> {
 }
 
 fn new_test_db_at(path: &str) -> Result<KeystoreDB> {
-    let conn = KeystoreDB::make_connection(path)?;
+    // Every test database has a single connection, so it gets a commit queue of its own.
+    let commit_queue = Arc::new(CommitQueue::new());
+    let conn = KeystoreDB::make_connection(path, &commit_queue)?;
 
-    let mut db = KeystoreDB { conn, gc: None, perboot: Arc::new(perboot::PerbootDB::new()) };
+    let mut db =
+        KeystoreDB { conn, gc: None, perboot: Arc::new(perboot::PerbootDB::new()), commit_queue };
     db.with_transaction(Immediate("TX_new_test_db"), |tx| {
         KeystoreDB::init_tables(tx).context("Failed to initialize tables.").no_gc()
     })?;
@@ -1075,6 +1078,153 @@ fn test_migrate_key_destination_occupied() -> Result<()> {
     Ok(())
 }
 
+// Creates keys in two namespaces, migrates one namespace and checks that all of its keys, and
+// only those, moved along with their aliases.
+#[test]
+fn test_migrate_namespace_app_to_selinux() -> Result<()> {
+    let mut db = new_test_db()?;
+    const SOURCE_UID: u32 = 1u32;
+    const OTHER_UID: u32 = 3u32;
+    const DESTINATION_NAMESPACE: i64 = 1000i64;
+    static ALIASES: [&str; 3] = ["ALIAS_1", "ALIAS_2", "ALIAS_3"];
+    let key_ids = ALIASES
+        .iter()
+        .map(|alias| {
+            make_test_key_entry(&mut db, Domain::APP, SOURCE_UID as i64, alias, None)
+                .map(|guard| guard.id())
+        })
+        .collect::<Result<Vec<_>>>()?;
+    make_test_key_entry(&mut db, Domain::APP, OTHER_UID as i64, ALIASES[0], None)?;
+
+    let source = KeyDescriptor { domain: Domain::APP, nspace: -1, alias: None, blob: None };
+    let destination = KeyDescriptor {
+        domain: Domain::SELINUX,
+        nspace: DESTINATION_NAMESPACE,
+        alias: None,
+        blob: None,
+    };
+
+    let checks = RefCell::new(0);
+    let migrated = db.migrate_namespace(&source, &destination, SOURCE_UID, |src, dst| {
+        *checks.borrow_mut() += 1;
+        assert_eq!((Domain::APP, SOURCE_UID as i64), (src.domain, src.nspace));
+        assert_eq!((Domain::SELINUX, DESTINATION_NAMESPACE), (dst.domain, dst.nspace));
+        Ok(())
+    })?;
+    assert_eq!(migrated, ALIASES.len());
+    assert_eq!(*checks.borrow(), 1);
+
+    for (alias, key_id) in ALIASES.iter().zip(key_ids) {
+        let (_, key_entry) = db.load_key_entry(
+            &KeyDescriptor { alias: Some(alias.to_string()), ..destination.clone() },
+            KeyType::Client,
+            KeyEntryLoadBits::BOTH,
+            SOURCE_UID,
+            |_k, _av| Ok(()),
+        )?;
+        assert_eq!(key_entry, make_test_key_entry_test_vector(key_id, None));
+        assert!(!db.key_exists(Domain::APP, SOURCE_UID as i64, alias, KeyType::Client)?);
+    }
+    assert!(db.key_exists(Domain::APP, OTHER_UID as i64, ALIASES[0], KeyType::Client)?);
+
+    Ok(())
+}
+
+// Tries to migrate a namespace to one that already holds one of its aliases, which is expected
+// to fail without moving any of the keys.
+#[test]
+fn test_migrate_namespace_destination_occupied() -> Result<()> {
+    let mut db = new_test_db()?;
+    const SOURCE_UID: u32 = 1u32;
+    const DESTINATION_NAMESPACE: i64 = 1000i64;
+    make_test_key_entry(&mut db, Domain::APP, SOURCE_UID as i64, "FREE", None)?;
+    make_test_key_entry(&mut db, Domain::APP, SOURCE_UID as i64, "TAKEN", None)?;
+    make_test_key_entry(&mut db, Domain::SELINUX, DESTINATION_NAMESPACE, "TAKEN", None)?;
+
+    let source = KeyDescriptor { domain: Domain::APP, nspace: -1, alias: None, blob: None };
+    let destination = KeyDescriptor {
+        domain: Domain::SELINUX,
+        nspace: DESTINATION_NAMESPACE,
+        alias: None,
+        blob: None,
+    };
+
+    assert_eq!(
+        Some(&KsError::Rc(ResponseCode::INVALID_ARGUMENT)),
+        db.migrate_namespace(&source, &destination, SOURCE_UID, |_src, _dst| Ok(()))
+            .unwrap_err()
+            .root_cause()
+            .downcast_ref::<KsError>()
+    );
+    assert!(db.key_exists(Domain::APP, SOURCE_UID as i64, "FREE", KeyType::Client)?);
+    assert!(!db.key_exists(Domain::SELINUX, DESTINATION_NAMESPACE, "FREE", KeyType::Client)?);
+
+    // The permission check comes first and is fatal.
+    let deny = |_src: &KeyDescriptor, _dst: &KeyDescriptor| -> Result<()> {
+        Err(KsError::Rc(ResponseCode::PERMISSION_DENIED)).context("Denied.")
+    };
+    assert_eq!(
+        Some(&KsError::Rc(ResponseCode::PERMISSION_DENIED)),
+        db.migrate_namespace(&source, &destination, SOURCE_UID, deny)
+            .unwrap_err()
+            .root_cause()
+            .downcast_ref::<KsError>()
+    );
+
+    Ok(())
+}
+
+// Compares migrating a namespace of 10k keys key by key with migrating it in bulk.
+#[test]
+fn test_migrate_namespace_with_many_keys() -> Result<()> {
+    const KEY_COUNT: usize = 10_000;
+    const SOURCE_UID: u32 = 10001;
+    const DESTINATION_NAMESPACE: i64 = 1000i64;
+    let destination = KeyDescriptor {
+        domain: Domain::SELINUX,
+        nspace: DESTINATION_NAMESPACE,
+        alias: None,
+        blob: None,
+    };
+
+    let mut db = new_test_db()?;
+    db_populate_keys(&mut db, 0, KEY_COUNT);
+    let start = Instant::now();
+    for i in 0..KEY_COUNT {
+        let alias = Some(format!("alias-{i}"));
+        let source =
+            KeyDescriptor { domain: Domain::APP, nspace: -1, alias: alias.clone(), blob: None };
+        let (key_id_guard, _) = db.load_key_entry(
+            &source,
+            KeyType::Client,
+            KeyEntryLoadBits::NONE,
+            SOURCE_UID,
+            |_k, _av| Ok(()),
+        )?;
+        db.migrate_key_namespace(
+            key_id_guard,
+            &KeyDescriptor { alias, ..destination.clone() },
+            SOURCE_UID,
+            |_k| Ok(()),
+        )?;
+    }
+    let per_key = start.elapsed();
+    assert_eq!(db_key_count(&mut db), 0);
+
+    let mut db = new_test_db()?;
+    db_populate_keys(&mut db, 0, KEY_COUNT);
+    let start = Instant::now();
+    let source = KeyDescriptor { domain: Domain::APP, nspace: -1, alias: None, blob: None };
+    let migrated = db.migrate_namespace(&source, &destination, SOURCE_UID, |_src, _dst| Ok(()))?;
+    let bulk = start.elapsed();
+    assert_eq!(migrated, KEY_COUNT);
+    assert_eq!(db_key_count(&mut db), 0);
+
+    println!("\nNumber_of_keys,per_key_time_in_s,bulk_time_in_s");
+    println!("{KEY_COUNT}, {}, {}", per_key.as_secs_f64(), bulk.as_secs_f64());
+    Ok(())
+}
+
 #[test]
 fn test_upgrade_0_to_1() {
     const ALIAS1: &str = "test_upgrade_0_to_1_1";
@@ -1326,6 +1476,133 @@ fn test_database_busy_error_code() {
     )
 }
 
+// Runs a mixed read/write workload on many threads, each with its own connection to the same
+// database, and reports the latency percentiles of reads and writes.
+#[test]
+fn test_mixed_workload_contention() -> Result<()> {
+    const THREAD_COUNT: u32 = 16;
+    const OPS_PER_THREAD: u32 = 100;
+    // One in WRITE_RATIO operations creates and deletes a key, the others load one.
+    const WRITE_RATIO: u32 = 4;
+    const UID: u32 = 33;
+    static READ_ALIAS: &str = "contention_test_read_key";
+
+    let temp_dir = Arc::new(TempDir::new("test_mixed_workload_contention_")?);
+    let mut db = KeystoreDB::new(temp_dir.path(), None)?;
+    make_test_key_entry(&mut db, Domain::APP, UID as i64, READ_ALIAS, None)?;
+
+    let handles: Vec<_> = (0..THREAD_COUNT)
+        .map(|thread_id| {
+            let temp_dir = temp_dir.clone();
+            thread::spawn(move || -> Result<(Vec<Duration>, Vec<Duration>)> {
+                let mut db = KeystoreDB::new(temp_dir.path(), None)?;
+                let (mut reads, mut writes) = (vec![], vec![]);
+                for op in 0..OPS_PER_THREAD {
+                    let start = Instant::now();
+                    if op % WRITE_RATIO == 0 {
+                        let alias = format!("contention_test_{thread_id}_{op}");
+                        make_test_key_entry(&mut db, Domain::APP, UID as i64, &alias, None)?;
+                        let key = KeyDescriptor {
+                            domain: Domain::APP,
+                            nspace: -1,
+                            alias: Some(alias),
+                            blob: None,
+                        };
+                        db.unbind_key(&key, KeyType::Client, UID, |_, _| Ok(()))?;
+                        writes.push(start.elapsed());
+                    } else {
+                        let key = KeyDescriptor {
+                            domain: Domain::APP,
+                            nspace: -1,
+                            alias: Some(READ_ALIAS.to_string()),
+                            blob: None,
+                        };
+                        db.load_key_entry(
+                            &key,
+                            KeyType::Client,
+                            KeyEntryLoadBits::NONE,
+                            UID,
+                            |_k, _av| Ok(()),
+                        )?;
+                        reads.push(start.elapsed());
+                    }
+                }
+                Ok((reads, writes))
+            })
+        })
+        .collect();
+
+    let (mut reads, mut writes) = (vec![], vec![]);
+    for handle in handles {
+        let (r, w) = handle.join().expect("Worker thread panicked.")?;
+        reads.extend(r);
+        writes.extend(w);
+    }
+
+    let percentile = |latencies: &mut Vec<Duration>, p: usize| {
+        latencies.sort();
+        latencies[(latencies.len() - 1) * p / 100].as_secs_f64()
+    };
+    println!("\nop,count,p50_in_s,p99_in_s");
+    for (name, latencies) in [("read", &mut reads), ("write", &mut writes)] {
+        println!(
+            "{name}, {}, {}, {}",
+            latencies.len(),
+            percentile(latencies, 50),
+            percentile(latencies, 99)
+        );
+    }
+    Ok(())
+}
+
+#[test]
+fn test_commit_queue_is_per_database() -> Result<()> {
+    let temp_dir_1 = TempDir::new("test_commit_queue_is_per_database_1_")?;
+    let temp_dir_2 = TempDir::new("test_commit_queue_is_per_database_2_")?;
+    let db_1a = KeystoreDB::new(temp_dir_1.path(), None)?;
+    let db_1b = KeystoreDB::new(temp_dir_1.path(), None)?;
+    let mut db_2 = KeystoreDB::new(temp_dir_2.path(), None)?;
+
+    assert!(Arc::ptr_eq(&db_1a.commit_queue, &db_1b.commit_queue));
+    assert!(!Arc::ptr_eq(&db_1a.commit_queue, &db_2.commit_queue));
+
+    // A writer to one database does not hold up writers to another.
+    let _turn = db_1a.commit_queue.enter();
+    make_test_key_entry(&mut db_2, Domain::APP, 1, "commit_queue_test", None)?;
+    Ok(())
+}
+
+#[test]
+fn test_load_super_key_waits_for_key_id_lock_outside_commit_queue() -> Result<()> {
+    let temp_dir = Arc::new(TempDir::new("test_load_super_key_key_id_lock_")?);
+    let mut db = KeystoreDB::new(temp_dir.path(), None)?;
+    let key_type = SuperKeyType {
+        alias: "test_super_key",
+        algorithm: SuperEncryptionAlgorithm::Aes256Gcm,
+        name: "test_super_key",
+    };
+    let key_id = db
+        .store_super_key(1, &key_type, b"super key", &BlobMetaData::new(), &KeyMetaData::new())?
+        .id();
+
+    // Holding the key id lock, as a loader of the super key would, blocks load_super_key.
+    let key_id_guard = KEY_ID_LOCK.get(key_id);
+    let loader = {
+        let temp_dir = temp_dir.clone();
+        thread::spawn(move || -> Result<bool> {
+            let mut db = KeystoreDB::new(temp_dir.path(), None)?;
+            Ok(db.load_super_key(&key_type, 1)?.is_some())
+        })
+    };
+    thread::sleep(Duration::from_millis(100));
+
+    // Writing while holding the key id lock must not wait for the blocked loader.
+    make_test_key_entry(&mut db, Domain::APP, 1, "written_while_loading", None)?;
+    drop(key_id_guard);
+    assert!(loader.join().expect("Loader thread panicked.")?);
+    Ok(())
+}
+
 #[cfg(disabled)]
 #[test]
 fn test_large_number_of_concurrent_db_manipulations() -> Result<()> {
@@ -2606,6 +2883,144 @@ fn test_get_list_app_uids_with_multiple_sids() -> Result<()> {
     Ok(())
 }
 
+#[test]
+fn test_get_list_app_uids_for_sid_after_upgrade() -> Result<()> {
+    let uid: i32 = 1;
+    let uid_offset: i64 = (uid as i64) * (AID_USER_OFFSET as i64);
+    let sid = 667;
+    let first_app_id: i64 = 123 + uid_offset;
+    let second_app_id: i64 = 456 + uid_offset;
+    let mut db = new_test_db()?;
+
+    // Simulate a database at version 1, which does not have the secure user ID index yet.
+    db.conn.execute("DROP INDEX persistent.keyparameter_user_secure_id_index;", [])?;
+    make_test_key_entry_with_sids(&mut db, Domain::APP, first_app_id, TEST_ALIAS, None, &[sid])?;
+    make_test_key_entry_with_sids(&mut db, Domain::APP, second_app_id, TEST_ALIAS, None, &[42])?;
+
+    db.with_transaction(Immediate("TX_test_upgrade"), |tx| KeystoreDB::from_1_to_2(tx).no_gc())?;
+    let index_count: i64 = db.conn.query_row(
+        "SELECT COUNT(*) FROM persistent.sqlite_master
+         WHERE type = 'index' AND name = 'keyparameter_user_secure_id_index';",
+        [],
+        |row| row.get(0),
+    )?;
+    assert_eq!(index_count, 1);
+
+    assert_eq!(db.get_app_uids_affected_by_sid(uid, sid)?, vec![first_app_id]);
+
+    // Keys that are no longer live must not be reported.
+    let key_id =
+        make_test_key_entry_with_sids(&mut db, Domain::APP, second_app_id, "alias2", None, &[sid])?;
+    let mut apps = db.get_app_uids_affected_by_sid(uid, sid)?;
+    apps.sort();
+    assert_eq!(apps, vec![first_app_id, second_app_id]);
+    db.with_transaction(Immediate("TX_test_unreferenced"), |tx| {
+        KeystoreDB::mark_unreferenced(tx, key_id.id()).no_gc()
+    })?;
+    assert_eq!(db.get_app_uids_affected_by_sid(uid, sid)?, vec![first_app_id]);
+    Ok(())
+}
+
+#[test]
+fn test_upgrade_2_to_3() -> Result<()> {
+    let mut db = new_test_db()?;
+
+    // Simulate a database at version 2, which does not have the grant index yet.
+    db.conn.execute("DROP INDEX persistent.grant_keyentryid_index;", [])?;
+    assert!(!grant_delete_uses_index(&mut db)?);
+
+    db.with_transaction(Immediate("TX_test_upgrade"), |tx| KeystoreDB::from_2_to_3(tx).no_gc())?;
+    assert!(grant_delete_uses_index(&mut db)?);
+    Ok(())
+}
+
+// Returns true if deleting the grants of a key is served by grant_keyentryid_index.
+fn grant_delete_uses_index(db: &mut KeystoreDB) -> Result<bool> {
+    let mut stmt =
+        db.conn.prepare("EXPLAIN QUERY PLAN DELETE FROM persistent.grant WHERE keyentryid = 1;")?;
+    let details =
+        stmt.query_map([], |row| row.get::<_, String>(3))?.collect::<Result<Vec<_>, _>>()?;
+    Ok(details.iter().any(|detail| detail.contains("grant_keyentryid_index")))
+}
+
+// Adds `grant_count` grants of unrelated keys to the grant table.
+fn db_populate_grants(db: &mut KeystoreDB, grant_count: i64) {
+    db.with_transaction(Immediate("test_grant"), |tx| {
+        for id in 0..grant_count {
+            tx.execute(
+                "INSERT INTO persistent.grant (id, grantee, keyentryid, access_vector)
+                 VALUES (?, ?, ?, ?);",
+                params![id, 10000 + id % 1000, 1_000_000 + id / 10, 0],
+            )?;
+        }
+        Ok(()).no_gc()
+    })
+    .unwrap();
+}
+
+// Measures grant, load by grant, and key unbind latency against a grant table of 100k
+// entries, with and without the grant index.
+#[test]
+fn test_grant_ops_with_many_grants() -> Result<()> {
+    const GRANT_COUNT: i64 = 100_000;
+    const ROUNDS: u32 = 100;
+    const OWNER: i64 = 1;
+    const GRANTEE: u32 = 2;
+
+    println!("\nindexed,grant_time_in_s,load_by_grant_time_in_s,delete_time_in_s");
+    for indexed in [true, false] {
+        let mut db = new_test_db()?;
+        if !indexed {
+            db.conn.execute("DROP INDEX persistent.grant_keyentryid_index;", [])?;
+        }
+        db_populate_grants(&mut db, GRANT_COUNT);
+
+        let (mut grant_time, mut load_time, mut delete_time) =
+            (Duration::ZERO, Duration::ZERO, Duration::ZERO);
+        for round in 0..ROUNDS {
+            let alias = format!("alias-{round}");
+            let key_id = make_test_key_entry(&mut db, Domain::APP, OWNER, &alias, None)?.id();
+            let key = KeyDescriptor {
+                domain: Domain::APP,
+                nspace: OWNER,
+                alias: Some(alias),
+                blob: None,
+            };
+
+            let start = Instant::now();
+            let granted =
+                db.grant(&key, OWNER as u32, GRANTEE, key_perm_set![KeyPerm::Use], |_k, _av| {
+                    Ok(())
+                })?;
+            grant_time += start.elapsed();
+
+            let start = Instant::now();
+            db.load_key_entry(
+                &granted,
+                KeyType::Client,
+                KeyEntryLoadBits::NONE,
+                GRANTEE,
+                |_k, _av| Ok(()),
+            )?;
+            load_time += start.elapsed();
+
+            let start = Instant::now();
+            db.with_transaction(Immediate("TX_test_unbind"), |tx| {
+                KeystoreDB::mark_unreferenced(tx, key_id).no_gc()
+            })?;
+            delete_time += start.elapsed();
+        }
+        assert_eq!(grant_delete_uses_index(&mut db)?, indexed);
+        println!(
+            "{indexed}, {}, {}, {}",
+            grant_time.as_secs_f64() / ROUNDS as f64,
+            load_time.as_secs_f64() / ROUNDS as f64,
+            delete_time.as_secs_f64() / ROUNDS as f64
+        );
+    }
+    Ok(())
+}
+
 // Starting from `next_keyid`, add keys to the database until the count reaches
 // `key_count`.  (`next_keyid` is assumed to indicate how many rows already exist.)
 fn db_populate_keys(db: &mut KeystoreDB, next_keyid: usize, key_count: usize) {
@@ -2721,6 +3136,44 @@ fn test_get_storage_stats_with_many_keys() -> Result<()> {
     })
 }
 
+#[test]
+fn test_storage_stats_estimate_error_bound() -> Result<()> {
+    // Estimates must be within 25% or 16KiB of the exact value, whichever is larger. The
+    // absolute slack accounts for tables that did not grow along with the database and
+    // occupy only a handful of pages.
+    const MAX_RELATIVE_ERROR: f64 = 0.25;
+    const MAX_ABSOLUTE_ERROR: i64 = 16 * 1024;
+
+    let db_root = tempfile::Builder::new().prefix("ks2db-test-").tempdir().unwrap();
+    let mut db_path = db_root.path().to_owned();
+    db_path.push("ks2-test.sqlite");
+    let mut db = new_test_db_at(&db_path.to_string_lossy())?;
+
+    db_populate_keys(&mut db, 0, 10_000);
+    let snapshot = db.sample_storage_stats();
+    assert_eq!(snapshot.stats().len(), KeystoreDB::STORAGE_STAT_TYPES.len());
+
+    for key_count in [20_000, 40_000] {
+        db_populate_keys(&mut db, db_key_count(&mut db), key_count);
+        let estimates =
+            db.estimate_storage_stats(&snapshot).into_iter().collect::<Result<Vec<_>>>()?;
+        let exact = db.sample_storage_stats();
+        for (estimate, exact) in estimates.iter().zip(exact.stats()) {
+            assert_eq!(estimate.storage_type, exact.storage_type);
+            let error = (estimate.size as i64 - exact.size as i64).abs();
+            let bound = MAX_ABSOLUTE_ERROR.max((exact.size as f64 * MAX_RELATIVE_ERROR) as i64);
+            assert!(
+                error <= bound,
+                "{:?} with {key_count} keys: estimate {} exact {}",
+                exact.storage_type,
+                estimate.size,
+                exact.size
+            );
+        }
+    }
+    Ok(())
+}
+
 #[test]
 fn test_list_keys_with_many_keys() -> Result<()> {
     run_with_many_keys(1_000_000, |db: &mut KeystoreDB| -> Result<()> {
@@ -2753,3 +3206,114 @@ fn test_list_keys_with_many_keys() -> Result<()> {
         }
     })
 }
+
+// The per-key scan that `get_app_uids_affected_by_sid` used before the secure user ID index was
+// introduced. Kept here as a baseline for the benchmark below.
+fn get_app_uids_affected_by_sid_by_scan(
+    db: &mut KeystoreDB,
+    user_id: i32,
+    secure_user_id: i64,
+) -> Result<Vec<i64>> {
+    let ids = db.with_transaction(Immediate("TX_get_app_uids_affected_by_sid_by_scan"), |tx| {
+        let mut stmt = tx.prepare(&format!(
+            "SELECT id, namespace from persistent.keyentry
+             WHERE key_type = ?
+             AND domain = ?
+             AND cast ( (namespace/{AID_USER_OFFSET}) as int) = ?
+             AND state = ?;",
+        ))?;
+        let ids = stmt
+            .query_map(
+                params![KeyType::Client, Domain::APP.0 as u32, user_id, KeyLifeCycle::Live],
+                |row| Ok((row.get::<_, i64>(0)?, row.get::<_, i64>(1)?)),
+            )?
+            .collect::<rusqlite::Result<Vec<(i64, i64)>>>()?;
+        Ok(ids).no_gc()
+    })?;
+    let mut app_uids: HashSet<i64> = Default::default();
+    for (key_id, app_uid) in ids {
+        let is_key_bound_to_sid =
+            db.with_transaction(Immediate("TX_get_app_uids_affected_by_sid_by_scan 2"), |tx| {
+                let params = KeystoreDB::load_key_parameters(key_id, tx)?;
+                Ok(params.iter().any(|kp| {
+                    matches!(
+                        kp.key_parameter_value(),
+                        KeyParameterValue::UserSecureID(sid) if *sid == secure_user_id
+                    )
+                }))
+                .no_gc()
+            })?;
+        if is_key_bound_to_sid {
+            app_uids.insert(app_uid);
+        }
+    }
+    Ok(app_uids.into_iter().collect())
+}
+
+#[test]
+fn test_get_app_uids_affected_by_sid_with_many_keys() -> Result<()> {
+    const KEY_COUNT: i64 = 20_000;
+    const APP_COUNT: i64 = 100;
+    let user_id: i32 = 10;
+    let uid_offset: i64 = (user_id as i64) * (AID_USER_OFFSET as i64);
+    let affected_sid: i64 = 667;
+
+    // Put the test database on disk for a more realistic result.
+    let db_root = tempfile::Builder::new().prefix("ks2db-test-").tempdir().unwrap();
+    let mut db_path = db_root.path().to_owned();
+    db_path.push("ks2-test.sqlite");
+    let mut db = new_test_db_at(&db_path.to_string_lossy())?;
+
+    // Every tenth app has one key bound to `affected_sid`, all other keys are bound to
+    // unrelated secure user IDs.
+    db.with_transaction(Immediate("TX_populate_sid_keys"), |tx| {
+        for key_id in 0..KEY_COUNT {
+            let app_id = 10000 + uid_offset + key_id % APP_COUNT;
+            tx.execute(
+                "INSERT into persistent.keyentry
+                        (id, key_type, domain, namespace, alias, state, km_uuid)
+                        VALUES(?, ?, ?, ?, ?, ?, ?);",
+                params![
+                    key_id,
+                    KeyType::Client,
+                    Domain::APP.0 as u32,
+                    app_id,
+                    &format!("alias-{key_id}"),
+                    KeyLifeCycle::Live,
+                    KEYSTORE_UUID,
+                ],
+            )?;
+            // Unrelated keys get sids above `affected_sid`, so that none of them collides with it.
+            let sid = if key_id < APP_COUNT && key_id % 10 == 0 {
+                affected_sid
+            } else {
+                affected_sid + 1 + key_id
+            };
+            for p in make_test_params_with_sids(None, &[sid]) {
+                tx.execute(
+                    "INSERT into persistent.keyparameter (keyentryid, tag, data, security_level)
+                     VALUES (?, ?, ?, ?);",
+                    params![key_id, p.get_tag().0, p.key_parameter_value(), p.security_level().0],
+                )?;
+            }
+        }
+        Ok(()).no_gc()
+    })?;
+
+    let start = std::time::Instant::now();
+    let mut expected = get_app_uids_affected_by_sid_by_scan(&mut db, user_id, affected_sid)?;
+    let scan_time = start.elapsed();
+
+    let start = std::time::Instant::now();
+    let mut actual = db.get_app_uids_affected_by_sid(user_id, affected_sid)?;
+    let indexed_time = start.elapsed();
+
+    expected.sort();
+    actual.sort();
+    assert_eq!(actual.len(), (APP_COUNT / 10) as usize);
+    assert_eq!(actual, expected);
+
+    println!("\nNumber_of_keys,scan_time_in_s,indexed_time_in_s");
+    println!("{KEY_COUNT}, {}, {}", scan_time.as_secs_f64(), indexed_time.as_secs_f64());
+    Ok(())
+}
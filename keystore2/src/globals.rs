@@ -359,6 +359,19 @@ pub fn get_keymint_device(
     }
 }
 
+/// Makes `dev` the KeyMint device of `security_level` in place of the device's HAL, for tests
+/// that run the service in-process. Replaces the device set by an earlier call.
+#[cfg(test)]
+pub fn set_keymint_device(
+    security_level: SecurityLevel,
+    dev: Strong<dyn IKeyMintDevice>,
+) -> Result<()> {
+    let hw_info = map_km_error(dev.getHardwareInfo())
+        .context(ks_err!("Trying to get hardware info of {:?}.", security_level))?;
+    KEY_MINT_DEVICES.lock().unwrap().insert(security_level, dev, hw_info);
+    Ok(())
+}
+
 /// Get a keymint device for the given uuid. This will only access the cache, but will not
 /// attempt to establish a new connection. It is assumed that the cache is already populated
 /// when this is called. This is a fair assumption, because service.rs iterates through all
@@ -0,0 +1,503 @@
+// Copyright 2024, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Pre-generation of keys whose generation is slow, such as large RSA keys or StrongBox keys.
+//!
+//! A device can configure a few key parameter templates in `CONFIG_PATH`. For each of them, a
+//! `KeyPool` generates a small number of keys in the background, while no other key generation
+//! is in flight on the same KeyMint device. If the parameters of a `generateKey` call equal a
+//! template exactly, the call takes one of these keys and binds it to the caller's alias instead
+//! of waiting for KeyMint. Any difference in the parameters, including their order, means the
+//! call generates a new key as usual.
+//!
+//! Pooled keys are generated before the caller is known. So templates must not ask for
+//! attestation or anything else that depends on the caller, and a pooled key is discarded when
+//! it is older than the configured maximum age, which bounds how far its `CREATION_DATETIME`
+//! lags behind the time it is handed out. The age is measured in boot time, so time the device
+//! spends suspended counts, and the configured maximum age may be at most a day.
+
+use crate::async_task::AsyncTask;
+use crate::database::BootTime;
+use crate::error::{Error, ResponseCode};
+use crate::key_parameter::KeyParameterValue as KsKeyParamValue;
+use crate::ks_err;
+use crate::utils::is_device_id_attestation_tag;
+use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
+    KeyCreationResult::KeyCreationResult, KeyParameter::KeyParameter, SecurityLevel::SecurityLevel,
+    Tag::Tag,
+};
+use anyhow::{Context, Result};
+use serde::Deserialize;
+use std::collections::VecDeque;
+use std::fs::File;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Arc, LazyLock, Mutex};
+use std::thread;
+use std::time::Duration;
+
+/// The file that configures the templates. There is no pool if it does not exist.
+pub const CONFIG_PATH: &str = "/system/etc/keystore2/key_pregeneration.cbor";
+
+/// The most keys a pool keeps for one template.
+const MAX_KEYS_PER_TEMPLATE: usize = 4;
+
+/// The shortest maximum age of pooled keys a configuration may set. Shorter ones would keep the
+/// pool regenerating keys.
+const MIN_MAX_AGE: Duration = Duration::from_secs(60);
+
+/// The longest maximum age of pooled keys a configuration may set, which bounds how far the
+/// `CREATION_DATETIME` of a pooled key may lag behind.
+const MAX_MAX_AGE: Duration = Duration::from_secs(24 * 60 * 60);
+
+/// How often a waiting refill checks whether KeyMint has become idle.
+const IDLE_POLL_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Tags that depend on the caller or on the time of the request, or, for rollback resistance,
+/// that make discarding a stale pooled key use up KeyMint's storage.
+const EXCLUDED_TAGS: &[Tag] = &[
+    Tag::ATTESTATION_CHALLENGE,
+    Tag::ATTESTATION_APPLICATION_ID,
+    Tag::INCLUDE_UNIQUE_ID,
+    Tag::RESET_SINCE_ID_ROTATION,
+    Tag::CREATION_DATETIME,
+    Tag::ROLLBACK_RESISTANCE,
+];
+
+/// The contents of `CONFIG_PATH`, encoded as CBOR.
+#[derive(Debug, Deserialize)]
+pub struct Config {
+    /// Pooled keys older than this are discarded.
+    pub max_age_secs: u64,
+    /// The templates to pre-generate keys for.
+    pub templates: Vec<TemplateConfig>,
+}
+
+/// One template of `Config`.
+#[derive(Debug, Deserialize)]
+pub struct TemplateConfig {
+    /// The security level of the KeyMint device that generates the keys.
+    pub security_level: i32,
+    /// The number of keys to keep ready, at most `MAX_KEYS_PER_TEMPLATE`.
+    pub count: usize,
+    /// The parameters a `generateKey` call must pass to get one of the keys.
+    pub params: Vec<KsKeyParamValue>,
+}
+
+static CONFIG: LazyLock<Option<Config>> = LazyLock::new(|| match Config::load(CONFIG_PATH) {
+    Ok(config) => config,
+    Err(e) => {
+        log::error!("Key pre-generation disabled: {:?}", e);
+        None
+    }
+});
+
+impl Config {
+    /// Reads the configuration from `path`, or returns None if it does not exist.
+    pub fn load(path: &str) -> Result<Option<Self>> {
+        let file = match File::open(path) {
+            Ok(file) => file,
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => return Err(e).context(ks_err!("Failed to open {path}.")),
+        };
+        serde_cbor::from_reader(file).map(Some).context(ks_err!("Failed to parse {path}."))
+    }
+
+    /// Returns the maximum age of pooled keys, or an error if it is outside of `MIN_MAX_AGE`
+    /// and `MAX_MAX_AGE`.
+    fn max_age(&self) -> Result<Duration> {
+        let max_age = Duration::from_secs(self.max_age_secs);
+        if !(MIN_MAX_AGE..=MAX_MAX_AGE).contains(&max_age) {
+            return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT)).context(ks_err!(
+                "max_age_secs must be between {} and {}, not {}.",
+                MIN_MAX_AGE.as_secs(),
+                MAX_MAX_AGE.as_secs(),
+                self.max_age_secs
+            ));
+        }
+        Ok(max_age)
+    }
+
+    /// Returns the templates of the given security level and their key counts.
+    fn templates_for(&self, security_level: SecurityLevel) -> Vec<(Vec<KeyParameter>, usize)> {
+        self.templates
+            .iter()
+            .filter(|t| t.security_level == security_level.0)
+            .map(|t| (t.params.iter().cloned().map(Into::into).collect(), t.count))
+            .collect()
+    }
+}
+
+/// Generates a key with the parameters of a template, adding the parameters `generateKey` adds.
+pub type Generator = Box<dyn Fn(&[KeyParameter]) -> Result<KeyCreationResult> + Send + Sync>;
+
+/// Returns the pool for the configured templates of `security_level`, or None if there are
+/// none. The pool starts filling in the background right away.
+pub fn pool_for(security_level: SecurityLevel, generator: Generator) -> Option<Arc<KeyPool>> {
+    let templates = CONFIG.as_ref()?.templates_for(security_level);
+    if templates.is_empty() {
+        return None;
+    }
+    let max_age = match CONFIG.as_ref()?.max_age() {
+        Ok(max_age) => max_age,
+        Err(e) => {
+            log::error!("Key pre-generation disabled: {:?}", e);
+            return None;
+        }
+    };
+    match KeyPool::new(templates, max_age, generator) {
+        Ok(pool) => {
+            pool.schedule_refill();
+            Some(pool)
+        }
+        Err(e) => {
+            log::error!("Key pre-generation disabled for {:?}: {:?}", security_level, e);
+            None
+        }
+    }
+}
+
+struct Template {
+    params: Vec<KeyParameter>,
+    count: usize,
+}
+
+struct PooledKey {
+    /// Boot time rather than an `Instant`, so that time spent in suspend counts towards the age.
+    generated: BootTime,
+    creation_result: KeyCreationResult,
+}
+
+impl PooledKey {
+    fn is_older_than(&self, max_age: Duration, now: BootTime) -> bool {
+        now.checked_sub(&self.generated)
+            .map_or(true, |age| age.milliseconds() as u128 > max_age.as_millis())
+    }
+}
+
+/// Keys generated ahead of time for a fixed set of parameter templates.
+pub struct KeyPool {
+    templates: Vec<Template>,
+    max_age: Duration,
+    generator: Generator,
+    /// The ready keys of each template, oldest first.
+    keys: Mutex<Vec<VecDeque<PooledKey>>>,
+    refill_task: AsyncTask,
+    refill_queued: AtomicBool,
+    /// The number of key generations in flight outside of the pool.
+    foreground_generations: Arc<AtomicUsize>,
+}
+
+/// Marks a key generation outside of the pool as in flight until it is dropped.
+pub struct ForegroundGeneration(Arc<AtomicUsize>);
+
+impl Drop for ForegroundGeneration {
+    fn drop(&mut self) {
+        self.0.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+impl KeyPool {
+    /// Creates an empty pool that keeps `count` keys of each template `params`, generated by
+    /// `generator`. Fails if a template is not eligible for pre-generation.
+    pub fn new(
+        templates: Vec<(Vec<KeyParameter>, usize)>,
+        max_age: Duration,
+        generator: Generator,
+    ) -> Result<Arc<Self>> {
+        for (params, count) in &templates {
+            if let Some(kp) = params
+                .iter()
+                .find(|kp| EXCLUDED_TAGS.contains(&kp.tag) || is_device_id_attestation_tag(kp.tag))
+            {
+                return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                    .context(ks_err!("Tag {:?} is not allowed in templates.", kp.tag));
+            }
+            if *count > MAX_KEYS_PER_TEMPLATE {
+                return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT)).context(ks_err!(
+                    "At most {MAX_KEYS_PER_TEMPLATE} keys per template, not {count}."
+                ));
+            }
+        }
+        Ok(Arc::new(Self {
+            keys: Mutex::new(templates.iter().map(|_| VecDeque::new()).collect()),
+            templates: templates
+                .into_iter()
+                .map(|(params, count)| Template { params, count })
+                .collect(),
+            max_age,
+            generator,
+            refill_task: Default::default(),
+            refill_queued: AtomicBool::new(false),
+            foreground_generations: Default::default(),
+        }))
+    }
+
+    /// Takes a pooled key if `params` equal one of the templates, element by element.
+    pub fn take(self: &Arc<Self>, params: &[KeyParameter]) -> Option<KeyCreationResult> {
+        let index = self.templates.iter().position(|t| t.params == params)?;
+        let key = {
+            let mut keys = self.keys.lock().unwrap();
+            let keys = &mut keys[index];
+            self.discard_stale(keys);
+            keys.pop_front()
+        };
+        self.schedule_refill();
+        key.map(|key| key.creation_result)
+    }
+
+    /// Marks a key generation outside of the pool as in flight, so that the pool does not
+    /// compete with it for KeyMint.
+    pub fn foreground_generation(&self) -> ForegroundGeneration {
+        self.foreground_generations.fetch_add(1, Ordering::Relaxed);
+        ForegroundGeneration(self.foreground_generations.clone())
+    }
+
+    /// Returns the number of ready keys of each template.
+    pub fn ready_keys(&self) -> Vec<usize> {
+        self.keys.lock().unwrap().iter().map(|keys| keys.len()).collect()
+    }
+
+    fn discard_stale(&self, keys: &mut VecDeque<PooledKey>) {
+        let now = BootTime::now();
+        while keys.front().is_some_and(|key| key.is_older_than(self.max_age, now)) {
+            keys.pop_front();
+        }
+    }
+
+    /// Returns the index of a template that has fewer keys than it should.
+    fn next_template_to_fill(&self) -> Option<usize> {
+        let mut keys = self.keys.lock().unwrap();
+        keys.iter_mut().enumerate().find_map(|(index, keys)| {
+            self.discard_stale(keys);
+            (keys.len() < self.templates[index].count).then_some(index)
+        })
+    }
+
+    /// Queues a refill on the pool's own worker thread, unless one is queued already.
+    pub fn schedule_refill(self: &Arc<Self>) {
+        if self.refill_queued.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        let pool = self.clone();
+        self.refill_task.queue_lo(move |_| pool.refill());
+    }
+
+    /// Generates keys one at a time until every template has its count, waiting for KeyMint
+    /// to be idle before each one.
+    fn refill(&self) {
+        loop {
+            let Some(index) = self.next_template_to_fill() else {
+                self.refill_queued.store(false, Ordering::Release);
+                // A key may have been taken after the check. If so, and no refill got queued
+                // for it, continue here.
+                if self.next_template_to_fill().is_some()
+                    && !self.refill_queued.swap(true, Ordering::AcqRel)
+                {
+                    continue;
+                }
+                return;
+            };
+            while self.foreground_generations.load(Ordering::Relaxed) > 0 {
+                thread::sleep(IDLE_POLL_INTERVAL);
+            }
+            let generated = BootTime::now();
+            match (self.generator)(&self.templates[index].params) {
+                Ok(creation_result) => {
+                    self.keys.lock().unwrap()[index]
+                        .push_back(PooledKey { generated, creation_result });
+                }
+                Err(e) => {
+                    // Do not retry right away. The next key taken from the pool schedules
+                    // another refill.
+                    log::error!("Failed to pre-generate a key: {:?}", e);
+                    self.refill_queued.store(false, Ordering::Release);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
+        Algorithm::Algorithm, Digest::Digest, KeyParameterValue::KeyParameterValue,
+        KeyPurpose::KeyPurpose, PaddingMode::PaddingMode,
+    };
+    use std::sync::atomic::AtomicI64;
+    use std::time::Instant;
+
+    fn param(tag: Tag, value: KeyParameterValue) -> KeyParameter {
+        KeyParameter { tag, value }
+    }
+
+    fn rsa_4096_template() -> Vec<KeyParameter> {
+        vec![
+            param(Tag::ALGORITHM, KeyParameterValue::Algorithm(Algorithm::RSA)),
+            param(Tag::KEY_SIZE, KeyParameterValue::Integer(4096)),
+            param(Tag::RSA_PUBLIC_EXPONENT, KeyParameterValue::LongInteger(65537)),
+            param(Tag::PURPOSE, KeyParameterValue::KeyPurpose(KeyPurpose::SIGN)),
+            param(Tag::DIGEST, KeyParameterValue::Digest(Digest::SHA_2_256)),
+            param(Tag::PADDING, KeyParameterValue::PaddingMode(PaddingMode::RSA_PSS)),
+            param(Tag::NO_AUTH_REQUIRED, KeyParameterValue::BoolValue(true)),
+        ]
+    }
+
+    /// A generator whose key blobs are a serial number, so tests can tell keys apart.
+    fn counting_generator(latency: Duration) -> (Generator, Arc<AtomicI64>) {
+        let generated = Arc::new(AtomicI64::new(0));
+        let counter = generated.clone();
+        let generator: Generator = Box::new(move |_params| {
+            thread::sleep(latency);
+            let serial = counter.fetch_add(1, Ordering::SeqCst);
+            Ok(KeyCreationResult { keyBlob: serial.to_le_bytes().to_vec(), ..Default::default() })
+        });
+        (generator, generated)
+    }
+
+    fn wait_until_full(pool: &KeyPool, expected: &[usize]) {
+        let deadline = Instant::now() + Duration::from_secs(10);
+        while pool.ready_keys() != expected {
+            assert!(Instant::now() < deadline, "Pool did not fill: {:?}", pool.ready_keys());
+            thread::sleep(Duration::from_millis(5));
+        }
+    }
+
+    #[test]
+    fn takes_key_for_identical_parameters() {
+        let (generator, _) = counting_generator(Duration::ZERO);
+        let pool = KeyPool::new(vec![(rsa_4096_template(), 2)], Duration::from_secs(60), generator)
+            .unwrap();
+        pool.schedule_refill();
+        wait_until_full(&pool, &[2]);
+
+        let first = pool.take(&rsa_4096_template()).unwrap();
+        let second = pool.take(&rsa_4096_template()).unwrap();
+        assert_ne!(first.keyBlob, second.keyBlob);
+        // Taking keys refills the pool.
+        wait_until_full(&pool, &[2]);
+    }
+
+    #[test]
+    fn never_takes_key_for_different_parameters() {
+        let (generator, _) = counting_generator(Duration::ZERO);
+        let pool = KeyPool::new(vec![(rsa_4096_template(), 1)], Duration::from_secs(60), generator)
+            .unwrap();
+        pool.schedule_refill();
+        wait_until_full(&pool, &[1]);
+
+        let template = rsa_4096_template();
+        let mut different_value = template.clone();
+        different_value[1] = param(Tag::KEY_SIZE, KeyParameterValue::Integer(3072));
+        let mut extra = template.clone();
+        extra.push(param(Tag::PURPOSE, KeyParameterValue::KeyPurpose(KeyPurpose::VERIFY)));
+        let mut challenge = template.clone();
+        challenge.push(param(Tag::ATTESTATION_CHALLENGE, KeyParameterValue::Blob(vec![1])));
+        let mut reordered = template.clone();
+        reordered.swap(3, 4);
+
+        for params in [
+            different_value,
+            extra,
+            challenge,
+            reordered,
+            template[..template.len() - 1].to_vec(),
+            vec![],
+        ] {
+            assert!(pool.take(&params).is_none(), "Took a key for {params:?}");
+        }
+        assert_eq!(pool.ready_keys(), [1]);
+        assert!(pool.take(&template).is_some());
+    }
+
+    #[test]
+    fn rejects_ineligible_templates() {
+        for tag in EXCLUDED_TAGS.iter().chain(&[Tag::DEVICE_UNIQUE_ATTESTATION]) {
+            let mut template = rsa_4096_template();
+            template.push(param(*tag, KeyParameterValue::BoolValue(true)));
+            let (generator, _) = counting_generator(Duration::ZERO);
+            assert!(KeyPool::new(vec![(template, 1)], Duration::from_secs(60), generator).is_err());
+        }
+        let (generator, _) = counting_generator(Duration::ZERO);
+        assert!(KeyPool::new(
+            vec![(rsa_4096_template(), MAX_KEYS_PER_TEMPLATE + 1)],
+            Duration::from_secs(60),
+            generator
+        )
+        .is_err());
+    }
+
+    #[test]
+    fn discards_stale_keys() {
+        const MAX_AGE: Duration = Duration::from_millis(200);
+        let (generator, _) = counting_generator(Duration::ZERO);
+        let pool = KeyPool::new(vec![(rsa_4096_template(), 1)], MAX_AGE, generator).unwrap();
+        pool.schedule_refill();
+        wait_until_full(&pool, &[1]);
+        thread::sleep(MAX_AGE * 2);
+        assert!(pool.take(&rsa_4096_template()).is_none());
+    }
+
+    #[test]
+    fn bounds_max_age() {
+        let config = |max_age_secs| Config { max_age_secs, templates: vec![] };
+        assert!(config(0).max_age().is_err());
+        assert!(config(MIN_MAX_AGE.as_secs() - 1).max_age().is_err());
+        assert_eq!(config(MIN_MAX_AGE.as_secs()).max_age().unwrap(), MIN_MAX_AGE);
+        assert_eq!(config(MAX_MAX_AGE.as_secs()).max_age().unwrap(), MAX_MAX_AGE);
+        assert!(config(MAX_MAX_AGE.as_secs() + 1).max_age().is_err());
+        assert!(config(u64::MAX).max_age().is_err());
+    }
+
+    #[test]
+    fn waits_for_foreground_generations() {
+        let (generator, generated) = counting_generator(Duration::ZERO);
+        let pool = KeyPool::new(vec![(rsa_4096_template(), 1)], Duration::from_secs(60), generator)
+            .unwrap();
+        let foreground = pool.foreground_generation();
+        pool.schedule_refill();
+        thread::sleep(IDLE_POLL_INTERVAL * 3);
+        assert_eq!(generated.load(Ordering::SeqCst), 0);
+        drop(foreground);
+        wait_until_full(&pool, &[1]);
+    }
+
+    #[test]
+    fn concurrent_takes_get_distinct_keys() {
+        const THREADS: usize = 8;
+        // Slow enough that the takes are over before the refill generates another key.
+        let (generator, _) = counting_generator(Duration::from_millis(100));
+        let pool = KeyPool::new(
+            vec![(rsa_4096_template(), MAX_KEYS_PER_TEMPLATE)],
+            Duration::from_secs(60),
+            generator,
+        )
+        .unwrap();
+        pool.schedule_refill();
+        wait_until_full(&pool, &[MAX_KEYS_PER_TEMPLATE]);
+
+        let taken: Vec<_> = thread::scope(|s| {
+            let workers: Vec<_> = (0..THREADS)
+                .map(|_| s.spawn(|| pool.take(&rsa_4096_template()).map(|r| r.keyBlob)))
+                .collect();
+            workers.into_iter().filter_map(|w| w.join().unwrap()).collect()
+        });
+        assert!(taken.len() >= MAX_KEYS_PER_TEMPLATE);
+        let mut distinct = taken.clone();
+        distinct.sort();
+        distinct.dedup();
+        assert_eq!(distinct.len(), taken.len());
+    }
+}
@@ -14,6 +14,7 @@
 
 //! This crate implements the Keystore 2.0 service entry point.
 
+use keystore2::bulk_operation::BulkOperation;
 use keystore2::entropy;
 use keystore2::globals::ENFORCEMENTS;
 use keystore2::maintenance::Maintenance;
@@ -33,6 +34,7 @@ static AUTHORIZATION_SERVICE_NAME: &str = "android.security.authorization";
 static METRICS_SERVICE_NAME: &str = "android.security.metrics";
 static USER_MANAGER_SERVICE_NAME: &str = "android.security.maintenance";
 static LEGACY_KEYSTORE_SERVICE_NAME: &str = "android.security.legacykeystore";
+static BULK_OPERATION_SERVICE_NAME: &str = "android.security.bulkoperation";
 
 /// Keystore 2.0 takes one argument which is a path indicating its designated working directory.
 fn main() {
@@ -142,6 +144,24 @@ fn main() {
         panic!("Failed to register service {} because of {:?}.", METRICS_SERVICE_NAME, e);
     });
 
+    // The bulk operation service is optional. Until the sepolicy of a device declares it,
+    // servicemanager refuses to register it, and Keystore carries on without it.
+    match BulkOperation::new_native_binder() {
+        Ok(bulk_operation_service) => {
+            if let Err(e) =
+                binder::add_service(BULK_OPERATION_SERVICE_NAME, bulk_operation_service.as_binder())
+            {
+                error!(
+                    "Failed to register service {} because of {:?}.",
+                    BULK_OPERATION_SERVICE_NAME, e
+                );
+            }
+        }
+        Err(e) => {
+            error!("Failed to create service {} because of {:?}.", BULK_OPERATION_SERVICE_NAME, e)
+        }
+    }
+
     binder::add_service(LEGACY_KEYSTORE_SERVICE_NAME, legacykeystore.as_binder()).unwrap_or_else(
         |e| {
             panic!(
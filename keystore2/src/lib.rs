@@ -19,6 +19,7 @@ pub mod apc;
 pub mod async_task;
 pub mod authorization;
 pub mod boot_level_keys;
+pub mod bulk_operation;
 pub mod database;
 pub mod ec_crypto;
 pub mod enforcements;
@@ -45,9 +46,14 @@ pub mod utils;
 mod attestation_key_utils;
 mod audit_log;
 mod gc;
+mod key_pregeneration;
 mod km_compat;
+#[cfg(test)]
+mod perf_harness;
 mod super_key;
 mod sw_keyblob;
+#[cfg(test)]
+mod test_keymint;
 mod watchdog_helper;
 
 use message_macro::source_location_msg as ks_err;
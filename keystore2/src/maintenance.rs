@@ -56,6 +56,12 @@ pub trait DeleteListener {
     fn delete_user(&self, user_id: u32) -> Result<()>;
 }
 
+/// The security levels that maintenance broadcasts such as `earlyBootEnded` are sent to.
+const SECURITY_LEVELS: [(SecurityLevel, &str); 2] = [
+    (SecurityLevel::TRUSTED_ENVIRONMENT, "TRUSTED_ENVIRONMENT"),
+    (SecurityLevel::STRONGBOX, "STRONGBOX"),
+];
+
 /// This struct is defined to implement the aforementioned AIDL interface.
 pub struct Maintenance {
     delete_listener: Box<dyn DeleteListener + Send + Sync + 'static>,
@@ -78,7 +84,8 @@ impl Maintenance {
         check_keystore_permission(KeystorePerm::ChangeUser).context(ks_err!())?;
 
         DB.with(|db| {
-            SUPER_KEY.write().unwrap().remove_user(
+            SuperKeyManager::remove_user(
+                &SUPER_KEY,
                 &mut db.borrow_mut(),
                 &LEGACY_IMPORTER,
                 user_id as u32,
@@ -99,9 +106,9 @@ impl Maintenance {
         // Permission check. Must return on error. Do not touch the '?'.
         check_keystore_permission(KeystorePerm::ChangeUser).context(ks_err!())?;
 
-        let mut skm = SUPER_KEY.write().unwrap();
         DB.with(|db| {
-            skm.initialize_user(
+            SuperKeyManager::initialize_user(
+                &SUPER_KEY,
                 &mut db.borrow_mut(),
                 &LEGACY_IMPORTER,
                 user_id as u32,
@@ -139,13 +146,15 @@ impl Maintenance {
             .context(ks_err!("While invoking the delete listener."))
     }
 
-    fn call_with_watchdog<F>(sec_level: SecurityLevel, name: &'static str, op: &F) -> Result<()>
+    fn call_with_watchdog<F>(
+        sec_level: SecurityLevel,
+        name: &'static str,
+        km_dev: &dyn IKeyMintDevice,
+        op: &F,
+    ) -> Result<()>
     where
-        F: Fn(Strong<dyn IKeyMintDevice>) -> binder::Result<()>,
+        F: Fn(&dyn IKeyMintDevice) -> binder::Result<()>,
     {
-        let (km_dev, _, _) =
-            get_keymint_device(&sec_level).context(ks_err!("getting keymint device"))?;
-
         let _wp = wd::watch_millis_with("Maintenance::call_with_watchdog", 500, (sec_level, name));
         map_km_error(op(km_dev)).with_context(|| ks_err!("calling {}", name))?;
         Ok(())
@@ -153,38 +162,86 @@ impl Maintenance {
 
     fn call_on_all_security_levels<F>(name: &'static str, op: F) -> Result<()>
     where
-        F: Fn(Strong<dyn IKeyMintDevice>) -> binder::Result<()>,
+        F: Fn(&dyn IKeyMintDevice) -> binder::Result<()>,
     {
-        let sec_levels = [
-            (SecurityLevel::TRUSTED_ENVIRONMENT, "TRUSTED_ENVIRONMENT"),
-            (SecurityLevel::STRONGBOX, "STRONGBOX"),
-        ];
-        sec_levels.iter().try_fold((), |_result, (sec_level, sec_level_string)| {
-            let curr_result = Maintenance::call_with_watchdog(*sec_level, name, &op);
-            match curr_result {
-                Ok(()) => log::info!(
-                    "Call to {} succeeded for security level {}.",
-                    name,
-                    &sec_level_string
-                ),
-                Err(ref e) => {
-                    if *sec_level == SecurityLevel::STRONGBOX
-                        && e.downcast_ref::<Error>()
-                            == Some(&Error::Km(ErrorCode::HARDWARE_TYPE_UNAVAILABLE))
-                    {
-                        log::info!("Call to {} failed for StrongBox as it is not available", name,)
-                    } else {
-                        log::error!(
-                            "Call to {} failed for security level {}: {}.",
-                            name,
-                            &sec_level_string,
-                            e
-                        )
-                    }
+        Maintenance::call_on_security_levels(
+            name,
+            &SECURITY_LEVELS,
+            |sec_level| {
+                let (km_dev, _, _) =
+                    get_keymint_device(&sec_level).context(ks_err!("getting keymint device"))?;
+                Ok(km_dev)
+            },
+            |sec_level, km_dev| Maintenance::call_with_watchdog(sec_level, name, &*km_dev, &op),
+        )
+    }
+
+    /// Invokes `call` for `sec_levels` one after the other and stops at the first one that
+    /// fails, returning its error. The outcome is logged per security level. Getting hold of a
+    /// KeyMint device may mean waiting for its HAL to start, so `connect` runs for all security
+    /// levels concurrently, overlapping with the calls to earlier security levels. A security
+    /// level is only called once all earlier ones have succeeded.
+    fn call_on_security_levels<D, P, C>(
+        name: &'static str,
+        sec_levels: &[(SecurityLevel, &'static str)],
+        connect: P,
+        mut call: C,
+    ) -> Result<()>
+    where
+        D: Send,
+        P: Fn(SecurityLevel) -> Result<D> + Sync,
+        C: FnMut(SecurityLevel, D) -> Result<()>,
+    {
+        std::thread::scope(|s| {
+            let connections: Vec<_> = sec_levels
+                .iter()
+                .map(|(sec_level, _)| {
+                    let connect = &connect;
+                    s.spawn(move || connect(*sec_level))
+                })
+                .collect();
+            sec_levels.iter().zip(connections).try_fold(
+                (),
+                |_result, ((sec_level, sec_level_string), connection)| {
+                    let curr_result = connection
+                        .join()
+                        .unwrap_or_else(|_| {
+                            Err(Error::sys()).context(ks_err!("connecting for {} panicked", name))
+                        })
+                        .and_then(|km_dev| call(*sec_level, km_dev));
+                    Maintenance::log_call_result(name, *sec_level, sec_level_string, &curr_result);
+                    curr_result
+                },
+            )
+        })
+    }
+
+    fn log_call_result(
+        name: &str,
+        sec_level: SecurityLevel,
+        sec_level_string: &str,
+        result: &Result<()>,
+    ) {
+        match result {
+            Ok(()) => {
+                log::info!("Call to {} succeeded for security level {}.", name, &sec_level_string)
+            }
+            Err(e) => {
+                if sec_level == SecurityLevel::STRONGBOX
+                    && e.downcast_ref::<Error>()
+                        == Some(&Error::Km(ErrorCode::HARDWARE_TYPE_UNAVAILABLE))
+                {
+                    log::info!("Call to {} failed for StrongBox as it is not available", name,)
+                } else {
+                    log::error!(
+                        "Call to {} failed for security level {}: {}.",
+                        name,
+                        &sec_level_string,
+                        e
+                    )
                 }
             }
-            curr_result
-        })
+        }
     }
 
     fn early_boot_ended() -> Result<()> {
@@ -247,6 +304,66 @@ impl Maintenance {
         })
     }
 
+    fn migrate_namespace(source: &KeyDescriptor, destination: &KeyDescriptor) -> Result<()> {
+        let calling_uid = ThreadState::get_calling_uid();
+
+        match (source.domain, destination.domain) {
+            (Domain::SELINUX | Domain::APP, Domain::SELINUX | Domain::APP) => (),
+            _ => {
+                return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT)).context(ks_err!(
+                    "Source and destination domain must be one of APP or SELINUX."
+                ));
+            }
+        };
+
+        let user_id = uid_to_android_user(calling_uid);
+
+        let super_key = SUPER_KEY.read().unwrap().get_after_first_unlock_key_by_user_id(user_id);
+
+        DB.with(|db| {
+            // Import all legacy keys of the source namespace first, so that they are moved
+            // along with the others.
+            let source_nspace =
+                if source.domain == Domain::APP { calling_uid as i64 } else { source.nspace };
+            let legacy_keys = LEGACY_IMPORTER
+                .list_uid(source.domain, source_nspace)
+                .context(ks_err!("Trying to list legacy keys."))?;
+            for key in legacy_keys.iter() {
+                LEGACY_IMPORTER
+                    .with_try_import(key, calling_uid, super_key.clone(), || {
+                        let alias = key.alias.as_deref().unwrap_or_default();
+                        if db.borrow_mut().key_exists(
+                            key.domain,
+                            key.nspace,
+                            alias,
+                            KeyType::Client,
+                        )? {
+                            Ok(())
+                        } else {
+                            Err(Error::Rc(ResponseCode::KEY_NOT_FOUND)).context(ks_err!())
+                        }
+                    })
+                    .context(ks_err!("Failed to import legacy key."))?;
+            }
+
+            // The permissions are checked once per namespace. This is equivalent to checking
+            // them for every key, because keys are not addressed by grant here.
+            let migrated = db.borrow_mut().migrate_namespace(
+                source,
+                destination,
+                calling_uid,
+                |src, dst| {
+                    check_key_permission(KeyPerm::Use, src, &None)?;
+                    check_key_permission(KeyPerm::Delete, src, &None)?;
+                    check_key_permission(KeyPerm::Grant, src, &None)?;
+                    check_key_permission(KeyPerm::Rebind, dst, &None)
+                },
+            )?;
+            log::info!("Migrated {} keys.", migrated);
+            Ok(())
+        })
+    }
+
     fn delete_all_keys() -> Result<()> {
         // Security critical permission check. This statement must return on fail.
         check_keystore_permission(KeystorePerm::DeleteAllKeys)
@@ -285,7 +402,7 @@ impl Maintenance {
         writeln!(f)?;
 
         // Display database size information.
-        match crate::metrics_store::pull_storage_stats() {
+        match crate::metrics_store::pull_storage_stats_exact() {
             Ok(atoms) => {
                 writeln!(f, "Database size information (in bytes):")?;
                 for atom in atoms {
@@ -309,6 +426,16 @@ impl Maintenance {
         }
         writeln!(f)?;
 
+        // Display usage of the locked memory that holds key material, but not its contents.
+        let pool_stats = keystore2_crypto::zvec::pool_stats();
+        writeln!(f, "ZVec pool information:")?;
+        writeln!(f, "  Capacity (bytes):         {}", pool_stats.capacity)?;
+        writeln!(f, "  In use (bytes):           {}", pool_stats.in_use)?;
+        writeln!(f, "  Peak in use (bytes):      {}", pool_stats.peak_in_use)?;
+        writeln!(f, "  Pool allocations:         {}", pool_stats.pool_allocations)?;
+        writeln!(f, "  Fallback allocations:     {}", pool_stats.fallback_allocations)?;
+        writeln!(f)?;
+
         // Display accumulated metrics.
         writeln!(f, "Metrics information:")?;
         writeln!(f)?;
@@ -399,6 +526,16 @@ impl IKeystoreMaintenance for Maintenance {
         Self::migrate_key_namespace(source, destination).map_err(into_logged_binder)
     }
 
+    fn migrateNamespace(
+        &self,
+        source: &KeyDescriptor,
+        destination: &KeyDescriptor,
+    ) -> BinderResult<()> {
+        log::info!("migrateNamespace(src={source:?}, dest={destination:?})");
+        let _wp = wd::watch("IKeystoreMaintenance::migrateNamespace");
+        Self::migrate_namespace(source, destination).map_err(into_logged_binder)
+    }
+
     fn deleteAllKeys(&self) -> BinderResult<()> {
         log::warn!("deleteAllKeys() invoked, indicating initial setup or post-factory reset");
         let _wp = wd::watch("IKeystoreMaintenance::deleteAllKeys");
@@ -415,3 +552,128 @@ impl IKeystoreMaintenance for Maintenance {
         Self::get_app_uids_affected_by_sid(user_id, secure_user_id).map_err(into_logged_binder)
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_keymint::{Rendezvous, SoftKeyMint};
+    use std::sync::atomic::Ordering;
+    use std::sync::Arc;
+
+    /// Sends the broadcast `name` to `tee` and `strongbox` and returns the security levels in
+    /// the order in which they were called. Connecting to StrongBox meets `strongbox_connect`,
+    /// if set.
+    fn broadcast<F>(
+        name: &'static str,
+        op: F,
+        tee: &SoftKeyMint,
+        strongbox: &SoftKeyMint,
+        strongbox_connect: Option<Arc<Rendezvous>>,
+    ) -> (Result<()>, Vec<SecurityLevel>)
+    where
+        F: Fn(&dyn IKeyMintDevice) -> binder::Result<()>,
+    {
+        let mut order = Vec::new();
+        let result = Maintenance::call_on_security_levels(
+            name,
+            &SECURITY_LEVELS,
+            |sec_level| {
+                Ok(match sec_level {
+                    SecurityLevel::STRONGBOX => {
+                        if let Some(rendezvous) = &strongbox_connect {
+                            rendezvous.meet();
+                        }
+                        strongbox
+                    }
+                    _ => tee,
+                })
+            },
+            |sec_level, km_dev| {
+                order.push(sec_level);
+                Maintenance::call_with_watchdog(sec_level, name, km_dev, &op)
+            },
+        );
+        (result, order)
+    }
+
+    fn delete_all_keys(
+        tee: &SoftKeyMint,
+        strongbox: &SoftKeyMint,
+        strongbox_connect: Option<Arc<Rendezvous>>,
+    ) -> (Result<()>, Vec<SecurityLevel>) {
+        broadcast("deleteAllKeys", |dev| dev.deleteAllKeys(), tee, strongbox, strongbox_connect)
+    }
+
+    fn early_boot_ended(
+        tee: &SoftKeyMint,
+        strongbox: &SoftKeyMint,
+        strongbox_connect: Option<Arc<Rendezvous>>,
+    ) -> (Result<()>, Vec<SecurityLevel>) {
+        broadcast("earlyBootEnded", |dev| dev.earlyBootEnded(), tee, strongbox, strongbox_connect)
+    }
+
+    /// Returns a KeyMint whose broadcasts fail with `error`, if set.
+    fn keymint(error: Option<ErrorCode>) -> SoftKeyMint {
+        SoftKeyMint { broadcast_error: error, ..Default::default() }
+    }
+
+    #[test]
+    fn test_broadcasts_call_security_levels_in_order() {
+        for broadcast in [delete_all_keys, early_boot_ended] {
+            let tee = keymint(None);
+            let strongbox = keymint(None);
+
+            let (result, order) = broadcast(&tee, &strongbox, None);
+
+            assert!(result.is_ok());
+            assert_eq!(order, vec![SecurityLevel::TRUSTED_ENVIRONMENT, SecurityLevel::STRONGBOX]);
+            assert_eq!(tee.broadcasts.load(Ordering::SeqCst), 1);
+            assert_eq!(strongbox.broadcasts.load(Ordering::SeqCst), 1);
+        }
+    }
+
+    #[test]
+    fn test_broadcasts_stop_at_first_failure() {
+        for broadcast in [delete_all_keys, early_boot_ended] {
+            let tee = keymint(Some(ErrorCode::UNKNOWN_ERROR));
+            let strongbox = keymint(Some(ErrorCode::HARDWARE_TYPE_UNAVAILABLE));
+
+            let (result, order) = broadcast(&tee, &strongbox, None);
+
+            // StrongBox is not called once the TEE failed, and the TEE error is returned.
+            assert_eq!(
+                result.unwrap_err().downcast_ref::<Error>(),
+                Some(&Error::Km(ErrorCode::UNKNOWN_ERROR))
+            );
+            assert_eq!(order, vec![SecurityLevel::TRUSTED_ENVIRONMENT]);
+            assert_eq!(tee.broadcasts.load(Ordering::SeqCst), 1);
+            assert_eq!(strongbox.broadcasts.load(Ordering::SeqCst), 0);
+
+            let tee = keymint(None);
+            let (result, _) = broadcast(&tee, &strongbox, None);
+            assert_eq!(
+                result.unwrap_err().downcast_ref::<Error>(),
+                Some(&Error::Km(ErrorCode::HARDWARE_TYPE_UNAVAILABLE))
+            );
+            assert_eq!(strongbox.broadcasts.load(Ordering::SeqCst), 1);
+        }
+    }
+
+    #[test]
+    fn test_broadcasts_connect_to_strongbox_while_calling_tee() {
+        for broadcast in [delete_all_keys, early_boot_ended] {
+            // The TEE call only returns once StrongBox is being connected to at the same time.
+            let rendezvous = Rendezvous::new(2);
+            let tee = SoftKeyMint {
+                broadcast_rendezvous: Some(rendezvous.clone()),
+                ..Default::default()
+            };
+            let strongbox = keymint(None);
+
+            let (result, _) = broadcast(&tee, &strongbox, Some(rendezvous.clone()));
+
+            assert!(result.is_ok());
+            assert_eq!(rendezvous.calls(), (2, 2));
+        }
+    }
+}
@@ -17,8 +17,9 @@
 //!    stores them in an in-memory store.
 //! 2. Returns the collected metrics when requested by the statsd proxy.
 
+use crate::database::StorageStatsSnapshot;
 use crate::error::anyhow_error_to_serialized_error;
-use crate::globals::DB;
+use crate::globals::{DB, LOGS_HANDLER};
 use crate::key_parameter::KeyParameterValue as KsKeyParamValue;
 use crate::ks_err;
 use crate::operation::Outcome;
@@ -32,6 +33,7 @@ use android_security_metrics::aidl::android::security::metrics::{
     Algorithm::Algorithm as MetricsAlgorithm, AtomID::AtomID, CrashStats::CrashStats,
     EcCurve::EcCurve as MetricsEcCurve,
     HardwareAuthenticatorType::HardwareAuthenticatorType as MetricsHardwareAuthenticatorType,
+    KeyCreationPhase::KeyCreationPhase, KeyCreationPhaseLatency::KeyCreationPhaseLatency,
     KeyCreationWithAuthInfo::KeyCreationWithAuthInfo,
     KeyCreationWithGeneralInfo::KeyCreationWithGeneralInfo,
     KeyCreationWithPurposeAndModesInfo::KeyCreationWithPurposeAndModesInfo,
@@ -42,10 +44,12 @@ use android_security_metrics::aidl::android::security::metrics::{
     Outcome::Outcome as MetricsOutcome, Purpose::Purpose as MetricsPurpose,
     RkpError::RkpError as MetricsRkpError, RkpErrorStats::RkpErrorStats,
     SecurityLevel::SecurityLevel as MetricsSecurityLevel, Storage::Storage as MetricsStorage,
+    StorageStats::StorageStats,
 };
 use anyhow::{anyhow, Context, Result};
 use std::collections::HashMap;
 use std::sync::{LazyLock, Mutex};
+use std::time::{Duration, Instant};
 
 // Note: Crash events are recorded at keystore restarts, based on the assumption that keystore only
 // gets restarted after a crash, during a boot cycle.
@@ -536,37 +540,82 @@ fn compute_purpose_bitmap(purpose_bitmap: &mut i32, purpose: KeyPurpose) {
     }
 }
 
+/// Storage statistics are estimated from a cached exact snapshot, see
+/// `KeystoreDB::estimate_storage_stats`. The snapshot is refreshed in the background by the
+/// first pull that finds it older than this.
+const STORAGE_STATS_SNAPSHOT_MAX_AGE: Duration = Duration::from_secs(12 * 60 * 60);
+
+#[derive(Default)]
+struct StorageStatsCache {
+    snapshot: Option<(Instant, StorageStatsSnapshot)>,
+    refresh_pending: bool,
+}
+
+static STORAGE_STATS_CACHE: LazyLock<Mutex<StorageStatsCache>> = LazyLock::new(Default::default);
+
+/// Schedules an exact storage statistics snapshot on the low priority queue of the logs handler,
+/// unless the cached snapshot is still fresh or a refresh is already pending.
+fn schedule_storage_stats_refresh(cache: &mut StorageStatsCache) {
+    let fresh = cache
+        .snapshot
+        .as_ref()
+        .is_some_and(|(taken, _)| taken.elapsed() < STORAGE_STATS_SNAPSHOT_MAX_AGE);
+    if fresh || cache.refresh_pending {
+        return;
+    }
+    cache.refresh_pending = true;
+    LOGS_HANDLER.queue_lo(|_| {
+        let snapshot = DB.with(|db| db.borrow_mut().sample_storage_stats());
+        let mut cache = STORAGE_STATS_CACHE.lock().unwrap();
+        cache.refresh_pending = false;
+        cache.snapshot = Some((Instant::now(), snapshot));
+    });
+}
+
+fn storage_stats_to_atoms(stats: impl IntoIterator<Item = StorageStats>) -> Vec<KeystoreAtom> {
+    stats
+        .into_iter()
+        .map(|s| KeystoreAtom {
+            payload: KeystoreAtomPayload::StorageStats(s),
+            ..Default::default()
+        })
+        .collect()
+}
+
+/// Returns estimated storage statistics without scanning the database. Until the first snapshot
+/// has been taken, exact statistics are returned instead, which also takes that snapshot.
 pub(crate) fn pull_storage_stats() -> Result<Vec<KeystoreAtom>> {
-    let mut atom_vec: Vec<KeystoreAtom> = Vec::new();
-    let mut append = |stat| {
-        match stat {
-            Ok(s) => atom_vec.push(KeystoreAtom {
-                payload: KeystoreAtomPayload::StorageStats(s),
-                ..Default::default()
-            }),
-            Err(error) => {
-                log::error!("pull_metrics_callback: Error getting storage stat: {}", error)
-            }
-        };
+    let snapshot = {
+        // It is ok to unwrap here since the mutex cannot be poisoned according to the way it is
+        // used in this module.
+        let mut cache = STORAGE_STATS_CACHE.lock().unwrap();
+        let snapshot = cache.snapshot.as_ref().map(|(_, snapshot)| snapshot.clone());
+        if snapshot.is_some() {
+            schedule_storage_stats_refresh(&mut cache);
+        }
+        snapshot
     };
-    DB.with(|db| {
-        let mut db = db.borrow_mut();
-        append(db.get_storage_stat(MetricsStorage::DATABASE));
-        append(db.get_storage_stat(MetricsStorage::KEY_ENTRY));
-        append(db.get_storage_stat(MetricsStorage::KEY_ENTRY_ID_INDEX));
-        append(db.get_storage_stat(MetricsStorage::KEY_ENTRY_DOMAIN_NAMESPACE_INDEX));
-        append(db.get_storage_stat(MetricsStorage::BLOB_ENTRY));
-        append(db.get_storage_stat(MetricsStorage::BLOB_ENTRY_KEY_ENTRY_ID_INDEX));
-        append(db.get_storage_stat(MetricsStorage::KEY_PARAMETER));
-        append(db.get_storage_stat(MetricsStorage::KEY_PARAMETER_KEY_ENTRY_ID_INDEX));
-        append(db.get_storage_stat(MetricsStorage::KEY_METADATA));
-        append(db.get_storage_stat(MetricsStorage::KEY_METADATA_KEY_ENTRY_ID_INDEX));
-        append(db.get_storage_stat(MetricsStorage::GRANT));
-        append(db.get_storage_stat(MetricsStorage::AUTH_TOKEN));
-        append(db.get_storage_stat(MetricsStorage::BLOB_METADATA));
-        append(db.get_storage_stat(MetricsStorage::BLOB_METADATA_BLOB_ENTRY_ID_INDEX));
-    });
-    Ok(atom_vec)
+    let Some(snapshot) = snapshot else {
+        return pull_storage_stats_exact();
+    };
+    let stats = DB.with(|db| db.borrow_mut().estimate_storage_stats(&snapshot));
+    Ok(storage_stats_to_atoms(stats.into_iter().filter_map(|stat| match stat {
+        Ok(s) => Some(s),
+        Err(error) => {
+            log::error!("pull_metrics_callback: Error getting storage stat: {}", error);
+            None
+        }
+    })))
+}
+
+/// Returns exact storage statistics by scanning the whole database. This is expensive and
+/// only meant for on demand use such as dumpsys, or for the first pull. The result also
+/// refreshes the snapshot that `pull_storage_stats` estimates from.
+pub(crate) fn pull_storage_stats_exact() -> Result<Vec<KeystoreAtom>> {
+    let snapshot = DB.with(|db| db.borrow_mut().sample_storage_stats());
+    let atoms = storage_stats_to_atoms(snapshot.stats().iter().cloned());
+    STORAGE_STATS_CACHE.lock().unwrap().snapshot = Some((Instant::now(), snapshot));
+    Ok(atoms)
 }
 
 /// Log error events related to Remote Key Provisioning (RKP).
@@ -578,6 +627,26 @@ pub fn log_rkp_error_stats(rkp_error: MetricsRkpError, sec_level: &SecurityLevel
     METRICS_STORE.insert_atom(AtomID::RKP_ERROR_STATS, rkp_error_stats);
 }
 
+/// Log the latency of a phase of a key generation.
+pub fn log_key_creation_phase_latency(
+    sec_level: SecurityLevel,
+    phase: KeyCreationPhase,
+    latency: Duration,
+) {
+    let key_creation_phase_latency =
+        KeystoreAtomPayload::KeyCreationPhaseLatency(KeyCreationPhaseLatency {
+            phase,
+            log2_latency_millis: compute_log2_latency_millis(latency),
+            security_level: process_security_level(sec_level),
+        });
+    METRICS_STORE.insert_atom(AtomID::KEY_CREATION_PHASE_LATENCY, key_creation_phase_latency);
+}
+
+/// Returns the base 2 logarithm of one plus `latency` in milliseconds, rounded down.
+fn compute_log2_latency_millis(latency: Duration) -> i32 {
+    latency.as_millis().saturating_add(1).ilog2() as i32
+}
+
 /// This function tries to read and update the system property: keystore.crash_count.
 /// If the property is absent, it sets the property with value 0. If the property is present, it
 /// increments the value. This helps tracking keystore crashes internally.
@@ -736,6 +805,16 @@ impl_summary_enum!(AtomID, 14,
     KEY_OPERATION_WITH_GENERAL_INFO => "KEYOP_GENERAL",
     RKP_ERROR_STATS => "RKP_ERR",
     CRASH_STATS => "CRASH",
+    KEY_CREATION_PHASE_LATENCY => "KEYGEN_PHASE",
+);
+
+impl_summary_enum!(KeyCreationPhase, 9,
+    KEY_CREATION_PHASE_UNSPECIFIED => "UNSPEC",
+    ATTESTATION_APPLICATION_ID => "AAID",
+    ATTESTATION_KEY => "ATTESTKEY",
+    PREPARATION => "PREPARE",
+    KEYMINT_GENERATION => "KEYMINT",
+    STORAGE => "STORAGE",
 );
 
 impl_summary_enum!(MetricsStorage, 28,
@@ -969,6 +1048,14 @@ impl Summary for KeystoreAtomPayload {
             KeystoreAtomPayload::CrashStats(v) => {
                 format!("count={}", v.count_of_crash_events)
             }
+            KeystoreAtomPayload::KeyCreationPhaseLatency(v) => {
+                format!(
+                    "{} log2(ms)={:2} sec={}",
+                    v.phase.show(),
+                    v.log2_latency_millis,
+                    v.security_level.show()
+                )
+            }
             KeystoreAtomPayload::Keystore2AtomWithOverflow(v) => {
                 format!("atom={}", v.atom_id.show())
             }
@@ -1002,4 +1089,15 @@ mod tests {
         modes |= 0x300;
         assert_eq!(show_blockmode(modes), "-T-E(full:0x000003aa)");
     }
+
+    #[test]
+    fn test_log2_latency_millis() {
+        assert_eq!(compute_log2_latency_millis(Duration::ZERO), 0);
+        assert_eq!(compute_log2_latency_millis(Duration::from_micros(999)), 0);
+        assert_eq!(compute_log2_latency_millis(Duration::from_millis(1)), 1);
+        assert_eq!(compute_log2_latency_millis(Duration::from_millis(2)), 1);
+        assert_eq!(compute_log2_latency_millis(Duration::from_millis(3)), 2);
+        assert_eq!(compute_log2_latency_millis(Duration::from_millis(1023)), 10);
+        assert_eq!(compute_log2_latency_millis(Duration::from_secs(3600)), 21);
+    }
 }
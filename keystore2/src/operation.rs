@@ -60,6 +60,20 @@
 //! exits. This should be the cue for the client to destroy its binder.
 //! At that point the operation gets dropped.
 //!
+//! ## Operation Teardown
+//! The last reference to an operation may be dropped on any thread, e.g., on a binder
+//! thread serving an unrelated request or on a thread pruning operations for a new
+//! `createOperation`. So if the operation is still active when it is dropped, its KeyMint
+//! operation is handed to the `OperationReaper` of its `OperationDb`, which aborts it on a
+//! background thread. Each security level has its own `OperationDb` and thus its own
+//! reaper, so slow StrongBox aborts never hold up TEE ones. The outcome is logged right
+//! away, because that does not involve KeyMint.
+//!
+//! Every abort the reaper is given gets a ticket. Before `OperationDb::prune` reports that
+//! no operation could be pruned, it waits for the aborts that were queued when it started,
+//! but not for ones queued later. It reports a freed slot as soon as one of them succeeded,
+//! because the caller only needs one, so a backlog of slow aborts does not hold it up.
+//!
 //! ## Architecture
 //! The `IKeystoreOperation` trait is implemented by `KeystoreOperation`.
 //! This acts as a proxy object holding a strong reference to actual operation
@@ -67,7 +81,7 @@
 //!
 //! ```
 //! struct KeystoreOperation {
-//!     operation: Mutex<Option<Arc<Operation>>>,
+//!     operation: Arc<Mutex<Option<Arc<Operation>>>>,
 //! }
 //! ```
 //!
@@ -105,6 +119,19 @@
 //!     a request (i.e., the client calls update, finish, or abort),
 //!     we go back to 1 and try again.
 //!
+//! ## Bulk Data
+//! `update` and `finish` only accept `MAX_RECEIVE_DATA` bytes per call. For large inputs,
+//! `IKeystoreBulkOperation` (see `bulk_operation.rs`) lets the client pass a file descriptor,
+//! e.g., a memfd or a regular file, along with the operation binder instead. Keystore then
+//! reads the input in `BULK_READ_SIZE` blocks and feeds it to KeyMint in `MAX_RECEIVE_DATA`
+//! slices through the very same `update` and `finish` implementations, so size limits,
+//! enforcement, and pruning apply unchanged. The operation slot stays locked for the whole
+//! bulk call, so that a concurrent `update` gets `ResponseCode::OPERATION_BUSY` instead of
+//! splicing its data into the bulk input. This is why `bulk_operation.rs` only accepts file
+//! descriptors whose reads cannot block indefinitely and caps the length of a call. To find
+//! the operation behind the binder, `KeystoreOperation` shares its operation slot with
+//! `OPERATION_SLOTS`.
+//!
 //! So the outer Mutex in `KeystoreOperation::operation` only protects
 //! operations against concurrent client calls but not against concurrent
 //! pruning attempts. This is what the `Operation::outcome` mutex is used for.
@@ -126,6 +153,7 @@
 //! or it transitions to its end-of-life, which means we may get a free slot.
 //! Either way, we have to revaluate the pruning scores.
 
+use crate::async_task::AsyncTask;
 use crate::enforcements::AuthInfo;
 use crate::error::{
     error_to_serialized_error, into_binder, into_logged_binder, map_km_error, Error, ErrorCode,
@@ -143,9 +171,13 @@ use android_system_keystore2::aidl::android::system::keystore2::{
     IKeystoreOperation::BnKeystoreOperation, IKeystoreOperation::IKeystoreOperation,
 };
 use anyhow::{anyhow, Context, Result};
+use binder::{SpIBinder, WpIBinder};
 use std::{
     collections::HashMap,
-    sync::{Arc, Mutex, MutexGuard, Weak},
+    fs::File,
+    io::Write,
+    os::unix::fs::FileExt,
+    sync::{Arc, Condvar, LazyLock, Mutex, MutexGuard, Weak},
     time::Duration,
     time::Instant,
 };
@@ -182,6 +214,7 @@ pub struct Operation {
     auth_info: Mutex<AuthInfo>,
     forced: bool,
     logging_info: LoggingInfo,
+    reaper: Arc<OperationReaper>,
 }
 
 /// Keeps track of the information required for logging operations.
@@ -215,6 +248,23 @@ struct PruningInfo {
 // We don't except more than 32KiB of data in `update`, `updateAad`, and `finish`.
 const MAX_RECEIVE_DATA: usize = 0x8000;
 
+// Bulk input is read from the client's file descriptor in blocks of this size. Each block is
+// still passed to KeyMint in slices of at most `MAX_RECEIVE_DATA` bytes.
+const BULK_READ_SIZE: usize = 0x40000;
+
+// I/O errors on the client's bulk data file descriptors are the client's fault.
+fn bulk_io_error(e: std::io::Error) -> anyhow::Error {
+    anyhow!(Error::Rc(ResponseCode::INVALID_ARGUMENT)).context(e)
+}
+
+/// Reads `block` from the client's bulk `input` at `offset`.
+fn read_bulk_block(input: &File, offset: u64, block: &mut [u8]) -> Result<()> {
+    input
+        .read_exact_at(block, offset)
+        .map_err(bulk_io_error)
+        .context(ks_err!("Failed to read bulk input."))
+}
+
 impl Operation {
     /// Constructor
     pub fn new(
@@ -224,6 +274,7 @@ impl Operation {
         auth_info: AuthInfo,
         forced: bool,
         logging_info: LoggingInfo,
+        reaper: Arc<OperationReaper>,
     ) -> Self {
         Self {
             index,
@@ -234,6 +285,7 @@ impl Operation {
             auth_info: Mutex::new(auth_info),
             forced,
             logging_info,
+            reaper,
         }
     }
 
@@ -440,6 +492,51 @@ impl Operation {
         }
     }
 
+    /// Passes `block` to `update` in slices of `MAX_RECEIVE_DATA` bytes and returns the
+    /// output. Fails with `ResponseCode::INVALID_ARGUMENT` if the operation produces output
+    /// but the caller has no `output` to write it to.
+    fn update_block(&self, block: &[u8], has_output: bool) -> Result<Vec<u8>> {
+        let mut output = Vec::new();
+        for slice in block.chunks(MAX_RECEIVE_DATA) {
+            if let Some(out) = self.update(slice).context(ks_err!())? {
+                if !has_output {
+                    return Err(Error::Rc(ResponseCode::INVALID_ARGUMENT))
+                        .context(ks_err!("Operation produced output but no output was given."));
+                }
+                output.extend(out);
+            }
+        }
+        Ok(output)
+    }
+
+    /// Reads `length` bytes from `input` at `offset` in `BULK_READ_SIZE` blocks, passes them to
+    /// `update_block`, and writes the output to `output`. Returns the number of bytes written.
+    fn update_bulk(
+        &self,
+        input: &File,
+        offset: u64,
+        length: usize,
+        output: Option<&File>,
+    ) -> Result<usize> {
+        let mut buffer = vec![0; length.min(BULK_READ_SIZE)];
+        let mut done = 0;
+        let mut written = 0;
+        while done < length {
+            let block = &mut buffer[..(length - done).min(BULK_READ_SIZE)];
+            read_bulk_block(input, offset + done as u64, block).context(ks_err!())?;
+            let out = self.update_block(block, output.is_some()).context(ks_err!())?;
+            if let Some(mut output) = output.filter(|_| !out.is_empty()) {
+                output
+                    .write_all(&out)
+                    .map_err(bulk_io_error)
+                    .context(ks_err!("Failed to write bulk output."))?;
+                written += out.len();
+            }
+            done += block.len();
+        }
+        Ok(written)
+    }
+
     /// Aborts the operation if it is active. IFF the operation is aborted the outcome is
     /// set to `outcome`. `outcome` must reflect the reason for the abort. Since the operation
     /// gets aborted `outcome` must not be `Operation::Success` or `Operation::Unknown`.
@@ -456,23 +553,115 @@ impl Operation {
 
 impl Drop for Operation {
     fn drop(&mut self) {
-        let guard = self.outcome.lock().expect("In drop.");
+        let outcome = self.outcome.get_mut().expect("In drop.");
+        // If the operation was still active, the reaper aborts it, and the outcome
+        // becomes `Outcome::Dropped`.
+        if *outcome == Outcome::Unknown {
+            *outcome = Outcome::Dropped;
+            self.reaper.abort(self.km_op.clone());
+        }
         log_key_operation_event_stats(
             self.logging_info.sec_level,
             self.logging_info.purpose,
-            &(self.logging_info.op_params),
-            &guard,
+            &self.logging_info.op_params,
+            outcome,
             self.logging_info.key_upgraded,
         );
-        if let Outcome::Unknown = *guard {
-            drop(guard);
-            // If the operation was still active we call abort, setting
-            // the outcome to `Outcome::Dropped`
-            if let Err(e) = self.abort(Outcome::Dropped) {
-                log::error!("While dropping Operation: abort failed:\n    {:?}", e);
+    }
+}
+
+#[derive(Default)]
+struct ReaperQueue {
+    pending: Vec<Strong<dyn IKeyMintOperation>>,
+    // Set while the reaper's task is scheduled or running.
+    running: bool,
+    // The number of aborts queued, completed, and completed successfully so far. An abort's
+    // ticket is the value of `queued` before it was queued.
+    queued: u64,
+    done: u64,
+    succeeded: u64,
+}
+
+/// Aborts the KeyMint operations of dropped operations off the request path, see
+/// "Operation Teardown" above.
+#[derive(Default)]
+pub struct OperationReaper {
+    queue: Arc<(Mutex<ReaperQueue>, Condvar)>,
+    task: AsyncTask,
+}
+
+impl std::fmt::Debug for OperationReaper {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        f.debug_struct("OperationReaper").finish_non_exhaustive()
+    }
+}
+
+impl OperationReaper {
+    /// Queues `km_op` to be aborted, starting the reaper if it is not running.
+    fn abort(&self, km_op: Strong<dyn IKeyMintOperation>) {
+        let mut queue = self.queue.0.lock().expect("In OperationReaper::abort.");
+        queue.pending.push(km_op);
+        queue.queued += 1;
+        if !queue.running {
+            queue.running = true;
+            let queue = self.queue.clone();
+            self.task.queue_hi(move |_| Self::abort_pending(&queue));
+        }
+    }
+
+    /// Aborts the queued operations in order until the queue is empty.
+    fn abort_pending(queue: &(Mutex<ReaperQueue>, Condvar)) {
+        let (queue, progress) = queue;
+        loop {
+            let batch = {
+                let mut queue = queue.lock().expect("In OperationReaper::abort_pending.");
+                if queue.pending.is_empty() {
+                    queue.running = false;
+                    return;
+                }
+                std::mem::take(&mut queue.pending)
+            };
+            for km_op in batch {
+                let result = {
+                    let _wp = wd::watch("OperationReaper: calling IKeyMintOperation::abort");
+                    map_km_error(km_op.abort())
+                };
+                if let Err(e) = &result {
+                    log::error!("While dropping Operation: abort failed:\n    {:?}", e);
+                }
+                let mut queue = queue.lock().expect("In OperationReaper::abort_pending.");
+                queue.done += 1;
+                if result.is_ok() {
+                    queue.succeeded += 1;
+                }
+                progress.notify_all();
             }
         }
     }
+
+    /// Waits until one of the aborts queued before this call has succeeded, or until all of
+    /// them have completed, without waiting for aborts queued in the meantime. Returns true if
+    /// an abort succeeded while waiting, i.e., if a KeyMint operation slot may have freed up.
+    fn wait_for_freed_slot(&self) -> bool {
+        let (queue, progress) = &*self.queue;
+        let queue = queue.lock().expect("In OperationReaper::wait_for_freed_slot.");
+        let (ticket, succeeded) = (queue.queued, queue.succeeded);
+        let queue = progress
+            .wait_while(queue, |queue| queue.done < ticket && queue.succeeded == succeeded)
+            .expect("In OperationReaper::wait_for_freed_slot: Waiting for the reaper.");
+        queue.succeeded > succeeded
+    }
+
+    /// Waits until the aborts queued before this call have completed.
+    #[cfg(test)]
+    fn wait_for_queued_aborts(&self) {
+        let (queue, progress) = &*self.queue;
+        let queue = queue.lock().expect("In OperationReaper::wait_for_queued_aborts.");
+        let ticket = queue.queued;
+        let _queue = progress
+            .wait_while(queue, |queue| queue.done < ticket)
+            .expect("In OperationReaper::wait_for_queued_aborts: Waiting for the reaper.");
+    }
 }
 
 /// The OperationDb holds weak references to all ongoing operations.
@@ -482,12 +671,19 @@ pub struct OperationDb {
     // TODO replace Vec with WeakTable when the weak_table crate becomes
     // available.
     operations: Mutex<Vec<Weak<Operation>>>,
+    reaper: Arc<OperationReaper>,
 }
 
 impl OperationDb {
     /// Creates a new OperationDb.
     pub fn new() -> Self {
-        Self { operations: Mutex::new(Vec::new()) }
+        Self { operations: Mutex::new(Vec::new()), reaper: Default::default() }
+    }
+
+    /// Waits until the operations dropped so far have been aborted.
+    #[cfg(test)]
+    pub fn wait_for_dropped_operations(&self) {
+        self.reaper.wait_for_queued_aborts();
     }
 
     /// Creates a new operation.
@@ -519,6 +715,7 @@ impl OperationDb {
                     auth_info,
                     forced,
                     logging_info,
+                    self.reaper.clone(),
                 ));
                 *free_slot = Arc::downgrade(&new_op);
                 new_op
@@ -531,6 +728,7 @@ impl OperationDb {
                     auth_info,
                     forced,
                     logging_info,
+                    self.reaper.clone(),
                 ));
                 operations.push(Arc::downgrade(&new_op));
                 new_op
@@ -752,20 +950,34 @@ impl OperationDb {
                         }
                         // This index does not exist any more. The operation
                         // in this slot was dropped. Good news, a slot
-                        // has freed up.
-                        None => break Ok(()),
+                        // has freed up as soon as the reaper has aborted it.
+                        None => {
+                            self.reaper.wait_for_freed_slot();
+                            break Ok(());
+                        }
                     }
                 }
-                // We did not get a pruning candidate.
+                // We did not get a pruning candidate. But if the reaper has just aborted
+                // a dropped operation, a slot has freed up.
+                None if self.reaper.wait_for_freed_slot() => break Ok(()),
                 None => break Err(Error::Rc(ResponseCode::BACKEND_BUSY)),
             }
         }
     }
 }
 
+/// The operation held by a `KeystoreOperation` until its life cycle ends.
+type OperationSlot = Mutex<Option<Arc<Operation>>>;
+
+/// The operation slots of all live `KeystoreOperation` binders, so that a binder that is
+/// passed back to keystore can be resolved to its operation. Entries only hold weak
+/// references, so they do not keep the operation from being dropped.
+static OPERATION_SLOTS: LazyLock<Mutex<Vec<(WpIBinder, Weak<OperationSlot>)>>> =
+    LazyLock::new(Default::default);
+
 /// Implementation of IKeystoreOperation.
 pub struct KeystoreOperation {
-    operation: Mutex<Option<Arc<Operation>>>,
+    operation: Arc<OperationSlot>,
 }
 
 impl KeystoreOperation {
@@ -774,9 +986,80 @@ impl KeystoreOperation {
     /// `BinderFeatures::set_requesting_sid` on the new interface, because
     /// we need it for checking Keystore permissions.
     pub fn new_native_binder(operation: Arc<Operation>) -> binder::Strong<dyn IKeystoreOperation> {
-        BnKeystoreOperation::new_binder(
-            Self { operation: Mutex::new(Some(operation)) },
+        let slot = Arc::new(Mutex::new(Some(operation)));
+        let weak_slot = Arc::downgrade(&slot);
+        let binder = BnKeystoreOperation::new_binder(
+            Self { operation: slot },
             BinderFeatures { set_requesting_sid: true, ..BinderFeatures::default() },
+        );
+        let mut slots = OPERATION_SLOTS.lock().unwrap();
+        slots.retain(|(_, slot)| slot.strong_count() > 0);
+        slots.push((binder.as_binder().downgrade(), weak_slot));
+        binder
+    }
+
+    /// Returns a handle to the operation behind `binder` if it is a `KeystoreOperation`
+    /// binder that is still alive. The handle shares the operation slot with the binder,
+    /// so concurrent calls through either of them yield `ResponseCode::OPERATION_BUSY`.
+    pub fn from_binder(binder: &SpIBinder) -> Option<Self> {
+        let slots = OPERATION_SLOTS.lock().unwrap();
+        slots.iter().find_map(|(weak_binder, slot)| match weak_binder.promote() {
+            Some(b) if b == *binder => slot.upgrade().map(|operation| Self { operation }),
+            _ => None,
+        })
+    }
+
+    /// Returns the uid of the operation's owner or `None` if the operation is no longer
+    /// active.
+    pub fn owner(&self) -> Option<u32> {
+        self.operation.lock().unwrap().as_ref().map(|op| op.owner)
+    }
+
+    /// Implementation of `IKeystoreBulkOperation::update`. Reads `length` bytes from `input`,
+    /// starting at `offset`, and passes them to the operation. Any output is written to
+    /// `output`, and the number of bytes written is returned. The operation is locked for the
+    /// whole call, so concurrent calls on it fail with `ResponseCode::OPERATION_BUSY` rather
+    /// than interleave their input with the bulk input.
+    pub fn update_bulk(
+        &self,
+        input: &File,
+        offset: u64,
+        length: usize,
+        output: Option<&File>,
+    ) -> Result<usize> {
+        self.with_locked_operation(
+            |op| op.update_bulk(input, offset, length, output).context(ks_err!()),
+            false,
+        )
+    }
+
+    /// Implementation of `IKeystoreBulkOperation::finish`. Like `update_bulk`, except that the
+    /// last slice of the input is passed to `finish` together with `signature`. The output of
+    /// `finish` is returned rather than written to `output`, as it is by
+    /// `IKeystoreOperation::finish`.
+    pub fn finish_bulk(
+        &self,
+        input: &File,
+        offset: u64,
+        length: usize,
+        signature: Option<&[u8]>,
+        output: Option<&File>,
+    ) -> Result<Option<Vec<u8>>> {
+        self.with_locked_operation(
+            |op| {
+                let last_slice_len = match length % MAX_RECEIVE_DATA {
+                    0 => length.min(MAX_RECEIVE_DATA),
+                    n => n,
+                };
+                let update_len = length - last_slice_len;
+                op.update_bulk(input, offset, update_len, output).context(ks_err!())?;
+                let mut last_slice = vec![0; last_slice_len];
+                read_bulk_block(input, offset + update_len as u64, &mut last_slice)
+                    .context(ks_err!())?;
+                let last_slice = if last_slice.is_empty() { None } else { Some(&last_slice[..]) };
+                op.finish(last_slice, signature).context(ks_err!("KeystoreOperation::finish_bulk"))
+            },
+            true,
         )
     }
 
@@ -869,3 +1152,146 @@ impl IKeystoreOperation for KeystoreOperation {
         })
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::globals::ENFORCEMENTS;
+    use crate::test_keymint::{Rendezvous, SoftKeyMint, SOFT_KEYMINT_MAX_OPERATIONS};
+    use android_hardware_security_keymint::aidl::android::hardware::security::keymint::IKeyMintDevice::IKeyMintDevice;
+    use binder::Interface;
+    use keystore2_test_utils::TempDir;
+    use std::sync::atomic::Ordering;
+    use std::thread;
+
+    const CALLER_UID: u32 = 10001;
+    // The length of the GCM tag the software KeyMint appends in `finish`.
+    const TAG_LENGTH: usize = 16;
+
+    /// Begins an encryption with `keymint` and returns it as a Keystore operation binder.
+    fn create_operation(
+        operation_db: &OperationDb,
+        keymint: &SoftKeyMint,
+    ) -> Strong<dyn IKeystoreOperation> {
+        let key_blob = keymint.generateKey(&[], None).unwrap().keyBlob;
+        let km_op =
+            keymint.begin(KeyPurpose::ENCRYPT, &key_blob, &[], None).unwrap().operation.unwrap();
+        let (_, auth_info) =
+            ENFORCEMENTS.authorize_create(KeyPurpose::ENCRYPT, None, &[], false).unwrap();
+        let operation = operation_db.create_operation(
+            km_op,
+            CALLER_UID,
+            auth_info,
+            false,
+            LoggingInfo::new(
+                SecurityLevel::TRUSTED_ENVIRONMENT,
+                KeyPurpose::ENCRYPT,
+                vec![],
+                false,
+            ),
+        );
+        KeystoreOperation::new_native_binder(operation)
+    }
+
+    /// Creates the file `name` in `dir` with `contents`.
+    fn file_with_contents(dir: &TempDir, name: &str, contents: &[u8]) -> File {
+        let mut file = File::options()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(dir.path().join(name))
+            .unwrap();
+        file.write_all(contents).unwrap();
+        file
+    }
+
+    #[test]
+    fn test_bulk_update_keeps_operation_busy() {
+        // The bulk input spans several KeyMint updates, the first of which waits for the test.
+        let input = vec![0x5a; 3 * MAX_RECEIVE_DATA + 100];
+        let rendezvous = Rendezvous::new(2);
+        let keymint =
+            SoftKeyMint { update_rendezvous: Some(rendezvous.clone()), ..Default::default() };
+        let operation_db = OperationDb::new();
+        let dir = TempDir::new("test_bulk_update_keeps_operation_busy").unwrap();
+        let input_file = file_with_contents(&dir, "input", &input);
+
+        let operation = create_operation(&operation_db, &keymint);
+        let bulk_operation = KeystoreOperation::from_binder(&operation.as_binder()).unwrap();
+        thread::scope(|s| {
+            let bulk_update =
+                s.spawn(|| bulk_operation.update_bulk(&input_file, 0, input.len(), None));
+            assert!(rendezvous.wait_for_in_flight(1));
+
+            // While the bulk call is in KeyMint, the operation is busy for everyone else.
+            let busy = operation.update(b"interleaved").unwrap_err();
+            assert_eq!(busy.service_specific_error(), ResponseCode::OPERATION_BUSY.0);
+            let busy = operation.finish(None, None).unwrap_err();
+            assert_eq!(busy.service_specific_error(), ResponseCode::OPERATION_BUSY.0);
+
+            assert!(rendezvous.meet());
+            assert_eq!(bulk_update.join().unwrap().unwrap(), 0);
+        });
+
+        // Only the bulk input made it into the operation.
+        let output = operation.finish(None, None).unwrap().unwrap();
+        assert_eq!(output.len(), input.len() + TAG_LENGTH);
+        assert_eq!(rendezvous.calls().0, 1 + input.len().div_ceil(MAX_RECEIVE_DATA));
+    }
+
+    #[test]
+    fn test_bulk_finish_passes_all_input() {
+        let input: Vec<u8> = (0..BULK_READ_SIZE + MAX_RECEIVE_DATA + 7).map(|i| i as u8).collect();
+        let keymint = SoftKeyMint::default();
+        let operation_db = OperationDb::new();
+        let dir = TempDir::new("test_bulk_finish_passes_all_input").unwrap();
+        let input_file = file_with_contents(&dir, "input", &input);
+        let output_file = file_with_contents(&dir, "output", &[]);
+
+        let operation = create_operation(&operation_db, &keymint);
+        let bulk_operation = KeystoreOperation::from_binder(&operation.as_binder()).unwrap();
+        let output = bulk_operation
+            .finish_bulk(&input_file, 0, input.len(), None, Some(&output_file))
+            .unwrap()
+            .unwrap();
+        assert_eq!(output.len(), input.len() + TAG_LENGTH);
+
+        // The operation is gone after `finish_bulk`, and its KeyMint operation is finished.
+        let gone = operation.update(b"more").unwrap_err();
+        assert_eq!(gone.service_specific_error(), ErrorCode::INVALID_OPERATION_HANDLE.0);
+        assert_eq!(keymint.operations.load(Ordering::SeqCst), 0);
+    }
+
+    #[test]
+    fn test_create_operation_with_backlogged_aborts() {
+        let keymint =
+            SoftKeyMint { abort_latency: Duration::from_millis(100), ..Default::default() };
+        let operation_db = OperationDb::new();
+
+        // Fill up KeyMint and drop all operations, so that the reaper has a backlog of aborts.
+        let operations: Vec<_> = (0..SOFT_KEYMINT_MAX_OPERATIONS)
+            .map(|_| create_operation(&operation_db, &keymint))
+            .collect();
+        drop(operations);
+
+        // Like `createOperation`, prune until KeyMint has a free slot.
+        let key_blob = keymint.generateKey(&[], None).unwrap().keyBlob;
+        let mut prunes = 0;
+        let km_op = loop {
+            match map_km_error(keymint.begin(KeyPurpose::ENCRYPT, &key_blob, &[], None)) {
+                Err(Error::Km(ErrorCode::TOO_MANY_OPERATIONS)) => {
+                    operation_db.prune(CALLER_UID, false).unwrap();
+                    prunes += 1;
+                }
+                result => break result.unwrap().operation.unwrap(),
+            }
+        };
+
+        // The first completed abort freed a slot, so the rest of the backlog was still pending.
+        assert_eq!(prunes, 1);
+        assert!(keymint.operations.load(Ordering::SeqCst) > 1);
+        operation_db.wait_for_dropped_operations();
+        assert_eq!(keymint.operations.load(Ordering::SeqCst), 1);
+        drop(km_op);
+    }
+}
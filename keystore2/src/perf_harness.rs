@@ -0,0 +1,656 @@
+// Copyright 2024, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! A hermetic performance harness for the Keystore service.
+//!
+//! The client tests in `keystore2/tests` drive a live Keystore service and the device's KeyMint
+//! HAL. The workloads in this module instead call the service objects in-process: the
+//! `KeystoreService` and its `KeystoreSecurityLevel`, `Maintenance`, `AuthorizationManager` and
+//! `BulkOperation`, with the database in a temporary directory. A software KeyMint is set as the
+//! TEE device in place of the HAL, the SELinux and Android permission checks are stubbed out, and
+//! a stub answers for the package manager. Nothing outside of the test process is touched, so
+//! results only depend on the build and the machine.
+//!
+//! In-process calls have no binder caller, so all of them come from the uid of the test process
+//! and the workloads tell their apps apart by key alias. The workloads share the service's global
+//! state, such as the database, so they run one at a time.
+//!
+//! Each workload is a test named `perf_harness::<workload>`. The workloads take seconds each,
+//! so they are ignored by default and run by passing `--ignored perf_harness::` to the
+//! `keystore2_test` binary. A workload prints one CSV line per API it exercised, with the
+//! latency percentiles in microseconds and a log2 histogram, e.g.
+//! ```text
+//! workload,api,count,failures,mean_us,p50_us,p90_us,p99_us,max_us,histogram
+//! operation_churn,update,1600,0,41,35,60,120,830,16:2 32:1400 64:180 128:17 1024:1
+//! ```
+//! where `32:1400` means 1400 calls took at least 32us but less than 64us. Comparing the output
+//! of two builds shows the effect of a change on each API.
+
+use crate::authorization::AuthorizationManager;
+use crate::bulk_operation::BulkOperation;
+use crate::database::Uuid;
+use crate::error::{map_binder_status, Error, ResponseCode};
+use crate::globals::{set_keymint_device, DB_PATH, SUPER_KEY};
+use crate::id_rotation::IdRotationState;
+use crate::key_parameter::{Algorithm, BlockMode, KeyParameterValue, KeyPurpose};
+use crate::maintenance::{DeleteListener, Maintenance};
+use crate::security_level::{stub_package_manager, KeystoreSecurityLevel};
+use crate::service::KeystoreService;
+use crate::test_keymint::SoftKeyMint;
+use crate::utils::{stub_permission_checks, uid_to_android_user};
+use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
+    IKeyMintDevice::BnKeyMintDevice, KeyParameter::KeyParameter as KmKeyParameter,
+    SecurityLevel::SecurityLevel,
+};
+use android_security_authorization::aidl::android::security::authorization::IKeystoreAuthorization::IKeystoreAuthorization;
+use android_security_bulkoperation::aidl::android::security::bulkoperation::IKeystoreBulkOperation::IKeystoreBulkOperation;
+use android_security_maintenance::aidl::android::security::maintenance::IKeystoreMaintenance::IKeystoreMaintenance;
+use android_system_keystore2::aidl::android::system::keystore2::{
+    Domain::Domain, IKeystoreOperation::IKeystoreOperation,
+    IKeystoreSecurityLevel::IKeystoreSecurityLevel, IKeystoreService::IKeystoreService,
+    KeyDescriptor::KeyDescriptor, KeyMetadata::KeyMetadata,
+};
+use anyhow::{Context, Result};
+use binder::{BinderFeatures, ExceptionCode, ParcelFileDescriptor, Strong, ThreadState};
+use keystore2_test_utils::TempDir;
+use std::collections::{BTreeMap, VecDeque};
+use std::fs::File;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, LazyLock, Mutex, MutexGuard};
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// The database directory of the service. The service's global state refers to it once it is
+/// set up, so all workloads of a test process share it.
+static DB_DIR: LazyLock<TempDir> =
+    LazyLock::new(|| TempDir::new("keystore2_perf_harness").expect("Failed to create DB_DIR."));
+
+/// Held while a workload runs, as workloads share the service's global state.
+static RUNNING: Mutex<()> = Mutex::new(());
+
+/// Latencies in microseconds and failure counts per API.
+#[derive(Default)]
+struct Recorder {
+    apis: BTreeMap<&'static str, (Vec<u64>, usize)>,
+}
+
+impl Recorder {
+    /// Runs `f` and records its latency, or a failure if it returns an error.
+    fn time<T>(&mut self, api: &'static str, f: impl FnOnce() -> Result<T>) -> Result<T> {
+        let start = Instant::now();
+        let result = f();
+        let (latencies, failures) = self.apis.entry(api).or_default();
+        match result {
+            Ok(_) => latencies.push(start.elapsed().as_micros() as u64),
+            Err(_) => *failures += 1,
+        }
+        result
+    }
+
+    fn merge(&mut self, other: Recorder) {
+        for (api, (latencies, failures)) in other.apis {
+            let (all_latencies, all_failures) = self.apis.entry(api).or_default();
+            all_latencies.extend(latencies);
+            *all_failures += failures;
+        }
+    }
+
+    fn report(mut self, workload: &str) {
+        println!("\nworkload,api,count,failures,mean_us,p50_us,p90_us,p99_us,max_us,histogram");
+        for (api, (latencies, failures)) in self.apis.iter_mut() {
+            latencies.sort_unstable();
+            let percentile = |p: usize| match latencies.len() {
+                0 => 0,
+                n => latencies[((n * p).div_ceil(100)).max(1) - 1],
+            };
+            let mean = latencies.iter().sum::<u64>() / (latencies.len().max(1) as u64);
+            let mut histogram = BTreeMap::<u64, usize>::new();
+            for latency in latencies.iter() {
+                let bucket = if *latency == 0 { 0 } else { 1 << latency.ilog2() };
+                *histogram.entry(bucket).or_default() += 1;
+            }
+            let histogram: Vec<_> =
+                histogram.iter().map(|(bucket, count)| format!("{bucket}:{count}")).collect();
+            println!(
+                "{workload},{api},{},{failures},{mean},{},{},{},{},{}",
+                latencies.len(),
+                percentile(50),
+                percentile(90),
+                percentile(99),
+                latencies.last().unwrap_or(&0),
+                histogram.join(" ")
+            );
+        }
+    }
+}
+
+/// The Keystore services that a workload runs against, backed by a software KeyMint.
+struct Harness {
+    /// The number of operations of the software KeyMint that are neither finished nor aborted.
+    keymint_operations: Arc<AtomicUsize>,
+    sec_level: Strong<dyn IKeystoreSecurityLevel>,
+    service: Strong<dyn IKeystoreService>,
+    maintenance: Strong<dyn IKeystoreMaintenance>,
+    authorization: Strong<dyn IKeystoreAuthorization>,
+    bulk_operation: Strong<dyn IKeystoreBulkOperation>,
+    _running: MutexGuard<'static, ()>,
+}
+
+impl Harness {
+    /// Sets up the services for a workload with `keymint` as the TEE device. The calling thread
+    /// is stubbed like the threads of `run`.
+    fn new(keymint: SoftKeyMint) -> Self {
+        // A workload that panicked leaves nothing behind that the next one depends on.
+        let running = RUNNING.lock().unwrap_or_else(|poisoned| poisoned.into_inner());
+        *DB_PATH.write().unwrap() = DB_DIR.path().to_path_buf();
+        stub_permission_checks();
+        stub_package_manager(|_| Ok(b"perf_harness".to_vec()));
+
+        let keymint_operations = keymint.operations.clone();
+        set_keymint_device(
+            SecurityLevel::TRUSTED_ENVIRONMENT,
+            BnKeyMintDevice::new_binder(keymint, BinderFeatures::default()),
+        )
+        .unwrap();
+        let (sec_level, km_uuid) = Self::new_sec_level(vec![]);
+        Self {
+            keymint_operations,
+            service: KeystoreService::new_for_test(vec![(
+                SecurityLevel::TRUSTED_ENVIRONMENT,
+                sec_level.clone(),
+                km_uuid,
+            )])
+            .unwrap(),
+            sec_level,
+            maintenance: Maintenance::new_native_binder(Box::new(NoDeleteListener)).unwrap(),
+            authorization: AuthorizationManager::new_native_binder().unwrap(),
+            bulk_operation: BulkOperation::new_native_binder().unwrap(),
+            _running: running,
+        }
+    }
+
+    /// Creates another TEE security level, which pre-generates keys for `pool_templates`.
+    fn new_sec_level(
+        pool_templates: Vec<(Vec<KmKeyParameter>, usize)>,
+    ) -> (Strong<dyn IKeystoreSecurityLevel>, Uuid) {
+        KeystoreSecurityLevel::new_for_test(
+            SecurityLevel::TRUSTED_ENVIRONMENT,
+            IdRotationState::new(DB_DIR.path()),
+            pool_templates,
+            Duration::from_secs(600),
+        )
+        .unwrap()
+    }
+
+    /// Runs `workload_thread` on `threads` threads at the same time and reports the latencies
+    /// they recorded.
+    fn run<F>(&self, workload: &str, threads: usize, workload_thread: F)
+    where
+        F: Fn(usize, &mut Recorder) -> Result<()> + Sync,
+    {
+        let mut recorder = Recorder::default();
+        thread::scope(|s| {
+            let workers: Vec<_> = (0..threads)
+                .map(|t| {
+                    let workload_thread = &workload_thread;
+                    s.spawn(move || {
+                        stub_permission_checks();
+                        let mut recorder = Recorder::default();
+                        workload_thread(t, &mut recorder).unwrap();
+                        recorder
+                    })
+                })
+                .collect();
+            for worker in workers {
+                recorder.merge(worker.join().unwrap());
+            }
+        });
+        recorder.report(workload);
+    }
+
+    /// Generates a key of the calling app with `params` and stores it under `alias`.
+    fn generate_key(&self, alias: String, params: &[KmKeyParameter]) -> Result<KeyMetadata> {
+        Ok(map_binder_status(self.sec_level.generateKey(&app_key(alias), None, params, 0, &[]))?)
+    }
+
+    /// Starts an encryption with the key of the calling app stored under `alias`.
+    fn create_operation(&self, alias: String) -> Result<Strong<dyn IKeystoreOperation>> {
+        let params: Vec<KmKeyParameter> = vec![
+            KeyParameterValue::KeyPurpose(KeyPurpose::ENCRYPT).into(),
+            KeyParameterValue::BlockMode(BlockMode::GCM).into(),
+            KeyParameterValue::MacLength(128).into(),
+        ];
+        map_binder_status(self.sec_level.createOperation(&app_key(alias), &params, false))?
+            .iOperation
+            .context("No operation.")
+    }
+
+    /// Creates the super keys of `user` and unlocks the user.
+    fn initialize_user(&self, user: u32) {
+        map_binder_status(self.maintenance.initUserSuperKeys(
+            user as i32,
+            &user_password(user),
+            true,
+        ))
+        .unwrap();
+        self.unlock_user(user).unwrap();
+    }
+
+    fn unlock_user(&self, user: u32) -> Result<()> {
+        Ok(map_binder_status(
+            self.authorization.onDeviceUnlocked(user as i32, Some(&user_password(user))),
+        )?)
+    }
+
+    fn lock_user(&self, user: u32) -> Result<()> {
+        Ok(map_binder_status(self.authorization.onDeviceLocked(user as i32, &[], false))?)
+    }
+}
+
+/// The harness has none of the components that `Maintenance` notifies about deletions.
+struct NoDeleteListener;
+
+impl DeleteListener for NoDeleteListener {
+    fn delete_namespace(&self, _domain: Domain, _namespace: i64) -> Result<()> {
+        Ok(())
+    }
+    fn delete_user(&self, _user_id: u32) -> Result<()> {
+        Ok(())
+    }
+}
+
+/// The Android user of the calling app.
+fn caller_user() -> u32 {
+    uid_to_android_user(ThreadState::get_calling_uid())
+}
+
+fn user_password(user: u32) -> Vec<u8> {
+    let mut password = vec![0; 32];
+    password[..4].copy_from_slice(&user.to_be_bytes());
+    password
+}
+
+/// A key of the calling app. The service fills in the namespace.
+fn app_key(alias: String) -> KeyDescriptor {
+    KeyDescriptor { domain: Domain::APP, nspace: -1, alias: Some(alias), blob: None }
+}
+
+fn aes_key_parameters(extra: &[KeyParameterValue]) -> Vec<KmKeyParameter> {
+    [
+        KeyParameterValue::Algorithm(Algorithm::AES),
+        KeyParameterValue::KeySize(256),
+        KeyParameterValue::BlockMode(BlockMode::GCM),
+        KeyParameterValue::KeyPurpose(KeyPurpose::ENCRYPT),
+        KeyParameterValue::KeyPurpose(KeyPurpose::DECRYPT),
+        KeyParameterValue::NoAuthRequired,
+    ]
+    .iter()
+    .chain(extra)
+    .map(|value| value.clone().into())
+    .collect()
+}
+
+/// Whether `e` is the `BACKEND_BUSY` a client sees when no operation could be pruned.
+fn is_backend_busy(e: &anyhow::Error) -> bool {
+    matches!(
+        e.downcast_ref::<Error>(),
+        Some(Error::Binder(ExceptionCode::SERVICE_SPECIFIC, code))
+            if *code == ResponseCode::BACKEND_BUSY.0
+    )
+}
+
+/// Many apps generating keys at the same time, in bursts separated by idle periods, as after
+/// a reboot or an OTA.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn bursty_key_generation() {
+    const THREADS: usize = 8;
+    const BURSTS: usize = 5;
+    const KEYS_PER_BURST: usize = 20;
+
+    let harness = Harness::new(Default::default());
+    let params = aes_key_parameters(&[]);
+    harness.run("bursty_key_generation", THREADS, |t, recorder| {
+        for burst in 0..BURSTS {
+            for k in 0..KEYS_PER_BURST {
+                recorder.time("generateKey", || {
+                    harness.generate_key(format!("bursty_{t}_{burst}_{k}"), &params)
+                })?;
+            }
+            thread::sleep(Duration::from_millis(10));
+        }
+        Ok(())
+    });
+}
+
+/// Apps running short encryptions back to back while also leaving some operations
+/// unfinished, so that the software KeyMint runs out of slots and operations get pruned.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn operation_churn() {
+    const THREADS: usize = 8;
+    const OPERATIONS: usize = 200;
+    const DATA_SIZE: usize = 4096;
+    const ABANDON_EVERY: usize = 5;
+    const MAX_ABANDONED: usize = 4;
+
+    let harness = Harness::new(Default::default());
+    harness.run("operation_churn", THREADS, |t, recorder| {
+        let alias = format!("churn_{t}");
+        harness.generate_key(alias.clone(), &aes_key_parameters(&[]))?;
+        let data = vec![t as u8; DATA_SIZE];
+        let mut abandoned = VecDeque::new();
+        for i in 0..OPERATIONS {
+            let operation = match recorder
+                .time("createOperation", || harness.create_operation(alias.clone()))
+            {
+                Ok(operation) => operation,
+                Err(e) if is_backend_busy(&e) => continue,
+                Err(e) => return Err(e),
+            };
+            if i % ABANDON_EVERY == 0 {
+                abandoned.push_back(operation);
+                if abandoned.len() > MAX_ABANDONED {
+                    abandoned.pop_front();
+                }
+                continue;
+            }
+            // The operation may have been pruned by another thread in the meantime.
+            if recorder.time("update", || Ok(map_binder_status(operation.update(&data))?)).is_ok() {
+                let _ = recorder
+                    .time("finish", || Ok(map_binder_status(operation.finish(None, None))?));
+            }
+        }
+        Ok(())
+    });
+}
+
+/// Apps abandoning most of their operations while the software KeyMint is slow to abort them,
+/// as when many clients die at once. The abandoned operations are torn down by the reaper, so
+/// dropping them does not wait for KeyMint, and `createOperation` keeps pruning operations
+/// while the reaper is busy.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn abandoned_operations() {
+    const THREADS: usize = 8;
+    const OPERATIONS: usize = 200;
+    const FINISH_EVERY: usize = 4;
+    const MAX_ABANDONED: usize = 8;
+    const REAPER_TIMEOUT: Duration = Duration::from_secs(10);
+
+    let harness =
+        Harness::new(SoftKeyMint { abort_latency: Duration::from_millis(2), ..Default::default() });
+    harness.run("abandoned_operations", THREADS, |t, recorder| {
+        let alias = format!("abandoned_{t}");
+        harness.generate_key(alias.clone(), &aes_key_parameters(&[]))?;
+        let mut abandoned = VecDeque::new();
+        for i in 0..OPERATIONS {
+            let operation = match recorder
+                .time("createOperation", || harness.create_operation(alias.clone()))
+            {
+                Ok(operation) => operation,
+                Err(e) if is_backend_busy(&e) => continue,
+                Err(e) => return Err(e),
+            };
+            if i % FINISH_EVERY == 0 {
+                // The operation may have been pruned by another thread in the meantime.
+                let _ = recorder
+                    .time("finish", || Ok(map_binder_status(operation.finish(None, None))?));
+                continue;
+            }
+            abandoned.push_back(operation);
+            if abandoned.len() > MAX_ABANDONED {
+                let operation = abandoned.pop_front();
+                recorder.time("dropOperation", || {
+                    drop(operation);
+                    Ok(())
+                })?;
+            }
+        }
+        Ok(())
+    });
+
+    // Every KeyMint operation is finished or aborted once the reaper is done.
+    let start = Instant::now();
+    while harness.keymint_operations.load(Ordering::SeqCst) > 0 && start.elapsed() < REAPER_TIMEOUT
+    {
+        thread::sleep(Duration::from_millis(10));
+    }
+    assert_eq!(harness.keymint_operations.load(Ordering::SeqCst), 0);
+}
+
+/// Apps deleting all of their keys one by one, followed by the uninstall of an app with many
+/// keys.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn mass_deletion() {
+    const THREADS: usize = 4;
+    const KEYS_PER_THREAD: usize = 250;
+    const UNINSTALLED_APP_KEYS: usize = 2000;
+
+    let harness = Harness::new(Default::default());
+    let params = aes_key_parameters(&[]);
+    harness.run("mass_deletion", THREADS, |t, recorder| {
+        for k in 0..KEYS_PER_THREAD {
+            harness.generate_key(format!("deleted_{t}_{k}"), &params)?;
+        }
+        for k in 0..KEYS_PER_THREAD {
+            let key = app_key(format!("deleted_{t}_{k}"));
+            recorder
+                .time("deleteKey", || Ok(map_binder_status(harness.service.deleteKey(&key))?))?;
+        }
+        Ok(())
+    });
+
+    harness.run("mass_deletion", 1, |_, recorder| {
+        for k in 0..UNINSTALLED_APP_KEYS {
+            harness.generate_key(format!("uninstalled_{k}"), &params)?;
+        }
+        let uid = ThreadState::get_calling_uid() as i64;
+        recorder.time("clearNamespace", || {
+            Ok(map_binder_status(harness.maintenance.clearNamespace(Domain::APP, uid))?)
+        })
+    });
+}
+
+/// Users being unlocked for the first time since boot on several threads at once, as when
+/// several profiles are unlocked together.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn user_unlock_storm() {
+    const USERS: u32 = 4;
+    const THREADS: usize = 4;
+    const UNLOCKS_PER_THREAD: usize = 5;
+
+    let harness = Harness::new(Default::default());
+    // Other users than the one of the calling app, whose keys other workloads use.
+    let first_user = caller_user() + 1;
+    for user in first_user..first_user + USERS {
+        harness.initialize_user(user);
+    }
+
+    harness.run("user_unlock_storm", THREADS, |t, recorder| {
+        for round in 0..UNLOCKS_PER_THREAD {
+            let user = first_user + ((t + round * THREADS) as u32) % USERS;
+            // Another thread may unlock the same user in the meantime, in which case this
+            // unlock finds the super keys in memory.
+            SUPER_KEY.write().unwrap().forget_all_keys_for_user(user);
+            recorder.time("onDeviceUnlocked", || harness.unlock_user(user))?;
+        }
+        Ok(())
+    });
+}
+
+/// One user's apps using keys that require an unlocked device while other users are being
+/// unlocked and locked over and over, as when a work profile is unlocked. The
+/// `createOperation` latency shows how much key use by the bystanding user is held up by other
+/// users' lock state changes.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn unlock_contention() {
+    const UNLOCKING_USERS: u32 = 3;
+    const UNLOCK_THREADS: usize = UNLOCKING_USERS as usize;
+    const BYSTANDER_THREADS: usize = 4;
+    const UNLOCKS_PER_THREAD: usize = 10;
+
+    let harness = Harness::new(Default::default());
+    let bystander_user = caller_user();
+    for user in bystander_user..=bystander_user + UNLOCKING_USERS {
+        harness.initialize_user(user);
+    }
+
+    // The key is encrypted with the bystanding user's UnlockedDeviceRequired super key, which
+    // has to be looked up to use the key.
+    harness
+        .generate_key(
+            "unlock_contention".to_string(),
+            &aes_key_parameters(&[KeyParameterValue::UnlockedDeviceRequired]),
+        )
+        .unwrap();
+
+    let unlocking = AtomicUsize::new(UNLOCK_THREADS);
+    harness.run("unlock_contention", UNLOCK_THREADS + BYSTANDER_THREADS, |t, recorder| {
+        if t < UNLOCK_THREADS {
+            let user = bystander_user + 1 + t as u32;
+            for _ in 0..UNLOCKS_PER_THREAD {
+                recorder.time("onDeviceUnlocked", || harness.unlock_user(user))?;
+                recorder.time("onDeviceLocked", || harness.lock_user(user))?;
+            }
+            unlocking.fetch_sub(1, Ordering::SeqCst);
+        } else {
+            while unlocking.load(Ordering::SeqCst) > 0 {
+                let operation = recorder.time("createOperation", || {
+                    harness.create_operation("unlock_contention".to_string())
+                })?;
+                map_binder_status(operation.finish(None, None))?;
+            }
+        }
+        Ok(())
+    });
+}
+
+/// Apps generating their first key one after another, with idle time in between, as on first
+/// launch after install. KeyMint takes as long as for a large RSA key. Without a pool every app
+/// waits for KeyMint, and with a `KeyPool` for the apps' parameters every app takes a key that
+/// was generated during the idle time.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn first_key_latency() {
+    const APPS: usize = 10;
+    const IDLE_TIME: Duration = Duration::from_millis(300);
+
+    let harness = Harness::new(SoftKeyMint {
+        generate_latency: Duration::from_millis(200),
+        ..Default::default()
+    });
+    let params = aes_key_parameters(&[]);
+    let (pooled_sec_level, _) = Harness::new_sec_level(vec![(params.clone(), 1)]);
+
+    let mut recorder = Recorder::default();
+    for (api, sec_level) in
+        [("generateKey (no pool)", &harness.sec_level), ("generateKey (pool)", &pooled_sec_level)]
+    {
+        for app in 0..APPS {
+            thread::sleep(IDLE_TIME);
+            let key = app_key(format!("first_key_{app}_{api}"));
+            recorder
+                .time(api, || {
+                    Ok(map_binder_status(sec_level.generateKey(&key, None, &params, 0, &[]))?)
+                })
+                .unwrap();
+        }
+    }
+    recorder.report("first_key_latency");
+}
+
+/// Apps generating attested keys while the package manager takes a while to return their
+/// attestation application IDs. The keys are self-contained blobs, so no attestation key is
+/// needed, and the software KeyMint ignores the challenge. The `generateKey` latency is that
+/// of Keystore and the package manager.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn attested_key_generation() {
+    const THREADS: usize = 4;
+    const KEYS_PER_THREAD: usize = 50;
+    const PACKAGE_MANAGER_LATENCY: Duration = Duration::from_millis(5);
+
+    let harness = Harness::new(Default::default());
+    stub_package_manager(|_| {
+        thread::sleep(PACKAGE_MANAGER_LATENCY);
+        Ok(b"perf_harness".to_vec())
+    });
+    let params =
+        aes_key_parameters(&[KeyParameterValue::AttestationChallenge(b"challenge".to_vec())]);
+    let key = KeyDescriptor { domain: Domain::BLOB, nspace: 0, alias: None, blob: None };
+    harness.run("attested_key_generation", THREADS, |_, recorder| {
+        for _ in 0..KEYS_PER_THREAD {
+            recorder.time("generateKey", || {
+                Ok(map_binder_status(harness.sec_level.generateKey(&key, None, &params, 0, &[]))?)
+            })?;
+        }
+        Ok(())
+    });
+}
+
+/// An app encrypting a large file, once through `IKeystoreOperation::update` in chunks of the
+/// most it accepts per call and once through `IKeystoreBulkOperation`. The `encrypt` latencies
+/// show what the bulk path saves on calls into Keystore for the same KeyMint work.
+#[test]
+#[ignore = "performance workload, run with --ignored"]
+fn bulk_throughput() {
+    const INPUT_SIZE: usize = 16 << 20;
+    const CHUNK_SIZE: usize = 0x8000;
+    const REPETITIONS: usize = 10;
+
+    let harness = Harness::new(Default::default());
+    harness.generate_key("bulk".to_string(), &aes_key_parameters(&[])).unwrap();
+    let input = vec![0x5a; INPUT_SIZE];
+    let input_path = DB_DIR.path().join("bulk_input");
+    std::fs::write(&input_path, &input).unwrap();
+
+    let mut recorder = Recorder::default();
+    for api in ["encrypt (chunked)", "encrypt (bulk)"] {
+        for _ in 0..REPETITIONS {
+            let operation = recorder
+                .time("createOperation", || harness.create_operation("bulk".to_string()))
+                .unwrap();
+            let input_file = ParcelFileDescriptor::new(File::open(&input_path).unwrap());
+            let output = recorder
+                .time(api, || {
+                    if api == "encrypt (chunked)" {
+                        for chunk in input.chunks(CHUNK_SIZE) {
+                            map_binder_status(operation.update(chunk))?;
+                        }
+                        Ok(map_binder_status(operation.finish(None, None))?)
+                    } else {
+                        Ok(map_binder_status(harness.bulk_operation.finish(
+                            &operation,
+                            &input_file,
+                            INPUT_SIZE as i64,
+                            None,
+                            None,
+                        ))?)
+                    }
+                })
+                .unwrap();
+            assert_eq!(output.unwrap_or_default().len(), INPUT_SIZE + 16);
+        }
+    }
+    for api in ["encrypt (chunked)", "encrypt (bulk)"] {
+        let (latencies, _) = &recorder.apis[api];
+        let mean_us = latencies.iter().sum::<u64>() / latencies.len() as u64;
+        println!("bulk_throughput,{api},{:.1} MB/s", INPUT_SIZE as f64 / mean_us as f64);
+    }
+    recorder.report("bulk_throughput");
+}
@@ -14,7 +14,9 @@
 
 //! This crate implements the IKeystoreSecurityLevel interface.
 
-use crate::attestation_key_utils::{get_attest_key_info, AttestationKeyInfo};
+use crate::attestation_key_utils::{
+    get_attest_key_info, use_user_generated_attestation_key, AttestationKeyInfo,
+};
 use crate::audit_log::{
     log_key_deleted, log_key_generated, log_key_imported, log_key_integrity_violation,
 };
@@ -27,8 +29,9 @@ use crate::globals::{
 };
 use crate::key_parameter::KeyParameter as KsKeyParam;
 use crate::key_parameter::KeyParameterValue as KsKeyParamValue;
+use crate::key_pregeneration::{self, KeyPool};
 use crate::ks_err;
-use crate::metrics_store::log_key_creation_event_stats;
+use crate::metrics_store::{log_key_creation_event_stats, log_key_creation_phase_latency};
 use crate::remote_provisioning::RemProvState;
 use crate::super_key::{KeyBlob, SuperKeyManager};
 use crate::utils::{
@@ -56,6 +59,7 @@ use android_hardware_security_keymint::aidl::android::hardware::security::keymin
     KeyParameterValue::KeyParameterValue, SecurityLevel::SecurityLevel, Tag::Tag,
 };
 use android_hardware_security_keymint::binder::{BinderFeatures, Strong, ThreadState};
+use android_security_metrics::aidl::android::security::metrics::KeyCreationPhase::KeyCreationPhase;
 use android_system_keystore2::aidl::android::system::keystore2::{
     AuthenticatorSpec::AuthenticatorSpec, CreateOperationResponse::CreateOperationResponse,
     Domain::Domain, EphemeralStorageKeyResponse::EphemeralStorageKeyResponse,
@@ -66,7 +70,8 @@ use android_system_keystore2::aidl::android::system::keystore2::{
 use anyhow::{anyhow, Context, Result};
 use rkpd_client::store_rkpd_attestation_key;
 use std::convert::TryInto;
-use std::time::SystemTime;
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime};
 
 /// Implementation of the IKeystoreSecurityLevel Interface.
 pub struct KeystoreSecurityLevel {
@@ -77,11 +82,110 @@ pub struct KeystoreSecurityLevel {
     operation_db: OperationDb,
     rem_prov_state: RemProvState,
     id_rotation_state: IdRotationState,
+    key_pool: Option<Arc<KeyPool>>,
 }
 
 // Blob of 32 zeroes used as empty masking key.
 static ZERO_BLOB_32: &[u8] = &[0; 32];
 
+/// Returns the CREATION_DATETIME parameter for a key created at `creation_datetime`.
+fn creation_datetime_parameter(creation_datetime: SystemTime) -> Result<KeyParameter> {
+    Ok(KeyParameter {
+        tag: Tag::CREATION_DATETIME,
+        value: KeyParameterValue::DateTime(
+            creation_datetime
+                .duration_since(SystemTime::UNIX_EPOCH)
+                .context(ks_err!("Failed to get epoch time."))?
+                .as_millis()
+                .try_into()
+                .context(ks_err!("Failed to convert epoch time."))?,
+        ),
+    })
+}
+
+/// If `params` describe an asymmetric key, adds the NOT_BEFORE and NOT_AFTER parameters that
+/// they lack to `result`.
+fn add_certificate_validity(params: &[KeyParameter], result: &mut Vec<KeyParameter>) {
+    match params.iter().find(|kp| kp.tag == Tag::ALGORITHM) {
+        Some(KeyParameter { tag: _, value: KeyParameterValue::Algorithm(Algorithm::RSA) })
+        | Some(KeyParameter { tag: _, value: KeyParameterValue::Algorithm(Algorithm::EC) }) => {
+            if !params.iter().any(|kp| kp.tag == Tag::CERTIFICATE_NOT_BEFORE) {
+                result.push(KeyParameter {
+                    tag: Tag::CERTIFICATE_NOT_BEFORE,
+                    value: KeyParameterValue::DateTime(0),
+                })
+            }
+            if !params.iter().any(|kp| kp.tag == Tag::CERTIFICATE_NOT_AFTER) {
+                result.push(KeyParameter {
+                    tag: Tag::CERTIFICATE_NOT_AFTER,
+                    value: KeyParameterValue::DateTime(UNDEFINED_NOT_AFTER),
+                })
+            }
+        }
+        _ => {}
+    }
+}
+
+/// The attestation application ID of a caller, or the error code of `keystore2_aaid::get_aaid`.
+type AaidResult = std::result::Result<Vec<u8>, u32>;
+
+/// Answers in place of the package manager while set, see `stub_package_manager`.
+#[cfg(test)]
+static PACKAGE_MANAGER_STUB: std::sync::Mutex<
+    Option<Arc<dyn Fn(u32) -> AaidResult + Send + Sync>>,
+> = std::sync::Mutex::new(None);
+
+/// Makes `fetch_aaid` call `get_aaid` instead of the package manager, for tests that run the
+/// service in-process. It applies to all threads, as the ID is fetched on a thread of its own.
+#[cfg(test)]
+pub fn stub_package_manager(get_aaid: impl Fn(u32) -> AaidResult + Send + Sync + 'static) {
+    *PACKAGE_MANAGER_STUB.lock().unwrap() = Some(Arc::new(get_aaid));
+}
+
+/// Fetches the attestation application ID of `uid` from the package manager.
+fn fetch_aaid(uid: u32, security_level: SecurityLevel) -> AaidResult {
+    #[cfg(test)]
+    if let Some(get_aaid) = PACKAGE_MANAGER_STUB.lock().unwrap().clone() {
+        return get_aaid(uid);
+    }
+    let _wp = wd::watch_millis_with(
+        " KeystoreSecurityLevel::add_required_parameters: calling get_aaid",
+        wd::DEFAULT_TIMEOUT_MS,
+        security_level,
+    );
+    keystore2_aaid::get_aaid(uid)
+}
+
+/// Calls `f` and returns its result along with how long it took.
+fn timed<T>(f: impl FnOnce() -> T) -> (T, Duration) {
+    let start = Instant::now();
+    let result = f();
+    (result, start.elapsed())
+}
+
+/// Runs the independent steps that prepare a key generation concurrently, so that the caller
+/// waits for the slowest of them rather than for their sum. `fetch_aaid`, a round trip to the
+/// package manager, runs on a scoped thread. `get_attestation_key`, which may call out to RKPD or
+/// load a key from the database, runs on the calling thread, because its permission checks depend
+/// on the caller's binder identity and the database connection is per thread. Both results are
+/// returned along with their latencies without being looked at, so that the caller can apply the
+/// error precedence of the sequential order.
+fn prepare_concurrently<A, K>(
+    fetch_aaid: Option<impl FnOnce() -> A + Send>,
+    get_attestation_key: impl FnOnce() -> K,
+) -> (Option<(A, Duration)>, (K, Duration))
+where
+    A: Send,
+{
+    std::thread::scope(|s| {
+        let aaid = fetch_aaid.map(|fetch_aaid| s.spawn(|| timed(fetch_aaid)));
+        let attestation_key = timed(get_attestation_key);
+        let aaid = aaid
+            .map(|handle| handle.join().unwrap_or_else(|panic| std::panic::resume_unwind(panic)));
+        (aaid, attestation_key)
+    })
+}
+
 impl KeystoreSecurityLevel {
     /// Creates a new security level instance wrapped in a
     /// BnKeystoreSecurityLevel proxy object. It also enables
@@ -91,8 +195,44 @@ impl KeystoreSecurityLevel {
         security_level: SecurityLevel,
         id_rotation_state: IdRotationState,
     ) -> Result<(Strong<dyn IKeystoreSecurityLevel>, Uuid)> {
+        Self::new_native_binder_with_pool(security_level, id_rotation_state, |dev, hw_info| {
+            Self::key_pool(security_level, dev, hw_info)
+        })
+    }
+
+    /// Like `new_native_binder`, but pre-generates keys for `pool_templates` rather than for the
+    /// templates configured on the device, for tests that run the service in-process with a
+    /// KeyMint device set by `globals::set_keymint_device`.
+    #[cfg(test)]
+    pub fn new_for_test(
+        security_level: SecurityLevel,
+        id_rotation_state: IdRotationState,
+        pool_templates: Vec<(Vec<KeyParameter>, usize)>,
+        pool_max_age: Duration,
+    ) -> Result<(Strong<dyn IKeystoreSecurityLevel>, Uuid)> {
+        Self::new_native_binder_with_pool(security_level, id_rotation_state, |dev, hw_info| {
+            if pool_templates.is_empty() {
+                return None;
+            }
+            let generator = Self::pool_generator(security_level, dev, hw_info);
+            let pool = KeyPool::new(pool_templates, pool_max_age, generator)
+                .expect("Invalid key pool templates.");
+            pool.schedule_refill();
+            Some(pool)
+        })
+    }
+
+    fn new_native_binder_with_pool<P>(
+        security_level: SecurityLevel,
+        id_rotation_state: IdRotationState,
+        key_pool: P,
+    ) -> Result<(Strong<dyn IKeystoreSecurityLevel>, Uuid)>
+    where
+        P: FnOnce(&Strong<dyn IKeyMintDevice>, &KeyMintHardwareInfo) -> Option<Arc<KeyPool>>,
+    {
         let (dev, hw_info, km_uuid) = get_keymint_device(&security_level)
             .context(ks_err!("KeystoreSecurityLevel::new_native_binder."))?;
+        let key_pool = key_pool(&dev, &hw_info);
         let result = BnKeystoreSecurityLevel::new_binder(
             Self {
                 security_level,
@@ -102,6 +242,7 @@ impl KeystoreSecurityLevel {
                 operation_db: OperationDb::new(),
                 rem_prov_state: RemProvState::new(security_level),
                 id_rotation_state,
+                key_pool,
             },
             BinderFeatures { set_requesting_sid: true, ..BinderFeatures::default() },
         );
@@ -401,11 +542,15 @@ impl KeystoreSecurityLevel {
         })
     }
 
+    /// Adds the parameters that Keystore controls to `params`. If `params` request attestation,
+    /// `aaid` is used as the attestation application ID if it was fetched in advance, otherwise it
+    /// is fetched here.
     fn add_required_parameters(
         &self,
         uid: u32,
         params: &[KeyParameter],
         key: &KeyDescriptor,
+        aaid: Option<AaidResult>,
     ) -> Result<Vec<KeyParameter>> {
         let mut result = params.to_vec();
 
@@ -423,30 +568,12 @@ impl KeystoreSecurityLevel {
 
         // Add CREATION_DATETIME only if the backend version Keymint V1 (100) or newer.
         if self.hw_info.versionNumber >= 100 {
-            result.push(KeyParameter {
-                tag: Tag::CREATION_DATETIME,
-                value: KeyParameterValue::DateTime(
-                    creation_datetime
-                        .duration_since(SystemTime::UNIX_EPOCH)
-                        .context(ks_err!(
-                            "KeystoreSecurityLevel::add_required_parameters: \
-                                Failed to get epoch time."
-                        ))?
-                        .as_millis()
-                        .try_into()
-                        .context(ks_err!(
-                            "KeystoreSecurityLevel::add_required_parameters: \
-                                Failed to convert epoch time."
-                        ))?,
-                ),
-            });
+            result.push(creation_datetime_parameter(creation_datetime).context(ks_err!())?);
         }
 
         // If there is an attestation challenge we need to get an application id.
         if params.iter().any(|kp| kp.tag == Tag::ATTESTATION_CHALLENGE) {
-            let _wp =
-                self.watch(" KeystoreSecurityLevel::add_required_parameters: calling get_aaid");
-            match keystore2_aaid::get_aaid(uid) {
+            match aaid.unwrap_or_else(|| fetch_aaid(uid, self.security_level)) {
                 Ok(aaid_ok) => {
                     result.push(KeyParameter {
                         tag: Tag::ATTESTATION_APPLICATION_ID,
@@ -491,29 +618,48 @@ impl KeystoreSecurityLevel {
             ))?;
         }
 
-        // If we are generating/importing an asymmetric key, we need to make sure
-        // that NOT_BEFORE and NOT_AFTER are present.
-        match params.iter().find(|kp| kp.tag == Tag::ALGORITHM) {
-            Some(KeyParameter { tag: _, value: KeyParameterValue::Algorithm(Algorithm::RSA) })
-            | Some(KeyParameter { tag: _, value: KeyParameterValue::Algorithm(Algorithm::EC) }) => {
-                if !params.iter().any(|kp| kp.tag == Tag::CERTIFICATE_NOT_BEFORE) {
-                    result.push(KeyParameter {
-                        tag: Tag::CERTIFICATE_NOT_BEFORE,
-                        value: KeyParameterValue::DateTime(0),
-                    })
-                }
-                if !params.iter().any(|kp| kp.tag == Tag::CERTIFICATE_NOT_AFTER) {
-                    result.push(KeyParameter {
-                        tag: Tag::CERTIFICATE_NOT_AFTER,
-                        value: KeyParameterValue::DateTime(UNDEFINED_NOT_AFTER),
-                    })
-                }
-            }
-            _ => {}
-        }
+        add_certificate_validity(params, &mut result);
         Ok(result)
     }
 
+    /// Returns the pool of pre-generated keys for the templates configured for this security
+    /// level, if any.
+    fn key_pool(
+        security_level: SecurityLevel,
+        keymint: &Strong<dyn IKeyMintDevice>,
+        hw_info: &KeyMintHardwareInfo,
+    ) -> Option<Arc<KeyPool>> {
+        key_pregeneration::pool_for(
+            security_level,
+            Self::pool_generator(security_level, keymint, hw_info),
+        )
+    }
+
+    /// Returns the function with which a key pool generates keys, like `generate_key` does
+    /// without an attestation key.
+    fn pool_generator(
+        security_level: SecurityLevel,
+        keymint: &Strong<dyn IKeyMintDevice>,
+        hw_info: &KeyMintHardwareInfo,
+    ) -> key_pregeneration::Generator {
+        let keymint = keymint.clone();
+        let km_version = hw_info.versionNumber;
+        Box::new(move |template| {
+            let mut params = template.to_vec();
+            if km_version >= 100 {
+                params.push(creation_datetime_parameter(SystemTime::now()).context(ks_err!())?);
+            }
+            add_certificate_validity(template, &mut params);
+            let _wp = wd::watch_millis_with(
+                "KeyPool: calling IKeyMintDevice::generate_key",
+                5000, // Generate can take a little longer.
+                security_level,
+            );
+            map_km_error(keymint.generateKey(&params, None))
+                .context(ks_err!("While pre-generating a key."))
+        })
+    }
+
     fn generate_key(
         &self,
         key: &KeyDescriptor,
@@ -542,10 +688,36 @@ impl KeystoreSecurityLevel {
         // Must return on error for security reasons.
         check_key_permission(KeyPerm::Rebind, &key, &None).context(ks_err!())?;
 
-        let attestation_key_info = match (key.domain, attest_key_descriptor) {
-            (Domain::BLOB, _) => None,
-            _ => DB
-                .with(|db| {
+        // A key pre-generated for exactly these parameters can be bound to the alias right away.
+        // Templates exclude attestation, so an attestation key rules the pool out.
+        let pooled_key = match (&self.key_pool, attest_key_descriptor) {
+            (Some(pool), None) => pool.take(params),
+            _ => None,
+        };
+        if let Some(creation_result) = pooled_key {
+            let user_id = uid_to_android_user(caller_uid);
+            return self
+                .store_new_key(key, creation_result, user_id, Some(flags))
+                .context(ks_err!("While binding a pre-generated key."));
+        }
+        // Keep the pool from competing with this generation for KeyMint.
+        let _foreground_generation =
+            self.key_pool.as_ref().map(|pool| pool.foreground_generation());
+
+        // The attestation application ID and the attestation key are fetched concurrently. The
+        // errors take precedence in the order in which the steps used to run one after another.
+        let preparation_start = Instant::now();
+        let challenge_present = params.iter().any(|kp| kp.tag == Tag::ATTESTATION_CHALLENGE);
+        let attestation_key_needed =
+            key.domain != Domain::BLOB && (attest_key_descriptor.is_some() || challenge_present);
+        let security_level = self.security_level;
+        let (aaid, (attestation_key_info, attestation_key_latency)) = prepare_concurrently(
+            challenge_present.then_some(move || fetch_aaid(caller_uid, security_level)),
+            || {
+                if !attestation_key_needed {
+                    return Ok(None);
+                }
+                DB.with(|db| {
                     get_attest_key_info(
                         &key,
                         caller_uid,
@@ -555,42 +727,65 @@ impl KeystoreSecurityLevel {
                         &mut db.borrow_mut(),
                     )
                 })
-                .context(ks_err!("Trying to get an attestation key"))?,
-        };
+            },
+        );
+        if let Some((_, aaid_latency)) = &aaid {
+            log_key_creation_phase_latency(
+                self.security_level,
+                KeyCreationPhase::ATTESTATION_APPLICATION_ID,
+                *aaid_latency,
+            );
+        }
+        if attestation_key_needed {
+            log_key_creation_phase_latency(
+                self.security_level,
+                KeyCreationPhase::ATTESTATION_KEY,
+                attestation_key_latency,
+            );
+        }
+        let attestation_key_info =
+            attestation_key_info.context(ks_err!("Trying to get an attestation key"))?;
         let params = self
-            .add_required_parameters(caller_uid, params, &key)
+            .add_required_parameters(caller_uid, params, &key, aaid.map(|(aaid, _)| aaid))
             .context(ks_err!("Trying to get aaid."))?;
+        log_key_creation_phase_latency(
+            self.security_level,
+            KeyCreationPhase::PREPARATION,
+            preparation_start.elapsed(),
+        );
+
+        let generation_start = Instant::now();
 
         let creation_result = match attestation_key_info {
-            Some(AttestationKeyInfo::UserGenerated {
-                key_id_guard,
-                blob,
-                blob_metadata,
-                issuer_subject,
-            }) => self
-                .upgrade_keyblob_if_required_with(
-                    Some(key_id_guard),
-                    &KeyBlob::Ref(&blob),
-                    blob_metadata.km_uuid().copied(),
-                    &params,
-                    |blob| {
-                        let attest_key = Some(AttestationKey {
-                            keyBlob: blob.to_vec(),
-                            attestKeyParams: vec![],
-                            issuerSubjectName: issuer_subject.clone(),
-                        });
-                        map_km_error({
-                            let _wp = self.watch_millis(
-                                concat!(
-                                    "KeystoreSecurityLevel::generate_key (UserGenerated): ",
-                                    "calling IKeyMintDevice::generate_key"
-                                ),
-                                5000, // Generate can take a little longer.
-                            );
-                            self.keymint.generateKey(&params, attest_key.as_ref())
-                        })
-                    },
-                )
+            Some(AttestationKeyInfo::UserGenerated { key_id, blob, issuer_subject }) => DB
+                .with(|db| {
+                    use_user_generated_attestation_key(
+                        &*self.keymint,
+                        self.hw_info.versionNumber,
+                        key_id,
+                        &blob,
+                        &params,
+                        caller_uid,
+                        db,
+                        |blob| {
+                            let attest_key = Some(AttestationKey {
+                                keyBlob: blob.to_vec(),
+                                attestKeyParams: vec![],
+                                issuerSubjectName: issuer_subject.clone(),
+                            });
+                            map_km_error({
+                                let _wp = self.watch_millis(
+                                    concat!(
+                                        "KeystoreSecurityLevel::generate_key (UserGenerated): ",
+                                        "calling IKeyMintDevice::generate_key"
+                                    ),
+                                    5000, // Generate can take a little longer.
+                                );
+                                self.keymint.generateKey(&params, attest_key.as_ref())
+                            })
+                        },
+                    )
+                })
                 .context(ks_err!(
                     "While generating with a user-generated \
                       attestation key, params: {:?}.",
@@ -642,10 +837,23 @@ impl KeystoreSecurityLevel {
                 log_security_safe_params(&params)
             )),
         }
-        .context(ks_err!())?;
+        .context(ks_err!());
+        log_key_creation_phase_latency(
+            self.security_level,
+            KeyCreationPhase::KEYMINT_GENERATION,
+            generation_start.elapsed(),
+        );
+        let creation_result = creation_result?;
 
         let user_id = uid_to_android_user(caller_uid);
-        self.store_new_key(key, creation_result, user_id, Some(flags)).context(ks_err!())
+        let (result, storage_latency) =
+            timed(|| self.store_new_key(key, creation_result, user_id, Some(flags)));
+        log_key_creation_phase_latency(
+            self.security_level,
+            KeyCreationPhase::STORAGE,
+            storage_latency,
+        );
+        result.context(ks_err!())
     }
 
     fn import_key(
@@ -676,7 +884,7 @@ impl KeystoreSecurityLevel {
         check_key_permission(KeyPerm::Rebind, &key, &None).context(ks_err!("In import_key."))?;
 
         let params = self
-            .add_required_parameters(caller_uid, params, &key)
+            .add_required_parameters(caller_uid, params, &key, None)
             .context(ks_err!("Trying to get aaid."))?;
 
         let format = params
@@ -1086,13 +1294,149 @@ mod tests {
     use super::*;
     use crate::error::map_km_error;
     use crate::globals::get_keymint_device;
+    use crate::test_keymint::Rendezvous;
     use crate::utils::upgrade_keyblob_if_required_with;
     use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
-        Algorithm::Algorithm, AttestationKey::AttestationKey, KeyParameter::KeyParameter,
-        KeyParameterValue::KeyParameterValue, Tag::Tag,
+        Algorithm::Algorithm, AttestationKey::AttestationKey, Certificate::Certificate,
+        KeyParameter::KeyParameter, KeyParameterValue::KeyParameterValue, Tag::Tag,
     };
     use keystore2_crypto::parse_subject_from_certificate;
     use rkpd_client::get_rkpd_attestation_key;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::thread;
+
+    const CALLER_UID: u32 = 10001;
+    const AAID: &[u8] = b"attestation application id";
+
+    /// A package manager that answers attestation application ID requests after `delay`. Each
+    /// request first meets `rendezvous`, if set.
+    struct FakePackageManager {
+        delay: Duration,
+        aaid: AaidResult,
+        calls: AtomicUsize,
+        rendezvous: Option<Arc<Rendezvous>>,
+    }
+
+    impl FakePackageManager {
+        fn new(delay: Duration, aaid: AaidResult) -> Self {
+            Self { delay, aaid, calls: AtomicUsize::new(0), rendezvous: None }
+        }
+
+        fn get_aaid(&self, uid: u32) -> AaidResult {
+            assert_eq!(uid, CALLER_UID);
+            self.calls.fetch_add(1, Ordering::SeqCst);
+            if let Some(rendezvous) = &self.rendezvous {
+                rendezvous.meet();
+            }
+            thread::sleep(self.delay);
+            self.aaid.clone()
+        }
+    }
+
+    /// An RKPD that hands out a remotely provisioned attestation key after `delay`, or fails if
+    /// it is `out_of_keys`. Each call first meets `rendezvous`, if set.
+    struct FakeRkpd {
+        delay: Duration,
+        out_of_keys: bool,
+        rendezvous: Option<Arc<Rendezvous>>,
+    }
+
+    impl FakeRkpd {
+        fn get_attestation_key(&self) -> Result<Option<AttestationKeyInfo>> {
+            if let Some(rendezvous) = &self.rendezvous {
+                rendezvous.meet();
+            }
+            thread::sleep(self.delay);
+            if self.out_of_keys {
+                return Err(Error::Rc(ResponseCode::OUT_OF_KEYS_TRANSIENT_ERROR))
+                    .context(ks_err!("Trying to get attestation key from RKPD."));
+            }
+            Ok(Some(AttestationKeyInfo::RkpdProvisioned {
+                attestation_key: AttestationKey {
+                    keyBlob: b"rkpd key blob".to_vec(),
+                    attestKeyParams: vec![],
+                    issuerSubjectName: vec![],
+                },
+                attestation_certs: Certificate { encodedCertificate: b"rkpd certs".to_vec() },
+            }))
+        }
+    }
+
+    #[test]
+    fn test_preparation_latency_is_max_not_sum() {
+        // Both lookups wait for each other, which only works out if they overlap.
+        let rendezvous = Rendezvous::new(2);
+        let mut package_manager =
+            FakePackageManager::new(Duration::from_millis(300), Ok(AAID.to_vec()));
+        package_manager.rendezvous = Some(rendezvous.clone());
+        let rkpd = FakeRkpd {
+            delay: Duration::from_millis(400),
+            out_of_keys: false,
+            rendezvous: Some(rendezvous.clone()),
+        };
+
+        let (aaid, (attestation_key, attestation_key_latency)) =
+            prepare_concurrently(Some(|| package_manager.get_aaid(CALLER_UID)), || {
+                rkpd.get_attestation_key()
+            });
+
+        let (aaid, aaid_latency) = aaid.unwrap();
+        assert_eq!(aaid, Ok(AAID.to_vec()));
+        assert!(matches!(
+            attestation_key.unwrap(),
+            Some(AttestationKeyInfo::RkpdProvisioned { .. })
+        ));
+        assert!(aaid_latency >= Duration::from_millis(300), "{aaid_latency:?}");
+        assert!(
+            attestation_key_latency >= Duration::from_millis(400),
+            "{attestation_key_latency:?}"
+        );
+        assert_eq!(rendezvous.calls(), (2, 2));
+    }
+
+    #[test]
+    fn test_preparation_returns_both_errors() {
+        let package_manager = FakePackageManager::new(
+            Duration::ZERO,
+            Err(ResponseCode::GET_ATTESTATION_APPLICATION_ID_FAILED.0 as u32),
+        );
+        let rkpd =
+            FakeRkpd { delay: Duration::from_millis(100), out_of_keys: true, rendezvous: None };
+
+        let (aaid, (attestation_key, _)) =
+            prepare_concurrently(Some(|| package_manager.get_aaid(CALLER_UID)), || {
+                rkpd.get_attestation_key()
+            });
+
+        // The package manager failed first, but both results are there for the caller to give
+        // the attestation key error precedence.
+        assert_eq!(
+            aaid.unwrap().0,
+            Err(ResponseCode::GET_ATTESTATION_APPLICATION_ID_FAILED.0 as u32)
+        );
+        assert_eq!(
+            attestation_key.err().unwrap().downcast_ref::<Error>(),
+            Some(&Error::Rc(ResponseCode::OUT_OF_KEYS_TRANSIENT_ERROR))
+        );
+    }
+
+    #[test]
+    fn test_preparation_gets_attestation_key_on_calling_thread() {
+        let package_manager = FakePackageManager::new(Duration::ZERO, Ok(AAID.to_vec()));
+        let caller = thread::current().id();
+
+        let (aaid, (attestation_key_thread, _)) = prepare_concurrently(
+            Some(|| (package_manager.get_aaid(CALLER_UID), thread::current().id())),
+            || thread::current().id(),
+        );
+        assert_eq!(attestation_key_thread, caller);
+        assert_ne!(aaid.unwrap().0 .1, caller);
+
+        // Without an attestation challenge, the package manager is not asked at all.
+        let (aaid, _) = prepare_concurrently(None::<fn() -> AaidResult>, || thread::current().id());
+        assert!(aaid.is_none());
+        assert_eq!(package_manager.calls.load(Ordering::SeqCst), 1);
+    }
 
     #[test]
     // This is a helper for a manual test. We want to check that after a system upgrade RKPD
@@ -85,7 +85,26 @@ impl KeystoreService {
             result.uuid_by_sec_level.insert(SecurityLevel::STRONGBOX, uuid);
         }
 
-        let uuid_by_sec_level = result.uuid_by_sec_level.clone();
+        result.into_native_binder()
+    }
+
+    /// Creates the service for `security_levels`, each given with its binder and the uuid of its
+    /// KeyMint device as returned by `KeystoreSecurityLevel::new_for_test`, for tests that run
+    /// the service in-process.
+    #[cfg(test)]
+    pub fn new_for_test(
+        security_levels: Vec<(SecurityLevel, Strong<dyn IKeystoreSecurityLevel>, Uuid)>,
+    ) -> Result<Strong<dyn IKeystoreService>> {
+        let mut result: Self = Default::default();
+        for (sec_level, dev, uuid) in security_levels {
+            result.i_sec_level_by_uuid.insert(uuid, dev);
+            result.uuid_by_sec_level.insert(sec_level, uuid);
+        }
+        result.into_native_binder()
+    }
+
+    fn into_native_binder(self) -> Result<Strong<dyn IKeystoreService>> {
+        let uuid_by_sec_level = self.uuid_by_sec_level.clone();
         LEGACY_IMPORTER
             .set_init(move || {
                 (create_thread_local_db(), uuid_by_sec_level, LEGACY_BLOB_LOADER.clone())
@@ -93,7 +112,7 @@ impl KeystoreService {
             .context(ks_err!("Trying to initialize the legacy migrator."))?;
 
         Ok(BnKeystoreService::new_binder(
-            result,
+            self,
             BinderFeatures { set_requesting_sid: true, ..BinderFeatures::default() },
         ))
     }
@@ -29,15 +29,22 @@ use keystore2_hal_names::get_hidl_instances;
 use std::fmt::{self, Display, Formatter};
 use std::time::Duration;
 
+/// Delay before the first retry of a participant that is not ready yet.
+const RETRY_INITIAL_DELAY: Duration = Duration::from_millis(10);
+/// Upper bound for the delay between two retries of a participant that is not ready yet.
+const RETRY_MAX_DELAY: Duration = Duration::from_millis(1000);
+
 /// This function initiates the shared secret negotiation. It starts a thread and then returns
 /// immediately. The thread gets hal names from the android ServiceManager. It then attempts
-/// to connect to all of these participants. If any connection fails the thread will retry once
-/// per second to connect to the failed instance(s) until all of the instances are connected.
-/// It then performs the negotiation.
+/// to connect to all of these participants concurrently. AIDL participants are waited for using
+/// service registration notifications. Any other failed connection is retried with exponential
+/// backoff, starting at `RETRY_INITIAL_DELAY` and capped at `RETRY_MAX_DELAY`, until all of the
+/// instances are connected. It then performs the negotiation.
 ///
-/// During the first phase of the negotiation it will again try every second until
-/// all instances have responded successfully to account for instances that register early but
-/// are not fully functioning at this time due to hardware delays or boot order dependency issues.
+/// During the first phase of the negotiation all participants are queried concurrently, and each
+/// is again retried with exponential backoff until it has responded successfully to account for
+/// instances that register early but are not fully functioning at this time due to hardware
+/// delays or boot order dependency issues.
 /// An error during the second phase or a checksum mismatch leads to a panic.
 pub fn perform_shared_secret_negotiation() {
     std::thread::spawn(|| {
@@ -82,6 +89,8 @@ impl Display for SharedSecretParticipant {
 
 #[derive(thiserror::Error, Debug)]
 enum SharedSecretError {
+    #[error("Unable to connect to instance {p} with error {e:?}.")]
+    Connection { e: Error, p: SharedSecretParticipant },
     #[error("Shared parameter retrieval failed on instance {p} with error {e:?}.")]
     ParameterRetrieval { e: Error, p: SharedSecretParticipant },
     #[error("Shared secret computation failed on instance {p} with error {e:?}.")]
@@ -149,109 +158,119 @@ fn list_participants() -> Result<Vec<SharedSecretParticipant>> {
         .collect())
 }
 
-fn connect_participants(
-    mut participants: Vec<SharedSecretParticipant>,
-) -> Vec<(Strong<dyn ISharedSecret>, SharedSecretParticipant)> {
-    let mut connected_participants: Vec<(Strong<dyn ISharedSecret>, SharedSecretParticipant)> =
-        vec![];
-    loop {
-        let (connected, not_connected) = participants.into_iter().fold(
-            (connected_participants, vec![]),
-            |(mut connected, mut failed), e| {
-                match e {
-                    SharedSecretParticipant::Aidl(instance_name) => {
-                        let service_name = format!(
-                            "{}/{}",
-                            <BpSharedSecret as ISharedSecret>::get_descriptor(),
-                            instance_name
-                        );
-                        match map_binder_status_code(binder::get_interface(&service_name)) {
-                            Err(e) => {
-                                log::warn!(
-                                    "Unable to connect \"{}\" with error:\n{:?}\nRetrying later.",
-                                    service_name,
-                                    e
-                                );
-                                failed.push(SharedSecretParticipant::Aidl(instance_name));
-                            }
-                            Ok(service) => connected
-                                .push((service, SharedSecretParticipant::Aidl(instance_name))),
-                        }
-                    }
-                    SharedSecretParticipant::Hidl { is_strongbox, version } => {
-                        // This is a no-op if it was called before.
-                        keystore2_km_compat::add_keymint_device_service();
-
-                        // If we cannot connect to the compatibility service there is no way to
-                        // recover.
-                        // PANIC! - Unless you brought your towel.
-                        let keystore_compat_service: Strong<dyn IKeystoreCompatService> =
-                            map_binder_status_code(binder::get_interface(COMPAT_PACKAGE_NAME))
-                                .expect(
-                                    "In connect_participants: Trying to connect to compat service.",
-                                );
-
-                        match map_binder_status(keystore_compat_service.getSharedSecret(
-                            if is_strongbox {
-                                SecurityLevel::STRONGBOX
-                            } else {
-                                SecurityLevel::TRUSTED_ENVIRONMENT
-                            },
-                        )) {
+/// Exponential backoff between retries of a single participant.
+struct Backoff {
+    next: Duration,
+    max: Duration,
+}
+
+impl Backoff {
+    fn new(initial: Duration, max: Duration) -> Self {
+        Self { next: initial, max }
+    }
+
+    /// Sleeps for the current delay and doubles it for the next call, up to the maximum.
+    fn sleep(&mut self) {
+        std::thread::sleep(self.next);
+        self.next = std::cmp::min(self.next * 2, self.max);
+    }
+}
+
+/// Calls `op` for all `participants` concurrently, one thread per participant. Each call that
+/// fails is logged and retried with exponential backoff until it succeeds. So the total latency
+/// is determined by the slowest participant rather than by a fixed polling interval. The results
+/// are returned in the order of `participants`. A panic in `op` is propagated to the caller.
+fn retry_concurrently<P, T, E, F>(
+    participants: &[P],
+    initial_delay: Duration,
+    max_delay: Duration,
+    op: F,
+) -> Vec<T>
+where
+    P: Sync,
+    T: Send,
+    E: Display,
+    F: Fn(&P) -> Result<T, E> + Sync,
+{
+    std::thread::scope(|s| {
+        let handles: Vec<_> = participants
+            .iter()
+            .map(|p| {
+                let op = &op;
+                s.spawn(move || {
+                    let mut backoff = Backoff::new(initial_delay, max_delay);
+                    loop {
+                        match op(p) {
+                            Ok(t) => break t,
                             Err(e) => {
-                                log::warn!(
-                                    concat!(
-                                        "Unable to connect keymaster device \"{}\" ",
-                                        "with error:\n{:?}\nRetrying later."
-                                    ),
-                                    if is_strongbox { "strongbox" } else { "TEE" },
-                                    e
-                                );
-                                failed
-                                    .push(SharedSecretParticipant::Hidl { is_strongbox, version });
+                                log::warn!("{} Retrying in {:?}.", e, backoff.next);
+                                backoff.sleep();
                             }
-                            Ok(service) => connected.push((
-                                service,
-                                SharedSecretParticipant::Hidl { is_strongbox, version },
-                            )),
                         }
                     }
-                }
-                (connected, failed)
-            },
-        );
-        participants = not_connected;
-        connected_participants = connected;
-        if participants.is_empty() {
-            break;
+                })
+            })
+            .collect();
+        handles
+            .into_iter()
+            .map(|handle| handle.join().unwrap_or_else(|e| std::panic::resume_unwind(e)))
+            .collect()
+    })
+}
+
+fn connect_participant(
+    participant: &SharedSecretParticipant,
+) -> Result<Strong<dyn ISharedSecret>, SharedSecretError> {
+    match participant {
+        SharedSecretParticipant::Aidl(instance_name) => {
+            let service_name = format!(
+                "{}/{}",
+                <BpSharedSecret as ISharedSecret>::get_descriptor(),
+                instance_name
+            );
+            // The instance was declared, so block until the service manager notifies us about
+            // its registration instead of polling for it.
+            map_binder_status_code(binder::wait_for_interface(&service_name))
+        }
+        SharedSecretParticipant::Hidl { is_strongbox, .. } => {
+            // This is a no-op if it was called before.
+            keystore2_km_compat::add_keymint_device_service();
+
+            // If we cannot connect to the compatibility service there is no way to
+            // recover.
+            // PANIC! - Unless you brought your towel.
+            let keystore_compat_service: Strong<dyn IKeystoreCompatService> =
+                map_binder_status_code(binder::get_interface(COMPAT_PACKAGE_NAME))
+                    .expect("In connect_participant: Trying to connect to compat service.");
+
+            map_binder_status(keystore_compat_service.getSharedSecret(if *is_strongbox {
+                SecurityLevel::STRONGBOX
+            } else {
+                SecurityLevel::TRUSTED_ENVIRONMENT
+            }))
         }
-        std::thread::sleep(Duration::from_millis(1000));
     }
-    connected_participants
+    .map_err(|e| SharedSecretError::Connection { e, p: participant.clone() })
+}
+
+fn connect_participants(
+    participants: Vec<SharedSecretParticipant>,
+) -> Vec<(Strong<dyn ISharedSecret>, SharedSecretParticipant)> {
+    retry_concurrently(&participants, RETRY_INITIAL_DELAY, RETRY_MAX_DELAY, connect_participant)
+        .into_iter()
+        .zip(participants)
+        .collect()
 }
 
 fn negotiate_shared_secret(
     participants: Vec<(Strong<dyn ISharedSecret>, SharedSecretParticipant)>,
 ) {
     // Phase 1: Get the sharing parameters from all participants.
-    let mut params = loop {
-        let result: Result<Vec<SharedSecretParameters>, SharedSecretError> = participants
-            .iter()
-            .map(|(s, p)| {
-                map_binder_status(s.getSharedSecretParameters())
-                    .map_err(|e| SharedSecretError::ParameterRetrieval { e, p: (*p).clone() })
-            })
-            .collect();
-
-        match result {
-            Err(e) => {
-                log::warn!("{:?}", e);
-                log::warn!("Retrying in one second.");
-                std::thread::sleep(Duration::from_millis(1000));
-            }
-            Ok(params) => break params,
-        }
-    };
+    let mut params: Vec<SharedSecretParameters> =
+        retry_concurrently(&participants, RETRY_INITIAL_DELAY, RETRY_MAX_DELAY, |(s, p)| {
+            map_binder_status(s.getSharedSecretParameters())
+                .map_err(|e| SharedSecretError::ParameterRetrieval { e, p: p.clone() })
+        });
 
     params.sort_unstable();
 
@@ -326,3 +345,83 @@ pub fn transfer_root_of_trust() {
     }
     log::info!("RootOfTrust transfer process complete");
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::test_keymint::Rendezvous;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::Arc;
+
+    /// A participant that only becomes reachable after `failures` failed attempts. Its first
+    /// attempt meets `first_attempt`, which all participants of a test share.
+    struct FakeParticipant {
+        name: &'static str,
+        failures: usize,
+        attempts: AtomicUsize,
+        first_attempt: Arc<Rendezvous>,
+    }
+
+    impl FakeParticipant {
+        fn new(name: &'static str, failures: usize, first_attempt: &Arc<Rendezvous>) -> Self {
+            Self {
+                name,
+                failures,
+                attempts: AtomicUsize::new(0),
+                first_attempt: first_attempt.clone(),
+            }
+        }
+
+        fn connect(&self) -> Result<&'static str, String> {
+            let attempt = self.attempts.fetch_add(1, Ordering::SeqCst);
+            if attempt == 0 {
+                self.first_attempt.meet();
+            }
+            if attempt >= self.failures {
+                Ok(self.name)
+            } else {
+                Err(format!("{} is not available yet.", self.name))
+            }
+        }
+    }
+
+    #[test]
+    fn test_backoff_is_capped() {
+        let mut backoff = Backoff::new(Duration::from_millis(1), Duration::from_millis(5));
+        let mut delays = vec![];
+        for _ in 0..5 {
+            delays.push(backoff.next);
+            backoff.sleep();
+        }
+        assert_eq!(
+            delays,
+            [1, 2, 4, 5, 5].iter().map(|ms| Duration::from_millis(*ms)).collect::<Vec<_>>()
+        );
+    }
+
+    #[test]
+    fn test_staggered_participants_are_retried_concurrently() {
+        let first_attempt = Rendezvous::new(3);
+        let participants = [
+            FakeParticipant::new("tee", 0, &first_attempt),
+            FakeParticipant::new("strongbox", 3, &first_attempt),
+            FakeParticipant::new("late", 6, &first_attempt),
+        ];
+
+        let connected = retry_concurrently(
+            &participants,
+            Duration::from_millis(1),
+            Duration::from_millis(5),
+            FakeParticipant::connect,
+        );
+
+        // Results are returned in the order of the participants.
+        assert_eq!(connected, ["tee", "strongbox", "late"]);
+        // All participants were tried at the same time rather than one after the other.
+        assert_eq!(first_attempt.calls(), (3, 3));
+        // Each participant was retried until it was reachable, and no more.
+        let attempts: Vec<_> =
+            participants.iter().map(|p| p.attempts.load(Ordering::SeqCst)).collect();
+        assert_eq!(attempts, [1, 4, 7]);
+    }
+}
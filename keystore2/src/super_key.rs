@@ -186,6 +186,7 @@ impl AesGcm for SuperKey {
 
 /// A SuperKey that has been encrypted with an AES-GCM key. For
 /// encryption the key is in memory, and for decryption it is in KM.
+#[derive(Clone)]
 struct LockedKey {
     algorithm: SuperEncryptionAlgorithm,
     id: SuperKeyIdentifier,
@@ -239,6 +240,7 @@ impl LockedKey {
 
 /// A user's UnlockedDeviceRequired super keys, encrypted with a biometric-bound key, and
 /// information about that biometric-bound key.
+#[derive(Clone)]
 struct BiometricUnlock {
     /// List of auth token SIDs that are accepted by the encrypting biometric-bound key.
     sids: Vec<i64>,
@@ -286,12 +288,24 @@ impl SkmState {
     }
 }
 
+/// Holds the in-memory super keys of all users. Lookups take the `RwLock` around the manager for
+/// reading. Unlocking, locking, initializing and removing a user are associated functions that
+/// take the `RwLock` themselves: they serialize on a lock of their own per user, do the database,
+/// key derivation and KeyMint work while holding only that, and take the manager lock for writing
+/// just long enough to install the result. So one user's unlock never stalls key use by another.
+/// A user lock must never be acquired while holding the manager lock.
 #[derive(Default)]
 pub struct SuperKeyManager {
     data: SkmState,
+    user_locks: Mutex<HashMap<UserId, Arc<Mutex<()>>>>,
 }
 
 impl SuperKeyManager {
+    /// Returns the lock that serializes changes to the given user's super keys.
+    fn user_lock(skm: &RwLock<Self>, user_id: UserId) -> Arc<Mutex<()>> {
+        skm.read().unwrap().user_locks.lock().unwrap().entry(user_id).or_default().clone()
+    }
+
     pub fn set_up_boot_level_cache(skm: &Arc<RwLock<Self>>, db: &mut KeystoreDB) -> Result<()> {
         let mut skm_guard = skm.write().unwrap();
         if skm_guard.data.boot_level_key_cache.is_some() {
@@ -479,10 +493,7 @@ impl SuperKeyManager {
     }
 
     /// Checks if the user's AfterFirstUnlock super key exists in the database (or legacy database).
-    /// The reference to self is unused but it is required to prevent calling this function
-    /// concurrently with skm state database changes.
     fn super_key_exists_in_db_for_user(
-        &self,
         db: &mut KeystoreDB,
         legacy_importer: &LegacyImporter,
         user_id: UserId,
@@ -503,21 +514,6 @@ impl SuperKeyManager {
         }
     }
 
-    // Helper function to populate super key cache from the super key blob loaded from the database.
-    fn populate_cache_from_super_key_blob(
-        &mut self,
-        user_id: UserId,
-        algorithm: SuperEncryptionAlgorithm,
-        entry: KeyEntry,
-        pw: &Password,
-    ) -> Result<Arc<SuperKey>> {
-        let super_key = Self::extract_super_key_from_key_entry(algorithm, entry, pw, None)
-            .context(ks_err!("Failed to extract super key from key entry"))?;
-        self.install_after_first_unlock_key_for_user(user_id, super_key.clone())
-            .context(ks_err!("Failed to install AfterFirstUnlock super key for user!"))?;
-        Ok(super_key)
-    }
-
     /// Extracts super key from the entry loaded from the database.
     pub fn extract_super_key_from_key_entry(
         algorithm: SuperEncryptionAlgorithm,
@@ -740,7 +736,6 @@ impl SuperKeyManager {
     }
 
     fn create_super_key(
-        &mut self,
         db: &mut KeystoreDB,
         user_id: UserId,
         key_type: &SuperKeyType,
@@ -781,10 +776,9 @@ impl SuperKeyManager {
     }
 
     /// Fetch a superencryption key from the database, or create it if it doesn't already exist.
-    /// When this is called, the caller must hold the lock on the SuperKeyManager.
+    /// When this is called, the caller must hold the user lock.
     /// So it's OK that the check and creation are different DB transactions.
     fn get_or_create_super_key(
-        &mut self,
         db: &mut KeystoreDB,
         user_id: UserId,
         key_type: &SuperKeyType,
@@ -800,19 +794,22 @@ impl SuperKeyManager {
                 reencrypt_with,
             )?)
         } else {
-            self.create_super_key(db, user_id, key_type, password, reencrypt_with)
+            Self::create_super_key(db, user_id, key_type, password, reencrypt_with)
         }
     }
 
     /// Decrypt the UnlockedDeviceRequired super keys for this user using the password and store
-    /// them in memory. If these keys don't exist yet, create them.
-    pub fn unlock_unlocked_device_required_keys(
-        &mut self,
+    /// them in memory. If these keys don't exist yet, create them. The caller must hold the user
+    /// lock.
+    fn unlock_unlocked_device_required_keys(
+        skm: &RwLock<Self>,
         db: &mut KeystoreDB,
         user_id: UserId,
         password: &Password,
     ) -> Result<()> {
-        let (symmetric, private) = self
+        let (symmetric, private) = skm
+            .read()
+            .unwrap()
             .data
             .user_keys
             .get(&user_id)
@@ -834,7 +831,7 @@ impl SuperKeyManager {
             // keys was initialized. This should never happen.
             symmetric
         } else {
-            self.get_or_create_super_key(
+            Self::get_or_create_super_key(
                 db,
                 user_id,
                 &USER_UNLOCKED_DEVICE_REQUIRED_SYMMETRIC_SUPER_KEY,
@@ -849,7 +846,7 @@ impl SuperKeyManager {
             // keys was initialized. This should never happen.
             private
         } else {
-            self.get_or_create_super_key(
+            Self::get_or_create_super_key(
                 db,
                 user_id,
                 &USER_UNLOCKED_DEVICE_REQUIRED_P521_SUPER_KEY,
@@ -859,9 +856,10 @@ impl SuperKeyManager {
             .context(ks_err!("Trying to get or create asymmetric key."))?
         };
 
-        self.data.add_key_to_key_index(&aes)?;
-        self.data.add_key_to_key_index(&ecdh)?;
-        let entry = self.data.user_keys.entry(user_id).or_default();
+        let mut skm_guard = skm.write().unwrap();
+        skm_guard.data.add_key_to_key_index(&aes)?;
+        skm_guard.data.add_key_to_key_index(&ecdh)?;
+        let entry = skm_guard.data.user_keys.entry(user_id).or_default();
         entry.unlocked_device_required_symmetric = Some(aes);
         entry.unlocked_device_required_private = Some(ecdh);
         Ok(())
@@ -870,70 +868,46 @@ impl SuperKeyManager {
     /// Protects the user's UnlockedDeviceRequired super keys in a way such that they can only be
     /// unlocked by the enabled unlock methods.
     pub fn lock_unlocked_device_required_keys(
-        &mut self,
+        skm: &RwLock<Self>,
         db: &mut KeystoreDB,
         user_id: UserId,
         unlocking_sids: &[i64],
         weak_unlock_enabled: bool,
     ) {
-        let entry = self.data.user_keys.entry(user_id).or_default();
-        if unlocking_sids.is_empty() {
-            entry.biometric_unlock = None;
-        } else if let (Some(aes), Some(ecdh)) = (
-            entry.unlocked_device_required_symmetric.as_ref().cloned(),
-            entry.unlocked_device_required_private.as_ref().cloned(),
-        ) {
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
+
+        let plaintext_keys = skm.read().unwrap().data.user_keys.get(&user_id).and_then(|e| {
+            e.unlocked_device_required_symmetric
+                .clone()
+                .zip(e.unlocked_device_required_private.clone())
+        });
+        // The new biometric-encrypted copy of the keys, or None to keep the current one.
+        let biometric_unlock = if unlocking_sids.is_empty() {
+            Some(None)
+        } else if let Some((aes, ecdh)) = plaintext_keys {
             // If class 3 biometric unlock methods are enabled, create a biometric-encrypted copy of
             // the keys.  Do this even if weak unlock methods are enabled too; in that case we'll
             // also retain a plaintext copy of the keys, but that copy will be wiped later if weak
             // unlock methods expire.  So we need the biometric-encrypted copy too just in case.
-            let res = (|| -> Result<()> {
-                let key_desc =
-                    KeyMintDevice::internal_descriptor(format!("biometric_unlock_key_{}", user_id));
-                let encrypting_key = generate_aes256_key()?;
-                let km_dev: KeyMintDevice = KeyMintDevice::get(SecurityLevel::TRUSTED_ENVIRONMENT)
-                    .context(ks_err!("KeyMintDevice::get failed"))?;
-                let mut key_params = vec![
-                    KeyParameterValue::Algorithm(Algorithm::AES),
-                    KeyParameterValue::KeySize(256),
-                    KeyParameterValue::BlockMode(BlockMode::GCM),
-                    KeyParameterValue::PaddingMode(PaddingMode::NONE),
-                    KeyParameterValue::CallerNonce,
-                    KeyParameterValue::KeyPurpose(KeyPurpose::DECRYPT),
-                    KeyParameterValue::MinMacLength(128),
-                    KeyParameterValue::AuthTimeout(BIOMETRIC_AUTH_TIMEOUT_S),
-                    KeyParameterValue::HardwareAuthenticatorType(
-                        HardwareAuthenticatorType::FINGERPRINT,
-                    ),
-                ];
-                for sid in unlocking_sids {
-                    key_params.push(KeyParameterValue::UserSecureID(*sid));
+            match Self::create_biometric_unlock(db, user_id, unlocking_sids, &aes, &ecdh) {
+                Ok(biometric) => Some(Some(biometric)),
+                Err(e) => {
+                    log::error!("Error setting up biometric unlock: {:#?}", e);
+                    // The caller can't do anything about the error, and for security reasons we
+                    // still wipe the keys (unless a weak unlock method is enabled).  So just log
+                    // the error.
+                    None
                 }
-                let key_params: Vec<KmKeyParameter> =
-                    key_params.into_iter().map(|x| x.into()).collect();
-                km_dev.create_and_store_key(
-                    db,
-                    &key_desc,
-                    KeyType::Client, /* TODO Should be Super b/189470584 */
-                    |dev| {
-                        let _wp =
-                            wd::watch("SKM::lock_unlocked_device_required_keys: calling IKeyMintDevice::importKey.");
-                        dev.importKey(key_params.as_slice(), KeyFormat::RAW, &encrypting_key, None)
-                    },
-                )?;
-                entry.biometric_unlock = Some(BiometricUnlock {
-                    sids: unlocking_sids.into(),
-                    key_desc,
-                    symmetric: LockedKey::new(&encrypting_key, &aes)?,
-                    private: LockedKey::new(&encrypting_key, &ecdh)?,
-                });
-                Ok(())
-            })();
-            if let Err(e) = res {
-                log::error!("Error setting up biometric unlock: {:#?}", e);
-                // The caller can't do anything about the error, and for security reasons we still
-                // wipe the keys (unless a weak unlock method is enabled).  So just log the error.
             }
+        } else {
+            None
+        };
+
+        let mut skm_guard = skm.write().unwrap();
+        let entry = skm_guard.data.user_keys.entry(user_id).or_default();
+        if let Some(biometric_unlock) = biometric_unlock {
+            entry.biometric_unlock = biometric_unlock;
         }
         // Wipe the plaintext copy of the keys, unless a weak unlock method is enabled.
         if !weak_unlock_enabled {
@@ -943,15 +917,69 @@ impl SuperKeyManager {
         Self::log_status_of_unlocked_device_required_keys(user_id, entry);
     }
 
-    pub fn wipe_plaintext_unlocked_device_required_keys(&mut self, user_id: UserId) {
-        let entry = self.data.user_keys.entry(user_id).or_default();
+    /// Creates a KeyMint key bound to the given biometric SIDs and encrypts the
+    /// UnlockedDeviceRequired super keys with it.
+    fn create_biometric_unlock(
+        db: &mut KeystoreDB,
+        user_id: UserId,
+        unlocking_sids: &[i64],
+        aes: &Arc<SuperKey>,
+        ecdh: &Arc<SuperKey>,
+    ) -> Result<BiometricUnlock> {
+        let key_desc =
+            KeyMintDevice::internal_descriptor(format!("biometric_unlock_key_{}", user_id));
+        let encrypting_key = generate_aes256_key()?;
+        let km_dev: KeyMintDevice = KeyMintDevice::get(SecurityLevel::TRUSTED_ENVIRONMENT)
+            .context(ks_err!("KeyMintDevice::get failed"))?;
+        let mut key_params = vec![
+            KeyParameterValue::Algorithm(Algorithm::AES),
+            KeyParameterValue::KeySize(256),
+            KeyParameterValue::BlockMode(BlockMode::GCM),
+            KeyParameterValue::PaddingMode(PaddingMode::NONE),
+            KeyParameterValue::CallerNonce,
+            KeyParameterValue::KeyPurpose(KeyPurpose::DECRYPT),
+            KeyParameterValue::MinMacLength(128),
+            KeyParameterValue::AuthTimeout(BIOMETRIC_AUTH_TIMEOUT_S),
+            KeyParameterValue::HardwareAuthenticatorType(HardwareAuthenticatorType::FINGERPRINT),
+        ];
+        for sid in unlocking_sids {
+            key_params.push(KeyParameterValue::UserSecureID(*sid));
+        }
+        let key_params: Vec<KmKeyParameter> = key_params.into_iter().map(|x| x.into()).collect();
+        km_dev.create_and_store_key(
+            db,
+            &key_desc,
+            KeyType::Client, /* TODO Should be Super b/189470584 */
+            |dev| {
+                let _wp = wd::watch(
+                    "SKM::lock_unlocked_device_required_keys: calling IKeyMintDevice::importKey.",
+                );
+                dev.importKey(key_params.as_slice(), KeyFormat::RAW, &encrypting_key, None)
+            },
+        )?;
+        Ok(BiometricUnlock {
+            sids: unlocking_sids.into(),
+            key_desc,
+            symmetric: LockedKey::new(&encrypting_key, aes)?,
+            private: LockedKey::new(&encrypting_key, ecdh)?,
+        })
+    }
+
+    pub fn wipe_plaintext_unlocked_device_required_keys(skm: &RwLock<Self>, user_id: UserId) {
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
+        let mut skm_guard = skm.write().unwrap();
+        let entry = skm_guard.data.user_keys.entry(user_id).or_default();
         entry.unlocked_device_required_symmetric = None;
         entry.unlocked_device_required_private = None;
         Self::log_status_of_unlocked_device_required_keys(user_id, entry);
     }
 
-    pub fn wipe_all_unlocked_device_required_keys(&mut self, user_id: UserId) {
-        let entry = self.data.user_keys.entry(user_id).or_default();
+    pub fn wipe_all_unlocked_device_required_keys(skm: &RwLock<Self>, user_id: UserId) {
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
+        let mut skm_guard = skm.write().unwrap();
+        let entry = skm_guard.data.user_keys.entry(user_id).or_default();
         entry.unlocked_device_required_symmetric = None;
         entry.unlocked_device_required_private = None;
         entry.biometric_unlock = None;
@@ -976,21 +1004,32 @@ impl SuperKeyManager {
     /// User has unlocked, not using a password. See if any of our stored auth tokens can be used
     /// to unlock the keys protecting UNLOCKED_DEVICE_REQUIRED keys.
     pub fn try_unlock_user_with_biometric(
-        &mut self,
+        skm: &RwLock<Self>,
         db: &mut KeystoreDB,
         user_id: UserId,
     ) -> Result<()> {
-        let entry = self.data.user_keys.entry(user_id).or_default();
-        if entry.unlocked_device_required_symmetric.is_some()
-            && entry.unlocked_device_required_private.is_some()
-        {
-            // If the keys are already cached in plaintext, then there is no need to decrypt the
-            // biometric-encrypted copy.  Both copies can be present here if the user has both
-            // class 3 biometric and weak unlock methods enabled, and the device was unlocked before
-            // the weak unlock methods expired.
-            return Ok(());
-        }
-        if let Some(biometric) = entry.biometric_unlock.as_ref() {
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
+
+        // Work on a copy of the biometric-encrypted keys, so that the manager lock is not held
+        // while KeyMint decrypts them.
+        let biometric = {
+            let skm_guard = skm.read().unwrap();
+            let Some(entry) = skm_guard.data.user_keys.get(&user_id) else {
+                return Ok(());
+            };
+            if entry.unlocked_device_required_symmetric.is_some()
+                && entry.unlocked_device_required_private.is_some()
+            {
+                // If the keys are already cached in plaintext, then there is no need to decrypt the
+                // biometric-encrypted copy.  Both copies can be present here if the user has both
+                // class 3 biometric and weak unlock methods enabled, and the device was unlocked
+                // before the weak unlock methods expired.
+                return Ok(());
+            }
+            entry.biometric_unlock.clone()
+        };
+        if let Some(biometric) = biometric {
             let (key_id_guard, key_entry) = db
                 .load_key_entry(
                     &biometric.key_desc,
@@ -1029,10 +1068,12 @@ impl SuperKeyManager {
                     })();
                     match res {
                         Ok((symmetric, private)) => {
-                            entry.unlocked_device_required_symmetric = Some(symmetric.clone());
-                            entry.unlocked_device_required_private = Some(private.clone());
-                            self.data.add_key_to_key_index(&symmetric)?;
-                            self.data.add_key_to_key_index(&private)?;
+                            let mut skm_guard = skm.write().unwrap();
+                            skm_guard.data.add_key_to_key_index(&symmetric)?;
+                            skm_guard.data.add_key_to_key_index(&private)?;
+                            let entry = skm_guard.data.user_keys.entry(user_id).or_default();
+                            entry.unlocked_device_required_symmetric = Some(symmetric);
+                            entry.unlocked_device_required_private = Some(private);
                             log::info!("Successfully unlocked user {user_id} with biometric {sid}",);
                             return Ok(());
                         }
@@ -1062,13 +1103,38 @@ impl SuperKeyManager {
         legacy_importer: &LegacyImporter,
         user_id: UserId,
     ) -> Result<UserState> {
-        match self.get_after_first_unlock_key_by_user_id_internal(user_id) {
+        Self::user_state(
+            self.get_after_first_unlock_key_by_user_id_internal(user_id),
+            db,
+            legacy_importer,
+            user_id,
+        )
+    }
+
+    /// Like `get_user_state`, but without holding the manager lock while checking the database.
+    fn get_user_state_unlocked(
+        skm: &RwLock<Self>,
+        db: &mut KeystoreDB,
+        legacy_importer: &LegacyImporter,
+        user_id: UserId,
+    ) -> Result<UserState> {
+        let after_first_unlock =
+            skm.read().unwrap().get_after_first_unlock_key_by_user_id_internal(user_id);
+        Self::user_state(after_first_unlock, db, legacy_importer, user_id)
+    }
+
+    fn user_state(
+        after_first_unlock: Option<Arc<SuperKey>>,
+        db: &mut KeystoreDB,
+        legacy_importer: &LegacyImporter,
+        user_id: UserId,
+    ) -> Result<UserState> {
+        match after_first_unlock {
             Some(super_key) => Ok(UserState::AfterFirstUnlock(super_key)),
             None => {
                 // Check if a super key exists in the database or legacy database.
                 // If so, return locked user state.
-                if self
-                    .super_key_exists_in_db_for_user(db, legacy_importer, user_id)
+                if Self::super_key_exists_in_db_for_user(db, legacy_importer, user_id)
                     .context(ks_err!())?
                 {
                     Ok(UserState::BeforeFirstUnlock)
@@ -1082,12 +1148,14 @@ impl SuperKeyManager {
     /// Deletes all keys and super keys for the given user.
     /// This is called when a user is deleted.
     pub fn remove_user(
-        &mut self,
+        skm: &RwLock<Self>,
         db: &mut KeystoreDB,
         legacy_importer: &LegacyImporter,
         user_id: UserId,
     ) -> Result<()> {
         log::info!("remove_user(user={user_id})");
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
         // Mark keys created on behalf of the user as unreferenced.
         legacy_importer
             .bulk_delete_user(user_id, false)
@@ -1095,7 +1163,7 @@ impl SuperKeyManager {
         db.unbind_keys_for_user(user_id).context(ks_err!("Error in unbinding keys."))?;
 
         // Delete super key in cache, if exists.
-        self.forget_all_keys_for_user(user_id);
+        skm.write().unwrap().forget_all_keys_for_user(user_id);
         Ok(())
     }
 
@@ -1103,30 +1171,39 @@ impl SuperKeyManager {
     /// UnlockedDeviceRequired. If allow_existing is true, then the user already being initialized
     /// is not considered an error.
     pub fn initialize_user(
-        &mut self,
+        skm: &RwLock<Self>,
         db: &mut KeystoreDB,
         legacy_importer: &LegacyImporter,
         user_id: UserId,
         password: &Password,
         allow_existing: bool,
     ) -> Result<()> {
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
         // Create the AfterFirstUnlock super key.
-        if self.super_key_exists_in_db_for_user(db, legacy_importer, user_id)? {
+        if Self::super_key_exists_in_db_for_user(db, legacy_importer, user_id)? {
             log::info!("AfterFirstUnlock super key already exists");
             if !allow_existing {
                 return Err(Error::sys()).context(ks_err!("Tried to re-init an initialized user!"));
             }
         } else {
-            let super_key = self
-                .create_super_key(db, user_id, &USER_AFTER_FIRST_UNLOCK_SUPER_KEY, password, None)
-                .context(ks_err!("Failed to create AfterFirstUnlock super key"))?;
+            let super_key = Self::create_super_key(
+                db,
+                user_id,
+                &USER_AFTER_FIRST_UNLOCK_SUPER_KEY,
+                password,
+                None,
+            )
+            .context(ks_err!("Failed to create AfterFirstUnlock super key"))?;
 
-            self.install_after_first_unlock_key_for_user(user_id, super_key)
+            skm.write()
+                .unwrap()
+                .install_after_first_unlock_key_for_user(user_id, super_key)
                 .context(ks_err!("Failed to install AfterFirstUnlock super key for user"))?;
         }
 
         // Create the UnlockedDeviceRequired super keys.
-        self.unlock_unlocked_device_required_keys(db, user_id, password)
+        Self::unlock_unlocked_device_required_keys(skm, db, user_id, password)
             .context(ks_err!("Failed to create UnlockedDeviceRequired super keys"))
     }
 
@@ -1140,16 +1217,18 @@ impl SuperKeyManager {
     /// - Unlock the user's UnlockedDeviceRequired super keys only
     ///
     pub fn unlock_user(
-        &mut self,
+        skm: &RwLock<Self>,
         db: &mut KeystoreDB,
         legacy_importer: &LegacyImporter,
         user_id: UserId,
         password: &Password,
     ) -> Result<()> {
         log::info!("unlock_user(user={user_id})");
-        match self.get_user_state(db, legacy_importer, user_id)? {
+        let user_lock = Self::user_lock(skm, user_id);
+        let _user_guard = user_lock.lock().unwrap();
+        match Self::get_user_state_unlocked(skm, db, legacy_importer, user_id)? {
             UserState::AfterFirstUnlock(_) => {
-                self.unlock_unlocked_device_required_keys(db, user_id, password)
+                Self::unlock_unlocked_device_required_keys(skm, db, user_id, password)
             }
             UserState::Uninitialized => {
                 Err(Error::sys()).context(ks_err!("Tried to unlock an uninitialized user!"))
@@ -1164,14 +1243,18 @@ impl SuperKeyManager {
 
                 match result {
                     Some((_, entry)) => {
-                        self.populate_cache_from_super_key_blob(
-                            user_id,
+                        let super_key = Self::extract_super_key_from_key_entry(
                             alias.algorithm,
                             entry,
                             password,
+                            None,
                         )
                         .context(ks_err!("Failed when unlocking user."))?;
-                        self.unlock_unlocked_device_required_keys(db, user_id, password)
+                        skm.write()
+                            .unwrap()
+                            .install_after_first_unlock_key_for_user(user_id, super_key)
+                            .context(ks_err!("Failed when unlocking user."))?;
+                        Self::unlock_unlocked_device_required_keys(skm, db, user_id, password)
                     }
                     None => {
                         Err(Error::sys()).context(ks_err!("Locked user does not have a super key!"))
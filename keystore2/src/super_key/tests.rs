@@ -39,11 +39,15 @@ fn setup_test(pw: &Password) -> (Arc<RwLock<SuperKeyManager>>, KeystoreDB, Legac
     let mut legacy_importer = LegacyImporter::new(Arc::new(Default::default()));
     legacy_importer.set_empty();
     let skm: Arc<RwLock<SuperKeyManager>> = Default::default();
-    assert!(skm
-        .write()
-        .unwrap()
-        .initialize_user(&mut keystore_db, &legacy_importer, USER_ID, pw, false)
-        .is_ok());
+    assert!(SuperKeyManager::initialize_user(
+        &skm,
+        &mut keystore_db,
+        &legacy_importer,
+        USER_ID,
+        pw,
+        false
+    )
+    .is_ok());
     (skm, keystore_db, legacy_importer)
 }
 
@@ -126,10 +130,7 @@ fn test_unlock_user() {
         "Clearing the cache did not lock the user!",
     );
 
-    assert!(skm
-        .write()
-        .unwrap()
-        .unlock_user(&mut keystore_db, &legacy_importer, USER_ID, &pw)
+    assert!(SuperKeyManager::unlock_user(&skm, &mut keystore_db, &legacy_importer, USER_ID, &pw)
         .is_ok());
     assert_unlocked(&skm, &mut keystore_db, &legacy_importer, USER_ID, "The user did not unlock!");
 }
@@ -156,11 +157,14 @@ fn test_unlock_wrong_password() {
         "Clearing the cache did not lock the user!",
     );
 
-    assert!(skm
-        .write()
-        .unwrap()
-        .unlock_user(&mut keystore_db, &legacy_importer, USER_ID, &wrong_pw)
-        .is_err());
+    assert!(SuperKeyManager::unlock_user(
+        &skm,
+        &mut keystore_db,
+        &legacy_importer,
+        USER_ID,
+        &wrong_pw
+    )
+    .is_err());
     assert_locked(
         &skm,
         &mut keystore_db,
@@ -192,11 +196,14 @@ fn test_unlock_user_idempotent() {
     );
 
     for _ in 0..5 {
-        assert!(skm
-            .write()
-            .unwrap()
-            .unlock_user(&mut keystore_db, &legacy_importer, USER_ID, &pw)
-            .is_ok());
+        assert!(SuperKeyManager::unlock_user(
+            &skm,
+            &mut keystore_db,
+            &legacy_importer,
+            USER_ID,
+            &pw
+        )
+        .is_ok());
         assert_unlocked(
             &skm,
             &mut keystore_db,
@@ -253,7 +260,7 @@ fn test_user_removal(locked: bool) {
         );
     }
 
-    assert!(skm.write().unwrap().remove_user(&mut keystore_db, &legacy_importer, USER_ID).is_ok());
+    assert!(SuperKeyManager::remove_user(&skm, &mut keystore_db, &legacy_importer, USER_ID).is_ok());
     assert_uninitialized(
         &skm,
         &mut keystore_db,
@@ -262,11 +269,12 @@ fn test_user_removal(locked: bool) {
         "The user was not removed!",
     );
 
-    assert!(!skm
-        .write()
-        .unwrap()
-        .super_key_exists_in_db_for_user(&mut keystore_db, &legacy_importer, USER_ID)
-        .unwrap());
+    assert!(!SuperKeyManager::super_key_exists_in_db_for_user(
+        &mut keystore_db,
+        &legacy_importer,
+        USER_ID
+    )
+    .unwrap());
 
     assert!(!keystore_db
         .key_exists(Domain::APP, USER_ID.into(), TEST_KEY_ALIAS, KeyType::Client)
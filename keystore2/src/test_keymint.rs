@@ -0,0 +1,364 @@
+// Copyright 2024, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! A software KeyMint device for unit tests and the performance harness.
+//!
+//! `SoftKeyMint` implements just enough of `IKeyMintDevice` to run Keystore's code paths
+//! without a HAL: key blobs are plain AES-256 keys, and operations encrypt with AES-256-GCM in
+//! `finish`, so tests pay for real cryptography. Tests that check how Keystore overlaps calls
+//! into KeyMint hold the calls at a `Rendezvous` and assert on its counters rather than on
+//! elapsed time. Tests that need other fake behavior enable it through the fields of
+//! `SoftKeyMint`.
+
+use crate::error::ErrorCode;
+use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
+    AttestationKey::AttestationKey,
+    BeginResult::BeginResult,
+    HardwareAuthToken::HardwareAuthToken,
+    IKeyMintDevice::IKeyMintDevice,
+    IKeyMintOperation::{BnKeyMintOperation, IKeyMintOperation},
+    KeyCharacteristics::KeyCharacteristics,
+    KeyCreationResult::KeyCreationResult,
+    KeyFormat::KeyFormat,
+    KeyMintHardwareInfo::KeyMintHardwareInfo,
+    KeyParameter::KeyParameter,
+    KeyPurpose::KeyPurpose,
+    SecurityLevel::SecurityLevel,
+};
+use android_hardware_security_keymint::binder::{BinderFeatures, Interface};
+use android_hardware_security_secureclock::aidl::android::hardware::security::secureclock::TimeStampToken::TimeStampToken;
+use keystore2_crypto::{aes_gcm_encrypt, generate_aes256_key};
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::Duration;
+
+/// The number of operations the software KeyMint supports at the same time. Like in hardware
+/// implementations, it is small enough for busy workloads to make Keystore prune operations.
+pub const SOFT_KEYMINT_MAX_OPERATIONS: usize = 16;
+
+/// How long a call waits at a `Rendezvous` before giving up, so that a test whose calls are
+/// serialized fails instead of hanging.
+const RENDEZVOUS_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// Returns the binder status with which KeyMint reports `error_code`.
+pub fn km_error(error_code: ErrorCode) -> binder::Status {
+    binder::Status::new_service_specific_error(error_code.0, None)
+}
+
+#[derive(Default)]
+struct Calls {
+    done: usize,
+    in_flight: usize,
+    max_in_flight: usize,
+}
+
+/// Holds calls until `expected` of them have been in flight at the same time, and counts them.
+/// Once that happened, later calls pass straight through.
+pub struct Rendezvous {
+    calls: Mutex<Calls>,
+    cond_var: Condvar,
+    expected: usize,
+}
+
+impl Rendezvous {
+    /// Creates a rendezvous for `expected` calls.
+    pub fn new(expected: usize) -> Arc<Self> {
+        Arc::new(Self { calls: Default::default(), cond_var: Condvar::new(), expected })
+    }
+
+    /// Waits until `expected` calls have been in `meet` at the same time. Returns false if that
+    /// did not happen within `RENDEZVOUS_TIMEOUT`.
+    pub fn meet(&self) -> bool {
+        let mut calls = self.calls.lock().unwrap();
+        calls.in_flight += 1;
+        calls.max_in_flight = calls.max_in_flight.max(calls.in_flight);
+        self.cond_var.notify_all();
+        let (mut calls, timeout) = self
+            .cond_var
+            .wait_timeout_while(calls, RENDEZVOUS_TIMEOUT, |calls| {
+                calls.max_in_flight < self.expected
+            })
+            .unwrap();
+        calls.in_flight -= 1;
+        calls.done += 1;
+        self.cond_var.notify_all();
+        !timeout.timed_out()
+    }
+
+    /// Waits until `in_flight` calls are waiting in `meet`. Returns false if that did not happen
+    /// within `RENDEZVOUS_TIMEOUT`.
+    pub fn wait_for_in_flight(&self, in_flight: usize) -> bool {
+        let calls = self.calls.lock().unwrap();
+        let (_, timeout) = self
+            .cond_var
+            .wait_timeout_while(calls, RENDEZVOUS_TIMEOUT, |calls| calls.in_flight < in_flight)
+            .unwrap();
+        !timeout.timed_out()
+    }
+
+    /// Returns the number of calls that left `meet` and the most that were in it at once.
+    pub fn calls(&self) -> (usize, usize) {
+        let calls = self.calls.lock().unwrap();
+        (calls.done, calls.max_in_flight)
+    }
+}
+
+/// A software stand-in for a KeyMint device, see the module documentation. Generating a key
+/// takes `generate_latency` and aborting an operation takes `abort_latency`, like a round trip to
+/// a secure environment would. Each key generation first meets `generate_rendezvous` and each
+/// call to `IKeyMintOperation::update` first meets `update_rendezvous`, if set.
+#[derive(Default)]
+pub struct SoftKeyMint {
+    /// The number of operations that are neither finished nor aborted.
+    pub operations: Arc<AtomicUsize>,
+    pub generate_latency: Duration,
+    pub abort_latency: Duration,
+    pub generate_rendezvous: Option<Arc<Rendezvous>>,
+    pub update_rendezvous: Option<Arc<Rendezvous>>,
+    /// If set, generating a key with the first blob as attestation key fails with
+    /// `KEY_REQUIRES_UPGRADE`, and `upgradeKey` upgrades it to the second blob.
+    pub key_upgrade: Option<(Vec<u8>, Vec<u8>)>,
+    /// The number of key blobs upgraded so far.
+    pub upgrades: AtomicUsize,
+    /// Each call to `deleteAllKeys` and `earlyBootEnded` counts in `broadcasts`, meets
+    /// `broadcast_rendezvous`, if set, and fails with `broadcast_error`, if set.
+    pub broadcast_rendezvous: Option<Arc<Rendezvous>>,
+    pub broadcast_error: Option<ErrorCode>,
+    pub broadcasts: AtomicUsize,
+}
+
+impl SoftKeyMint {
+    /// Handles a broadcast that has no effect on the software KeyMint.
+    fn broadcast(&self) -> binder::Result<()> {
+        self.broadcasts.fetch_add(1, Ordering::SeqCst);
+        if let Some(rendezvous) = &self.broadcast_rendezvous {
+            rendezvous.meet();
+        }
+        match self.broadcast_error {
+            Some(e) => Err(km_error(e)),
+            None => Ok(()),
+        }
+    }
+}
+
+impl Interface for SoftKeyMint {}
+
+impl IKeyMintDevice for SoftKeyMint {
+    fn getHardwareInfo(&self) -> binder::Result<KeyMintHardwareInfo> {
+        Ok(KeyMintHardwareInfo {
+            versionNumber: 300,
+            securityLevel: SecurityLevel::TRUSTED_ENVIRONMENT,
+            keyMintName: "SoftKeyMint".to_string(),
+            keyMintAuthorName: "Keystore tests".to_string(),
+            timestampTokenRequired: false,
+        })
+    }
+    fn addRngEntropy(&self, _data: &[u8]) -> binder::Result<()> {
+        Ok(())
+    }
+    fn deleteAllKeys(&self) -> binder::Result<()> {
+        self.broadcast()
+    }
+    fn destroyAttestationIds(&self) -> binder::Result<()> {
+        unimplemented!()
+    }
+    fn deviceLocked(
+        &self,
+        _password_only: bool,
+        _timestamp_token: Option<&TimeStampToken>,
+    ) -> binder::Result<()> {
+        unimplemented!()
+    }
+    fn earlyBootEnded(&self) -> binder::Result<()> {
+        self.broadcast()
+    }
+    fn getRootOfTrustChallenge(&self) -> binder::Result<[u8; 16]> {
+        unimplemented!()
+    }
+    fn getRootOfTrust(&self, _challenge: &[u8; 16]) -> binder::Result<Vec<u8>> {
+        unimplemented!()
+    }
+    fn sendRootOfTrust(&self, _root_of_trust: &[u8]) -> binder::Result<()> {
+        unimplemented!()
+    }
+    fn generateKey(
+        &self,
+        key_params: &[KeyParameter],
+        attestation_key: Option<&AttestationKey>,
+    ) -> binder::Result<KeyCreationResult> {
+        if let (Some((old_blob, _)), Some(attestation_key)) = (&self.key_upgrade, attestation_key) {
+            if attestation_key.keyBlob == *old_blob {
+                return Err(km_error(ErrorCode::KEY_REQUIRES_UPGRADE));
+            }
+        }
+        if let Some(rendezvous) = &self.generate_rendezvous {
+            rendezvous.meet();
+        }
+        thread::sleep(self.generate_latency);
+        let key_blob = generate_aes256_key().map_err(|_| km_error(ErrorCode::UNKNOWN_ERROR))?;
+        Ok(KeyCreationResult {
+            keyBlob: key_blob.to_vec(),
+            keyCharacteristics: vec![KeyCharacteristics {
+                securityLevel: SecurityLevel::TRUSTED_ENVIRONMENT,
+                authorizations: key_params.to_vec(),
+            }],
+            certificateChain: vec![],
+        })
+    }
+    fn importKey(
+        &self,
+        _key_params: &[KeyParameter],
+        _key_format: KeyFormat,
+        _key_data: &[u8],
+        _attestation_key: Option<&AttestationKey>,
+    ) -> binder::Result<KeyCreationResult> {
+        unimplemented!()
+    }
+    fn importWrappedKey(
+        &self,
+        _wrapped_key_data: &[u8],
+        _wrapping_key_blob: &[u8],
+        _masking_key: &[u8],
+        _unwrapping_params: &[KeyParameter],
+        _password_sid: i64,
+        _biometric_sid: i64,
+    ) -> binder::Result<KeyCreationResult> {
+        unimplemented!()
+    }
+    fn upgradeKey(
+        &self,
+        keyblob_to_upgrade: &[u8],
+        _upgrade_params: &[KeyParameter],
+    ) -> binder::Result<Vec<u8>> {
+        match &self.key_upgrade {
+            Some((old_blob, new_blob)) if keyblob_to_upgrade == old_blob.as_slice() => {
+                self.upgrades.fetch_add(1, Ordering::SeqCst);
+                Ok(new_blob.clone())
+            }
+            _ => Err(km_error(ErrorCode::INVALID_KEY_BLOB)),
+        }
+    }
+    fn deleteKey(&self, _keyblob: &[u8]) -> binder::Result<()> {
+        Ok(())
+    }
+    fn begin(
+        &self,
+        _purpose: KeyPurpose,
+        keyblob: &[u8],
+        _params: &[KeyParameter],
+        _auth_token: Option<&HardwareAuthToken>,
+    ) -> binder::Result<BeginResult> {
+        if self.operations.fetch_add(1, Ordering::SeqCst) >= SOFT_KEYMINT_MAX_OPERATIONS {
+            self.operations.fetch_sub(1, Ordering::SeqCst);
+            return Err(km_error(ErrorCode::TOO_MANY_OPERATIONS));
+        }
+        let operation = BnKeyMintOperation::new_binder(
+            SoftKeyMintOperation {
+                key: keyblob.to_vec(),
+                input: Mutex::new(Vec::new()),
+                active: AtomicBool::new(true),
+                operations: self.operations.clone(),
+                abort_latency: self.abort_latency,
+                update_rendezvous: self.update_rendezvous.clone(),
+            },
+            BinderFeatures::default(),
+        );
+        Ok(BeginResult { challenge: 0, params: vec![], operation: Some(operation) })
+    }
+    fn getKeyCharacteristics(
+        &self,
+        _keyblob: &[u8],
+        _app_id: &[u8],
+        _app_data: &[u8],
+    ) -> binder::Result<Vec<KeyCharacteristics>> {
+        unimplemented!()
+    }
+    fn convertStorageKeyToEphemeral(&self, _storage_keyblob: &[u8]) -> binder::Result<Vec<u8>> {
+        unimplemented!()
+    }
+}
+
+struct SoftKeyMintOperation {
+    key: Vec<u8>,
+    input: Mutex<Vec<u8>>,
+    active: AtomicBool,
+    operations: Arc<AtomicUsize>,
+    abort_latency: Duration,
+    update_rendezvous: Option<Arc<Rendezvous>>,
+}
+
+impl SoftKeyMintOperation {
+    /// Frees the operation's slot in the software KeyMint.
+    fn end(&self) {
+        if self.active.swap(false, Ordering::SeqCst) {
+            self.operations.fetch_sub(1, Ordering::SeqCst);
+        }
+    }
+}
+
+impl Drop for SoftKeyMintOperation {
+    fn drop(&mut self) {
+        self.end();
+    }
+}
+
+impl Interface for SoftKeyMintOperation {}
+
+impl IKeyMintOperation for SoftKeyMintOperation {
+    fn updateAad(
+        &self,
+        _input: &[u8],
+        _auth_token: Option<&HardwareAuthToken>,
+        _timestamp_token: Option<&TimeStampToken>,
+    ) -> binder::Result<()> {
+        Ok(())
+    }
+
+    fn update(
+        &self,
+        input: &[u8],
+        _auth_token: Option<&HardwareAuthToken>,
+        _timestamp_token: Option<&TimeStampToken>,
+    ) -> binder::Result<Vec<u8>> {
+        if let Some(rendezvous) = &self.update_rendezvous {
+            rendezvous.meet();
+        }
+        self.input.lock().unwrap().extend_from_slice(input);
+        Ok(Vec::new())
+    }
+
+    fn finish(
+        &self,
+        input: Option<&[u8]>,
+        _signature: Option<&[u8]>,
+        _auth_token: Option<&HardwareAuthToken>,
+        _timestamp_token: Option<&TimeStampToken>,
+        _confirmation_token: Option<&[u8]>,
+    ) -> binder::Result<Vec<u8>> {
+        self.end();
+        let mut plaintext = std::mem::take(&mut *self.input.lock().unwrap());
+        plaintext.extend_from_slice(input.unwrap_or_default());
+        let (mut ciphertext, _iv, tag) = aes_gcm_encrypt(&plaintext, &self.key)
+            .map_err(|_| km_error(ErrorCode::UNKNOWN_ERROR))?;
+        ciphertext.extend(tag);
+        Ok(ciphertext)
+    }
+
+    fn abort(&self) -> binder::Result<()> {
+        thread::sleep(self.abort_latency);
+        self.end();
+        Ok(())
+    }
+}
@@ -60,10 +60,36 @@ mod tests;
 /// 999912312359559, which is 253402300799000 ms from Jan 1, 1970.
 pub const UNDEFINED_NOT_AFTER: i64 = 253402300799000i64;
 
+#[cfg(test)]
+thread_local! {
+    static PERMISSION_CHECKS_STUBBED: std::cell::Cell<bool> = const { std::cell::Cell::new(false) };
+}
+
+/// Makes the permission checks of this module pass on the current thread, for tests that run the
+/// service in-process. Such calls have no calling SID to check SELinux permissions with, and
+/// there is no permission controller to ask for Android permissions.
+#[cfg(test)]
+pub fn stub_permission_checks() {
+    PERMISSION_CHECKS_STUBBED.with(|stubbed| stubbed.set(true));
+}
+
+#[cfg(test)]
+fn permission_checks_stubbed() -> bool {
+    PERMISSION_CHECKS_STUBBED.with(|stubbed| stubbed.get())
+}
+
+#[cfg(not(test))]
+fn permission_checks_stubbed() -> bool {
+    false
+}
+
 /// This function uses its namesake in the permission module and in
 /// combination with with_calling_sid from the binder crate to check
 /// if the caller has the given keystore permission.
 pub fn check_keystore_permission(perm: KeystorePerm) -> anyhow::Result<()> {
+    if permission_checks_stubbed() {
+        return Ok(());
+    }
     ThreadState::with_calling_sid(|calling_sid| {
         permission::check_keystore_permission(
             calling_sid
@@ -78,6 +104,9 @@ pub fn check_keystore_permission(perm: KeystorePerm) -> anyhow::Result<()> {
 /// combination with with_calling_sid from the binder crate to check
 /// if the caller has the given grant permission.
 pub fn check_grant_permission(access_vec: KeyPermSet, key: &KeyDescriptor) -> anyhow::Result<()> {
+    if permission_checks_stubbed() {
+        return Ok(());
+    }
     ThreadState::with_calling_sid(|calling_sid| {
         permission::check_grant_permission(
             calling_sid
@@ -97,6 +126,9 @@ pub fn check_key_permission(
     key: &KeyDescriptor,
     access_vector: &Option<KeyPermSet>,
 ) -> anyhow::Result<()> {
+    if permission_checks_stubbed() {
+        return Ok(());
+    }
     ThreadState::with_calling_sid(|calling_sid| {
         permission::check_key_permission(
             ThreadState::get_calling_uid(),
@@ -161,6 +193,9 @@ pub fn check_dump_permission() -> anyhow::Result<()> {
 }
 
 fn check_android_permission(permission: &str, err: Error) -> anyhow::Result<()> {
+    if permission_checks_stubbed() {
+        return Ok(());
+    }
     let permission_controller: Strong<dyn IPermissionController::IPermissionController> =
         binder::get_interface("permission")?;
 
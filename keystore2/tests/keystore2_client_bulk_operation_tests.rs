@@ -0,0 +1,215 @@
+// Copyright 2024, The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+use crate::keystore2_client_test_utils::get_op_nonce;
+use android_hardware_security_keymint::aidl::android::hardware::security::keymint::{
+    Algorithm::Algorithm, BlockMode::BlockMode, KeyPurpose::KeyPurpose, PaddingMode::PaddingMode,
+};
+use android_security_bulkoperation::aidl::android::security::bulkoperation::IKeystoreBulkOperation::IKeystoreBulkOperation;
+use android_system_keystore2::aidl::android::system::keystore2::{
+    IKeystoreOperation::IKeystoreOperation, KeyDescriptor::KeyDescriptor,
+    ResponseCode::ResponseCode,
+};
+use binder::ParcelFileDescriptor;
+use keystore2_test_utils::{authorizations, key_generations, key_generations::Error, SecLevel};
+use std::fs::{File, OpenOptions};
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::time::Instant;
+
+static BULK_OPERATION_SERVICE_NAME: &str = "android.security.bulkoperation";
+
+// The most `IKeystoreOperation::update` accepts per call.
+const MAX_CHUNK_SIZE: usize = 0x8000;
+
+fn get_bulk_operation() -> binder::Strong<dyn IKeystoreBulkOperation> {
+    binder::get_interface(BULK_OPERATION_SERVICE_NAME).unwrap()
+}
+
+/// Creates an empty, unlinked file to pass input and output through.
+fn temp_file(name: &str) -> File {
+    let path = std::env::temp_dir().join(format!("ks_bulk_op_test_{name}_{}", std::process::id()));
+    let file =
+        OpenOptions::new().read(true).write(true).create(true).truncate(true).open(&path).unwrap();
+    std::fs::remove_file(&path).unwrap();
+    file
+}
+
+fn file_with_contents(name: &str, contents: &[u8]) -> File {
+    let mut file = temp_file(name);
+    file.write_all(contents).unwrap();
+    file.seek(SeekFrom::Start(0)).unwrap();
+    file
+}
+
+fn read_back(mut file: File) -> Vec<u8> {
+    let mut contents = Vec::new();
+    file.seek(SeekFrom::Start(0)).unwrap();
+    file.read_to_end(&mut contents).unwrap();
+    contents
+}
+
+fn create_aes_ctr_operation(
+    sl: &SecLevel,
+    key: &KeyDescriptor,
+    purpose: KeyPurpose,
+    nonce: &mut Option<Vec<u8>>,
+) -> binder::Strong<dyn IKeystoreOperation> {
+    let mut op_params = authorizations::AuthSetBuilder::new()
+        .purpose(purpose)
+        .padding_mode(PaddingMode::NONE)
+        .block_mode(BlockMode::CTR);
+    if let Some(value) = nonce {
+        op_params = op_params.nonce(value.to_vec());
+    }
+    let op_response = sl.binder.createOperation(key, &op_params, false).unwrap();
+    if nonce.is_none() {
+        *nonce = get_op_nonce(&op_response.parameters.unwrap());
+    }
+    op_response.iOperation.unwrap()
+}
+
+fn generate_aes_ctr_key(sl: &SecLevel, alias: &str) -> KeyDescriptor {
+    key_generations::generate_sym_key(
+        sl,
+        Algorithm::AES,
+        128,
+        alias,
+        &PaddingMode::NONE,
+        &BlockMode::CTR,
+        None,
+    )
+    .unwrap()
+    .key
+}
+
+/// Encrypts `input` in `MAX_CHUNK_SIZE` calls to `IKeystoreOperation::update`.
+fn encrypt_chunked(op: &binder::Strong<dyn IKeystoreOperation>, input: &[u8]) -> Vec<u8> {
+    let mut output = Vec::with_capacity(input.len());
+    let mut chunks = input.chunks(MAX_CHUNK_SIZE).peekable();
+    while let Some(chunk) = chunks.next() {
+        let out = if chunks.peek().is_some() {
+            op.update(chunk).unwrap()
+        } else {
+            op.finish(Some(chunk), None).unwrap()
+        };
+        output.extend(out.unwrap_or_default());
+    }
+    output
+}
+
+/// Encrypts `input` by passing it to `IKeystoreBulkOperation::finish` in one call.
+fn encrypt_bulk(op: &binder::Strong<dyn IKeystoreOperation>, input: &[u8]) -> Vec<u8> {
+    let input_file = file_with_contents("input", input);
+    let output_file = temp_file("output");
+    let last = get_bulk_operation()
+        .finish(
+            op,
+            &ParcelFileDescriptor::new(input_file),
+            input.len() as i64,
+            None,
+            Some(&ParcelFileDescriptor::new(output_file.try_clone().unwrap())),
+        )
+        .unwrap();
+    let mut output = read_back(output_file);
+    output.extend(last.unwrap_or_default());
+    output
+}
+
+/// Encrypts the same input through the chunked `IKeystoreOperation` path and through
+/// `IKeystoreBulkOperation` and reports the throughput of both. Both outputs must decrypt to the
+/// input.
+#[test]
+fn keystore2_bulk_operation_throughput() {
+    const INPUT_SIZE: usize = 16 * 1024 * 1024;
+
+    let sl = SecLevel::tee();
+    let key = generate_aes_ctr_key(&sl, "ks_bulk_op_throughput_key");
+    let input: Vec<u8> = (0..INPUT_SIZE).map(|i| i as u8).collect();
+
+    for bulk in [false, true] {
+        let mut nonce = None;
+        let op = create_aes_ctr_operation(&sl, &key, KeyPurpose::ENCRYPT, &mut nonce);
+        let start = Instant::now();
+        let cipher_text =
+            if bulk { encrypt_bulk(&op, &input) } else { encrypt_chunked(&op, &input) };
+        let elapsed = start.elapsed();
+        eprintln!(
+            "{}: {} MiB in {:?}, {:.1} MB/s",
+            if bulk { "bulk" } else { "chunked" },
+            INPUT_SIZE / (1024 * 1024),
+            elapsed,
+            INPUT_SIZE as f64 / 1e6 / elapsed.as_secs_f64()
+        );
+
+        assert_eq!(cipher_text.len(), input.len());
+        let op = create_aes_ctr_operation(&sl, &key, KeyPurpose::DECRYPT, &mut nonce);
+        assert_eq!(encrypt_chunked(&op, &cipher_text), input);
+    }
+}
+
+/// Output produced by `IKeystoreBulkOperation::update` is written to the output file, and the
+/// operation stays usable through `IKeystoreOperation` afterwards.
+#[test]
+fn keystore2_bulk_operation_update_then_finish() {
+    let sl = SecLevel::tee();
+    let key = generate_aes_ctr_key(&sl, "ks_bulk_op_update_key");
+    let input: Vec<u8> = (0..3 * MAX_CHUNK_SIZE + 100).map(|i| (i * 7) as u8).collect();
+
+    let mut nonce = None;
+    let op = create_aes_ctr_operation(&sl, &key, KeyPurpose::ENCRYPT, &mut nonce);
+    let output_file = temp_file("update_output");
+    let written = get_bulk_operation()
+        .update(
+            &op,
+            &ParcelFileDescriptor::new(file_with_contents("update_input", &input[..100])),
+            100,
+            Some(&ParcelFileDescriptor::new(output_file.try_clone().unwrap())),
+        )
+        .unwrap();
+    let mut cipher_text = read_back(output_file);
+    assert_eq!(written as usize, cipher_text.len());
+    cipher_text.extend(encrypt_chunked(&op, &input[100..]));
+
+    let op = create_aes_ctr_operation(&sl, &key, KeyPurpose::DECRYPT, &mut nonce);
+    assert_eq!(encrypt_chunked(&op, &cipher_text), input);
+}
+
+/// An operation that produces output cannot be fed through `IKeystoreBulkOperation` without an
+/// output file, and a short input file fails the operation.
+#[test]
+fn keystore2_bulk_operation_invalid_arguments() {
+    let sl = SecLevel::tee();
+    let key = generate_aes_ctr_key(&sl, "ks_bulk_op_invalid_args_key");
+    let input = vec![0u8; 2 * MAX_CHUNK_SIZE];
+
+    let mut nonce = None;
+    let op = create_aes_ctr_operation(&sl, &key, KeyPurpose::ENCRYPT, &mut nonce);
+    let result = key_generations::map_ks_error(get_bulk_operation().update(
+        &op,
+        &ParcelFileDescriptor::new(file_with_contents("no_output", &input)),
+        input.len() as i64,
+        None,
+    ));
+    assert_eq!(Err(Error::Rc(ResponseCode::INVALID_ARGUMENT)), result);
+
+    let op = create_aes_ctr_operation(&sl, &key, KeyPurpose::ENCRYPT, &mut None);
+    let result = key_generations::map_ks_error(get_bulk_operation().finish(
+        &op,
+        &ParcelFileDescriptor::new(file_with_contents("short_input", &input)),
+        input.len() as i64 + 1,
+        None,
+        Some(&ParcelFileDescriptor::new(temp_file("short_output"))),
+    ));
+    assert_eq!(Err(Error::Rc(ResponseCode::INVALID_ARGUMENT)), result);
+}
@@ -115,6 +115,14 @@ impl EdDsa {
         secret_key: &SignatureSecretKey,
         data: &[u8],
     ) -> Result<Vec<u8>, EdDsaError> {
+        Ok(self.signer(secret_key)?.sign(data))
+    }
+
+    /// Turns `secret_key` into a signer that can be used for any number of signatures. Unlike
+    /// `sign`, which checks the key and derives the public key from the seed for every signature,
+    /// this does it only once. BoringSSL still hashes the seed on every signature, as its
+    /// Ed25519 interface takes the seed rather than the expanded key.
+    pub fn signer(&self, secret_key: &SignatureSecretKey) -> Result<EdDsaSigner, EdDsaError> {
         if self.0 != Curve::Ed25519 {
             return Err(EdDsaError::UnsupportedCipherSuite);
         }
@@ -127,10 +135,14 @@ impl EdDsa {
 
         let private_key =
             ed25519::PrivateKey::from_seed(secret_key[..ed25519::SEED_LEN].try_into()?);
-        Ok(private_key.sign(data).to_vec())
+        Ok(EdDsaSigner(private_key))
     }
 
     /// Verifies `signature` is a valid signature of `data` using `public_key`.
+    ///
+    /// There is no batch variant. BoringSSL has no Ed25519 batch verification, and
+    /// `ED25519_verify` decompresses the public key on every call, so verifying many signatures
+    /// made with the same key shares no work beyond what calling this in a loop does.
     pub fn verify(
         &self,
         public_key: &SignaturePublicKey,
@@ -163,12 +175,24 @@ impl EdDsa {
     }
 }
 
+/// An EdDSA private key that has been checked and paired with its public key, see
+/// `EdDsa::signer`.
+pub struct EdDsaSigner(ed25519::PrivateKey);
+
+impl EdDsaSigner {
+    /// Signs `data`.
+    pub fn sign(&self, data: &[u8]) -> Vec<u8> {
+        self.0.sign(data).to_vec()
+    }
+}
+
 #[cfg(all(not(mls_build_async), test))]
 mod test {
     use super::{EdDsa, EdDsaError};
     use crate::test_helpers::decode_hex;
     use assert_matches::assert_matches;
     use mls_rs_core::crypto::{CipherSuite, SignaturePublicKey, SignatureSecretKey};
+    use std::time::Instant;
 
     #[test]
     fn signature_key_generate() {
@@ -266,6 +290,49 @@ mod test {
         );
     }
 
+    #[test]
+    fn signer_sign() {
+        // Test 3 from https://www.rfc-editor.org/rfc/rfc8032#section-7.1
+        let private_key = SignatureSecretKey::from(
+            decode_hex::<32>("c5aa8df43f9f837bedb7442f31dcb7b166d38535076f094b85ce3a2e0b4458f7")
+                .to_vec(),
+        );
+        let data: [u8; 2] = decode_hex("af82");
+        let expected_sig = decode_hex::<64>("6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a").to_vec();
+
+        let ed25519 = EdDsa::new(CipherSuite::CURVE25519_AES128).unwrap();
+        let signer = ed25519.signer(&private_key).unwrap();
+        assert_eq!(signer.sign(&data), expected_sig);
+        assert_eq!(signer.sign(&data), expected_sig);
+        assert_matches!(
+            ed25519.signer(&SignatureSecretKey::from(vec![0u8; 16])),
+            Err(EdDsaError::InvalidPrivKeyLen { .. })
+        );
+    }
+
+    /// Compares signing with `sign` against a reused signer for growing numbers of signatures.
+    /// Only prints timings, so it is ignored by default and run with `--ignored`.
+    #[test]
+    #[ignore]
+    fn signer_benchmark() {
+        let ed25519 = EdDsa::new(CipherSuite::CURVE25519_AES128).unwrap();
+        let (secret_key, _) = ed25519.signature_key_generate().unwrap();
+        for count in [16, 256, 4096] {
+            let start = Instant::now();
+            for i in 0..count {
+                ed25519.sign(&secret_key, &i.to_string().into_bytes()).unwrap();
+            }
+            let sign = start.elapsed();
+            let start = Instant::now();
+            let signer = ed25519.signer(&secret_key).unwrap();
+            for i in 0..count {
+                signer.sign(&i.to_string().into_bytes());
+            }
+            let signer_sign = start.elapsed();
+            eprintln!("{count} signatures: sign {sign:?}, signer {signer_sign:?}");
+        }
+    }
+
     #[test]
     fn unsupported_cipher_suites() {
         for suite in vec![
@@ -35,7 +35,7 @@ use zeroize::Zeroizing;
 
 use aead::AeadWrapper;
 use ecdh::Ecdh;
-use eddsa::{EdDsa, EdDsaError};
+use eddsa::{EdDsa, EdDsaError, EdDsaSigner};
 use hash::{Hash, HashError};
 use hpke::{ContextR, ContextS, DhKem, Hpke, HpkeError};
 use kdf::Kdf;
@@ -165,6 +165,15 @@ where
         bssl_crypto::rand_bytes(out);
         Ok(())
     }
+
+    /// Returns a signer for `secret_key` that avoids checking the key and deriving its public key
+    /// again for every signature. See `EdDsa::signer`.
+    pub fn signer(
+        &self,
+        secret_key: &SignatureSecretKey,
+    ) -> Result<EdDsaSigner, BoringsslCryptoError> {
+        Ok(self.eddsa.signer(secret_key)?)
+    }
 }
 
 #[cfg_attr(not(mls_build_async), maybe_async::must_be_sync)]
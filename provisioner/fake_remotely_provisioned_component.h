@@ -0,0 +1,122 @@
+/*
+ * Copyright 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/security/keymint/IRemotelyProvisionedComponent.h>
+#include <cppbor.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Holds calls until `expected` of them have been in flight at the same time, and counts them.
+// Once that happened, later calls pass straight through. Tests use it to check that calls
+// overlap without relying on elapsed time. A call gives up waiting after `timeout`, so that a
+// test whose calls are serialized fails instead of hanging.
+class Rendezvous {
+  public:
+    explicit Rendezvous(size_t expected,
+                        std::chrono::steady_clock::duration timeout = std::chrono::seconds(5))
+        : expected_(expected), timeout_(timeout) {}
+
+    // Waits until `expected` calls have been in meet() at the same time. Returns false if that
+    // did not happen within the timeout.
+    bool meet() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++inFlight_;
+        maxInFlight_ = std::max(maxInFlight_, inFlight_);
+        cv_.notify_all();
+        const bool met =
+            cv_.wait_for(lock, timeout_, [this] { return maxInFlight_ >= expected_; });
+        --inFlight_;
+        return met;
+    }
+
+    // The most calls that were in meet() at the same time.
+    size_t maxInFlight() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return maxInFlight_;
+    }
+
+  private:
+    const size_t expected_;
+    const std::chrono::steady_clock::duration timeout_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t inFlight_ = 0;
+    size_t maxInFlight_ = 0;
+};
+
+// An in-process IRemotelyProvisionedComponent that returns a structurally valid, but unsigned,
+// version 3 CSR after a configurable delay. It lets tests and benchmarks exercise the
+// extraction flow, and in particular its concurrency, without a real HAL. If `rendezvous` is
+// set, each CSR request first meets it. Getting the hardware info takes `hwInfoLatency`, as a
+// round trip into the secure environment would.
+class FakeRemotelyProvisionedComponent
+    : public aidl::android::hardware::security::keymint::IRemotelyProvisionedComponentDefault {
+  public:
+    explicit FakeRemotelyProvisionedComponent(
+        std::chrono::milliseconds latency, std::shared_ptr<Rendezvous> rendezvous = nullptr,
+        std::chrono::milliseconds hwInfoLatency = std::chrono::milliseconds(0))
+        : latency_(latency), rendezvous_(std::move(rendezvous)), hwInfoLatency_(hwInfoLatency) {}
+
+    ::ndk::ScopedAStatus getHardwareInfo(
+        aidl::android::hardware::security::keymint::RpcHardwareInfo* info) override {
+        std::this_thread::sleep_for(hwInfoLatency_);
+        ++hwInfoCount_;
+        info->versionNumber = 3;
+        info->rpcAuthorName = "Fake";
+        return ::ndk::ScopedAStatus::ok();
+    }
+
+    ::ndk::ScopedAStatus generateCertificateRequestV2(
+        const std::vector<aidl::android::hardware::security::keymint::MacedPublicKey>&
+        /*keysToSign*/,
+        const std::vector<uint8_t>& /*challenge*/, std::vector<uint8_t>* csr) override {
+        if (rendezvous_) {
+            rendezvous_->meet();
+        }
+        std::this_thread::sleep_for(latency_);
+        ++csrCount_;
+        *csr = cppbor::Array()
+                   .add(3 /* version */)
+                   .add(cppbor::Map() /* UdsCerts */)
+                   .add(cppbor::Array() /* DiceCertChain */)
+                   .add(cppbor::Array() /* SignedData */)
+                   .encode();
+        return ::ndk::ScopedAStatus::ok();
+    }
+
+    // Number of CSRs generated so far.
+    size_t csrCount() const { return csrCount_; }
+
+    // Number of times the hardware info was queried so far.
+    size_t hwInfoCount() const { return hwInfoCount_; }
+
+  private:
+    const std::chrono::milliseconds latency_;
+    const std::shared_ptr<Rendezvous> rendezvous_;
+    const std::chrono::milliseconds hwInfoLatency_;
+    std::atomic<size_t> csrCount_ = 0;
+    std::atomic<size_t> hwInfoCount_ = 0;
+};
@@ -29,10 +29,15 @@
 #include <remote_prov/remote_prov_utils.h>
 #include <sys/random.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include "cppbor_parse.h"
@@ -79,7 +84,7 @@ std::string toBase64(const std::vector<uint8_t>& buffer) {
     return base64;
 }
 
-std::vector<uint8_t> generateChallenge() {
+ErrMsgOr<std::vector<uint8_t>> tryGenerateChallenge() {
     std::vector<uint8_t> challenge(kChallengeSize);
 
     ssize_t bytesRemaining = static_cast<ssize_t>(challenge.size());
@@ -90,8 +95,7 @@ std::vector<uint8_t> generateChallenge() {
             if (errno == EINTR) {
                 continue;
             } else {
-                std::cerr << errno << ": " << strerror(errno) << std::endl;
-                exit(-1);
+                return std::to_string(errno) + ": " + strerror(errno);
             }
         }
         bytesRemaining -= bytesRead;
@@ -101,6 +105,15 @@ std::vector<uint8_t> generateChallenge() {
     return challenge;
 }
 
+std::vector<uint8_t> generateChallenge() {
+    auto challenge = tryGenerateChallenge();
+    if (!challenge) {
+        std::cerr << challenge.message() << std::endl;
+        exit(-1);
+    }
+    return challenge.moveValue();
+}
+
 CborResult<Array> composeCertificateRequestV1(const ProtectedData& protectedData,
                                               const DeviceInfo& verifiedDeviceInfo,
                                               const std::vector<uint8_t>& challenge,
@@ -135,71 +148,59 @@ CborResult<Array> composeCertificateRequestV1(const ProtectedData& protectedData
     return {std::move(certificateRequest), ""};
 }
 
-CborResult<Array> getCsrV1(std::string_view componentName, IRemotelyProvisionedComponent* irpc) {
+CborResult<Array> getCsrV1(std::string_view componentName, IRemotelyProvisionedComponent* irpc,
+                           const RpcHardwareInfo& hwInfo, const std::vector<uint8_t>& challenge) {
     std::vector<uint8_t> keysToSignMac;
     std::vector<MacedPublicKey> emptyKeys;
     DeviceInfo verifiedDeviceInfo;
     ProtectedData protectedData;
-    RpcHardwareInfo hwInfo;
-    ::ndk::ScopedAStatus status = irpc->getHardwareInfo(&hwInfo);
-    if (!status.isOk()) {
-        std::cerr << "Failed to get hardware info for '" << componentName
-                  << "'. Description: " << status.getDescription() << "." << std::endl;
-        exit(-1);
-    }
 
     const std::vector<uint8_t> eek = getProdEekChain(hwInfo.supportedEekCurve);
-    const std::vector<uint8_t> challenge = generateChallenge();
-    status = irpc->generateCertificateRequest(
+    auto status = irpc->generateCertificateRequest(
         /*test_mode=*/false, emptyKeys, eek, challenge, &verifiedDeviceInfo, &protectedData,
         &keysToSignMac);
     if (!status.isOk()) {
-        std::cerr << "Bundle extraction failed for '" << componentName
-                  << "'. Description: " << status.getDescription() << "." << std::endl;
-        exit(-1);
+        return {nullptr, "Bundle extraction failed for '" + std::string(componentName) +
+                             "'. Description: " + status.getDescription() + "."};
     }
     return composeCertificateRequestV1(protectedData, verifiedDeviceInfo, challenge, keysToSignMac,
                                        irpc);
 }
 
-void selfTestGetCsrV1(std::string_view componentName, IRemotelyProvisionedComponent* irpc) {
+// Returns an empty string if the self test passed, and a description of the failure otherwise.
+std::string selfTestGetCsrV1(std::string_view componentName, IRemotelyProvisionedComponent* irpc,
+                             const RpcHardwareInfo& hwInfo) {
     std::vector<uint8_t> keysToSignMac;
     std::vector<MacedPublicKey> emptyKeys;
     DeviceInfo verifiedDeviceInfo;
     ProtectedData protectedData;
-    RpcHardwareInfo hwInfo;
-    ::ndk::ScopedAStatus status = irpc->getHardwareInfo(&hwInfo);
-    if (!status.isOk()) {
-        std::cerr << "Failed to get hardware info for '" << componentName
-                  << "'. Description: " << status.getDescription() << "." << std::endl;
-        exit(-1);
-    }
 
     const std::vector<uint8_t> eekId = {0, 1, 2, 3, 4, 5, 6, 7};
     ErrMsgOr<EekChain> eekChain = generateEekChain(hwInfo.supportedEekCurve, /*length=*/3, eekId);
     if (!eekChain) {
-        std::cerr << "Error generating test EEK certificate chain: " << eekChain.message();
-        exit(-1);
+        return "Error generating test EEK certificate chain: " + eekChain.message();
     }
-    const std::vector<uint8_t> challenge = generateChallenge();
-    status = irpc->generateCertificateRequest(
-        /*test_mode=*/true, emptyKeys, eekChain->chain, challenge, &verifiedDeviceInfo,
+    auto challenge = tryGenerateChallenge();
+    if (!challenge) {
+        return "Error generating challenge: " + challenge.message();
+    }
+    auto status = irpc->generateCertificateRequest(
+        /*test_mode=*/true, emptyKeys, eekChain->chain, *challenge, &verifiedDeviceInfo,
         &protectedData, &keysToSignMac);
     if (!status.isOk()) {
-        std::cerr << "Error generating test cert chain for '" << componentName
-                  << "'. Description: " << status.getDescription() << "." << std::endl;
-        exit(-1);
+        return "Error generating test cert chain for '" + std::string(componentName) +
+               "'. Description: " + status.getDescription() + ".";
     }
 
     auto result = verifyFactoryProtectedData(verifiedDeviceInfo, /*keysToSign=*/{}, keysToSignMac,
                                              protectedData, *eekChain, eekId,
-                                             hwInfo.supportedEekCurve, irpc, challenge);
+                                             hwInfo.supportedEekCurve, irpc, *challenge);
 
     if (!result) {
-        std::cerr << "Self test failed for IRemotelyProvisionedComponent '" << componentName
-                  << "'. Error message: '" << result.message() << "'." << std::endl;
-        exit(-1);
+        return "Self test failed for IRemotelyProvisionedComponent '" +
+               std::string(componentName) + "'. Error message: '" + result.message() + "'.";
     }
+    return "";
 }
 
 CborResult<Array> composeCertificateRequestV3(const std::vector<uint8_t>& csr) {
@@ -224,26 +225,25 @@ CborResult<Array> composeCertificateRequestV3(const std::vector<uint8_t>& csr) {
 }
 
 CborResult<cppbor::Array> getCsrV3(std::string_view componentName,
-                                   IRemotelyProvisionedComponent* irpc, bool selfTest,
+                                   IRemotelyProvisionedComponent* irpc,
+                                   const std::vector<uint8_t>& challenge, bool selfTest,
                                    bool allowDegenerate) {
     std::vector<uint8_t> csr;
     std::vector<MacedPublicKey> emptyKeys;
-    const std::vector<uint8_t> challenge = generateChallenge();
 
     auto status = irpc->generateCertificateRequestV2(emptyKeys, challenge, &csr);
     if (!status.isOk()) {
-        std::cerr << "Bundle extraction failed for '" << componentName
-                  << "'. Description: " << status.getDescription() << "." << std::endl;
-        exit(-1);
+        return {nullptr, "Bundle extraction failed for '" + std::string(componentName) +
+                             "'. Description: " + status.getDescription() + "."};
     }
 
     if (selfTest) {
         auto result =
             verifyFactoryCsr(/*keysToSign=*/cppbor::Array(), csr, irpc, challenge, allowDegenerate);
         if (!result) {
-            std::cerr << "Self test failed for IRemotelyProvisionedComponent '" << componentName
-                      << "'. Error message: '" << result.message() << "'." << std::endl;
-            exit(-1);
+            return {nullptr, "Self test failed for IRemotelyProvisionedComponent '" +
+                                 std::string(componentName) + "'. Error message: '" +
+                                 result.message() + "'."};
         }
     }
 
@@ -252,25 +252,48 @@ CborResult<cppbor::Array> getCsrV3(std::string_view componentName,
 
 CborResult<Array> getCsr(std::string_view componentName, IRemotelyProvisionedComponent* irpc,
                          bool selfTest, bool allowDegenerate) {
-    RpcHardwareInfo hwInfo;
-    auto status = irpc->getHardwareInfo(&hwInfo);
-    if (!status.isOk()) {
-        std::cerr << "Failed to get hardware info for '" << componentName
-                  << "'. Description: " << status.getDescription() << "." << std::endl;
-        exit(-1);
+    auto challenge = tryGenerateChallenge();
+    if (!challenge) {
+        return {nullptr, "Error generating challenge: " + challenge.message()};
     }
+    CsrExtractor extractor(componentName, irpc, selfTest, allowDegenerate);
+    return extractor.getCsr(*challenge);
+}
 
-    if (hwInfo.versionNumber < kVersionWithoutSuperencryption) {
-        if (selfTest) {
-            selfTestGetCsrV1(componentName, irpc);
+CsrExtractor::CsrExtractor(std::string_view componentName, IRemotelyProvisionedComponent* irpc,
+                           bool selfTest, bool allowDegenerate)
+    : componentName_(componentName), irpc_(irpc), selfTest_(selfTest),
+      allowDegenerate_(allowDegenerate) {}
+
+CborResult<Array> CsrExtractor::getCsr(const std::vector<uint8_t>& challenge) {
+    if (!hwInfo_) {
+        RpcHardwareInfo hwInfo;
+        auto status = irpc_->getHardwareInfo(&hwInfo);
+        if (!status.isOk()) {
+            return {nullptr, "Failed to get hardware info for '" + componentName_ +
+                                 "'. Description: " + status.getDescription() + "."};
         }
-        return getCsrV1(componentName, irpc);
+        hwInfo_ = hwInfo;
+    }
+
+    if (hwInfo_->versionNumber < kVersionWithoutSuperencryption) {
+        // The V1 self test uses its own test mode request, independent of the production CSR,
+        // so it only needs to pass once per component.
+        if (selfTest_ && !selfTestPassed_) {
+            std::string selfTestErrMsg = selfTestGetCsrV1(componentName_, irpc_, *hwInfo_);
+            if (!selfTestErrMsg.empty()) {
+                return {nullptr, std::move(selfTestErrMsg)};
+            }
+            selfTestPassed_ = true;
+        }
+        return getCsrV1(componentName_, irpc_, *hwInfo_, challenge);
     } else {
-        return getCsrV3(componentName, irpc, selfTest, allowDegenerate);
+        // The V3 self test validates the CSR itself, so it has to run for every CSR.
+        return getCsrV3(componentName_, irpc_, challenge, selfTest_, allowDegenerate_);
     }
 }
 
-bool isRemoteProvisioningSupported(IRemotelyProvisionedComponent* irpc) {
+ErrMsgOr<bool> checkRemoteProvisioningSupported(IRemotelyProvisionedComponent* irpc) {
     RpcHardwareInfo hwInfo;
     auto status = irpc->getHardwareInfo(&hwInfo);
     if (status.isOk()) {
@@ -279,7 +302,55 @@ bool isRemoteProvisioningSupported(IRemotelyProvisionedComponent* irpc) {
     if (status.getExceptionCode() == EX_UNSUPPORTED_OPERATION) {
         return false;
     }
-    std::cerr << "Unexpected error when getting hardware info. Description: "
-              << status.getDescription() << "." << std::endl;
-    exit(-1);
+    return "Unexpected error when getting hardware info. Description: " +
+           status.getDescription() + ".";
+}
+
+bool isRemoteProvisioningSupported(IRemotelyProvisionedComponent* irpc) {
+    auto supported = checkRemoteProvisioningSupported(irpc);
+    if (!supported) {
+        std::cerr << supported.message() << std::endl;
+        exit(-1);
+    }
+    return *supported;
+}
+
+std::vector<InstanceCsr> getCsrsConcurrently(
+    const std::vector<std::string>& instanceNames,
+    std::function<CborResult<cppbor::Array>(const std::string& instanceName)> getCsrForInstance,
+    std::chrono::steady_clock::duration timeout) {
+    // The state is shared with the worker threads, which may outlive this call if a HAL hangs.
+    struct State {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<std::optional<CborResult<Array>>> results;
+        size_t pending;
+    };
+    auto state = std::make_shared<State>();
+    state->results.resize(instanceNames.size());
+    state->pending = instanceNames.size();
+
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (size_t i = 0; i < instanceNames.size(); ++i) {
+        std::thread([state, i, name = instanceNames[i], getCsrForInstance] {
+            auto result = getCsrForInstance(name);
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->results[i] = std::move(result);
+            --state->pending;
+            state->cv.notify_all();
+        }).detach();
+    }
+
+    std::vector<InstanceCsr> csrs;
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait_until(lock, deadline, [&state] { return state->pending == 0; });
+    for (size_t i = 0; i < instanceNames.size(); ++i) {
+        auto& result = state->results[i];
+        if (!result) {
+            csrs.push_back({instanceNames[i], nullptr, "Timed out waiting for CSR."});
+            continue;
+        }
+        csrs.push_back({instanceNames[i], std::move(result->cborData), std::move(result->errMsg)});
+    }
+    return csrs;
 }
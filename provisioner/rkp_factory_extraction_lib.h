@@ -19,8 +19,11 @@
 #include <cppbor.h>
 #include <keymaster/cppcose/cppcose.h>
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -41,6 +44,15 @@ std::string toBase64(const std::vector<uint8_t>& buffer);
 // Generate a random challenge containing `kChallengeSize` bytes.
 std::vector<uint8_t> generateChallenge();
 
+// The CSR, or the reason there is none, for one named component.
+// A null csr with an empty errMsg means that the component was skipped, e.g. because it
+// does not support remote provisioning.
+struct InstanceCsr {
+    std::string instanceName;
+    std::unique_ptr<cppbor::Array> csr;
+    std::string errMsg;
+};
+
 // Get a certificate signing request for the given IRemotelyProvisionedComponent.
 // On error, the csr Array is null, and the string field contains a description of
 // what went wrong.
@@ -49,11 +61,55 @@ getCsr(std::string_view componentName,
        aidl::android::hardware::security::keymint::IRemotelyProvisionedComponent* irpc,
        bool selfTest, bool allowDegenerate);
 
+// Gets certificate signing requests from one IRemotelyProvisionedComponent repeatedly, e.g. for
+// a batch of device requests on the factory line. The hardware info is queried only once, and
+// for HALs that predate version 3, the test mode self test only runs before the first CSR, as
+// its result does not depend on the request. On error, the csr Array is null, and the string
+// field contains a description of what went wrong.
+class CsrExtractor {
+  public:
+    CsrExtractor(std::string_view componentName,
+                 aidl::android::hardware::security::keymint::IRemotelyProvisionedComponent* irpc,
+                 bool selfTest, bool allowDegenerate);
+
+    // Get a certificate signing request for the given challenge.
+    CborResult<cppbor::Array> getCsr(const std::vector<uint8_t>& challenge);
+
+  private:
+    std::string componentName_;
+    aidl::android::hardware::security::keymint::IRemotelyProvisionedComponent* irpc_;
+    bool selfTest_;
+    bool allowDegenerate_;
+    std::optional<aidl::android::hardware::security::keymint::RpcHardwareInfo> hwInfo_;
+    bool selfTestPassed_ = false;
+};
+
 // Generates a test certificate chain and validates it, exiting the process on error.
 void selfTestGetCsr(
     std::string_view componentName,
     aidl::android::hardware::security::keymint::IRemotelyProvisionedComponent* irpc);
 
-// Returns true if the given IRemotelyProvisionedComponent supports remote provisioning.
+// Returns true if the given IRemotelyProvisionedComponent supports remote provisioning, or an
+// error message if that cannot be determined. Unlike isRemoteProvisioningSupported, this never
+// exits the process, so it is safe to call from the workers of getCsrsConcurrently.
+cppcose::ErrMsgOr<bool> checkRemoteProvisioningSupported(
+    aidl::android::hardware::security::keymint::IRemotelyProvisionedComponent* irpc);
+
+// Returns true if the given IRemotelyProvisionedComponent supports remote provisioning, exiting
+// the process on error.
 bool isRemoteProvisioningSupported(
     aidl::android::hardware::security::keymint::IRemotelyProvisionedComponent* irpc);
+
+// Calls `getCsrForInstance` for every name in `instanceNames` concurrently, each on its own
+// thread, and waits for all of them, but no longer than `timeout` in total. Instances that have
+// not finished by then are reported with a timeout error; their threads are left running in the
+// background, since a hung HAL call cannot be cancelled.
+// The results are in the same order as `instanceNames`, irrespective of completion order.
+// `getCsrForInstance` must report errors in its result rather than exit the process, so that
+// the CSRs of the other instances are still returned.
+// Every thread gets its own copy of `getCsrForInstance`, which may still run after this returns.
+// So it must own, rather than reference, whatever it uses.
+std::vector<InstanceCsr> getCsrsConcurrently(
+    const std::vector<std::string>& instanceNames,
+    std::function<CborResult<cppbor::Array>(const std::string& instanceName)> getCsrForInstance,
+    std::chrono::steady_clock::duration timeout);
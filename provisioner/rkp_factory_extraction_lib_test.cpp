@@ -26,16 +26,21 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
 #include <cstdint>
+#include <iostream>
+#include <map>
 #include <memory>
 #include <ostream>
 #include <set>
+#include <string>
 #include <vector>
 
 #include "aidl/android/hardware/security/keymint/ProtectedData.h"
 #include "android/binder_auto_utils.h"
 #include "android/binder_interface_utils.h"
 #include "cppbor.h"
+#include "fake_remotely_provisioned_component.h"
 
 using ::ndk::ScopedAStatus;
 using ::ndk::SharedRefBase;
@@ -266,3 +271,176 @@ TEST(LibRkpFactoryExtractionTests, GetCsrWithV3Hal) {
     const Tstr fingerprint(android::base::GetProperty("ro.build.fingerprint", ""));
     EXPECT_THAT(*unverifedDeviceInfo->get("fingerprint")->asTstr(), Eq(fingerprint));
 }
+
+// Gets a CSR straight from `fake`. Unlike getCsr, this does not add the build fingerprint, which
+// would make the test wait for a device property.
+CborResult<Array> getFakeCsr(FakeRemotelyProvisionedComponent* fake) {
+    std::vector<uint8_t> csr;
+    auto status = fake->generateCertificateRequestV2({}, generateChallenge(), &csr);
+    if (!status.isOk()) {
+        return {nullptr, status.getDescription()};
+    }
+    auto [item, _, errMsg] = parse(csr);
+    if (!item || !item->asArray()) {
+        return {nullptr, "CSR is not a CBOR array: " + errMsg};
+    }
+    return {std::unique_ptr<Array>(item.release()->asArray()), ""};
+}
+
+TEST(LibRkpFactoryExtractionTests, GetCsrsConcurrently) {
+    const std::vector<std::string> kInstanceNames = {"avf", "default", "strongbox"};
+    // Every CSR request waits for the others, which only works out if they are all in flight at
+    // the same time.
+    auto rendezvous = std::make_shared<Rendezvous>(kInstanceNames.size());
+    std::map<std::string, std::shared_ptr<FakeRemotelyProvisionedComponent>> fakes;
+    for (const auto& name : kInstanceNames) {
+        fakes[name] = SharedRefBase::make<FakeRemotelyProvisionedComponent>(
+            std::chrono::milliseconds(0), rendezvous);
+    }
+
+    // The workers get their own copy of the fakes, since they outlive the call on a timeout.
+    auto csrs = getCsrsConcurrently(
+        kInstanceNames,
+        [fakes](const std::string& name) { return getFakeCsr(fakes.at(name).get()); },
+        std::chrono::seconds(10));
+
+    EXPECT_THAT(rendezvous->maxInFlight(), Eq(kInstanceNames.size()));
+    ASSERT_THAT(csrs, SizeIs(kInstanceNames.size()));
+    for (size_t i = 0; i < kInstanceNames.size(); ++i) {
+        EXPECT_THAT(csrs[i].instanceName, Eq(kInstanceNames[i]));
+        EXPECT_THAT(csrs[i].csr, NotNull()) << csrs[i].errMsg;
+        EXPECT_THAT(fakes.at(kInstanceNames[i])->csrCount(), Eq(1));
+    }
+}
+
+TEST(LibRkpFactoryExtractionTests, GetCsrsConcurrentlyWithHungInstance) {
+    const std::vector<std::string> kInstanceNames = {"default", "hung", "strongbox"};
+    std::map<std::string, std::shared_ptr<FakeRemotelyProvisionedComponent>> fakes;
+    fakes["default"] =
+        SharedRefBase::make<FakeRemotelyProvisionedComponent>(std::chrono::milliseconds(10));
+    fakes["hung"] = SharedRefBase::make<FakeRemotelyProvisionedComponent>(std::chrono::seconds(5));
+    fakes["strongbox"] =
+        SharedRefBase::make<FakeRemotelyProvisionedComponent>(std::chrono::milliseconds(100));
+
+    const auto start = std::chrono::steady_clock::now();
+    auto csrs = getCsrsConcurrently(
+        kInstanceNames,
+        [fakes](const std::string& name) { return getFakeCsr(fakes.at(name).get()); },
+        std::chrono::seconds(1));
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // The overall deadline bounds the wait, and all other instances still produce their CSRs.
+    EXPECT_THAT(elapsed, Lt(std::chrono::seconds(3)));
+    ASSERT_THAT(csrs, SizeIs(kInstanceNames.size()));
+    EXPECT_THAT(csrs[0].instanceName, Eq("default"));
+    EXPECT_THAT(csrs[0].csr, NotNull()) << csrs[0].errMsg;
+    EXPECT_THAT(csrs[1].instanceName, Eq("hung"));
+    EXPECT_THAT(csrs[1].csr, IsNull());
+    EXPECT_THAT(csrs[1].errMsg, HasSubstr("Timed out"));
+    EXPECT_THAT(csrs[2].instanceName, Eq("strongbox"));
+    EXPECT_THAT(csrs[2].csr, NotNull()) << csrs[2].errMsg;
+}
+
+TEST(LibRkpFactoryExtractionTests, GetCsrsConcurrentlyReportsErrors) {
+    auto mockRpc = SharedRefBase::make<MockIRemotelyProvisionedComponent>();
+    EXPECT_CALL(*mockRpc, getHardwareInfo(NotNull())).WillRepeatedly([](RpcHardwareInfo*) {
+        return ScopedAStatus::fromServiceSpecificError(-1);
+    });
+    auto fake = SharedRefBase::make<FakeRemotelyProvisionedComponent>(std::chrono::milliseconds(0));
+
+    auto csrs = getCsrsConcurrently(
+        {"broken", "default"},
+        [mockRpc, fake](const std::string& name) {
+            if (name == "broken") {
+                return getCsr(name, mockRpc.get(), /*selfTest=*/false, /*allowDegenerate=*/true);
+            }
+            return getFakeCsr(fake.get());
+        },
+        std::chrono::seconds(10));
+
+    ASSERT_THAT(csrs, SizeIs(2));
+    EXPECT_THAT(csrs[0].csr, IsNull());
+    EXPECT_THAT(csrs[0].errMsg, HasSubstr("Failed to get hardware info for 'broken'"));
+    EXPECT_THAT(csrs[1].csr, NotNull()) << csrs[1].errMsg;
+}
+
+TEST(LibRkpFactoryExtractionTests, CheckRemoteProvisioningSupportedReportsErrors) {
+    auto mockRpc = SharedRefBase::make<MockIRemotelyProvisionedComponent>();
+    EXPECT_CALL(*mockRpc, getHardwareInfo(NotNull()))
+        .WillOnce(Return(ByMove(ScopedAStatus::ok())))
+        .WillOnce(Return(ByMove(ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION))))
+        .WillOnce(Return(ByMove(ScopedAStatus::fromServiceSpecificError(-1))));
+
+    auto supported = checkRemoteProvisioningSupported(mockRpc.get());
+    ASSERT_TRUE(supported) << supported.message();
+    EXPECT_TRUE(*supported);
+    auto unsupported = checkRemoteProvisioningSupported(mockRpc.get());
+    ASSERT_TRUE(unsupported) << unsupported.message();
+    EXPECT_FALSE(*unsupported);
+    // Unexpected errors are returned to the caller instead of exiting the process.
+    auto failed = checkRemoteProvisioningSupported(mockRpc.get());
+    EXPECT_FALSE(failed);
+    EXPECT_THAT(failed.message(), HasSubstr("Unexpected error when getting hardware info"));
+}
+
+TEST(LibRkpFactoryExtractionTests, CsrExtractorReusesHardwareInfo) {
+    const std::vector<uint8_t> kCsr = Array()
+                                          .add(3 /* version */)
+                                          .add(Map() /* UdsCerts */)
+                                          .add(Array() /* DiceCertChain */)
+                                          .add(Array() /* SignedData */)
+                                          .encode();
+    auto mockRpc = SharedRefBase::make<MockIRemotelyProvisionedComponent>();
+    EXPECT_CALL(*mockRpc, getHardwareInfo(NotNull())).WillOnce([](RpcHardwareInfo* hwInfo) {
+        hwInfo->versionNumber = 3;
+        return ScopedAStatus::ok();
+    });
+    std::vector<std::vector<uint8_t>> challenges;
+    EXPECT_CALL(*mockRpc, generateCertificateRequestV2(IsEmpty(), _, NotNull()))
+        .Times(3)
+        .WillRepeatedly([&](const std::vector<MacedPublicKey>&, const std::vector<uint8_t>& in,
+                            std::vector<uint8_t>* out) {
+            challenges.push_back(in);
+            *out = kCsr;
+            return ScopedAStatus::ok();
+        });
+
+    CsrExtractor extractor("mock component name", mockRpc.get(), /*selfTest=*/false,
+                           /*allowDegenerate=*/true);
+    for (uint8_t i = 0; i < 3; ++i) {
+        const std::vector<uint8_t> challenge(kChallengeSize, i);
+        auto [csr, csrErrMsg] = extractor.getCsr(challenge);
+        ASSERT_THAT(csr, NotNull()) << csrErrMsg;
+        EXPECT_THAT(challenges.back(), Eq(challenge));
+    }
+}
+
+TEST(LibRkpFactoryExtractionTests, CsrExtractorThroughput) {
+    constexpr size_t kCsrCount = 200;
+    // Both calls into the HAL take about as long as a round trip into the secure environment, so
+    // the benchmark shows what querying the hardware info only once saves.
+    constexpr auto kHalLatency = std::chrono::milliseconds(1);
+    auto fake = SharedRefBase::make<FakeRemotelyProvisionedComponent>(kHalLatency, nullptr,
+                                                                      kHalLatency);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kCsrCount; ++i) {
+        auto [csr, csrErrMsg] = getCsr("fake", fake.get(), /*selfTest=*/false,
+                                       /*allowDegenerate=*/true);
+        ASSERT_THAT(csr, NotNull()) << csrErrMsg;
+    }
+    const std::chrono::duration<double> singleElapsed = std::chrono::steady_clock::now() - start;
+
+    CsrExtractor extractor("fake", fake.get(), /*selfTest=*/false, /*allowDegenerate=*/true);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kCsrCount; ++i) {
+        auto [csr, csrErrMsg] = extractor.getCsr(generateChallenge());
+        ASSERT_THAT(csr, NotNull()) << csrErrMsg;
+    }
+    const std::chrono::duration<double> batchElapsed = std::chrono::steady_clock::now() - start;
+
+    EXPECT_THAT(fake->csrCount(), Eq(2 * kCsrCount));
+    EXPECT_THAT(fake->hwInfoCount(), Eq(kCsrCount + 1));
+    std::cout << "getCsr: " << kCsrCount / singleElapsed.count() << " CSRs/s" << std::endl;
+    std::cout << "CsrExtractor: " << kCsrCount / batchElapsed.count() << " CSRs/s" << std::endl;
+}
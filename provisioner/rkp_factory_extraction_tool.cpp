@@ -24,7 +24,13 @@
 #include <remote_prov/remote_prov_utils.h>
 #include <sys/random.h>
 
-#include <future>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -47,6 +53,16 @@ DEFINE_bool(allow_degenerate, true,
             "If true, self_test validation will allow degenerate DICE chains in the CSR.");
 DEFINE_string(serialno_prop, "ro.serialno",
               "The property of getting serial number. Defaults to 'ro.serialno'.");
+DEFINE_bool(batch, false,
+            "If true, this tool reads requests from stdin, one per line, until EOF. Each request "
+            "is the name of an IRemotelyProvisionedComponent instance, optionally followed by a "
+            "space and a base64 encoded challenge. For each request, one record is written to "
+            "stdout: the size of the formatted CSR as a 4 byte big endian integer, followed by "
+            "the CSR itself. Failed requests produce an empty record and an error on stderr. "
+            "Connections to the components are kept open across requests.");
+DEFINE_int32(timeout_seconds, 10,
+             "How long to wait in total for all IRemotelyProvisionedComponent instances, which "
+             "are queried concurrently. Defaults to 10 seconds.");
 
 namespace {
 
@@ -95,25 +111,176 @@ void getCsrForIRpc(const char* descriptor, const char* name, IRemotelyProvisione
     writeOutput(std::string(name), *request);
 }
 
-// Callback for AServiceManager_forEachDeclaredInstance that writes out a CSR
-// for every IRemotelyProvisionedComponent.
-void getCsrForInstance(const char* name, void* /*context*/) {
-    auto fullName = getFullServiceName(IRemotelyProvisionedComponent::descriptor, name);
-    std::future<AIBinder*> wait_for_service_func =
-        std::async(std::launch::async, AServiceManager_waitForService, fullName.c_str());
-    if (wait_for_service_func.wait_for(std::chrono::seconds(10)) == std::future_status::timeout) {
-        std::cerr << "Wait for service timed out after 10 seconds: " << fullName;
-        exit(-1);
+// Callback for AServiceManager_forEachDeclaredInstance that collects the names of all
+// declared IRemotelyProvisionedComponent instances.
+void addInstanceName(const char* name, void* context) {
+    static_cast<std::vector<std::string>*>(context)->push_back(name);
+}
+
+// Connects to the named IRemotelyProvisionedComponent instance. Returns nullptr if the instance
+// is not declared, so that callers never wait for a service that cannot start. Declared
+// services are started on demand, so waiting for one that is not running yet is bounded.
+std::shared_ptr<IRemotelyProvisionedComponent> getIrpcInstance(const std::string& name) {
+    auto fullName = getFullServiceName(IRemotelyProvisionedComponent::descriptor, name.c_str());
+    if (!AServiceManager_isDeclared(fullName.c_str())) {
+        return nullptr;
+    }
+    ::ndk::SpAIBinder rkp_binder(AServiceManager_checkService(fullName.c_str()));
+    if (!rkp_binder.get()) {
+        rkp_binder = ::ndk::SpAIBinder(AServiceManager_waitForService(fullName.c_str()));
     }
-    AIBinder* rkpAiBinder = wait_for_service_func.get();
-    ::ndk::SpAIBinder rkp_binder(rkpAiBinder);
-    auto rkp_service = IRemotelyProvisionedComponent::fromBinder(rkp_binder);
+    return IRemotelyProvisionedComponent::fromBinder(rkp_binder);
+}
+
+// Gets a CSR from the named IRemotelyProvisionedComponent instance.
+CborResult<Array> getCsrForInstance(const std::string& name) {
+    auto rkp_service = getIrpcInstance(name);
     if (!rkp_service) {
-        std::cerr << "Unable to get binder object for '" << fullName << "', skipping.";
-        exit(-1);
+        auto fullName =
+            getFullServiceName(IRemotelyProvisionedComponent::descriptor, name.c_str());
+        return {nullptr, "Unable to get binder object for '" + fullName + "'."};
+    }
+
+    // AVF RKP HAL is not always supported, so we need to check if it is supported before
+    // generating the CSR. This runs on a worker thread, so errors are returned, not exited on.
+    if (name == "avf") {
+        auto supported = checkRemoteProvisioningSupported(rkp_service.get());
+        if (!supported) {
+            return {nullptr, supported.message()};
+        }
+        if (!*supported) {
+            return {nullptr, ""};
+        }
+    }
+    return getCsr(name, rkp_service.get(), FLAGS_self_test, FLAGS_allow_degenerate);
+}
+
+// Returns the CSR formatted according to --output_format, or std::nullopt with `errMsg` set.
+std::optional<std::string> formatRecord(const std::string& instance_name, const Array& csr,
+                                        std::string* errMsg) {
+    if (FLAGS_output_format == kBinaryCsrOutput) {
+        auto bytes = csr.encode();
+        return std::string(bytes.begin(), bytes.end());
+    } else if (FLAGS_output_format == kBuildPlusCsr) {
+        auto [json, error] = jsonEncodeCsrWithBuild(instance_name, csr, FLAGS_serialno_prop);
+        if (!error.empty()) {
+            *errMsg = "Error JSON encoding the output: " + error;
+            return std::nullopt;
+        }
+        return json;
+    }
+    *errMsg = "Unexpected output_format '" + FLAGS_output_format + "'";
+    return std::nullopt;
+}
+
+void writeRecord(const std::string& payload) {
+    const uint32_t size = payload.size();
+    const char header[] = {static_cast<char>(size >> 24), static_cast<char>(size >> 16),
+                           static_cast<char>(size >> 8), static_cast<char>(size)};
+    std::cout.write(header, sizeof(header));
+    std::cout.write(payload.data(), payload.size());
+    std::cout.flush();
+}
+
+std::optional<std::vector<uint8_t>> fromBase64(const std::string& base64) {
+    size_t length;
+    if (!EVP_DecodedLength(&length, base64.size())) {
+        return std::nullopt;
+    }
+    std::vector<uint8_t> buffer(length);
+    if (!EVP_DecodeBase64(buffer.data(), &length, buffer.size(),
+                          reinterpret_cast<const uint8_t*>(base64.data()), base64.size())) {
+        return std::nullopt;
+    }
+    buffer.resize(length);
+    return buffer;
+}
+
+// A component that batch mode keeps connected across requests.
+struct BatchComponent {
+    std::shared_ptr<IRemotelyProvisionedComponent> irpc;
+    std::unique_ptr<CsrExtractor> extractor;
+};
+
+// The components known to batch mode: those connected to so far, and the DRM components,
+// which are looked up once, on first use.
+struct BatchComponents {
+    std::map<std::string, BatchComponent> connected;
+    std::optional<std::map<std::string, std::shared_ptr<IRemotelyProvisionedComponent>>> drm;
+};
+
+// Looks up the named component, connecting to it on first use. Returns nullptr if there is no
+// such component, or if it is the AVF component and that does not support provisioning.
+BatchComponent* getBatchComponent(const std::string& name, BatchComponents* components) {
+    auto it = components->connected.find(name);
+    if (it != components->connected.end()) {
+        return &it->second;
+    }
+
+    std::shared_ptr<IRemotelyProvisionedComponent> irpc = getIrpcInstance(name);
+    if (irpc) {
+        // AVF RKP HAL is not always supported, so we need to check if it is supported before
+        // generating the CSR.
+        if (name == "avf") {
+            auto supported = checkRemoteProvisioningSupported(irpc.get());
+            if (!supported || !*supported) {
+                return nullptr;
+            }
+        }
+    } else {
+        if (!components->drm) {
+            components->drm.emplace();
+            for (auto const& e : android::mediadrm::getDrmRemotelyProvisionedComponents()) {
+                components->drm->emplace(e.first, e.second);
+            }
+        }
+        auto drmIt = components->drm->find(name);
+        if (drmIt == components->drm->end()) {
+            return nullptr;
+        }
+        irpc = drmIt->second;
     }
 
-    getCsrForIRpc(IRemotelyProvisionedComponent::descriptor, name, rkp_service.get());
+    BatchComponent component;
+    component.extractor =
+        std::make_unique<CsrExtractor>(name, irpc.get(), FLAGS_self_test, FLAGS_allow_degenerate);
+    component.irpc = std::move(irpc);
+    return &components->connected.emplace(name, std::move(component)).first->second;
+}
+
+// Serves requests from stdin until EOF. Returns true if all requests succeeded.
+bool runBatch() {
+    BatchComponents components;
+    bool allSucceeded = true;
+    std::string line;
+    for (size_t requestIndex = 0; std::getline(std::cin, line); ++requestIndex) {
+        std::istringstream request(line);
+        std::string name;
+        std::string base64Challenge;
+        request >> name >> base64Challenge;
+
+        std::string errMsg;
+        std::optional<std::string> record;
+        BatchComponent* component = getBatchComponent(name, &components);
+        std::optional<std::vector<uint8_t>> challenge =
+            base64Challenge.empty() ? generateChallenge() : fromBase64(base64Challenge);
+        if (!component) {
+            errMsg = "Unknown component '" + name + "'";
+        } else if (!challenge) {
+            errMsg = "Invalid base64 challenge";
+        } else if (auto [csr, csrErrMsg] = component->extractor->getCsr(*challenge); !csr) {
+            errMsg = csrErrMsg;
+        } else {
+            record = formatRecord(name, *csr, &errMsg);
+        }
+
+        if (!record) {
+            std::cerr << "Request " << requestIndex << " failed: " << errMsg << std::endl;
+            allSucceeded = false;
+        }
+        writeRecord(record.value_or(""));
+    }
+    return allSucceeded;
 }
 
 }  // namespace
@@ -121,13 +288,36 @@ void getCsrForInstance(const char* name, void* /*context*/) {
 int main(int argc, char** argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, /*remove_flags=*/true);
 
+    if (FLAGS_batch) {
+        return runBatch() ? 0 : -1;
+    }
+
+    std::vector<std::string> instanceNames;
     AServiceManager_forEachDeclaredInstance(IRemotelyProvisionedComponent::descriptor,
-                                            /*context=*/nullptr, getCsrForInstance);
+                                            &instanceNames, addInstanceName);
+    // Sort the instances so that the output order does not depend on the service manager.
+    std::sort(instanceNames.begin(), instanceNames.end());
+
+    // Query all instances concurrently. If one of them fails or hangs, the CSRs of all others
+    // are still written before exiting with an error.
+    auto csrs = getCsrsConcurrently(instanceNames, getCsrForInstance,
+                                    std::chrono::seconds(FLAGS_timeout_seconds));
+    bool failed = false;
+    for (auto& [name, csr, errMsg] : csrs) {
+        if (csr) {
+            writeOutput(name, *csr);
+        } else if (!errMsg.empty()) {
+            auto fullName =
+                getFullServiceName(IRemotelyProvisionedComponent::descriptor, name.c_str());
+            std::cerr << "Unable to build CSR for '" << fullName << "': " << errMsg << std::endl;
+            failed = true;
+        }
+    }
 
     // Append drm csr's
     for (auto const& e : android::mediadrm::getDrmRemotelyProvisionedComponents()) {
         getCsrForIRpc(IDrmFactory::descriptor, e.first.c_str(), e.second.get());
     }
 
-    return 0;
+    return failed ? -1 : 0;
 }